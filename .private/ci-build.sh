@@ -4,6 +4,8 @@ set -e
 
 builddir=
 install=no
+asan=no
+tests=
 
 while [ $# -gt 0 ]; do
 	case "$1" in
@@ -19,6 +21,18 @@ while [ $# -gt 0 ]; do
 		install=yes
 		shift
 		;;
+	--asan)
+		asan=yes
+		shift
+		;;
+	--test)
+		if [ $# -lt 2 ]; then
+			echo "ERROR: missing argument for --test option" >&2
+			exit 1
+		fi
+		tests+=" $2"
+		shift 2
+		;;
 	--)
 		shift
 		break;
@@ -52,14 +66,26 @@ cflags+=" -Wpointer-arith"
 cflags+=" -Wredundant-decls"
 cflags+=" -Wswitch-enum"
 
+ldflags=
+if [ "${asan}" = "yes" ]; then
+	cflags+=" -fsanitize=address -fno-omit-frame-pointer"
+	ldflags+=" -fsanitize=address"
+fi
+
 echo ""
 echo "Configuring ..."
-CFLAGS="${cflags}" ../configure --enable-examples-build --enable-tests-build "$@"
+CFLAGS="${cflags}" LDFLAGS="${ldflags}" ../configure --enable-examples-build --enable-tests-build "$@"
 
 echo ""
 echo "Building ..."
 make -j4 -k
 
+for test in ${tests}; do
+	echo ""
+	echo "Running ${test} ..."
+	tests/${test} -v
+done
+
 if [ "${install}" = "yes" ]; then
 	echo ""
 	echo "Installing ..."
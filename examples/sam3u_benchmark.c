@@ -106,10 +106,8 @@ static void LIBUSB_CALL cb_xfr(struct libusb_transfer *xfr)
 	num_bytes += xfr->actual_length;
 	num_xfer++;
 
-	if (libusb_submit_transfer(xfr) < 0) {
-		fprintf(stderr, "error re-submitting URB\n");
-		exit(1);
-	}
+	/* libusb resubmits the transfer once we return, as it has the
+	 * LIBUSB_TRANSFER_AUTO_RESUBMIT flag set */
 }
 
 static int benchmark_in(uint8_t ep)
@@ -134,6 +132,7 @@ static int benchmark_in(uint8_t ep)
 	} else
 		libusb_fill_bulk_transfer(xfr, devh, ep, buf,
 				sizeof(buf), cb_xfr, NULL, 0);
+	xfr->flags = LIBUSB_TRANSFER_AUTO_RESUBMIT;
 
 	get_timestamp(&tv_start);
 
@@ -0,0 +1,184 @@
+/*
+ * libusb example program to measure synchronous transfer latency
+ *
+ * Measures the round-trip time of small synchronous bulk or interrupt
+ * transfers to a loopback device, which returns on its IN endpoint the data
+ * it receives on its OUT endpoint. Each round trip is measured with the
+ * backend's direct system call path, and with the asynchronous transfer
+ * path with and without the transfers kept by the device handle, see
+ * LIBUSB_OPTION_SYNC_DIRECT_IO and LIBUSB_OPTION_SYNC_CACHE_SIZE.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "libusb.h"
+
+#define TRANSFER_SIZE	64
+#define TIMEOUT_MS	1000
+
+enum sync_path {
+	PATH_DIRECT,
+	PATH_ASYNC,
+	PATH_ASYNC_NO_CACHE,
+};
+
+struct result {
+	double us;
+	double allocations;
+};
+
+struct target {
+	uint16_t vid, pid;
+	int interface;
+	unsigned char ep_out, ep_in;
+	int iterations;
+};
+
+static int round_trip(libusb_device_handle *devh, const struct target *t)
+{
+	unsigned char out[TRANSFER_SIZE], in[TRANSFER_SIZE];
+	int i, r, transferred;
+
+	for (i = 0; i < TRANSFER_SIZE; i++)
+		out[i] = (unsigned char)(rand() & 0xff);
+
+	r = libusb_bulk_transfer(devh, t->ep_out, out, TRANSFER_SIZE,
+		&transferred, TIMEOUT_MS);
+	if (r < 0)
+		return r;
+
+	r = libusb_bulk_transfer(devh, t->ep_in, in, TRANSFER_SIZE,
+		&transferred, TIMEOUT_MS);
+	if (r < 0)
+		return r;
+
+	return transferred == TRANSFER_SIZE ? 0 : LIBUSB_ERROR_IO;
+}
+
+/* Measures the mean round-trip time in microseconds and the number of
+ * allocations per round trip */
+static int measure(const struct target *t, enum sync_path path,
+	struct result *result)
+{
+	struct libusb_init_option options[] = {
+		{ .option = LIBUSB_OPTION_SYNC_DIRECT_IO },
+		{ .option = LIBUSB_OPTION_SYNC_CACHE_SIZE, .value = { .ival = 0 } },
+	};
+	const struct libusb_init_option *path_options = options;
+	struct libusb_sync_stats before, after;
+	struct timespec start, end;
+	libusb_context *ctx;
+	libusb_device_handle *devh;
+	int num_options;
+	int i, r;
+
+	switch (path) {
+	case PATH_DIRECT:
+		num_options = 1;
+		break;
+	case PATH_ASYNC:
+		num_options = 0;
+		break;
+	case PATH_ASYNC_NO_CACHE:
+		path_options = options + 1;
+		num_options = 1;
+		break;
+	}
+
+	r = libusb_init_context(&ctx, path_options, num_options);
+	if (r < 0)
+		return r;
+
+	devh = libusb_open_device_with_vid_pid(ctx, t->vid, t->pid);
+	if (!devh) {
+		libusb_exit(ctx);
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	r = libusb_claim_interface(devh, t->interface);
+	if (r < 0)
+		goto out;
+
+	/* warm up */
+	r = round_trip(devh, t);
+	if (r < 0)
+		goto out_release;
+
+	libusb_get_sync_stats(ctx, &before);
+	timespec_get(&start, TIME_UTC);
+	for (i = 0; i < t->iterations; i++) {
+		r = round_trip(devh, t);
+		if (r < 0)
+			goto out_release;
+	}
+	timespec_get(&end, TIME_UTC);
+	libusb_get_sync_stats(ctx, &after);
+
+out_release:
+	libusb_release_interface(devh, t->interface);
+out:
+	libusb_close(devh);
+	libusb_exit(ctx);
+	if (r < 0)
+		return r;
+
+	result->us = ((double)(end.tv_sec - start.tv_sec) * 1e6 +
+		(double)(end.tv_nsec - start.tv_nsec) / 1e3) / t->iterations;
+	result->allocations = (double)(after.allocations - before.allocations) /
+		t->iterations;
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *const path_names[] = { "direct", "async", "async without cache" };
+	struct target t;
+	int path, r;
+
+	if (argc < 5) {
+		fprintf(stderr, "usage: %s vid pid ep_out ep_in [interface [iterations]]\n", argv[0]);
+		return 1;
+	}
+
+	t.vid = (uint16_t)strtoul(argv[1], NULL, 16);
+	t.pid = (uint16_t)strtoul(argv[2], NULL, 16);
+	t.ep_out = (unsigned char)strtoul(argv[3], NULL, 16);
+	t.ep_in = (unsigned char)strtoul(argv[4], NULL, 16);
+	t.interface = argc > 5 ? atoi(argv[5]) : 0;
+	t.iterations = argc > 6 ? atoi(argv[6]) : 10000;
+	if (t.iterations < 1)
+		t.iterations = 1;
+
+	printf("%d byte round trips:\n", TRANSFER_SIZE);
+	for (path = PATH_DIRECT; path <= PATH_ASYNC_NO_CACHE; path++) {
+		struct result result;
+
+		r = measure(&t, (enum sync_path)path, &result);
+		if (r < 0) {
+			fprintf(stderr, "%s path failed: %s\n", path_names[path],
+				libusb_error_name(r));
+			return 1;
+		}
+
+		printf("  %-20s %8.1fus %6.2f allocations\n", path_names[path],
+			result.us, result.allocations);
+	}
+
+	return 0;
+}
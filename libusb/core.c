@@ -46,6 +46,11 @@ static int default_context_refcnt;
 static usbi_mutex_static_t default_context_lock = USBI_MUTEX_INITIALIZER;
 static struct usbi_option default_context_options[LIBUSB_OPTION_MAX];
 
+#if defined(ENABLE_LOGGING) && !defined(ENABLE_DEBUG_LOGGING)
+static int log_ring_init(struct libusb_context *ctx);
+static void log_ring_exit(struct libusb_context *ctx);
+#endif
+
 
 usbi_mutex_static_t active_contexts_lock = USBI_MUTEX_INITIALIZER;
 struct list_head active_contexts_list;
@@ -379,6 +384,10 @@ if (cfg != desired)
   * - libusb_detach_kernel_driver()
   * - libusb_dev_mem_alloc()
   * - libusb_dev_mem_free()
+  * - libusb_alloc_buffer_pool()
+  * - libusb_buffer_pool_get()
+  * - libusb_buffer_pool_put()
+  * - libusb_free_buffer_pool()
   * - libusb_error_name()
   * - libusb_event_handler_active()
   * - libusb_event_handling_ok()
@@ -1362,12 +1371,19 @@ int API_EXPORTED libusb_wrap_sys_device(libusb_context *ctx, intptr_t sys_dev,
 	if (!_dev_handle)
 		return LIBUSB_ERROR_NO_MEM;
 
+	r = usbi_io_handle_init(ctx, _dev_handle);
+	if (r < 0) {
+		free(_dev_handle);
+		return r;
+	}
+
 	usbi_mutex_init(&_dev_handle->lock);
 
 	r = usbi_backend.wrap_sys_device(ctx, _dev_handle, sys_dev);
 	if (r < 0) {
 		usbi_dbg(ctx, "wrap_sys_device 0x%" PRIxPTR " returns %d", (uintptr_t)sys_dev, r);
 		usbi_mutex_destroy(&_dev_handle->lock);
+		usbi_io_handle_exit(ctx, _dev_handle);
 		free(_dev_handle);
 		return r;
 	}
@@ -1416,6 +1432,12 @@ int API_EXPORTED libusb_open(libusb_device *dev,
 	if (!_dev_handle)
 		return LIBUSB_ERROR_NO_MEM;
 
+	r = usbi_io_handle_init(ctx, _dev_handle);
+	if (r < 0) {
+		free(_dev_handle);
+		return r;
+	}
+
 	usbi_mutex_init(&_dev_handle->lock);
 
 	_dev_handle->dev = libusb_ref_device(dev);
@@ -1425,6 +1447,7 @@ int API_EXPORTED libusb_open(libusb_device *dev,
 		usbi_dbg(DEVICE_CTX(dev), "open %d.%d returns %d", dev->bus_number, dev->device_address, r);
 		libusb_unref_device(dev);
 		usbi_mutex_destroy(&_dev_handle->lock);
+		usbi_io_handle_exit(ctx, _dev_handle);
 		free(_dev_handle);
 		return r;
 	}
@@ -1496,17 +1519,14 @@ static void do_close(struct libusb_context *ctx,
 	struct usbi_transfer *tmp;
 
 	/* remove any transfers in flight that are for this device */
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	usbi_mutex_lock(&dev_handle->flying_transfers_lock);
 
 	/* safe iteration because transfers may be being deleted */
-	for_each_transfer_safe(ctx, itransfer, tmp) {
+	for_each_transfer_safe(dev_handle, itransfer, tmp) {
 		struct libusb_transfer *transfer =
 			USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 		uint32_t state_flags;
 
-		if (transfer->dev_handle != dev_handle)
-			continue;
-
 		usbi_mutex_lock(&itransfer->lock);
 		state_flags = itransfer->state_flags;
 		usbi_mutex_unlock(&itransfer->lock);
@@ -1524,6 +1544,7 @@ static void do_close(struct libusb_context *ctx,
 		 * (or that such accesses will be easily caught and identified as a crash)
 		 */
 		list_del(&itransfer->list);
+		usbi_timeout_heap_remove(&dev_handle->flying_timeouts, &itransfer->timeout);
 		transfer->dev_handle = NULL;
 
 		/* it is up to the user to free up the actual transfer struct.  this is
@@ -1533,13 +1554,15 @@ static void do_close(struct libusb_context *ctx,
 		usbi_dbg(ctx, "Removed transfer %p from the in-flight list because device handle %p closed",
 			 (void *) transfer, (void *) dev_handle);
 	}
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
 
 	usbi_mutex_lock(&ctx->open_devs_lock);
 	list_del(&dev_handle->list);
+	usbi_sync_stats_add(&ctx->closed_sync_stats, dev_handle);
 	usbi_mutex_unlock(&ctx->open_devs_lock);
 
 	usbi_backend.close(dev_handle);
+	usbi_io_handle_exit(ctx, dev_handle);
 	libusb_unref_device(dev_handle->dev);
 	usbi_mutex_destroy(&dev_handle->lock);
 	free(dev_handle);
@@ -1559,6 +1582,7 @@ static void do_close(struct libusb_context *ctx,
 void API_EXPORTED libusb_close(libusb_device_handle *dev_handle)
 {
 	struct libusb_context *ctx;
+	struct usbi_event_worker *event_worker;
 	unsigned int event_flags;
 	int handling_events;
 
@@ -1567,7 +1591,17 @@ void API_EXPORTED libusb_close(libusb_device_handle *dev_handle)
 	ctx = HANDLE_CTX(dev_handle);
 	usbi_dbg(ctx, " ");
 
-	handling_events = usbi_handling_events(ctx);
+	/* Transfers already reaped are no longer on the flying list, so their
+	 * callbacks must not be left queued to callback threads. This waits
+	 * for callbacks running on those threads, so it is done without the
+	 * event handling lock, which they may need. */
+	usbi_flush_callbacks(dev_handle);
+
+	/* An event thread closing a device from a transfer callback lets go of
+	 * its devices, so that it can be paused below like the others, and
+	 * then takes the event handling lock like any other thread. */
+	event_worker = usbi_leave_event_worker(ctx);
+	handling_events = !event_worker && usbi_handling_events(ctx);
 
 	/* Similarly to libusb_open(), we want to interrupt all event handlers
 	 * at this point. More importantly, we want to perform the actual close of
@@ -1592,8 +1626,10 @@ void API_EXPORTED libusb_close(libusb_device_handle *dev_handle)
 		libusb_lock_events(ctx);
 	}
 
-	/* Close the device */
+	/* Close the device, while no event thread may be handling its events */
+	usbi_pause_event_workers(ctx);
 	do_close(ctx, dev_handle);
+	usbi_resume_event_workers(ctx);
 
 	if (!handling_events) {
 		/* We're done with closing this device.
@@ -1608,6 +1644,8 @@ void API_EXPORTED libusb_close(libusb_device_handle *dev_handle)
 		/* Release event handling lock and wake up event waiters */
 		libusb_unlock_events(ctx);
 	}
+
+	usbi_return_to_event_worker(event_worker);
 }
 
 /** \ingroup libusb_dev
@@ -2061,6 +2099,300 @@ int API_EXPORTED libusb_dev_mem_free(libusb_device_handle *dev_handle,
 		return LIBUSB_ERROR_NOT_SUPPORTED;
 }
 
+/* Buffer pools are carved from regions of up to this many bytes, so that
+ * the cost of libusb_dev_mem_alloc() is paid once per region rather than
+ * once per buffer */
+#define BUFFER_POOL_REGION_SIZE		(4 * 1024 * 1024)
+
+/* Buffers are placed on cache line boundaries, and regions of host memory
+ * on page boundaries */
+#define BUFFER_POOL_BUFFER_ALIGN	64
+#define BUFFER_POOL_REGION_ALIGN	4096
+
+/* The free list head holds the index of the first free buffer in its low
+ * bits and a generation count in the remaining bits, which is incremented on
+ * every change so that a stale head cannot be swapped in (ABA problem). The
+ * head is 64 bits wide on every platform, so that the count does not wrap
+ * around in any realistic time. */
+#define BUFFER_POOL_INDEX_BITS		16
+#define BUFFER_POOL_INDEX_MASK		((UINT64_C(1) << BUFFER_POOL_INDEX_BITS) - 1)
+#define BUFFER_POOL_NO_BUFFER		BUFFER_POOL_INDEX_MASK
+#define BUFFER_POOL_MAX_BUFFERS		((int)BUFFER_POOL_INDEX_MASK)
+
+struct buffer_pool_region {
+	/* first buffer of the region */
+	unsigned char *base;
+
+	/* start of the host memory allocation, or NULL for device memory */
+	unsigned char *host_mem;
+
+	size_t length;
+	int first_index;
+	int num_buffers;
+};
+
+struct libusb_buffer_pool {
+	struct libusb_device_handle *dev_handle;
+	size_t stride;
+	int num_buffers;
+	int num_regions;
+
+	usbi_atomic64_t free_head;
+
+	/* index of the next free buffer, for each free buffer */
+	usbi_atomic_t *next_free;
+
+	struct buffer_pool_region regions[ZERO_SIZED_ARRAY];
+};
+
+static int64_t buffer_pool_head(int64_t head, uint64_t index)
+{
+	uint64_t generation = ((uint64_t)head >> BUFFER_POOL_INDEX_BITS) + 1;
+
+	return (int64_t)((generation << BUFFER_POOL_INDEX_BITS) | index);
+}
+
+static void buffer_pool_push(struct libusb_buffer_pool *pool, int index)
+{
+	int64_t head;
+
+	do {
+		head = usbi_atomic64_load(&pool->free_head);
+		usbi_atomic_store(&pool->next_free[index],
+			(long)((uint64_t)head & BUFFER_POOL_INDEX_MASK));
+	} while (!usbi_atomic64_cas(&pool->free_head, head,
+			buffer_pool_head(head, (uint64_t)index)));
+}
+
+static int buffer_pool_pop(struct libusb_buffer_pool *pool)
+{
+	uint64_t index;
+	int64_t head;
+	long next;
+
+	do {
+		head = usbi_atomic64_load(&pool->free_head);
+		index = (uint64_t)head & BUFFER_POOL_INDEX_MASK;
+		if (index == BUFFER_POOL_NO_BUFFER)
+			return -1;
+		next = usbi_atomic_load(&pool->next_free[index]);
+	} while (!usbi_atomic64_cas(&pool->free_head, head,
+			buffer_pool_head(head, (uint64_t)next)));
+
+	return (int)index;
+}
+
+static int alloc_buffer_pool_region(struct libusb_buffer_pool *pool,
+	struct buffer_pool_region *region)
+{
+	size_t length = pool->stride * (size_t)region->num_buffers;
+
+	region->length = length;
+
+	if (pool->dev_handle) {
+		region->base = libusb_dev_mem_alloc(pool->dev_handle, length);
+		if (region->base)
+			return 0;
+	}
+
+	region->host_mem = malloc(length + BUFFER_POOL_REGION_ALIGN - 1);
+	if (!region->host_mem)
+		return LIBUSB_ERROR_NO_MEM;
+
+	region->base = (unsigned char *)(((uintptr_t)region->host_mem +
+		BUFFER_POOL_REGION_ALIGN - 1) & ~(uintptr_t)(BUFFER_POOL_REGION_ALIGN - 1));
+	return 0;
+}
+
+static void free_buffer_pool_region(struct libusb_buffer_pool *pool,
+	struct buffer_pool_region *region)
+{
+	if (region->host_mem)
+		free(region->host_mem);
+	else if (region->base)
+		libusb_dev_mem_free(pool->dev_handle, region->base, region->length);
+}
+
+/** \ingroup libusb_asyncio
+ * Allocate a pool of fixed-size transfer buffers. The buffers are carved
+ * from a few large blocks of device memory obtained with
+ * \ref libusb_dev_mem_alloc, so that transfers using them benefit from
+ * zero-copy DMA without paying the cost of a device memory allocation per
+ * buffer. Where device memory is not supported, or runs out, the pool falls
+ * back to regular host memory aligned to a page boundary.
+ *
+ * Buffers are taken with \ref libusb_buffer_pool_get and given back with
+ * \ref libusb_buffer_pool_put. Both functions are lock-free and may be
+ * called from any thread, including from transfer callbacks.
+ *
+ * The pool must be freed with \ref libusb_free_buffer_pool before the device
+ * handle is closed.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param dev_handle a device handle, or NULL for a pool of host memory only
+ * \param buffer_size size of each buffer
+ * \param num_buffers number of buffers, at most 65535
+ * \param pool output location for the new pool
+ * \returns \ref LIBUSB_SUCCESS on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if the size or number of buffers
+ * is out of range
+ * \returns \ref LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns \ref LIBUSB_ERROR_NO_MEM on memory allocation failure
+ */
+int API_EXPORTED libusb_alloc_buffer_pool(libusb_device_handle *dev_handle,
+	size_t buffer_size, int num_buffers, libusb_buffer_pool **pool)
+{
+	struct libusb_buffer_pool *_pool;
+	size_t stride;
+	int buffers_per_region, num_regions;
+	int i, r;
+
+	if (!buffer_size || buffer_size > SIZE_MAX / 2 || num_buffers <= 0 ||
+	    num_buffers > BUFFER_POOL_MAX_BUFFERS || !pool)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	if (dev_handle && !usbi_atomic_load(&dev_handle->dev->attached))
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	stride = (buffer_size + BUFFER_POOL_BUFFER_ALIGN - 1) &
+		~(size_t)(BUFFER_POOL_BUFFER_ALIGN - 1);
+	buffers_per_region = stride < BUFFER_POOL_REGION_SIZE ?
+		(int)(BUFFER_POOL_REGION_SIZE / stride) : 1;
+	if (buffers_per_region > num_buffers)
+		buffers_per_region = num_buffers;
+	num_regions = (num_buffers + buffers_per_region - 1) / buffers_per_region;
+
+	_pool = calloc(1, sizeof(*_pool) +
+		(size_t)num_regions * sizeof(_pool->regions[0]));
+	if (!_pool)
+		return LIBUSB_ERROR_NO_MEM;
+
+	_pool->next_free = calloc((size_t)num_buffers, sizeof(*_pool->next_free));
+	if (!_pool->next_free) {
+		free(_pool);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	_pool->dev_handle = dev_handle;
+	_pool->stride = stride;
+	_pool->num_buffers = num_buffers;
+	usbi_atomic64_store(&_pool->free_head, (int64_t)BUFFER_POOL_NO_BUFFER);
+
+	for (i = 0; i < num_regions; i++) {
+		struct buffer_pool_region *region = &_pool->regions[i];
+		int first_index = i * buffers_per_region;
+
+		region->first_index = first_index;
+		region->num_buffers = MIN(buffers_per_region, num_buffers - first_index);
+		r = alloc_buffer_pool_region(_pool, region);
+		if (r < 0) {
+			libusb_free_buffer_pool(_pool);
+			return r;
+		}
+		_pool->num_regions++;
+	}
+
+	for (i = num_buffers - 1; i >= 0; i--)
+		buffer_pool_push(_pool, i);
+
+	if (dev_handle)
+		usbi_dbg(HANDLE_CTX(dev_handle),
+			"%d buffers of %zu bytes in %d regions, first in %s memory",
+			num_buffers, buffer_size, num_regions,
+			_pool->regions[0].host_mem ? "host" : "device");
+
+	*pool = _pool;
+	return LIBUSB_SUCCESS;
+}
+
+/** \ingroup libusb_asyncio
+ * Take a buffer from a pool allocated with \ref libusb_alloc_buffer_pool.
+ * This function is lock-free.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param pool the pool to take the buffer from
+ * \returns a buffer of at least the size the pool was allocated with, or
+ * NULL if all buffers are in use
+ */
+DEFAULT_VISIBILITY
+unsigned char * LIBUSB_CALL libusb_buffer_pool_get(libusb_buffer_pool *pool)
+{
+	struct buffer_pool_region *region;
+	int index, i;
+
+	index = buffer_pool_pop(pool);
+	if (index < 0)
+		return NULL;
+
+	for (i = pool->num_regions - 1; i > 0; i--) {
+		if (index >= pool->regions[i].first_index)
+			break;
+	}
+
+	region = &pool->regions[i];
+	return region->base + (size_t)(index - region->first_index) * pool->stride;
+}
+
+/** \ingroup libusb_asyncio
+ * Give back a buffer taken with \ref libusb_buffer_pool_get. This function
+ * is lock-free.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param pool the pool the buffer was taken from
+ * \param buffer the buffer to give back
+ */
+void API_EXPORTED libusb_buffer_pool_put(libusb_buffer_pool *pool,
+	unsigned char *buffer)
+{
+	int i;
+
+	if (!buffer)
+		return;
+
+	for (i = 0; i < pool->num_regions; i++) {
+		struct buffer_pool_region *region = &pool->regions[i];
+		size_t offset;
+
+		if (buffer < region->base || buffer >= region->base + region->length)
+			continue;
+
+		offset = (size_t)(buffer - region->base);
+		if (offset % pool->stride)
+			break;
+
+		buffer_pool_push(pool, region->first_index + (int)(offset / pool->stride));
+		return;
+	}
+
+	usbi_warn(pool->dev_handle ? HANDLE_CTX(pool->dev_handle) : NULL,
+		"buffer %p does not belong to pool %p", (void *)buffer, (void *)pool);
+}
+
+/** \ingroup libusb_asyncio
+ * Free a pool allocated with \ref libusb_alloc_buffer_pool, along with all
+ * of its buffers. No buffer of the pool may be in use by a transfer.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param pool the pool to free, may be NULL
+ */
+void API_EXPORTED libusb_free_buffer_pool(libusb_buffer_pool *pool)
+{
+	int i;
+
+	if (!pool)
+		return;
+
+	for (i = 0; i < pool->num_regions; i++)
+		free_buffer_pool_region(pool, &pool->regions[i]);
+
+	free(pool->next_free);
+	free(pool);
+}
+
 /** \ingroup libusb_dev
  * Determine if a kernel driver is active on an interface. If a kernel driver
  * is active, you cannot claim the interface, and libusb will be unable to
@@ -2211,7 +2543,7 @@ void API_EXPORTED libusb_set_debug(libusb_context *ctx, int level)
 	ctx = usbi_get_context(ctx);
 	if (!ctx->debug_fixed) {
 		level = CLAMP(level, LIBUSB_LOG_LEVEL_NONE, LIBUSB_LOG_LEVEL_DEBUG);
-		ctx->debug = (enum libusb_log_level)level;
+		usbi_atomic_store(&ctx->debug, level);
 	}
 #else
 	UNUSED(ctx);
@@ -2312,6 +2644,43 @@ int API_EXPORTEDV libusb_set_option(libusb_context *ctx,
 	if (LIBUSB_OPTION_LOG_CB == option) {
 		log_cb = (libusb_log_cb) va_arg(ap, libusb_log_cb);
 	}
+	if (LIBUSB_OPTION_TRANSFER_POOL == option || LIBUSB_OPTION_REAP_BUDGET == option ||
+	    LIBUSB_OPTION_SYNC_CACHE_SIZE == option) {
+		arg = va_arg(ap, int);
+		if (arg < 0) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+		}
+	}
+	if (LIBUSB_OPTION_CALLBACK_THREADS == option) {
+		arg = va_arg(ap, int);
+		if (arg < 0 || arg > USBI_MAX_CALLBACK_THREADS) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+		}
+	}
+	if (LIBUSB_OPTION_EVENT_THREADS == option) {
+		arg = va_arg(ap, int);
+		if (arg < 0 || arg > USBI_MAX_EVENT_THREADS) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+		}
+#ifndef HAVE_OS_EVENT_SET
+		/* event threads each wait on their own event set */
+		else if (arg > 0) {
+			r = LIBUSB_ERROR_NOT_SUPPORTED;
+		}
+#endif
+	}
+	if (LIBUSB_OPTION_LOG_RING == option) {
+		arg = va_arg(ap, int);
+		if (arg < 0 || arg > USBI_MAX_LOG_RING) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+		}
+#if !defined(ENABLE_LOGGING) || defined(ENABLE_DEBUG_LOGGING)
+		/* the ring is kept by the context, like its log level */
+		else if (arg > 0) {
+			r = LIBUSB_ERROR_NOT_SUPPORTED;
+		}
+#endif
+	}
 
 	do {
 		if (LIBUSB_SUCCESS != r) {
@@ -2323,10 +2692,20 @@ int API_EXPORTEDV libusb_set_option(libusb_context *ctx,
 			break;
 		}
 
+		/* the transfer pool is not tied to any context */
+		if (LIBUSB_OPTION_TRANSFER_POOL == option) {
+			r = usbi_transfer_pool_set_max(arg);
+			break;
+		}
+
 		if (NULL == ctx) {
 			usbi_mutex_static_lock(&default_context_lock);
 			default_context_options[option].is_set = 1;
-			if (LIBUSB_OPTION_LOG_LEVEL == option) {
+			if (LIBUSB_OPTION_LOG_LEVEL == option || LIBUSB_OPTION_REAP_BUDGET == option ||
+			    LIBUSB_OPTION_SYNC_CACHE_SIZE == option ||
+			    LIBUSB_OPTION_CALLBACK_THREADS == option ||
+			    LIBUSB_OPTION_EVENT_THREADS == option ||
+			    LIBUSB_OPTION_LOG_RING == option) {
 				default_context_options[option].arg.ival = arg;
 			} else if (LIBUSB_OPTION_LOG_CB == option) {
 				default_context_options[option].arg.log_cbval = log_cb;
@@ -2344,7 +2723,7 @@ int API_EXPORTEDV libusb_set_option(libusb_context *ctx,
 		case LIBUSB_OPTION_LOG_LEVEL:
 #if defined(ENABLE_LOGGING) && !defined(ENABLE_DEBUG_LOGGING)
 			if (!ctx->debug_fixed)
-				ctx->debug = (enum libusb_log_level)arg;
+				usbi_atomic_store(&ctx->debug, arg);
 #endif
 			break;
 
@@ -2363,6 +2742,39 @@ int API_EXPORTEDV libusb_set_option(libusb_context *ctx,
 		case LIBUSB_OPTION_LOG_CB:
 			libusb_set_log_cb_internal(ctx, log_cb, LIBUSB_LOG_CB_CONTEXT);
 			break;
+
+		case LIBUSB_OPTION_TRANSFER_POOL:
+			/* handled above */
+			break;
+
+		case LIBUSB_OPTION_REAP_BUDGET:
+			ctx->reap_budget = arg;
+			break;
+
+		case LIBUSB_OPTION_SYNC_DIRECT_IO:
+			ctx->sync_direct_io = 1;
+			break;
+
+		case LIBUSB_OPTION_SYNC_CACHE_SIZE:
+			ctx->sync_cache_size = arg;
+			break;
+
+		case LIBUSB_OPTION_CALLBACK_THREADS:
+			/* only used when the context is created */
+			ctx->callback_threads = arg;
+			break;
+
+		case LIBUSB_OPTION_EVENT_THREADS:
+			/* only used when the context is created */
+			ctx->event_threads = arg;
+			break;
+
+		case LIBUSB_OPTION_LOG_RING:
+#if defined(ENABLE_LOGGING) && !defined(ENABLE_DEBUG_LOGGING)
+			/* only used when the context is created */
+			ctx->log_ring_size = arg;
+#endif
+			break;
 		default:
 			r = LIBUSB_ERROR_INVALID_PARAM;
 		}
@@ -2456,12 +2868,12 @@ int API_EXPORTED libusb_init_context(libusb_context **ctx, const struct libusb_i
 	}
 
 #if defined(ENABLE_LOGGING) && !defined(ENABLE_DEBUG_LOGGING)
-	_ctx->debug = LIBUSB_LOG_LEVEL_NONE;
+	usbi_atomic_store(&_ctx->debug, LIBUSB_LOG_LEVEL_NONE);
 	if (getenv("LIBUSB_DEBUG")) {
-		_ctx->debug = get_env_debug_level();
+		usbi_atomic_store(&_ctx->debug, get_env_debug_level());
 		_ctx->debug_fixed = 1;
 	} else if (default_context_options[LIBUSB_OPTION_LOG_LEVEL].is_set) {
-		_ctx->debug = default_context_options[LIBUSB_OPTION_LOG_LEVEL].arg.ival;
+		usbi_atomic_store(&_ctx->debug, default_context_options[LIBUSB_OPTION_LOG_LEVEL].arg.ival);
 	}
 #endif
 
@@ -2469,16 +2881,25 @@ int API_EXPORTED libusb_init_context(libusb_context **ctx, const struct libusb_i
 	usbi_mutex_init(&_ctx->open_devs_lock);
 	list_init(&_ctx->usb_devs);
 	list_init(&_ctx->open_devs);
+	_ctx->reap_budget = USBI_DEFAULT_REAP_BUDGET;
+	_ctx->sync_cache_size = USBI_DEFAULT_SYNC_CACHE_SIZE;
 
 	/* apply default options to all new contexts */
 	for (enum libusb_option option = 0 ; option < LIBUSB_OPTION_MAX ; option++) {
-		if (LIBUSB_OPTION_LOG_LEVEL == option || !default_context_options[option].is_set) {
+		if (LIBUSB_OPTION_LOG_LEVEL == option || LIBUSB_OPTION_TRANSFER_POOL == option ||
+		    !default_context_options[option].is_set) {
 			continue;
 		}
-		if (LIBUSB_OPTION_LOG_CB != option) {
-			r = libusb_set_option(_ctx, option);
-		} else {
+		if (LIBUSB_OPTION_LOG_CB == option) {
 			r = libusb_set_option(_ctx, option, default_context_options[option].arg.log_cbval);
+		} else if (LIBUSB_OPTION_REAP_BUDGET == option ||
+			   LIBUSB_OPTION_SYNC_CACHE_SIZE == option ||
+			   LIBUSB_OPTION_CALLBACK_THREADS == option ||
+			   LIBUSB_OPTION_EVENT_THREADS == option ||
+			   LIBUSB_OPTION_LOG_RING == option) {
+			r = libusb_set_option(_ctx, option, default_context_options[option].arg.ival);
+		} else {
+			r = libusb_set_option(_ctx, option);
 		}
 		if (LIBUSB_SUCCESS != r)
 			goto err_free_ctx;
@@ -2497,6 +2918,14 @@ int API_EXPORTED libusb_init_context(libusb_context **ctx, const struct libusb_i
 			goto err_free_ctx;
 	}
 
+#if defined(ENABLE_LOGGING) && !defined(ENABLE_DEBUG_LOGGING)
+	if (_ctx->log_ring_size) {
+		r = log_ring_init(_ctx);
+		if (r < 0)
+			goto err_free_ctx;
+	}
+#endif
+
 	/* default context must be initialized before calling usbi_dbg */
 	if (!ctx) {
 		usbi_default_context = _ctx;
@@ -2555,6 +2984,9 @@ err_free_ctx:
 	usbi_mutex_destroy(&_ctx->open_devs_lock);
 	usbi_mutex_destroy(&_ctx->usb_devs_lock);
 
+#if defined(ENABLE_LOGGING) && !defined(ENABLE_DEBUG_LOGGING)
+	log_ring_exit(_ctx);
+#endif
 	free(_ctx);
 
 	usbi_mutex_static_unlock(&default_context_lock);
@@ -2600,6 +3032,10 @@ void API_EXPORTED libusb_exit(libusb_context *ctx)
 	list_del(&_ctx->list);
 	usbi_mutex_static_unlock(&active_contexts_lock);
 
+	/* Run the pending transfer callbacks while the backend is still up */
+	usbi_stop_event_threads(_ctx);
+	usbi_stop_callback_threads(_ctx);
+
 	/* Exit hotplug before backend dependency */
 	usbi_hotplug_exit(_ctx);
 
@@ -2630,6 +3066,10 @@ void API_EXPORTED libusb_exit(libusb_context *ctx)
 	usbi_mutex_destroy(&_ctx->open_devs_lock);
 	usbi_mutex_destroy(&_ctx->usb_devs_lock);
 
+#if defined(ENABLE_LOGGING) && !defined(ENABLE_DEBUG_LOGGING)
+	/* write out the messages still in the ring */
+	log_ring_exit(_ctx);
+#endif
 	free(_ctx);
 }
 
@@ -2741,36 +3181,16 @@ static void log_str(enum libusb_log_level level, const char *str)
 #endif /* USE_SYSTEM_LOGGING_FACILITY */
 }
 
-static void log_v(struct libusb_context *ctx, enum libusb_log_level level,
-	const char *function, const char *format, va_list args)
+/* Writes the header of a message into buf, with the time and thread that
+ * logged it if timestamp is not NULL, and returns its length */
+static int log_header(char *buf, enum libusb_log_level level,
+	const char *function, const struct timespec *timestamp, unsigned int tid)
 {
-	const char *prefix;
-	char buf[USBI_MAX_LOG_LEN];
-	int global_debug, header_len, text_len;
 	static int has_debug_header_been_displayed = 0;
-
-#ifdef ENABLE_DEBUG_LOGGING
-	global_debug = 1;
-	UNUSED(ctx);
-#else
-	enum libusb_log_level ctx_level;
-
-	ctx = ctx ? ctx : usbi_default_context;
-	ctx = ctx ? ctx : usbi_fallback_context;
-	if (ctx)
-		ctx_level = ctx->debug;
-	else
-		ctx_level = get_env_debug_level();
-
-	if (ctx_level < level)
-		return;
-
-	global_debug = (ctx_level == LIBUSB_LOG_LEVEL_DEBUG);
-#endif
+	const char *prefix;
+	int header_len;
 
 	switch (level) {
-	case LIBUSB_LOG_LEVEL_NONE:	/* Impossible, but keeps compiler happy */
-		return;
 	case LIBUSB_LOG_LEVEL_ERROR:
 		prefix = "error";
 		break;
@@ -2788,8 +3208,8 @@ static void log_v(struct libusb_context *ctx, enum libusb_log_level level,
 		break;
 	}
 
-	if (global_debug) {
-		struct timespec timestamp;
+	if (timestamp) {
+		struct timespec elapsed;
 
 		if (!has_debug_header_been_displayed) {
 			has_debug_header_been_displayed = 1;
@@ -2797,33 +3217,38 @@ static void log_v(struct libusb_context *ctx, enum libusb_log_level level,
 			log_str(LIBUSB_LOG_LEVEL_DEBUG, "--------------------------------------------------------------------------------" USBI_LOG_LINE_END);
 		}
 
-		usbi_get_monotonic_time(&timestamp);
-		TIMESPEC_SUB(&timestamp, &timestamp_origin, &timestamp);
+		TIMESPEC_SUB(timestamp, &timestamp_origin, &elapsed);
 
-		header_len = snprintf(buf, sizeof(buf),
+		header_len = snprintf(buf, USBI_MAX_LOG_LEN,
 			"[%2ld.%06ld] [%08x] libusb: %s [%s] ",
-			(long)timestamp.tv_sec, (long)(timestamp.tv_nsec / 1000L), usbi_get_tid(), prefix, function);
+			(long)elapsed.tv_sec, (long)(elapsed.tv_nsec / 1000L), tid, prefix, function);
 	} else {
-		header_len = snprintf(buf, sizeof(buf),
+		header_len = snprintf(buf, USBI_MAX_LOG_LEN,
 			"libusb: %s [%s] ", prefix, function);
 	}
 
-	if (header_len < 0 || header_len >= (int)sizeof(buf)) {
+	if (header_len < 0 || header_len >= USBI_MAX_LOG_LEN) {
 		/* Somehow snprintf() failed to write to the buffer,
 		 * remove the header so something useful is output. */
 		header_len = 0;
 	}
 
-	text_len = vsnprintf(buf + header_len, sizeof(buf) - (size_t)header_len,
-		format, args);
-	if (text_len < 0 || text_len + header_len >= (int)sizeof(buf)) {
+	return header_len;
+}
+
+/* Terminates a message formatted after its header in buf, and passes it to
+ * the log handlers */
+static void log_write(struct libusb_context *ctx, enum libusb_log_level level,
+	char *buf, int header_len, int text_len)
+{
+	if (text_len < 0 || text_len + header_len >= USBI_MAX_LOG_LEN) {
 		/* Truncated log output. On some platforms a -1 return value means
 		 * that the output was truncated. */
-		text_len = (int)sizeof(buf) - header_len;
+		text_len = USBI_MAX_LOG_LEN - header_len;
 	}
-	if (header_len + text_len + (int)sizeof(USBI_LOG_LINE_END) >= (int)sizeof(buf)) {
+	if (header_len + text_len + (int)sizeof(USBI_LOG_LINE_END) >= USBI_MAX_LOG_LEN) {
 		/* Need to truncate the text slightly to fit on the terminator. */
-		text_len -= (header_len + text_len + (int)sizeof(USBI_LOG_LINE_END)) - (int)sizeof(buf);
+		text_len -= (header_len + text_len + (int)sizeof(USBI_LOG_LINE_END)) - USBI_MAX_LOG_LEN;
 	}
 	strcpy(buf + header_len + text_len, USBI_LOG_LINE_END);
 
@@ -2833,9 +3258,551 @@ static void log_v(struct libusb_context *ctx, enum libusb_log_level level,
 #ifndef ENABLE_DEBUG_LOGGING
 	if (ctx && ctx->log_handler)
 		ctx->log_handler(ctx, level, buf);
+#else
+	UNUSED(ctx);
 #endif
 }
 
+#ifndef ENABLE_DEBUG_LOGGING
+/* Maximum number of arguments of a recorded message, and of bytes of its
+ * string arguments */
+#define LOG_RECORD_MAX_ARGS	8
+#define LOG_RECORD_STRINGS_LEN	128
+
+/* Maximum length of a single conversion specification, rewritten to print
+ * the argument as recorded */
+#define LOG_SPEC_LEN		16
+
+enum log_arg_type {
+	LOG_ARG_INT,
+	LOG_ARG_SIGNED,
+	LOG_ARG_UNSIGNED,
+	LOG_ARG_DOUBLE,
+	LOG_ARG_STRING,
+	LOG_ARG_POINTER,
+};
+
+/* An argument of a recorded message. Integers are widened to long long so
+ * that they can be printed without knowing their original type, and strings
+ * are copied into the record since they may not outlive the call. */
+union log_arg {
+	int i;
+	long long ll;
+	unsigned long long ull;
+	double d;
+	const void *p;
+	size_t offset;
+};
+
+/* A message in a context's log ring. The format is NULL if the arguments of
+ * the message could not be recorded, in which case it was written out when
+ * it was logged. */
+struct usbi_log_record {
+	struct timespec timestamp;
+	unsigned int tid;
+	enum libusb_log_level level;
+	const char *function;
+	const char *format;
+	union log_arg args[LOG_RECORD_MAX_ARGS];
+	char strings[LOG_RECORD_STRINGS_LEN];
+};
+
+/* A conversion specification of a format string */
+struct log_conversion {
+	const char *end;	/* past the conversion character */
+	size_t flags_len;	/* flags, width and precision after the '%' */
+	int num_stars;		/* width and precision taken from the arguments */
+	char length;		/* length modifier, 'H' for hh and 'L' for ll */
+	enum log_arg_type type;
+};
+
+/* Parses the conversion specification that follows a '%'. Returns 0, or -1
+ * if its argument cannot be recorded. */
+static int log_parse_conversion(const char *p, struct log_conversion *conv)
+{
+	const char *start = p;
+	int precision = 0;
+
+	conv->num_stars = 0;
+	conv->length = 0;
+
+	while (*p && strchr("-+ #0", *p))
+		p++;
+	if (*p == '*') {
+		conv->num_stars++;
+		p++;
+	} else {
+		while (*p >= '0' && *p <= '9')
+			p++;
+	}
+	if (*p == '.') {
+		precision = 1;
+		p++;
+		if (*p == '*') {
+			conv->num_stars++;
+			p++;
+		} else {
+			while (*p >= '0' && *p <= '9')
+				p++;
+		}
+	}
+
+	/* room for the '%', "ll", the conversion and the terminator */
+	conv->flags_len = (size_t)(p - start);
+	if (conv->flags_len + 5 > LOG_SPEC_LEN)
+		return -1;
+
+	switch (*p) {
+	case 'h':
+		conv->length = *p++;
+		if (*p == 'h') {
+			conv->length = 'H';
+			p++;
+		}
+		break;
+	case 'l':
+		conv->length = *p++;
+		if (*p == 'l') {
+			conv->length = 'L';
+			p++;
+		}
+		break;
+	case 'j':
+	case 'z':
+	case 't':
+		conv->length = *p++;
+		break;
+	case 'I':
+		/* PRId64 and friends expand to these with the MSVC runtime */
+		if (p[1] == '6' && p[2] == '4')
+			conv->length = 'L';
+		else if (p[1] != '3' || p[2] != '2')
+			return -1;
+		p += 3;
+		break;
+	default:
+		break;
+	}
+
+	switch (*p) {
+	case 'd':
+	case 'i':
+		conv->type = LOG_ARG_SIGNED;
+		break;
+	case 'o':
+	case 'u':
+	case 'x':
+	case 'X':
+		conv->type = LOG_ARG_UNSIGNED;
+		break;
+	case 'c':
+		conv->type = LOG_ARG_INT;
+		break;
+	case 'a':
+	case 'A':
+	case 'e':
+	case 'E':
+	case 'f':
+	case 'F':
+	case 'g':
+	case 'G':
+		conv->type = LOG_ARG_DOUBLE;
+		break;
+	case 's':
+		/* a string with a precision need not be terminated */
+		if (precision)
+			return -1;
+		conv->type = LOG_ARG_STRING;
+		break;
+	case 'p':
+		conv->type = LOG_ARG_POINTER;
+		break;
+	default:
+		return -1;
+	}
+
+	/* wide characters and long doubles are not recorded */
+	if (conv->length && conv->type != LOG_ARG_SIGNED && conv->type != LOG_ARG_UNSIGNED)
+		return -1;
+
+	conv->end = p + 1;
+	return 0;
+}
+
+/* Copies the arguments of a message into its record. Returns 0, or -1 if
+ * they cannot be recorded. */
+static int log_record_args(struct usbi_log_record *record, const char *format,
+	va_list args)
+{
+	struct log_conversion conv;
+	size_t strings_len = 0;
+	const char *p = format;
+	int n = 0;
+
+	while ((p = strchr(p, '%'))) {
+		union log_arg *arg;
+
+		p++;
+		if (*p == '%') {
+			p++;
+			continue;
+		}
+
+		if (log_parse_conversion(p, &conv) < 0 ||
+		    n + conv.num_stars >= LOG_RECORD_MAX_ARGS)
+			return -1;
+		p = conv.end;
+
+		while (conv.num_stars-- > 0)
+			record->args[n++].i = va_arg(args, int);
+
+		arg = &record->args[n++];
+		switch (conv.type) {
+		case LOG_ARG_INT:
+			arg->i = va_arg(args, int);
+			break;
+		case LOG_ARG_SIGNED:
+			switch (conv.length) {
+			case 'H':
+				arg->ll = (signed char)va_arg(args, int);
+				break;
+			case 'h':
+				arg->ll = (short)va_arg(args, int);
+				break;
+			case 'l':
+				arg->ll = va_arg(args, long);
+				break;
+			case 'L':
+				arg->ll = va_arg(args, long long);
+				break;
+			case 'j':
+				arg->ll = (long long)va_arg(args, intmax_t);
+				break;
+			case 'z':
+				arg->ll = (long long)va_arg(args, ssize_t);
+				break;
+			case 't':
+				arg->ll = (long long)va_arg(args, ptrdiff_t);
+				break;
+			default:
+				arg->ll = va_arg(args, int);
+				break;
+			}
+			break;
+		case LOG_ARG_UNSIGNED:
+			switch (conv.length) {
+			case 'H':
+				arg->ull = (unsigned char)va_arg(args, unsigned int);
+				break;
+			case 'h':
+				arg->ull = (unsigned short)va_arg(args, unsigned int);
+				break;
+			case 'l':
+				arg->ull = va_arg(args, unsigned long);
+				break;
+			case 'L':
+				arg->ull = va_arg(args, unsigned long long);
+				break;
+			case 'j':
+				arg->ull = (unsigned long long)va_arg(args, uintmax_t);
+				break;
+			case 'z':
+				arg->ull = (unsigned long long)va_arg(args, size_t);
+				break;
+			case 't':
+				arg->ull = (unsigned long long)(size_t)va_arg(args, ptrdiff_t);
+				break;
+			default:
+				arg->ull = va_arg(args, unsigned int);
+				break;
+			}
+			break;
+		case LOG_ARG_DOUBLE:
+			arg->d = va_arg(args, double);
+			break;
+		case LOG_ARG_POINTER:
+			arg->p = va_arg(args, void *);
+			break;
+		case LOG_ARG_STRING: {
+			const char *str = va_arg(args, const char *);
+			size_t len = 0;
+
+			if (!str)
+				str = "(null)";
+
+			/* strings that do not fit are truncated, and once the
+			 * record is full they share its last terminator */
+			if (strings_len == sizeof(record->strings)) {
+				arg->offset = strings_len - 1;
+				break;
+			}
+			while (str[len] && strings_len + len < sizeof(record->strings) - 1) {
+				record->strings[strings_len + len] = str[len];
+				len++;
+			}
+			record->strings[strings_len + len] = '\0';
+			arg->offset = strings_len;
+			strings_len += len + 1;
+			break;
+		}
+		}
+	}
+
+	return 0;
+}
+
+/* Formats a recorded message into buf, which has room for size bytes, and
+ * returns the length of the text */
+static int log_format_record(char *buf, size_t size,
+	const struct usbi_log_record *record)
+{
+	const char *p = record->format;
+	size_t len = 0;
+	int n = 0;
+
+	while (*p && len < size - 1) {
+		struct log_conversion conv;
+		const union log_arg *arg;
+		char spec[LOG_SPEC_LEN];
+		int stars[2], num_stars, r;
+		size_t spec_len;
+
+		if (*p != '%') {
+			buf[len++] = *p++;
+			continue;
+		}
+		if (p[1] == '%') {
+			buf[len++] = '%';
+			p += 2;
+			continue;
+		}
+
+		/* this succeeded when the message was recorded */
+		(void)log_parse_conversion(p + 1, &conv);
+
+		spec[0] = '%';
+		memcpy(spec + 1, p + 1, conv.flags_len);
+		spec_len = 1 + conv.flags_len;
+		if (conv.type == LOG_ARG_SIGNED || conv.type == LOG_ARG_UNSIGNED) {
+			spec[spec_len++] = 'l';
+			spec[spec_len++] = 'l';
+		}
+		spec[spec_len++] = conv.end[-1];
+		spec[spec_len] = '\0';
+		p = conv.end;
+
+		for (num_stars = 0; num_stars < conv.num_stars; num_stars++)
+			stars[num_stars] = record->args[n++].i;
+		arg = &record->args[n++];
+
+#define LOG_SNPRINTF(value)						\
+	(num_stars == 0 ? snprintf(buf + len, size - len, spec, value) :	\
+	 num_stars == 1 ? snprintf(buf + len, size - len, spec, stars[0], value) : \
+	 snprintf(buf + len, size - len, spec, stars[0], stars[1], value))
+
+		switch (conv.type) {
+		case LOG_ARG_INT:
+			r = LOG_SNPRINTF(arg->i);
+			break;
+		case LOG_ARG_SIGNED:
+			r = LOG_SNPRINTF(arg->ll);
+			break;
+		case LOG_ARG_UNSIGNED:
+			r = LOG_SNPRINTF(arg->ull);
+			break;
+		case LOG_ARG_DOUBLE:
+			r = LOG_SNPRINTF(arg->d);
+			break;
+		case LOG_ARG_POINTER:
+			r = LOG_SNPRINTF(arg->p);
+			break;
+		case LOG_ARG_STRING:
+			r = LOG_SNPRINTF(record->strings + arg->offset);
+			break;
+		default:
+			r = -1;
+			break;
+		}
+
+#undef LOG_SNPRINTF
+
+		if (r < 0)
+			break;
+		len += MIN((size_t)r, size - len - 1);
+	}
+	buf[len] = '\0';
+
+	return (int)len;
+}
+
+/* Copies a message into the context's log ring, or counts it as dropped if
+ * the ring is full. Returns 0, or -1 if the arguments of the message cannot
+ * be recorded and it must be written out instead. */
+static int log_record(struct libusb_context *ctx, enum libusb_log_level level,
+	const char *function, const char *format, va_list args)
+{
+	struct usbi_log_record *record;
+	unsigned long position;
+	va_list args_copy;
+	int r;
+
+	if (!usbi_ring_acquire_write(&ctx->log_ring, &position)) {
+		(void)usbi_atomic_inc(&ctx->log_dropped);
+		return 0;
+	}
+
+	record = &ctx->log_records[position % ctx->log_ring.size];
+	usbi_get_monotonic_time(&record->timestamp);
+	record->tid = usbi_get_tid();
+	record->level = level;
+	record->function = function;
+
+	/* the caller still needs the arguments if they cannot be recorded */
+	va_copy(args_copy, args);
+	r = log_record_args(record, format, args_copy);
+	va_end(args_copy);
+
+	record->format = r == 0 ? format : NULL;
+	usbi_ring_commit_write(&ctx->log_ring, position);
+
+	return r;
+}
+
+/* Formats up to max_messages recorded messages, or all of them if 0, and
+ * passes them to the log handlers. Returns how many were passed on. */
+static int log_ring_drain(struct libusb_context *ctx, int max_messages)
+{
+	char buf[USBI_MAX_LOG_LEN];
+	int header_len, text_len, drained = 0;
+	long dropped;
+
+	dropped = usbi_atomic_load(&ctx->log_dropped);
+	while (dropped && !usbi_atomic_cas(&ctx->log_dropped, dropped, 0))
+		dropped = usbi_atomic_load(&ctx->log_dropped);
+	if (dropped) {
+		struct timespec timestamp;
+
+		usbi_get_monotonic_time(&timestamp);
+		header_len = log_header(buf, LIBUSB_LOG_LEVEL_WARNING, __func__,
+			&timestamp, usbi_get_tid());
+		text_len = snprintf(buf + header_len, sizeof(buf) - (size_t)header_len,
+			"%ld messages dropped while the log ring was full", dropped);
+		log_write(ctx, LIBUSB_LOG_LEVEL_WARNING, buf, header_len, text_len);
+	}
+
+	while (!max_messages || drained < max_messages) {
+		struct usbi_log_record *record;
+		enum libusb_log_level level;
+		unsigned long position;
+		int recorded;
+
+		if (!usbi_ring_acquire_read(&ctx->log_ring, &position))
+			break;
+
+		/* the entry is handed back before the message is passed on,
+		 * so that the log handlers do not hold up the writers */
+		record = &ctx->log_records[position % ctx->log_ring.size];
+		recorded = record->format != NULL;
+		level = record->level;
+		if (recorded) {
+			header_len = log_header(buf, level, record->function,
+				&record->timestamp, record->tid);
+			text_len = log_format_record(buf + header_len,
+				sizeof(buf) - (size_t)header_len, record);
+		}
+		usbi_ring_commit_read(&ctx->log_ring, position);
+
+		if (recorded) {
+			log_write(ctx, level, buf, header_len, text_len);
+			drained++;
+		}
+	}
+
+	return drained;
+}
+
+static int log_ring_init(struct libusb_context *ctx)
+{
+	struct usbi_ring_slot *slots;
+	unsigned long size = 1;
+
+	/* positions are taken modulo the size */
+	while (size < (unsigned long)ctx->log_ring_size)
+		size <<= 1;
+
+	slots = calloc(size, sizeof(*slots));
+	ctx->log_records = calloc(size, sizeof(*ctx->log_records));
+	if (!slots || !ctx->log_records) {
+		free(slots);
+		free(ctx->log_records);
+		ctx->log_records = NULL;
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	usbi_ring_init(&ctx->log_ring, slots, size);
+	usbi_atomic_store(&ctx->log_dropped, 0);
+	return 0;
+}
+
+static void log_ring_exit(struct libusb_context *ctx)
+{
+	if (!ctx->log_records)
+		return;
+
+	(void)log_ring_drain(ctx, 0);
+
+	free(ctx->log_ring.slots);
+	free(ctx->log_records);
+	ctx->log_records = NULL;
+}
+#endif /* ENABLE_DEBUG_LOGGING */
+
+static void log_v(struct libusb_context *ctx, enum libusb_log_level level,
+	const char *function, const char *format, va_list args)
+{
+	char buf[USBI_MAX_LOG_LEN];
+	int global_debug, header_len, text_len;
+
+	if (level == LIBUSB_LOG_LEVEL_NONE)	/* Impossible, but keeps compiler happy */
+		return;
+
+#ifdef ENABLE_DEBUG_LOGGING
+	global_debug = 1;
+#else
+	enum libusb_log_level ctx_level;
+
+	ctx = ctx ? ctx : usbi_default_context;
+	ctx = ctx ? ctx : usbi_fallback_context;
+	if (ctx)
+		ctx_level = (enum libusb_log_level)usbi_atomic_load(&ctx->debug);
+	else
+		ctx_level = get_env_debug_level();
+
+	if (ctx_level < level)
+		return;
+
+	/* recorded messages are formatted by libusb_drain_log() */
+	if (ctx && ctx->log_records &&
+	    log_record(ctx, level, function, format, args) == 0)
+		return;
+
+	global_debug = (ctx_level == LIBUSB_LOG_LEVEL_DEBUG);
+#endif
+
+	if (global_debug) {
+		struct timespec timestamp;
+
+		usbi_get_monotonic_time(&timestamp);
+		header_len = log_header(buf, level, function, &timestamp, usbi_get_tid());
+	} else {
+		header_len = log_header(buf, level, function, NULL, 0);
+	}
+
+	text_len = vsnprintf(buf + header_len, sizeof(buf) - (size_t)header_len,
+		format, args);
+	log_write(ctx, level, buf, header_len, text_len);
+}
+
 void usbi_log(struct libusb_context *ctx, enum libusb_log_level level,
 	const char *function, const char *format, ...)
 {
@@ -2848,6 +3815,38 @@ void usbi_log(struct libusb_context *ctx, enum libusb_log_level level,
 
 #endif /* ENABLE_LOGGING */
 
+/** \ingroup libusb_lib
+ * Format the messages recorded in a context's log ring and pass them to the
+ * log handlers, oldest first, on the calling thread. The context must have
+ * been created with the \ref LIBUSB_OPTION_LOG_RING option for messages to
+ * be recorded. If messages were dropped because the ring was full, a
+ * warning saying how many is passed on first.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param max_messages the maximum number of messages to pass on, or 0 for
+ * all of those recorded
+ * \returns the number of messages passed on, or
+ * \ref LIBUSB_ERROR_INVALID_PARAM if max_messages is negative
+ */
+int API_EXPORTED libusb_drain_log(libusb_context *ctx, int max_messages)
+{
+	if (max_messages < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+#if defined(ENABLE_LOGGING) && !defined(ENABLE_DEBUG_LOGGING)
+	ctx = usbi_get_context(ctx);
+	if (!ctx || !ctx->log_records)
+		return 0;
+
+	return log_ring_drain(ctx, max_messages);
+#else
+	UNUSED(ctx);
+	return 0;
+#endif
+}
+
 /** \ingroup libusb_misc
  * Returns a constant NULL-terminated string with the ASCII name of a libusb
  * error or transfer status code. The caller must not free() the returned
@@ -22,6 +22,7 @@
  */
 
 #include "libusbi.h"
+#include <string.h>
 
 /**
  * \page libusb_io Synchronous and asynchronous device I/O
@@ -40,6 +41,7 @@
  * detailed API documentation pages for the details:
  * - \ref libusb_syncio
  * - \ref libusb_asyncio
+ * - \ref libusb_stream
  *
  * \section theory Transfers at a logical level
  *
@@ -534,6 +536,12 @@ if (r == 0 && actual_length == sizeof(data)) {
  * - \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_TRANSFER
  *   "LIBUSB_TRANSFER_FREE_TRANSFER" causes libusb to automatically free the
  *   transfer after the transfer callback returns.
+ * - \ref libusb_transfer_flags::LIBUSB_TRANSFER_AUTO_RESUBMIT
+ *   "LIBUSB_TRANSFER_AUTO_RESUBMIT" causes libusb to resubmit a successfully
+ *   completed transfer after the transfer callback returns, which suits
+ *   continuous streaming from an endpoint. Resubmitting a transfer without a
+ *   timeout this way is cheaper than calling libusb_submit_transfer() from
+ *   the callback.
  *
  * \section asyncevent Event handling
  *
@@ -788,6 +796,29 @@ while (user has not requested application exit) {
  * during the life of your application. Rather than having to repeatedly
  * call libusb_get_pollfds(), you can set up notification functions for when
  * the file descriptor set changes using libusb_set_pollfd_notifiers().
+ *
+ * \subsection pollsinglefd Polling a single file descriptor
+ *
+ * On platforms where the event sources can be gathered in the kernel (Linux
+ * with epoll), libusb_get_event_fd() returns a single file descriptor that
+ * covers all of them. It becomes readable whenever libusb has work to do,
+ * including expired timeouts, and stays the same for the lifetime of the
+ * context, so the file descriptor set never changes. When it is readable,
+ * call libusb_handle_ready_events():
+\code
+// initialise libusb
+
+fd = libusb_get_event_fd(ctx)
+while (user has not requested application exit) {
+	poll(on fd plus any other event sources of interest,
+		using any timeout that you like)
+	if (poll() indicated activity on fd)
+		libusb_handle_ready_events(ctx);
+	// handle events from other sources here
+}
+
+// clean up and exit
+\endcode
  *
  * \subsection mtissues Multi-threaded considerations
  *
@@ -1157,27 +1188,37 @@ printf("completed!\n");
  * give up the events lock if instructed.
  */
 
+static int start_callback_threads(struct libusb_context *ctx);
+static int start_event_threads(struct libusb_context *ctx);
+
 int usbi_io_init(struct libusb_context *ctx)
 {
 	int r;
 
-	usbi_mutex_init(&ctx->flying_transfers_lock);
+	usbi_mutex_init(&ctx->timeout_lock);
 	usbi_mutex_init(&ctx->events_lock);
 	usbi_mutex_init(&ctx->event_waiters_lock);
 	usbi_cond_init(&ctx->event_waiters_cond);
+	list_init(&ctx->event_waiters);
 	usbi_mutex_init(&ctx->event_data_lock);
 	usbi_tls_key_create(&ctx->event_handling_key);
-	list_init(&ctx->flying_transfers);
 	list_init(&ctx->event_sources);
 	list_init(&ctx->removed_event_sources);
 	list_init(&ctx->hotplug_msgs);
+	usbi_atomic_ptr_store(&ctx->completed_queue, NULL);
 	list_init(&ctx->completed_transfers);
 
-	r = usbi_create_event(&ctx->event);
+#ifdef HAVE_OS_EVENT_SET
+	r = usbi_create_event_set(&ctx->event_set);
 	if (r < 0)
 		goto err;
+#endif
+
+	r = usbi_create_event(&ctx->event);
+	if (r < 0)
+		goto err_destroy_event_set;
 
-	r = usbi_add_event_source(ctx, USBI_EVENT_OS_HANDLE(&ctx->event), USBI_EVENT_POLL_EVENTS);
+	r = usbi_add_event_source(ctx, USBI_EVENT_OS_HANDLE(&ctx->event), USBI_EVENT_POLL_EVENTS, NULL);
 	if (r < 0)
 		goto err_destroy_event;
 
@@ -1185,7 +1226,7 @@ int usbi_io_init(struct libusb_context *ctx)
 	r = usbi_create_timer(&ctx->timer);
 	if (r == 0) {
 		usbi_dbg(ctx, "using timer for timeouts");
-		r = usbi_add_event_source(ctx, USBI_TIMER_OS_HANDLE(&ctx->timer), USBI_TIMER_POLL_EVENTS);
+		r = usbi_add_event_source(ctx, USBI_TIMER_OS_HANDLE(&ctx->timer), USBI_TIMER_POLL_EVENTS, NULL);
 		if (r < 0)
 			goto err_destroy_timer;
 	} else {
@@ -1193,17 +1234,35 @@ int usbi_io_init(struct libusb_context *ctx)
 	}
 #endif
 
+	r = start_callback_threads(ctx);
+	if (r < 0)
+		goto err_remove_timer;
+
+	r = start_event_threads(ctx);
+	if (r < 0)
+		goto err_stop_callback_threads;
+
 	return 0;
 
+err_stop_callback_threads:
+	usbi_stop_callback_threads(ctx);
+err_remove_timer:
 #ifdef HAVE_OS_TIMER
+	if (usbi_using_timer(ctx))
+		usbi_remove_event_source(ctx, USBI_TIMER_OS_HANDLE(&ctx->timer));
 err_destroy_timer:
-	usbi_destroy_timer(&ctx->timer);
-	usbi_remove_event_source(ctx, USBI_EVENT_OS_HANDLE(&ctx->event));
+	if (usbi_using_timer(ctx))
+		usbi_destroy_timer(&ctx->timer);
 #endif
+	usbi_remove_event_source(ctx, USBI_EVENT_OS_HANDLE(&ctx->event));
 err_destroy_event:
 	usbi_destroy_event(&ctx->event);
+err_destroy_event_set:
+#ifdef HAVE_OS_EVENT_SET
+	usbi_destroy_event_set(&ctx->event_set);
 err:
-	usbi_mutex_destroy(&ctx->flying_transfers_lock);
+#endif
+	usbi_mutex_destroy(&ctx->timeout_lock);
 	usbi_mutex_destroy(&ctx->events_lock);
 	usbi_mutex_destroy(&ctx->event_waiters_lock);
 	usbi_cond_destroy(&ctx->event_waiters_cond);
@@ -1224,6 +1283,8 @@ static void cleanup_removed_event_sources(struct libusb_context *ctx)
 
 void usbi_io_exit(struct libusb_context *ctx)
 {
+	usbi_stop_event_threads(ctx);
+	usbi_stop_callback_threads(ctx);
 #ifdef HAVE_OS_TIMER
 	if (usbi_using_timer(ctx)) {
 		usbi_remove_event_source(ctx, USBI_TIMER_OS_HANDLE(&ctx->timer));
@@ -1232,7 +1293,10 @@ void usbi_io_exit(struct libusb_context *ctx)
 #endif
 	usbi_remove_event_source(ctx, USBI_EVENT_OS_HANDLE(&ctx->event));
 	usbi_destroy_event(&ctx->event);
-	usbi_mutex_destroy(&ctx->flying_transfers_lock);
+#ifdef HAVE_OS_EVENT_SET
+	usbi_destroy_event_set(&ctx->event_set);
+#endif
+	usbi_mutex_destroy(&ctx->timeout_lock);
 	usbi_mutex_destroy(&ctx->events_lock);
 	usbi_mutex_destroy(&ctx->event_waiters_lock);
 	usbi_cond_destroy(&ctx->event_waiters_cond);
@@ -1240,26 +1304,362 @@ void usbi_io_exit(struct libusb_context *ctx)
 	usbi_tls_key_delete(ctx->event_handling_key);
 	cleanup_removed_event_sources(ctx);
 	free(ctx->event_data);
+	free(ctx->event_user_data);
+	free(ctx->timeout_heap.items);
+}
+
+static void timeout_heap_set(struct usbi_timeout_heap *heap,
+	unsigned int i, struct usbi_timeout_node *node)
+{
+	heap->items[i] = node;
+	node->heap_index = i + 1;
+}
+
+static void timeout_heap_sift_up(struct usbi_timeout_heap *heap,
+	unsigned int i)
+{
+	struct usbi_timeout_node *node = heap->items[i];
+
+	while (i > 0) {
+		unsigned int parent = (i - 1) / 2;
+
+		if (!TIMESPEC_CMP(&node->expiry, &heap->items[parent]->expiry, <))
+			break;
+		timeout_heap_set(heap, i, heap->items[parent]);
+		i = parent;
+	}
+	timeout_heap_set(heap, i, node);
+}
+
+static void timeout_heap_sift_down(struct usbi_timeout_heap *heap,
+	unsigned int i)
+{
+	struct usbi_timeout_node *node = heap->items[i];
+
+	while (1) {
+		unsigned int child = 2 * i + 1;
+
+		if (child >= heap->count)
+			break;
+		if (child + 1 < heap->count &&
+		    TIMESPEC_CMP(&heap->items[child + 1]->expiry, &heap->items[child]->expiry, <))
+			child++;
+		if (!TIMESPEC_CMP(&heap->items[child]->expiry, &node->expiry, <))
+			break;
+		timeout_heap_set(heap, i, heap->items[child]);
+		i = child;
+	}
+	timeout_heap_set(heap, i, node);
+}
+
+/* Make sure the heap can hold at least size nodes without growing.
+ * Returns 0 on success or LIBUSB_ERROR_NO_MEM. */
+int usbi_timeout_heap_reserve(struct usbi_timeout_heap *heap,
+	unsigned int size)
+{
+	struct usbi_timeout_node **items;
+
+	if (size <= heap->size)
+		return 0;
+
+	if (size < 2 * heap->size)
+		size = 2 * heap->size;
+	if (size < 16)
+		size = 16;
+
+	items = realloc(heap->items, size * sizeof(*items));
+	if (!items)
+		return LIBUSB_ERROR_NO_MEM;
+	heap->items = items;
+	heap->size = size;
+	return 0;
+}
+
+/* Insert a node into the heap.
+ * Returns 0 on success or LIBUSB_ERROR_NO_MEM if the heap could not grow. */
+int usbi_timeout_heap_insert(struct usbi_timeout_heap *heap,
+	struct usbi_timeout_node *node)
+{
+	int r = usbi_timeout_heap_reserve(heap, heap->count + 1);
+
+	if (r)
+		return r;
+
+	heap->items[heap->count++] = node;
+	timeout_heap_sift_up(heap, heap->count - 1);
+	return 0;
+}
+
+/* Remove a node from the heap. Does nothing if it is not in the heap. */
+void usbi_timeout_heap_remove(struct usbi_timeout_heap *heap,
+	struct usbi_timeout_node *node)
+{
+	struct usbi_timeout_node *last;
+	unsigned int i;
+
+	if (!node->heap_index)
+		return;
+
+	i = node->heap_index - 1;
+	node->heap_index = 0;
+	last = heap->items[--heap->count];
+	if (i == heap->count)
+		return;
+
+	heap->items[i] = last;
+	if (i > 0 && TIMESPEC_CMP(&last->expiry, &heap->items[(i - 1) / 2]->expiry, <))
+		timeout_heap_sift_up(heap, i);
+	else
+		timeout_heap_sift_down(heap, i);
+}
+
+/* Prepares in-flight transfer tracking for a new device handle. This also
+ * reserves room for the handle in the context timeout heap so that publishing
+ * a timeout never has to allocate. */
+int usbi_io_handle_init(struct libusb_context *ctx,
+	struct libusb_device_handle *dev_handle)
+{
+	int r;
+
+	usbi_mutex_lock(&ctx->timeout_lock);
+	r = usbi_timeout_heap_reserve(&ctx->timeout_heap, ctx->timeout_shards + 1);
+	if (r == 0)
+		ctx->timeout_shards++;
+	usbi_mutex_unlock(&ctx->timeout_lock);
+	if (r)
+		return r;
+
+	usbi_mutex_init(&dev_handle->flying_transfers_lock);
+	list_init(&dev_handle->flying_transfers);
+	usbi_mutex_init(&dev_handle->sync_cache_lock);
+	list_init(&dev_handle->sync_cache);
+	return 0;
+}
+
+void usbi_io_handle_exit(struct libusb_context *ctx,
+	struct libusb_device_handle *dev_handle)
+{
+	usbi_mutex_lock(&ctx->timeout_lock);
+	usbi_timeout_heap_remove(&ctx->timeout_heap, &dev_handle->timeout_node);
+	ctx->timeout_shards--;
+	usbi_mutex_unlock(&ctx->timeout_lock);
+
+	usbi_mutex_destroy(&dev_handle->flying_transfers_lock);
+	free(dev_handle->flying_timeouts.items);
+
+	usbi_sync_cache_free(dev_handle);
+	usbi_mutex_destroy(&dev_handle->sync_cache_lock);
 }
 
-static void calculate_timeout(struct usbi_transfer *itransfer)
+/* now is the current monotonic time, or NULL to read the clock here */
+static void calculate_timeout(struct usbi_transfer *itransfer,
+	const struct timespec *now)
 {
 	unsigned int timeout =
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->timeout;
 
 	if (!timeout) {
-		TIMESPEC_CLEAR(&itransfer->timeout);
+		TIMESPEC_CLEAR(&itransfer->timeout.expiry);
 		return;
 	}
 
-	usbi_get_monotonic_time(&itransfer->timeout);
+	if (now)
+		itransfer->timeout.expiry = *now;
+	else
+		usbi_get_monotonic_time(&itransfer->timeout.expiry);
+
+	itransfer->timeout.expiry.tv_sec += timeout / 1000U;
+	itransfer->timeout.expiry.tv_nsec += (timeout % 1000U) * 1000000L;
+	if (itransfer->timeout.expiry.tv_nsec >= NSEC_PER_SEC) {
+		++itransfer->timeout.expiry.tv_sec;
+		itransfer->timeout.expiry.tv_nsec -= NSEC_PER_SEC;
+	}
+}
+
+/* Transfer pool, see LIBUSB_OPTION_TRANSFER_POOL.
+ *
+ * Free transfer blocks are kept in lists per iso packet count class, so that
+ * a block serves any transfer with up to that many iso packets. The lists
+ * are split in shards with their own lock, and a thread always uses the
+ * shard selected by its thread id, so threads allocating and freeing
+ * transfers rarely contend with each other. Pooled blocks keep their
+ * initialized mutex. */
+#define TRANSFER_POOL_SHARDS	16
+
+static const int transfer_pool_classes[] = { 0, 8, 32, 128 };
+
+struct transfer_pool_shard {
+	usbi_mutex_t lock;
+	struct list_head free_list[ARRAYSIZE(transfer_pool_classes)];
+	unsigned int free_count[ARRAYSIZE(transfer_pool_classes)];
+	uint64_t hits;
+	uint64_t misses;
+};
+
+static usbi_mutex_static_t transfer_pool_lock = USBI_MUTEX_INITIALIZER;
+static struct transfer_pool_shard *transfer_pool;
+/* maximum number of free blocks per class and shard, 0 if disabled */
+static usbi_atomic_t transfer_pool_max;
+
+static int transfer_pool_class(int iso_packets)
+{
+	int i;
+
+	for (i = 0; i < (int)ARRAYSIZE(transfer_pool_classes); i++) {
+		if (iso_packets <= transfer_pool_classes[i])
+			return i;
+	}
+
+	return -1;
+}
+
+static struct transfer_pool_shard *transfer_pool_get_shard(void)
+{
+	return &transfer_pool[usbi_get_tid() % TRANSFER_POOL_SHARDS];
+}
+
+static size_t transfer_alloc_size(int iso_packets)
+{
+	return PTR_ALIGN(usbi_backend.transfer_priv_size)
+		+ sizeof(struct usbi_transfer)
+		+ sizeof(struct libusb_transfer)
+		+ (sizeof(struct libusb_iso_packet_descriptor) * (size_t)iso_packets);
+}
+
+static void transfer_pool_drain(void)
+{
+	size_t priv_size = PTR_ALIGN(usbi_backend.transfer_priv_size);
+	struct usbi_transfer *itransfer, *tmp;
+	unsigned int i, j;
+
+	for (i = 0; i < TRANSFER_POOL_SHARDS; i++) {
+		struct transfer_pool_shard *shard = &transfer_pool[i];
+
+		usbi_mutex_lock(&shard->lock);
+		for (j = 0; j < ARRAYSIZE(transfer_pool_classes); j++) {
+			__for_each_transfer_safe(&shard->free_list[j], itransfer, tmp) {
+				list_del(&itransfer->list);
+				usbi_mutex_destroy(&itransfer->lock);
+				free((unsigned char *)itransfer - priv_size);
+			}
+			shard->free_count[j] = 0;
+		}
+		usbi_mutex_unlock(&shard->lock);
+	}
+}
+
+/* Sets the maximum number of free transfers kept per size class and shard.
+ * 0 disables the pool and frees all pooled transfers. */
+int usbi_transfer_pool_set_max(int max)
+{
+	int r = LIBUSB_SUCCESS;
+
+	if (max < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_mutex_static_lock(&transfer_pool_lock);
+	if (!transfer_pool && max) {
+		transfer_pool = calloc(TRANSFER_POOL_SHARDS, sizeof(*transfer_pool));
+		if (transfer_pool) {
+			unsigned int i, j;
+
+			for (i = 0; i < TRANSFER_POOL_SHARDS; i++) {
+				usbi_mutex_init(&transfer_pool[i].lock);
+				for (j = 0; j < ARRAYSIZE(transfer_pool_classes); j++)
+					list_init(&transfer_pool[i].free_list[j]);
+			}
+		} else {
+			r = LIBUSB_ERROR_NO_MEM;
+		}
+	}
+	if (r == LIBUSB_SUCCESS) {
+		usbi_atomic_store(&transfer_pool_max, max);
+		if (!max && transfer_pool)
+			transfer_pool_drain();
+	}
+	usbi_mutex_static_unlock(&transfer_pool_lock);
+
+	return r;
+}
+
+/* takes a free transfer block of the given class from the pool, or returns
+ * NULL and counts a miss */
+static struct usbi_transfer *transfer_pool_get(int pool_class)
+{
+	struct transfer_pool_shard *shard = transfer_pool_get_shard();
+	struct usbi_transfer *itransfer = NULL;
+
+	usbi_mutex_lock(&shard->lock);
+	if (!list_empty(&shard->free_list[pool_class])) {
+		itransfer = list_first_entry(&shard->free_list[pool_class],
+			struct usbi_transfer, list);
+		list_del(&itransfer->list);
+		shard->free_count[pool_class]--;
+		shard->hits++;
+	} else {
+		shard->misses++;
+	}
+	usbi_mutex_unlock(&shard->lock);
+
+	return itransfer;
+}
+
+/* returns a transfer block to the pool. returns 0 if the pool is full or has
+ * been disabled, in which case the caller must free the block */
+static int transfer_pool_put(struct usbi_transfer *itransfer)
+{
+	struct transfer_pool_shard *shard = transfer_pool_get_shard();
+	int pool_class = itransfer->pool_class - 1;
+	long max;
+	int r = 0;
+
+	usbi_mutex_lock(&shard->lock);
+	/* checked under the shard lock so that transfer_pool_drain() cannot miss
+	 * this block */
+	max = usbi_atomic_load(&transfer_pool_max);
+	if (shard->free_count[pool_class] < (unsigned long)max) {
+		list_add(&itransfer->list, &shard->free_list[pool_class]);
+		shard->free_count[pool_class]++;
+		r = 1;
+	}
+	usbi_mutex_unlock(&shard->lock);
+
+	return r;
+}
+
+/** \ingroup libusb_asyncio
+ * Retrieve the hit and miss counters of the transfer pool enabled with
+ * \ref libusb_option::LIBUSB_OPTION_TRANSFER_POOL "LIBUSB_OPTION_TRANSFER_POOL".
+ * A hit is a libusb_alloc_transfer() call that was served from the pool, a
+ * miss is one that had to allocate memory while the pool was enabled.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param stats output location for the counters
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if stats is NULL
+ */
+int API_EXPORTED libusb_get_transfer_pool_stats(
+	struct libusb_transfer_pool_stats *stats)
+{
+	unsigned int i;
+
+	if (!stats)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	stats->hits = 0;
+	stats->misses = 0;
 
-	itransfer->timeout.tv_sec += timeout / 1000U;
-	itransfer->timeout.tv_nsec += (timeout % 1000U) * 1000000L;
-	if (itransfer->timeout.tv_nsec >= NSEC_PER_SEC) {
-		++itransfer->timeout.tv_sec;
-		itransfer->timeout.tv_nsec -= NSEC_PER_SEC;
+	usbi_mutex_static_lock(&transfer_pool_lock);
+	for (i = 0; transfer_pool && i < TRANSFER_POOL_SHARDS; i++) {
+		usbi_mutex_lock(&transfer_pool[i].lock);
+		stats->hits += transfer_pool[i].hits;
+		stats->misses += transfer_pool[i].misses;
+		usbi_mutex_unlock(&transfer_pool[i].lock);
 	}
+	usbi_mutex_static_unlock(&transfer_pool_lock);
+
+	return LIBUSB_SUCCESS;
 }
 
 /** \ingroup libusb_asyncio
@@ -1282,6 +1682,11 @@ static void calculate_timeout(struct usbi_transfer *itransfer)
  * use it on a non-isochronous endpoint. If you do this, ensure that at time
  * of submission, num_iso_packets is 0 and that type is set appropriately.
  *
+ * If the transfer pool is enabled with
+ * \ref libusb_option::LIBUSB_OPTION_TRANSFER_POOL "LIBUSB_OPTION_TRANSFER_POOL",
+ * the returned transfer may be a previously freed one. It is initialized
+ * exactly like a newly allocated transfer.
+ *
  * \param iso_packets number of isochronous packet descriptors to allocate. Must be non-negative.
  * \returns a newly allocated transfer, or NULL on error
  */
@@ -1294,24 +1699,44 @@ struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(
 	unsigned char *ptr;
 	struct usbi_transfer *itransfer;
 	struct libusb_transfer *transfer;
+	int pool_class = -1;
 
 	assert(iso_packets >= 0);
 	if (iso_packets < 0)
 		return NULL;
 
 	priv_size = PTR_ALIGN(usbi_backend.transfer_priv_size);
-	alloc_size = priv_size
-		+ sizeof(struct usbi_transfer)
-		+ sizeof(struct libusb_transfer)
-		+ (sizeof(struct libusb_iso_packet_descriptor) * (size_t)iso_packets);
+
+	if (usbi_atomic_load(&transfer_pool_max))
+		pool_class = transfer_pool_class(iso_packets);
+
+	if (pool_class >= 0) {
+		alloc_size = transfer_alloc_size(transfer_pool_classes[pool_class]);
+		itransfer = transfer_pool_get(pool_class);
+		if (itransfer) {
+			/* clear everything but the mutex */
+			unsigned char *lock_start = (unsigned char *)&itransfer->lock;
+			unsigned char *lock_end = lock_start + sizeof(itransfer->lock);
+
+			ptr = (unsigned char *)itransfer - priv_size;
+			memset(ptr, 0, (size_t)(lock_start - ptr));
+			memset(lock_end, 0, (size_t)(ptr + alloc_size - lock_end));
+			goto out;
+		}
+	} else {
+		alloc_size = transfer_alloc_size(iso_packets);
+	}
+
 	ptr = calloc(1, alloc_size);
 	if (!ptr)
 		return NULL;
 
 	itransfer = (struct usbi_transfer *)(ptr + priv_size);
+	usbi_mutex_init(&itransfer->lock);
+out:
 	itransfer->num_iso_packets = iso_packets;
+	itransfer->pool_class = pool_class + 1;
 	itransfer->priv = ptr;
-	usbi_mutex_init(&itransfer->lock);
 	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	return transfer;
 }
@@ -1347,42 +1772,63 @@ void API_EXPORTED libusb_free_transfer(struct libusb_transfer *transfer)
 		free(transfer->buffer);
 
 	itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
-	usbi_mutex_destroy(&itransfer->lock);
 	if (itransfer->dev)
 		libusb_unref_device(itransfer->dev);
 
+	if (usbi_backend.free_transfer_priv)
+		usbi_backend.free_transfer_priv(itransfer);
+
+	if (itransfer->pool_class && transfer_pool_put(itransfer))
+		return;
+
+	usbi_mutex_destroy(&itransfer->lock);
+
 	priv_size = PTR_ALIGN(usbi_backend.transfer_priv_size);
 	ptr = (unsigned char *)itransfer - priv_size;
 	assert(ptr == itransfer->priv);
 	free(ptr);
 }
 
-/* iterates through the flying transfers, and rearms the timer based on the
- * next upcoming timeout.
- * must be called with flying_list locked.
+#define TIMEOUT_NODE_TO_HANDLE(node) \
+	container_of(node, struct libusb_device_handle, timeout_node)
+
+/* returns the flying transfer on a device handle with the soonest timeout
+ * that still needs to be handled by libusb, or NULL if there is none.
+ * transfers whose timeout has been handled already or is handled by the OS
+ * are dropped from the heap on the way.
+ * must be called with the device handle's flying_list locked. */
+static struct usbi_transfer *next_timeout_transfer(struct libusb_device_handle *dev_handle)
+{
+	struct usbi_timeout_node *node;
+	struct usbi_transfer *itransfer;
+
+	while ((node = usbi_timeout_heap_top(&dev_handle->flying_timeouts))) {
+		itransfer = container_of(node, struct usbi_transfer, timeout);
+		if (!(itransfer->timeout_flags & (USBI_TRANSFER_TIMEOUT_HANDLED | USBI_TRANSFER_OS_HANDLES_TIMEOUT)))
+			return itransfer;
+		usbi_timeout_heap_remove(&dev_handle->flying_timeouts, node);
+	}
+
+	return NULL;
+}
+
+/* rearms the timer based on the next upcoming timeout of any device handle.
+ * must be called with the timeout_lock held.
  * returns 0 on success or a LIBUSB_ERROR code on failure.
  */
 #ifdef HAVE_OS_TIMER
 static int arm_timer_for_next_timeout(struct libusb_context *ctx)
 {
-	struct usbi_transfer *itransfer;
+	struct usbi_timeout_node *node;
 
 	if (!usbi_using_timer(ctx))
 		return 0;
 
-	for_each_transfer(ctx, itransfer) {
-		struct timespec *cur_ts = &itransfer->timeout;
-
-		/* if we've reached transfers of infinite timeout, then we have no
-		 * arming to do */
-		if (!TIMESPEC_IS_SET(cur_ts))
-			break;
-
-		/* act on first transfer that has not already been handled */
-		if (!(itransfer->timeout_flags & (USBI_TRANSFER_TIMEOUT_HANDLED | USBI_TRANSFER_OS_HANDLES_TIMEOUT))) {
-			usbi_dbg(ctx, "next timeout originally %ums", USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->timeout);
-			return usbi_arm_timer(&ctx->timer, cur_ts);
-		}
+	node = usbi_timeout_heap_top(&ctx->timeout_heap);
+	if (node) {
+		usbi_dbg(ctx, "next timeout on device handle %p",
+			(void *) TIMEOUT_NODE_TO_HANDLE(node));
+		return usbi_arm_timer(&ctx->timer, &node->expiry);
 	}
 
 	usbi_dbg(ctx, "no timeouts, disarming timer");
@@ -1396,85 +1842,110 @@ static inline int arm_timer_for_next_timeout(struct libusb_context *ctx)
 }
 #endif
 
-/* add a transfer to the (timeout-sorted) active transfers list.
- * This function will return non 0 if fails to update the timer,
- * in which case the transfer is *not* on the flying_transfers list. */
-static int add_to_flying_list(struct usbi_transfer *itransfer)
+/* make sure the context knows about a timeout on this device handle that
+ * expires no later than expiry.
+ * must be called with the timeout_lock held.
+ * returns 1 if this is now the earliest timeout of the context and the timer
+ * must be rearmed, 0 otherwise. */
+static int publish_timeout_locked(struct libusb_device_handle *dev_handle,
+	const struct timespec *expiry)
 {
-	struct usbi_transfer *cur;
-	struct timespec *timeout = &itransfer->timeout;
-	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
-	int r = 0;
-	int first = 1;
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	struct usbi_timeout_node *node = &dev_handle->timeout_node;
 
-	calculate_timeout(itransfer);
+	if (node->heap_index && !TIMESPEC_CMP(expiry, &node->expiry, <))
+		return 0;
 
-	/* if we have no other flying transfers, start the list with this one */
-	if (list_empty(&ctx->flying_transfers)) {
-		list_add(&itransfer->list, &ctx->flying_transfers);
-		goto out;
-	}
+	usbi_timeout_heap_remove(&ctx->timeout_heap, node);
+	node->expiry = *expiry;
+	/* cannot fail, usbi_io_handle_init() reserved room for us */
+	(void)usbi_timeout_heap_insert(&ctx->timeout_heap, node);
+	return node->heap_index == 1;
+}
 
-	/* if we have infinite timeout, append to end of list */
-	if (!TIMESPEC_IS_SET(timeout)) {
-		list_add_tail(&itransfer->list, &ctx->flying_transfers);
-		/* first is irrelevant in this case */
-		goto out;
-	}
+/* like publish_timeout_locked(), rearming the timer if needed.
+ * must be called without any flying_transfers_lock or transfer lock held. */
+static void publish_timeout(struct libusb_device_handle *dev_handle,
+	const struct timespec *expiry)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
 
-	/* otherwise, find appropriate place in list */
-	for_each_transfer(ctx, cur) {
-		/* find first timeout that occurs after the transfer in question */
-		struct timespec *cur_ts = &cur->timeout;
+	usbi_mutex_lock(&ctx->timeout_lock);
+	if (publish_timeout_locked(dev_handle, expiry) &&
+	    arm_timer_for_next_timeout(ctx))
+		usbi_err(ctx, "failed to set timer for next timeout");
+	usbi_mutex_unlock(&ctx->timeout_lock);
+}
 
-		if (!TIMESPEC_IS_SET(cur_ts) || TIMESPEC_CMP(cur_ts, timeout, >)) {
-			list_add_tail(&itransfer->list, &cur->list);
-			goto out;
-		}
-		first = 0;
-	}
-	/* first is 0 at this stage (list not empty) */
+/* add a transfer to its device handle's active transfers list, and to the
+ * handle's timeout heap if it has a finite timeout. now is passed on to
+ * calculate_timeout().
+ * must be called with the device handle's flying_list locked.
+ * returns 1 if the timeout of the transfer must be published to the context
+ * with publish_timeout() once all locks are dropped, 0 if not, or a
+ * LIBUSB_ERROR code on failure, in which case the transfer is *not* on the
+ * flying_transfers list. */
+static int add_to_flying_list(struct usbi_transfer *itransfer,
+	const struct timespec *now)
+{
+	struct libusb_device_handle *dev_handle =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->dev_handle;
+	struct timespec *timeout = &itransfer->timeout.expiry;
+	int r;
 
-	/* otherwise we need to be inserted at the end */
-	list_add_tail(&itransfer->list, &ctx->flying_transfers);
-out:
-#ifdef HAVE_OS_TIMER
-	if (first && usbi_using_timer(ctx) && TIMESPEC_IS_SET(timeout)) {
-		/* if this transfer has the lowest timeout of all active transfers,
-		 * rearm the timer with this transfer's timeout */
-		usbi_dbg(ctx, "arm timer for timeout in %ums (first in line)",
-			USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->timeout);
-		r = usbi_arm_timer(&ctx->timer, timeout);
+	calculate_timeout(itransfer, now);
+
+	/* infinite timeouts never need the timer */
+	if (!TIMESPEC_IS_SET(timeout)) {
+		list_add_tail(&itransfer->list, &dev_handle->flying_transfers);
+		return 0;
 	}
-#else
-	UNUSED(first);
-#endif
 
+	r = usbi_timeout_heap_insert(&dev_handle->flying_timeouts, &itransfer->timeout);
 	if (r)
-		list_del(&itransfer->list);
+		return r;
+	list_add_tail(&itransfer->list, &dev_handle->flying_transfers);
 
-	return r;
+	/* the context only needs to hear about this timeout if it is now the
+	 * earliest on this device handle, and earlier than what the context
+	 * has been told about already */
+	if (next_timeout_transfer(dev_handle) != itransfer)
+		return 0;
+	if (TIMESPEC_IS_SET(&dev_handle->timeout_published) &&
+	    !TIMESPEC_CMP(timeout, &dev_handle->timeout_published, <))
+		return 0;
+
+	dev_handle->timeout_published = *timeout;
+	return 1;
 }
 
-/* remove a transfer from the active transfers list.
- * This function will *always* remove the transfer from the
- * flying_transfers list. It will return a LIBUSB_ERROR code
- * if it fails to update the timer for the next timeout. */
-static int remove_from_flying_list(struct usbi_transfer *itransfer)
+/* reset the state of a transfer about to be submitted.
+ * must be called with the device handle's flying_list and the transfer
+ * locked. */
+static void reset_transfer_state(struct usbi_transfer *itransfer)
 {
-	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
-	int rearm_timer;
-	int r = 0;
+	/* a transfer resubmitted from its callback may still be on the
+	 * flying list, see usbi_handle_transfer_completion() */
+	if (itransfer->state_flags & USBI_TRANSFER_RESUBMIT_PENDING)
+		list_del(&itransfer->list);
+	itransfer->transferred = 0;
+	itransfer->state_flags = 0;
+	itransfer->timeout_flags = 0;
+}
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	rearm_timer = (TIMESPEC_IS_SET(&itransfer->timeout) &&
-		list_first_entry(&ctx->flying_transfers, struct usbi_transfer, list) == itransfer);
-	list_del(&itransfer->list);
-	if (rearm_timer)
-		r = arm_timer_for_next_timeout(ctx);
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+/* remove a transfer from its device handle's active transfers list.
+ * The context timeout heap is not updated, so the timer may fire for a
+ * timeout that no longer exists. handle_timeouts_locked() then publishes the
+ * next timeout of the device handle, if any. */
+static void remove_from_flying_list(struct usbi_transfer *itransfer)
+{
+	struct libusb_device_handle *dev_handle =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->dev_handle;
 
-	return r;
+	usbi_mutex_lock(&dev_handle->flying_transfers_lock);
+	usbi_timeout_heap_remove(&dev_handle->flying_timeouts, &itransfer->timeout);
+	list_del(&itransfer->list);
+	usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
 }
 
 /** \ingroup libusb_asyncio
@@ -1495,7 +1966,10 @@ int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
 {
 	struct usbi_transfer *itransfer =
 		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	struct libusb_device_handle *dev_handle = transfer->dev_handle;
 	struct libusb_context *ctx;
+	struct timespec timeout;
+	int publish;
 	int r;
 
 	assert(transfer->dev_handle);
@@ -1509,17 +1983,21 @@ int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
 	/*
 	 * Important note on locking, this function takes / releases locks
 	 * in the following order:
-	 *  take flying_transfers_lock
+	 *  take dev_handle->flying_transfers_lock
 	 *  take itransfer->lock
 	 *  clear transfer
 	 *  add to flying_transfers list
-	 *  release flying_transfers_lock
+	 *  release dev_handle->flying_transfers_lock
 	 *  submit transfer
 	 *  release itransfer->lock
 	 *  if submit failed:
-	 *   take flying_transfers_lock
+	 *   take dev_handle->flying_transfers_lock
 	 *   remove from flying_transfers list
-	 *   release flying_transfers_lock
+	 *   release dev_handle->flying_transfers_lock
+	 *  if the transfer has the earliest timeout on the device handle:
+	 *   take ctx->timeout_lock
+	 *   publish the timeout, rearm the timer
+	 *   release ctx->timeout_lock
 	 *
 	 * Note that it takes locks in the order a-b and then releases them
 	 * in the same order a-b. This is somewhat unusual but not wrong,
@@ -1532,33 +2010,38 @@ int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
 	 *
 	 * This is done this way because when we take both locks we must always
 	 * take flying_transfers_lock first to avoid ab-ba style deadlocks with
-	 * the timeout handling and usbi_handle_disconnect paths.
+	 * the timeout handling and usbi_handle_disconnect paths. For the same
+	 * reason the timeout_lock, which the timeout handling path takes before
+	 * any flying_transfers_lock, is only taken once all other locks have
+	 * been released. The timeout is published even if the submission failed,
+	 * as timeout_published has already been updated; the worst outcome is
+	 * an early timer expiry.
 	 *
 	 * And we cannot release itransfer->lock before the submission is
 	 * complete otherwise timeout handling for transfers with short
 	 * timeouts may run before submission.
 	 */
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	usbi_mutex_lock(&dev_handle->flying_transfers_lock);
 	usbi_mutex_lock(&itransfer->lock);
 	if (itransfer->state_flags & USBI_TRANSFER_IN_FLIGHT) {
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
+		usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
 		usbi_mutex_unlock(&itransfer->lock);
 		return LIBUSB_ERROR_BUSY;
 	}
-	itransfer->transferred = 0;
-	itransfer->state_flags = 0;
-	itransfer->timeout_flags = 0;
-	r = add_to_flying_list(itransfer);
-	if (r) {
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	reset_transfer_state(itransfer);
+	r = add_to_flying_list(itransfer, NULL);
+	if (r < 0) {
+		usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
 		usbi_mutex_unlock(&itransfer->lock);
 		return r;
 	}
+	publish = r;
+	timeout = itransfer->timeout.expiry;
 	/*
 	 * We must release the flying transfers lock here, because with
 	 * some backends the submit_transfer method is synchronous.
 	 */
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
 
 	r = usbi_backend.submit_transfer(itransfer);
 	if (r == LIBUSB_SUCCESS) {
@@ -1569,19 +2052,234 @@ int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
 	if (r != LIBUSB_SUCCESS)
 		remove_from_flying_list(itransfer);
 
+	if (publish)
+		publish_timeout(dev_handle, &timeout);
+
 	return r;
 }
 
-/** \ingroup libusb_asyncio
- * Asynchronously cancel a previously submitted transfer.
- * This function returns immediately, but this does not indicate cancellation
- * is complete. Your callback function will be invoked at some later time
- * with a transfer status of
- * \ref libusb_transfer_status::LIBUSB_TRANSFER_CANCELLED
- * "LIBUSB_TRANSFER_CANCELLED."
- *
- * This function behaves differently on Darwin-based systems (macOS and iOS):
- *
+/* maximum number of transfers passed to the backend at once */
+#define SUBMIT_BATCH_MAX	64
+
+/* maximum number of device handle timeouts published at once */
+#define PUBLISH_BATCH_MAX	16
+
+struct timeout_publish {
+	struct libusb_device_handle *dev_handle;
+	struct timespec expiry;
+};
+
+/* publish the timeouts of several device handles of the same context,
+ * rearming the timer at most once.
+ * must be called without any flying_transfers_lock or transfer lock held. */
+static void publish_timeouts(struct timeout_publish *publishes, int count)
+{
+	struct libusb_context *ctx;
+	int rearm = 0;
+	int i;
+
+	if (!count)
+		return;
+
+	ctx = HANDLE_CTX(publishes[0].dev_handle);
+	usbi_mutex_lock(&ctx->timeout_lock);
+	for (i = 0; i < count; i++)
+		rearm |= publish_timeout_locked(publishes[i].dev_handle,
+			&publishes[i].expiry);
+	if (rearm && arm_timer_for_next_timeout(ctx))
+		usbi_err(ctx, "failed to set timer for next timeout");
+	usbi_mutex_unlock(&ctx->timeout_lock);
+}
+
+/* submit up to SUBMIT_BATCH_MAX transfers of the same device handle, following
+ * the locking scheme of libusb_submit_transfer() with each lock taken once
+ * for the whole batch. Returns 1 and the earliest timeout to publish in
+ * expiry if the device handle's published timeout must be updated. */
+static int submit_transfer_batch(struct libusb_device_handle *dev_handle,
+	struct libusb_transfer **transfers, int count, int *results,
+	const struct timespec *now, struct timespec *expiry)
+{
+	struct usbi_transfer *batch[SUBMIT_BATCH_MAX];
+	int batch_results[SUBMIT_BATCH_MAX];
+	int batch_index[SUBMIT_BATCH_MAX];
+	int num_batch = 0, publish = 0, failed = 0;
+	int i, j, r;
+
+	for (i = 0; i < count; i++) {
+		struct usbi_transfer *itransfer =
+			LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]);
+
+		if (itransfer->dev)
+			libusb_unref_device(itransfer->dev);
+		itransfer->dev = libusb_ref_device(dev_handle->dev);
+	}
+
+	usbi_mutex_lock(&dev_handle->flying_transfers_lock);
+	for (i = 0; i < count; i++) {
+		struct usbi_transfer *itransfer =
+			LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]);
+
+		/* a transfer listed twice is busy the second time */
+		for (j = 0; j < i; j++) {
+			if (transfers[j] == transfers[i])
+				break;
+		}
+		if (j < i) {
+			results[i] = LIBUSB_ERROR_BUSY;
+			continue;
+		}
+
+		usbi_mutex_lock(&itransfer->lock);
+		if (itransfer->state_flags & USBI_TRANSFER_IN_FLIGHT) {
+			usbi_mutex_unlock(&itransfer->lock);
+			results[i] = LIBUSB_ERROR_BUSY;
+			continue;
+		}
+		reset_transfer_state(itransfer);
+		r = add_to_flying_list(itransfer, now);
+		if (r < 0) {
+			usbi_mutex_unlock(&itransfer->lock);
+			results[i] = r;
+			continue;
+		}
+		if (r && (!publish || TIMESPEC_CMP(&itransfer->timeout.expiry, expiry, <))) {
+			*expiry = itransfer->timeout.expiry;
+			publish = 1;
+		}
+		batch[num_batch] = itransfer;
+		batch_index[num_batch++] = i;
+	}
+	usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
+
+	if (usbi_backend.submit_transfers && num_batch > 1) {
+		usbi_backend.submit_transfers(batch, num_batch, batch_results);
+	} else {
+		for (i = 0; i < num_batch; i++)
+			batch_results[i] = usbi_backend.submit_transfer(batch[i]);
+	}
+
+	for (i = 0; i < num_batch; i++) {
+		if (batch_results[i] == LIBUSB_SUCCESS)
+			batch[i]->state_flags |= USBI_TRANSFER_IN_FLIGHT;
+		else
+			failed = 1;
+		results[batch_index[i]] = batch_results[i];
+		usbi_mutex_unlock(&batch[i]->lock);
+	}
+
+	if (failed) {
+		usbi_mutex_lock(&dev_handle->flying_transfers_lock);
+		for (i = 0; i < num_batch; i++) {
+			if (batch_results[i] == LIBUSB_SUCCESS)
+				continue;
+			usbi_timeout_heap_remove(&dev_handle->flying_timeouts,
+				&batch[i]->timeout);
+			list_del(&batch[i]->list);
+		}
+		usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
+	}
+
+	return publish;
+}
+
+/** \ingroup libusb_asyncio
+ * Submit several transfers at once. This has the same effect as calling
+ * libusb_submit_transfer() on each transfer in turn, but the current time is
+ * read once, the in-flight transfers of each device handle are updated under
+ * a single lock acquisition and the timer is rearmed at most once per group
+ * of transfers. Backends that can submit several transfers in one operation
+ * receive consecutive transfers of the same device handle together.
+ *
+ * Transfers are submitted in array order. A failure does not stop the
+ * submission of the remaining transfers.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param transfers array of transfers to submit
+ * \param num_transfers number of transfers in the array
+ * \param results optional array of num_transfers elements which receives the
+ * return code libusb_submit_transfer() would have given for each transfer
+ * \returns the number of transfers successfully submitted
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if transfers is NULL, num_transfers
+ * is negative, or a transfer is NULL or has no device handle. No transfer is
+ * submitted in this case.
+ */
+int API_EXPORTED libusb_submit_transfers(struct libusb_transfer **transfers,
+	int num_transfers, int *results)
+{
+	struct timeout_publish publishes[PUBLISH_BATCH_MAX];
+	int chunk_results[SUBMIT_BATCH_MAX];
+	int num_publishes = 0, submitted = 0;
+	struct timespec now;
+	int i, j, start;
+
+	if (!transfers || num_transfers < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	for (i = 0; i < num_transfers; i++) {
+		if (!transfers[i] || !transfers[i]->dev_handle)
+			return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	if (!num_transfers)
+		return 0;
+
+	usbi_dbg(HANDLE_CTX(transfers[0]->dev_handle), "%d transfers", num_transfers);
+	usbi_get_monotonic_time(&now);
+
+	for (start = 0; start < num_transfers; start += i) {
+		struct libusb_device_handle *dev_handle = transfers[start]->dev_handle;
+		struct timespec expiry;
+		int *chunk = results ? results + start : chunk_results;
+
+		/* group consecutive transfers of the same device handle */
+		for (i = 1; i < SUBMIT_BATCH_MAX && start + i < num_transfers; i++) {
+			if (transfers[start + i]->dev_handle != dev_handle)
+				break;
+		}
+
+		if (submit_transfer_batch(dev_handle, transfers + start, i, chunk,
+				&now, &expiry)) {
+			for (j = 0; j < num_publishes; j++) {
+				if (publishes[j].dev_handle == dev_handle)
+					break;
+			}
+			/* publishes are flushed per context */
+			if (j == num_publishes && (num_publishes == PUBLISH_BATCH_MAX ||
+			    (num_publishes &&
+			     HANDLE_CTX(publishes[0].dev_handle) != HANDLE_CTX(dev_handle)))) {
+				publish_timeouts(publishes, num_publishes);
+				num_publishes = j = 0;
+			}
+			if (j == num_publishes) {
+				publishes[num_publishes].dev_handle = dev_handle;
+				publishes[num_publishes++].expiry = expiry;
+			} else if (TIMESPEC_CMP(&expiry, &publishes[j].expiry, <)) {
+				publishes[j].expiry = expiry;
+			}
+		}
+
+		for (j = 0; j < i; j++) {
+			if (chunk[j] == LIBUSB_SUCCESS)
+				submitted++;
+		}
+	}
+
+	publish_timeouts(publishes, num_publishes);
+
+	return submitted;
+}
+
+/** \ingroup libusb_asyncio
+ * Asynchronously cancel a previously submitted transfer.
+ * This function returns immediately, but this does not indicate cancellation
+ * is complete. Your callback function will be invoked at some later time
+ * with a transfer status of
+ * \ref libusb_transfer_status::LIBUSB_TRANSFER_CANCELLED
+ * "LIBUSB_TRANSFER_CANCELLED."
+ *
+ * This function behaves differently on Darwin-based systems (macOS and iOS):
+ *
  * - Calling this function for one transfer will cause all transfers on the
  *   same endpoint to be cancelled. Your callback function will be invoked with
  *   a transfer status of
@@ -1622,60 +2320,685 @@ int API_EXPORTED libusb_cancel_transfer(struct libusb_transfer *transfer)
 		r = LIBUSB_ERROR_NOT_FOUND;
 		goto out;
 	}
-	r = usbi_backend.cancel_transfer(itransfer);
-	if (r < 0) {
-		if (r != LIBUSB_ERROR_NOT_FOUND &&
-		    r != LIBUSB_ERROR_NO_DEVICE)
-			usbi_err(ctx, "cancel transfer failed error %d", r);
-		else
-			usbi_dbg(ctx, "cancel transfer failed error %d", r);
+	r = usbi_backend.cancel_transfer(itransfer);
+	if (r < 0) {
+		if (r != LIBUSB_ERROR_NOT_FOUND &&
+		    r != LIBUSB_ERROR_NO_DEVICE)
+			usbi_err(ctx, "cancel transfer failed error %d", r);
+		else
+			usbi_dbg(ctx, "cancel transfer failed error %d", r);
+
+		if (r == LIBUSB_ERROR_NO_DEVICE)
+			itransfer->state_flags |= USBI_TRANSFER_DEVICE_DISAPPEARED;
+	}
+
+	itransfer->state_flags |= USBI_TRANSFER_CANCELLING;
+
+out:
+	usbi_mutex_unlock(&itransfer->lock);
+	return r;
+}
+
+/** \ingroup libusb_asyncio
+ * Set a transfers bulk stream id. Note users are advised to use
+ * libusb_fill_bulk_stream_transfer() instead of calling this function
+ * directly.
+ *
+ * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
+ *
+ * \param transfer the transfer to set the stream id for
+ * \param stream_id the stream id to set
+ * \see libusb_alloc_streams()
+ */
+void API_EXPORTED libusb_transfer_set_stream_id(
+	struct libusb_transfer *transfer, uint32_t stream_id)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	itransfer->stream_id = stream_id;
+}
+
+/** \ingroup libusb_asyncio
+ * Get a transfers bulk stream id.
+ *
+ * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
+ *
+ * \param transfer the transfer to get the stream id for
+ * \returns the stream id for the transfer
+ */
+uint32_t API_EXPORTED libusb_transfer_get_stream_id(
+	struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	return itransfer->stream_id;
+}
+
+/* Wakes the event waiters whose completion flag is set after a transfer
+ * callback ran, and if unflagged is set those without a completion flag.
+ * Other waiters sleep on, rather than all of them racing for the events lock.
+ * Called with the event waiters lock held. */
+static void wake_completed_waiters(struct libusb_context *ctx, int unflagged)
+{
+	struct usbi_event_waiter *waiter;
+
+	for_each_helper(waiter, &ctx->event_waiters, struct usbi_event_waiter) {
+		if (waiter->wakeup ||
+		    (waiter->completed ? !*waiter->completed : !unflagged))
+			continue;
+		waiter->wakeup = USBI_WAITER_COMPLETED;
+		usbi_cond_signal(&waiter->cond);
+	}
+}
+
+/* Called with the event waiters lock held when a thread gave up event
+ * handling. Waiters without a completion flag return to their caller as
+ * before, and the longest waiting one that still waits for its transfer
+ * takes over event handling. */
+static void hand_off_event_handling(struct libusb_context *ctx)
+{
+	struct usbi_event_waiter *waiter;
+
+	wake_completed_waiters(ctx, 1);
+	for_each_helper(waiter, &ctx->event_waiters, struct usbi_event_waiter) {
+		if (waiter->wakeup)
+			continue;
+		waiter->wakeup = USBI_WAITER_HANDOFF;
+		usbi_cond_signal(&waiter->cond);
+		break;
+	}
+}
+
+/* Resubmit a transfer with the LIBUSB_TRANSFER_AUTO_RESUBMIT flag after its
+ * callback returned, unless the callback cleared the flag or resubmitted the
+ * transfer itself. A transfer that usbi_handle_transfer_completion() left on
+ * the flying list goes straight back to the backend, as long as it still has
+ * no timeout. If the resubmission fails, the callback is invoked once more
+ * with an error status. */
+static void auto_resubmit_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
+	uint32_t state_flags;
+	uint8_t flags;
+	int r;
+
+	usbi_mutex_lock(&itransfer->lock);
+	state_flags = itransfer->state_flags;
+	itransfer->state_flags &= ~USBI_TRANSFER_RESUBMIT_PENDING;
+	usbi_mutex_unlock(&itransfer->lock);
+
+	if (state_flags & USBI_TRANSFER_IN_FLIGHT)
+		return;
+
+	/* do_close() already removed the transfer from the flying list */
+	if (!transfer->dev_handle)
+		state_flags &= ~USBI_TRANSFER_RESUBMIT_PENDING;
+
+	if (!(transfer->flags & LIBUSB_TRANSFER_AUTO_RESUBMIT) || !transfer->dev_handle) {
+		if (state_flags & USBI_TRANSFER_RESUBMIT_PENDING)
+			remove_from_flying_list(itransfer);
+		if (transfer->flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+			libusb_free_transfer(transfer);
+		return;
+	}
+
+	if ((state_flags & USBI_TRANSFER_RESUBMIT_PENDING) && !transfer->timeout) {
+		usbi_mutex_lock(&itransfer->lock);
+		itransfer->transferred = 0;
+		itransfer->state_flags = 0;
+		itransfer->timeout_flags = 0;
+		r = usbi_backend.submit_transfer(itransfer);
+		if (r == LIBUSB_SUCCESS)
+			itransfer->state_flags |= USBI_TRANSFER_IN_FLIGHT;
+		usbi_mutex_unlock(&itransfer->lock);
+
+		if (r != LIBUSB_SUCCESS)
+			remove_from_flying_list(itransfer);
+	} else {
+		if (state_flags & USBI_TRANSFER_RESUBMIT_PENDING)
+			remove_from_flying_list(itransfer);
+		r = libusb_submit_transfer(transfer);
+	}
+
+	if (r == LIBUSB_SUCCESS)
+		return;
+
+	usbi_dbg(ctx, "failed to resubmit transfer %p, error %d", (void *) transfer, r);
+	flags = transfer->flags;
+	transfer->status = r == LIBUSB_ERROR_NO_DEVICE ?
+		LIBUSB_TRANSFER_NO_DEVICE : LIBUSB_TRANSFER_ERROR;
+	transfer->actual_length = 0;
+	if (transfer->callback) {
+		libusb_lock_event_waiters(ctx);
+		transfer->callback(transfer);
+		libusb_unlock_event_waiters(ctx);
+	}
+	/* transfer might have been freed by the above call, do not use from
+	 * this point. */
+	if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+		libusb_free_transfer(transfer);
+}
+
+/* Lets threads waiting for transfers whose callbacks ran on a thread not
+ * handling events, with libusb_wait_for_event() or through the event
+ * handler, check them again */
+static void signal_callbacks_run(struct libusb_context *ctx)
+{
+	unsigned int event_flags;
+
+	usbi_mutex_lock(&ctx->event_waiters_lock);
+	wake_completed_waiters(ctx, 1);
+	if (ctx->event_waiters_cond_users)
+		usbi_cond_broadcast(&ctx->event_waiters_cond);
+	usbi_mutex_unlock(&ctx->event_waiters_lock);
+
+	usbi_mutex_lock(&ctx->event_data_lock);
+	event_flags = ctx->event_flags;
+	ctx->event_flags |= USBI_EVENT_CALLBACKS_RUN;
+	if (!event_flags)
+		usbi_signal_event(&ctx->event);
+	usbi_mutex_unlock(&ctx->event_data_lock);
+}
+
+/* Callback threads, see LIBUSB_OPTION_CALLBACK_THREADS. The thread handling
+ * events queues each completed transfer that has a callback to the thread
+ * picked by its device handle and endpoint, which keeps the callbacks of an
+ * endpoint in completion order. Returns 0 if the device handle is closing,
+ * in which case the callback must run on the calling thread. */
+static int queue_callback(struct libusb_context *ctx,
+	struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct usbi_callback_worker *worker;
+	uintptr_t key;
+	int was_empty;
+
+	key = ((uintptr_t)transfer->dev_handle >> 4) * 31 + transfer->endpoint;
+	worker = &ctx->callback_workers[key % (uintptr_t)ctx->callback_threads];
+
+	usbi_mutex_lock(&worker->lock);
+	if (usbi_atomic_load(&transfer->dev_handle->closing)) {
+		usbi_mutex_unlock(&worker->lock);
+		return 0;
+	}
+	was_empty = list_empty(&worker->transfers);
+	list_add_tail(&itransfer->completed_list, &worker->transfers);
+	if (was_empty)
+		usbi_cond_signal(&worker->cond);
+	usbi_mutex_unlock(&worker->lock);
+	return 1;
+}
+
+/* Runs the callback of a transfer queued by queue_callback(), then lets
+ * threads waiting for the transfer, with libusb_wait_for_event() or through
+ * the event handler, check it again. */
+static void run_callback(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
+	uint8_t flags = transfer->flags;
+	int resubmit;
+
+	resubmit = (flags & LIBUSB_TRANSFER_AUTO_RESUBMIT) &&
+		transfer->status == LIBUSB_TRANSFER_COMPLETED;
+
+	/* the waiters lock is only taken after the callback, so that callbacks
+	 * of other threads are not held up. A waiter checks its completion
+	 * flag under that lock, so it cannot miss the wakeup below. */
+	transfer->callback(transfer);
+	if (resubmit)
+		auto_resubmit_transfer(itransfer);
+	else if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+		libusb_free_transfer(transfer);
+
+	signal_callbacks_run(ctx);
+}
+
+/* Transfers are taken off the queue one at a time, so that
+ * usbi_flush_callbacks() finds every callback that has not run yet */
+static void callback_worker_main(void *arg)
+{
+	struct usbi_callback_worker *worker = arg;
+
+	usbi_mutex_lock(&worker->lock);
+	worker->tid = usbi_get_tid();
+	for (;;) {
+		struct usbi_transfer *itransfer;
+
+		while (list_empty(&worker->transfers) && !worker->stop)
+			usbi_cond_wait(&worker->cond, &worker->lock);
+		if (list_empty(&worker->transfers))
+			break;
+
+		itransfer = list_first_entry(&worker->transfers,
+			struct usbi_transfer, completed_list);
+		list_del(&itransfer->completed_list);
+		worker->running = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->dev_handle;
+		usbi_mutex_unlock(&worker->lock);
+
+		run_callback(itransfer);
+
+		usbi_mutex_lock(&worker->lock);
+		worker->running = NULL;
+		usbi_cond_broadcast(&worker->idle);
+	}
+	usbi_mutex_unlock(&worker->lock);
+}
+
+static void stop_callback_workers(struct usbi_callback_worker *workers, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		usbi_mutex_lock(&workers[i].lock);
+		workers[i].stop = 1;
+		usbi_cond_signal(&workers[i].cond);
+		usbi_mutex_unlock(&workers[i].lock);
+	}
+
+	for (i = 0; i < count; i++) {
+		usbi_thread_join(workers[i].thread);
+		usbi_mutex_destroy(&workers[i].lock);
+		usbi_cond_destroy(&workers[i].cond);
+		usbi_cond_destroy(&workers[i].idle);
+	}
+
+	free(workers);
+}
+
+static int start_callback_threads(struct libusb_context *ctx)
+{
+	struct usbi_callback_worker *workers;
+	int i, r;
+
+	if (!ctx->callback_threads)
+		return 0;
+
+	workers = calloc((size_t)ctx->callback_threads, sizeof(*workers));
+	if (!workers)
+		return LIBUSB_ERROR_NO_MEM;
+
+	for (i = 0; i < ctx->callback_threads; i++) {
+		struct usbi_callback_worker *worker = &workers[i];
+
+		worker->ctx = ctx;
+		usbi_mutex_init(&worker->lock);
+		usbi_cond_init(&worker->cond);
+		usbi_cond_init(&worker->idle);
+		list_init(&worker->transfers);
+		r = usbi_thread_create(&worker->thread, callback_worker_main, worker);
+		if (r < 0) {
+			usbi_err(ctx, "failed to start callback thread %d", i);
+			usbi_mutex_destroy(&worker->lock);
+			usbi_cond_destroy(&worker->cond);
+			usbi_cond_destroy(&worker->idle);
+			stop_callback_workers(workers, i);
+			return r;
+		}
+	}
+
+	usbi_dbg(ctx, "started %d callback threads", ctx->callback_threads);
+	ctx->callback_workers = workers;
+	return 0;
+}
+
+/* Runs the callbacks still queued and stops the callback threads. Transfers
+ * completing after this run their callbacks on the thread handling events. */
+void usbi_stop_callback_threads(struct libusb_context *ctx)
+{
+	struct usbi_callback_worker *workers = ctx->callback_workers;
+
+	if (!workers)
+		return;
+
+	stop_callback_workers(workers, ctx->callback_threads);
+	ctx->callback_workers = NULL;
+}
+
+/* Runs the callbacks of a device handle still queued to callback threads on
+ * the calling thread, after waiting for those the threads are running,
+ * except for the one calling this. Callbacks of the handle's transfers
+ * completing afterwards run on the thread handling events, so libusb_close()
+ * calls this before it takes the event handling lock. */
+void usbi_flush_callbacks(struct libusb_device_handle *dev_handle)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	struct usbi_callback_worker *workers = ctx->callback_workers;
+	struct usbi_transfer *itransfer, *tmp;
+	struct list_head flushed;
+	unsigned int tid;
+	int i;
+
+	usbi_atomic_store(&dev_handle->closing, 1);
+	if (!workers)
+		return;
+
+	tid = usbi_get_tid();
+	list_init(&flushed);
+	for (i = 0; i < ctx->callback_threads; i++) {
+		struct usbi_callback_worker *worker = &workers[i];
+
+		usbi_mutex_lock(&worker->lock);
+		__for_each_completed_transfer_safe(&worker->transfers, itransfer, tmp) {
+			if (USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->dev_handle != dev_handle)
+				continue;
+			list_del(&itransfer->completed_list);
+			list_add_tail(&itransfer->completed_list, &flushed);
+		}
+		while (worker->running == dev_handle && worker->tid != tid)
+			usbi_cond_wait(&worker->idle, &worker->lock);
+		usbi_mutex_unlock(&worker->lock);
+	}
+
+	__for_each_completed_transfer_safe(&flushed, itransfer, tmp) {
+		list_del(&itransfer->completed_list);
+		run_callback(itransfer);
+	}
+}
+
+/* Event threads, see LIBUSB_OPTION_EVENT_THREADS. Each waits on an event set
+ * of its own, holding the event sources of the devices assigned to it by
+ * usbi_add_event_source(), and runs the callbacks of their transfers. It
+ * holds its lock while it waits for and handles events, so that taking the
+ * lock pauses it. */
+
+/* Returns the event thread the calling thread is, or NULL */
+static struct usbi_event_worker *current_event_worker(struct libusb_context *ctx)
+{
+	void *self;
+
+	if (!ctx->event_workers)
+		return NULL;
+
+	self = usbi_tls_key_get(ctx->event_handling_key);
+	return self == ctx ? NULL : self;
+}
+
+/* An event thread calls this before it pauses the event threads, e.g. to
+ * close a device from a transfer callback, and returns to event handling
+ * with usbi_return_to_event_worker() */
+struct usbi_event_worker *usbi_leave_event_worker(struct libusb_context *ctx)
+{
+	struct usbi_event_worker *worker = current_event_worker(ctx);
+
+#ifdef HAVE_OS_EVENT_SET
+	if (worker)
+		usbi_mutex_unlock(&worker->lock);
+#endif
+	return worker;
+}
+
+void usbi_return_to_event_worker(struct usbi_event_worker *worker)
+{
+#ifdef HAVE_OS_EVENT_SET
+	if (worker)
+		usbi_mutex_lock(&worker->lock);
+#else
+	UNUSED(worker);
+#endif
+}
+
+/* Waits until all event threads are between event handling passes, and
+ * keeps them there until usbi_resume_event_workers() is called. Called with
+ * the event handling lock held, after usbi_leave_event_worker(). */
+void usbi_pause_event_workers(struct libusb_context *ctx)
+{
+#ifdef HAVE_OS_EVENT_SET
+	struct usbi_event_worker *workers = ctx->event_workers;
+	int i;
+
+	if (!workers)
+		return;
+
+	for (i = 0; i < ctx->event_threads; i++) {
+		(void)usbi_atomic_inc(&workers[i].pause_requests);
+		usbi_signal_event(&workers[i].event);
+	}
+	for (i = 0; i < ctx->event_threads; i++)
+		usbi_mutex_lock(&workers[i].lock);
+#else
+	UNUSED(ctx);
+#endif
+}
+
+void usbi_resume_event_workers(struct libusb_context *ctx)
+{
+#ifdef HAVE_OS_EVENT_SET
+	struct usbi_event_worker *workers = ctx->event_workers;
+	int i;
+
+	if (!workers)
+		return;
+
+	for (i = 0; i < ctx->event_threads; i++) {
+		if (usbi_atomic_dec(&workers[i].pause_requests) == 0)
+			usbi_cond_signal(&workers[i].cond);
+		usbi_mutex_unlock(&workers[i].lock);
+	}
+#else
+	UNUSED(ctx);
+#endif
+}
+
+#ifdef HAVE_OS_EVENT_SET
+static void event_worker_main(void *arg)
+{
+	struct usbi_event_worker *worker = arg;
+	struct libusb_context *ctx = worker->ctx;
+	int r;
+
+	usbi_tls_key_set(ctx->event_handling_key, worker);
+
+	usbi_mutex_lock(&worker->lock);
+	for (;;) {
+		while (usbi_atomic_load(&worker->pause_requests))
+			usbi_cond_wait(&worker->cond, &worker->lock);
+		if (worker->stop)
+			break;
+
+		r = usbi_wait_for_worker_events(worker);
+		if (r <= 0)
+			continue;
+
+		r = usbi_backend.handle_events(ctx, worker->fds, worker->user_data,
+			(unsigned int)r, (unsigned int)r);
+		if (r)
+			usbi_err(ctx, "backend handle_events failed with error %d", r);
+
+		/* waiters are woken once per pass rather than per callback */
+		if (worker->callbacks_run) {
+			worker->callbacks_run = 0;
+			signal_callbacks_run(ctx);
+		}
+	}
+	usbi_mutex_unlock(&worker->lock);
+
+	usbi_tls_key_set(ctx->event_handling_key, NULL);
+}
+
+/* Adds a device event source to the event thread with the fewest. Called
+ * with event_data_lock held. */
+static int add_worker_event_source(struct libusb_context *ctx,
+	struct usbi_event_source *ievent_source)
+{
+	struct usbi_event_worker *worker = &ctx->event_workers[0];
+	int i, r;
+
+	for (i = 1; i < ctx->event_threads; i++) {
+		if (ctx->event_workers[i].num_event_sources < worker->num_event_sources)
+			worker = &ctx->event_workers[i];
+	}
+
+	r = usbi_event_set_add(&worker->event_set, ievent_source);
+	if (r)
+		return r;
+
+	ievent_source->worker = worker;
+	list_add_tail(&ievent_source->list, &worker->event_sources);
+	worker->num_event_sources++;
+	return 0;
+}
+
+/* Returns the event source of an event thread with the given OS handle, or
+ * NULL. Called with event_data_lock held. */
+static struct usbi_event_source *find_worker_event_source(
+	struct libusb_context *ctx, usbi_os_handle_t os_handle)
+{
+	struct usbi_event_source *ievent_source;
+	int i;
+
+	if (!ctx->event_workers)
+		return NULL;
+
+	for (i = 0; i < ctx->event_threads; i++) {
+		for_each_helper(ievent_source, &ctx->event_workers[i].event_sources,
+				struct usbi_event_source) {
+			if (ievent_source->data.os_handle == os_handle)
+				return ievent_source;
+		}
+	}
+
+	return NULL;
+}
+
+/* Removes an event source of an event thread, while that thread is paused or
+ * by the thread itself. Called with event_data_lock held. */
+static void remove_worker_event_source(struct libusb_context *ctx,
+	struct usbi_event_source *ievent_source)
+{
+	struct usbi_event_worker *worker = ievent_source->worker;
+
+	usbi_event_set_remove(&worker->event_set, ievent_source);
+	list_del(&ievent_source->list);
+	worker->num_event_sources--;
+	(void)usbi_atomic_inc(&ctx->event_sources_removed);
+	free(ievent_source);
+}
+
+static void stop_event_workers(struct usbi_event_worker *workers, int count)
+{
+	struct usbi_event_source *ievent_source, *tmp;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		(void)usbi_atomic_inc(&workers[i].pause_requests);
+		usbi_signal_event(&workers[i].event);
+		usbi_mutex_lock(&workers[i].lock);
+		workers[i].stop = 1;
+		(void)usbi_atomic_dec(&workers[i].pause_requests);
+		usbi_cond_signal(&workers[i].cond);
+		usbi_mutex_unlock(&workers[i].lock);
+	}
+
+	for (i = 0; i < count; i++) {
+		usbi_thread_join(workers[i].thread);
+
+		/* of devices left open */
+		for_each_safe_helper(ievent_source, tmp, &workers[i].event_sources,
+				     struct usbi_event_source) {
+			list_del(&ievent_source->list);
+			free(ievent_source);
+		}
+		usbi_mutex_destroy(&workers[i].lock);
+		usbi_cond_destroy(&workers[i].cond);
+		usbi_destroy_event(&workers[i].event);
+		usbi_destroy_event_set(&workers[i].event_set);
+	}
 
-		if (r == LIBUSB_ERROR_NO_DEVICE)
-			itransfer->state_flags |= USBI_TRANSFER_DEVICE_DISAPPEARED;
+	free(workers);
+}
+
+static int start_event_worker(struct usbi_event_worker *worker)
+{
+	struct libusb_context *ctx = worker->ctx;
+	int r;
+
+	r = usbi_create_event_set(&worker->event_set);
+	if (r < 0)
+		return r;
+
+	r = usbi_create_event(&worker->event);
+	if (r < 0)
+		goto err_destroy_event_set;
+
+	worker->event_source.data.os_handle = USBI_EVENT_OS_HANDLE(&worker->event);
+	worker->event_source.data.poll_events = USBI_EVENT_POLL_EVENTS;
+	r = usbi_event_set_add(&worker->event_set, &worker->event_source);
+	if (r < 0)
+		goto err_destroy_event;
+
+	usbi_mutex_init(&worker->lock);
+	usbi_cond_init(&worker->cond);
+	list_init(&worker->event_sources);
+	r = usbi_thread_create(&worker->thread, event_worker_main, worker);
+	if (r < 0) {
+		usbi_err(ctx, "failed to start event thread");
+		usbi_mutex_destroy(&worker->lock);
+		usbi_cond_destroy(&worker->cond);
+		goto err_destroy_event;
 	}
 
-	itransfer->state_flags |= USBI_TRANSFER_CANCELLING;
+	return 0;
 
-out:
-	usbi_mutex_unlock(&itransfer->lock);
+err_destroy_event:
+	usbi_destroy_event(&worker->event);
+err_destroy_event_set:
+	usbi_destroy_event_set(&worker->event_set);
 	return r;
 }
+#endif
 
-/** \ingroup libusb_asyncio
- * Set a transfers bulk stream id. Note users are advised to use
- * libusb_fill_bulk_stream_transfer() instead of calling this function
- * directly.
- *
- * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
- *
- * \param transfer the transfer to set the stream id for
- * \param stream_id the stream id to set
- * \see libusb_alloc_streams()
- */
-void API_EXPORTED libusb_transfer_set_stream_id(
-	struct libusb_transfer *transfer, uint32_t stream_id)
+static int start_event_threads(struct libusb_context *ctx)
 {
-	struct usbi_transfer *itransfer =
-		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+#ifdef HAVE_OS_EVENT_SET
+	struct usbi_event_worker *workers;
+	int i, r;
 
-	itransfer->stream_id = stream_id;
+	if (!ctx->event_threads)
+		return 0;
+
+	workers = calloc((size_t)ctx->event_threads, sizeof(*workers));
+	if (!workers)
+		return LIBUSB_ERROR_NO_MEM;
+
+	for (i = 0; i < ctx->event_threads; i++) {
+		workers[i].ctx = ctx;
+		r = start_event_worker(&workers[i]);
+		if (r < 0) {
+			stop_event_workers(workers, i);
+			return r;
+		}
+	}
+
+	usbi_dbg(ctx, "started %d event threads", ctx->event_threads);
+	ctx->event_workers = workers;
+#else
+	UNUSED(ctx);
+#endif
+	return 0;
 }
 
-/** \ingroup libusb_asyncio
- * Get a transfers bulk stream id.
- *
- * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
- *
- * \param transfer the transfer to get the stream id for
- * \returns the stream id for the transfer
- */
-uint32_t API_EXPORTED libusb_transfer_get_stream_id(
-	struct libusb_transfer *transfer)
+/* Stops the event threads. Devices opened after this are handled by the
+ * thread handling events, those still open are no longer handled. */
+void usbi_stop_event_threads(struct libusb_context *ctx)
 {
-	struct usbi_transfer *itransfer =
-		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+#ifdef HAVE_OS_EVENT_SET
+	struct usbi_event_worker *workers = ctx->event_workers;
 
-	return itransfer->stream_id;
+	if (!workers)
+		return;
+
+	stop_event_workers(workers, ctx->event_threads);
+	ctx->event_workers = NULL;
+#else
+	UNUSED(ctx);
+#endif
 }
 
 /* Handle completion of a transfer (completion might be an error condition).
@@ -1693,15 +3016,7 @@ int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
 	uint8_t flags;
-	int r;
-
-	r = remove_from_flying_list(itransfer);
-	if (r < 0)
-		usbi_err(ctx, "failed to set timer for next timeout");
-
-	usbi_mutex_lock(&itransfer->lock);
-	itransfer->state_flags &= ~USBI_TRANSFER_IN_FLIGHT;
-	usbi_mutex_unlock(&itransfer->lock);
+	int resubmit;
 
 	if (status == LIBUSB_TRANSFER_COMPLETED
 			&& transfer->flags & LIBUSB_TRANSFER_SHORT_NOT_OK) {
@@ -1715,20 +3030,67 @@ int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 	}
 
 	flags = transfer->flags;
+	resubmit = (flags & LIBUSB_TRANSFER_AUTO_RESUBMIT) &&
+		status == LIBUSB_TRANSFER_COMPLETED;
+
+	/* a transfer that is going to be resubmitted stays on the flying list,
+	 * so that do_close() detaches it if the callback closes the device
+	 * handle. One without timeout saves its removal and reinsertion, the
+	 * timeout of any other is no longer tracked. */
+	if (resubmit) {
+		if (transfer->timeout) {
+			struct libusb_device_handle *dev_handle = transfer->dev_handle;
+
+			usbi_mutex_lock(&dev_handle->flying_transfers_lock);
+			usbi_timeout_heap_remove(&dev_handle->flying_timeouts,
+				&itransfer->timeout);
+			usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
+		}
+
+		usbi_mutex_lock(&itransfer->lock);
+		itransfer->state_flags &= ~USBI_TRANSFER_IN_FLIGHT;
+		itransfer->state_flags |= USBI_TRANSFER_RESUBMIT_PENDING;
+		usbi_mutex_unlock(&itransfer->lock);
+	} else {
+		remove_from_flying_list(itransfer);
+
+		usbi_mutex_lock(&itransfer->lock);
+		itransfer->state_flags &= ~USBI_TRANSFER_IN_FLIGHT;
+		usbi_mutex_unlock(&itransfer->lock);
+	}
+
 	transfer->status = status;
 	transfer->actual_length = itransfer->transferred;
 	usbi_dbg(ctx, "transfer %p has callback %p",
 		 (void *) transfer, transfer->callback);
+	if (transfer->callback && ctx->callback_workers &&
+	    queue_callback(ctx, itransfer))
+		return 0;
 	if (transfer->callback) {
-		libusb_lock_event_waiters (ctx);
-		transfer->callback(transfer);
-		libusb_unlock_event_waiters(ctx);
+#ifdef HAVE_OS_EVENT_SET
+		struct usbi_event_worker *worker = current_event_worker(ctx);
+
+		if (worker) {
+			/* see event_worker_main() */
+			transfer->callback(transfer);
+			worker->callbacks_run = 1;
+		} else
+#endif
+		{
+			libusb_lock_event_waiters (ctx);
+			transfer->callback(transfer);
+			libusb_unlock_event_waiters(ctx);
+		}
+	}
+	if (resubmit) {
+		auto_resubmit_transfer(itransfer);
+		return 0;
 	}
 	/* transfer might have been freed by the above call, do not use from
 	 * this point. */
 	if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
 		libusb_free_transfer(transfer);
-	return r;
+	return 0;
 }
 
 /* Similar to usbi_handle_transfer_completion() but exclusively for transfers
@@ -1740,11 +3102,13 @@ int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 int usbi_handle_transfer_cancellation(struct usbi_transfer *itransfer)
 {
 	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
+	struct libusb_device_handle *dev_handle =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->dev_handle;
 	uint8_t timed_out;
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	usbi_mutex_lock(&dev_handle->flying_transfers_lock);
 	timed_out = itransfer->timeout_flags & USBI_TRANSFER_TIMED_OUT;
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
 
 	/* if the URB was cancelled due to timeout, report timeout to the user */
 	if (timed_out) {
@@ -1756,9 +3120,11 @@ int usbi_handle_transfer_cancellation(struct usbi_transfer *itransfer)
 	return usbi_handle_transfer_completion(itransfer, LIBUSB_TRANSFER_CANCELLED);
 }
 
-/* Add a completed transfer to the completed_transfers list of the
- * context and signal the event. The backend's handle_transfer_completion()
- * function will be called the next time an event handler runs. */
+/* Add a completed transfer to the completed_queue of the context and signal
+ * the event. The backend's handle_transfer_completion() function will be
+ * called the next time an event handler runs. Only the transfer that finds
+ * the queue empty takes the event data lock to flag and signal it, the ones
+ * following it until the event handler takes the queue are picked up along. */
 void usbi_signal_transfer_completion(struct usbi_transfer *itransfer)
 {
 	struct libusb_device *dev = itransfer->dev;
@@ -1767,10 +3133,12 @@ void usbi_signal_transfer_completion(struct usbi_transfer *itransfer)
 		struct libusb_context *ctx = DEVICE_CTX(dev);
 		unsigned int event_flags;
 
+		if (!usbi_completed_queue_push(&ctx->completed_queue, itransfer))
+			return;
+
 		usbi_mutex_lock(&ctx->event_data_lock);
 		event_flags = ctx->event_flags;
 		ctx->event_flags |= USBI_EVENT_TRANSFER_COMPLETED;
-		list_add_tail(&itransfer->completed_list, &ctx->completed_transfers);
 		if (!event_flags)
 			usbi_signal_event(&ctx->event);
 		usbi_mutex_unlock(&ctx->event_data_lock);
@@ -1860,11 +3228,13 @@ void API_EXPORTED libusb_unlock_events(libusb_context *ctx)
 	ctx->event_handler_active = 0;
 	usbi_mutex_unlock(&ctx->events_lock);
 
-	/* FIXME: perhaps we should be a bit more efficient by not broadcasting
-	 * the availability of the events lock when we are modifying pollfds
-	 * (check ctx->device_close)? */
+	/* one waiter of libusb_handle_events_timeout_completed() takes over
+	 * event handling, those of libusb_wait_for_event() all check whether
+	 * they have to */
 	usbi_mutex_lock(&ctx->event_waiters_lock);
-	usbi_cond_broadcast(&ctx->event_waiters_cond);
+	hand_off_event_handling(ctx);
+	if (ctx->event_waiters_cond_users)
+		usbi_cond_broadcast(&ctx->event_waiters_cond);
 	usbi_mutex_unlock(&ctx->event_waiters_lock);
 }
 
@@ -2031,22 +3401,81 @@ int API_EXPORTED libusb_wait_for_event(libusb_context *ctx, struct timeval *tv)
 	int r;
 
 	ctx = usbi_get_context(ctx);
+	if (tv && !TIMEVAL_IS_VALID(tv))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	ctx->event_waiters_cond_users++;
 	if (!tv) {
 		usbi_cond_wait(&ctx->event_waiters_cond, &ctx->event_waiters_lock);
+		ctx->event_waiters_cond_users--;
 		return 0;
 	}
 
-	if (!TIMEVAL_IS_VALID(tv))
-		return LIBUSB_ERROR_INVALID_PARAM;
-
 	r = usbi_cond_timedwait(&ctx->event_waiters_cond,
 		&ctx->event_waiters_lock, tv);
+	ctx->event_waiters_cond_users--;
 	if (r < 0)
 		return r == LIBUSB_ERROR_TIMEOUT;
 
 	return 0;
 }
 
+/* Stores in left what remains of timeout since start. Returns 0 if nothing
+ * remains. */
+static int timeout_left(const struct timeval *timeout,
+	const struct timespec *start, struct timeval *left)
+{
+	struct timespec waited;
+	int64_t left_us;
+
+	usbi_get_monotonic_time(&waited);
+	TIMESPEC_SUB(&waited, start, &waited);
+	left_us = (int64_t)timeout->tv_sec * USEC_PER_SEC + timeout->tv_usec -
+		((int64_t)waited.tv_sec * USEC_PER_SEC + waited.tv_nsec / 1000L);
+	if (left_us <= 0)
+		return 0;
+
+	left->tv_sec = (TIMEVAL_TV_SEC_TYPE)(left_us / USEC_PER_SEC);
+	left->tv_usec = (int)(left_us % USEC_PER_SEC);
+	return 1;
+}
+
+/* Sleeps as one of ctx->event_waiters until the thread handling events wakes
+ * this one, see wake_completed_waiters() and hand_off_event_handling(), or the
+ * timeout expires. Called with the event waiters lock held. Returns 0 after a
+ * completion, USBI_WAITER_HANDOFF if this thread is to take over event
+ * handling and 1 if the timeout expired. */
+static int wait_for_completion(struct libusb_context *ctx, int *completed,
+	const struct timeval *tv)
+{
+	struct usbi_event_waiter waiter;
+	struct timespec wait_start;
+	struct timeval left = *tv;
+	int r = 0;
+
+	waiter.completed = completed;
+	waiter.wakeup = 0;
+	usbi_cond_init(&waiter.cond);
+	list_add_tail(&waiter.list, &ctx->event_waiters);
+
+	/* a spurious wakeup only waits for what is left of the timeout */
+	usbi_get_monotonic_time(&wait_start);
+	while (!waiter.wakeup && !r) {
+		r = usbi_cond_timedwait(&waiter.cond, &ctx->event_waiters_lock, &left);
+		if (!r && !waiter.wakeup && !timeout_left(tv, &wait_start, &left))
+			r = LIBUSB_ERROR_TIMEOUT;
+	}
+
+	list_del(&waiter.list);
+	usbi_cond_destroy(&waiter.cond);
+
+	if (waiter.wakeup == USBI_WAITER_HANDOFF)
+		return USBI_WAITER_HANDOFF;
+	else if (waiter.wakeup)
+		return 0;
+	return r == LIBUSB_ERROR_TIMEOUT;
+}
+
 static void handle_timeout(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer =
@@ -2062,45 +3491,71 @@ static void handle_timeout(struct usbi_transfer *itransfer)
 			"async cancel failed %d", r);
 }
 
+/* handles the expired timeouts of one device handle, and publishes the next
+ * timeout of the handle, if any. the handle's timeout node must already have
+ * been taken off the context timeout heap.
+ * must be called with the timeout_lock held. */
+static void handle_device_timeouts(struct libusb_device_handle *dev_handle,
+	const struct timespec *systime)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	struct usbi_transfer *itransfer;
+
+	usbi_mutex_lock(&dev_handle->flying_transfers_lock);
+
+	/* pop transfers off the timeout heap for as long as they have expired.
+	 * handle_timeout() marks each one as handled, so the next call to
+	 * next_timeout_transfer() drops it from the heap. */
+	while ((itransfer = next_timeout_transfer(dev_handle))) {
+		/* if transfer has non-expired timeout, nothing more to do */
+		if (TIMESPEC_CMP(&itransfer->timeout.expiry, systime, >))
+			break;
+
+		/* otherwise, we've got an expired timeout to handle */
+		handle_timeout(itransfer);
+	}
+
+	if (itransfer) {
+		dev_handle->timeout_published = itransfer->timeout.expiry;
+		dev_handle->timeout_node.expiry = itransfer->timeout.expiry;
+		/* cannot fail, usbi_io_handle_init() reserved room for us */
+		(void)usbi_timeout_heap_insert(&ctx->timeout_heap, &dev_handle->timeout_node);
+	} else {
+		TIMESPEC_CLEAR(&dev_handle->timeout_published);
+	}
+
+	usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
+}
+
 static void handle_timeouts_locked(struct libusb_context *ctx)
 {
 	struct timespec systime;
-	struct usbi_transfer *itransfer;
+	struct usbi_timeout_node *node;
 
-	if (list_empty(&ctx->flying_transfers))
+	if (!usbi_timeout_heap_top(&ctx->timeout_heap))
 		return;
 
 	/* get current time */
 	usbi_get_monotonic_time(&systime);
 
-	/* iterate through flying transfers list, finding all transfers that
-	 * have expired timeouts */
-	for_each_transfer(ctx, itransfer) {
-		struct timespec *cur_ts = &itransfer->timeout;
-
-		/* if we've reached transfers of infinite timeout, we're all done */
-		if (!TIMESPEC_IS_SET(cur_ts))
-			return;
-
-		/* ignore timeouts we've already handled */
-		if (itransfer->timeout_flags & (USBI_TRANSFER_TIMEOUT_HANDLED | USBI_TRANSFER_OS_HANDLES_TIMEOUT))
-			continue;
-
-		/* if transfer has non-expired timeout, nothing more to do */
-		if (TIMESPEC_CMP(cur_ts, &systime, >))
+	/* visit every device handle whose earliest timeout may have expired.
+	 * handle_device_timeouts() puts the handle back with a timeout in the
+	 * future, if it still has one. */
+	while ((node = usbi_timeout_heap_top(&ctx->timeout_heap))) {
+		if (TIMESPEC_CMP(&node->expiry, &systime, >))
 			return;
 
-		/* otherwise, we've got an expired timeout to handle */
-		handle_timeout(itransfer);
+		usbi_timeout_heap_remove(&ctx->timeout_heap, node);
+		handle_device_timeouts(TIMEOUT_NODE_TO_HANDLE(node), &systime);
 	}
 }
 
 static void handle_timeouts(struct libusb_context *ctx)
 {
 	ctx = usbi_get_context(ctx);
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	usbi_mutex_lock(&ctx->timeout_lock);
 	handle_timeouts_locked(ctx);
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	usbi_mutex_unlock(&ctx->timeout_lock);
 }
 
 static int handle_event_trigger(struct libusb_context *ctx)
@@ -2125,6 +3580,11 @@ static int handle_event_trigger(struct libusb_context *ctx)
 		ctx->event_flags &= ~USBI_EVENT_USER_INTERRUPT;
 	}
 
+	/* a callback thread ran callbacks, which may have completed what the
+	 * caller of libusb_handle_events_completed() is waiting for */
+	if (ctx->event_flags & USBI_EVENT_CALLBACKS_RUN)
+		ctx->event_flags &= ~USBI_EVENT_CALLBACKS_RUN;
+
 	if (ctx->event_flags & USBI_EVENT_HOTPLUG_CB_DEREGISTERED) {
 		usbi_dbg(ctx, "someone unregistered a hotplug cb");
 		ctx->event_flags &= ~USBI_EVENT_HOTPLUG_CB_DEREGISTERED;
@@ -2144,12 +3604,14 @@ static int handle_event_trigger(struct libusb_context *ctx)
 		list_cut(&hotplug_msgs, &ctx->hotplug_msgs);
 	}
 
-	/* complete any pending transfers */
+	/* complete any pending transfers. the flag is cleared before the queue
+	 * is taken, so a transfer queued after that flags it again */
 	if (ctx->event_flags & USBI_EVENT_TRANSFER_COMPLETED) {
 		struct usbi_transfer *itransfer, *tmp;
 		struct list_head completed_transfers;
 
-		assert(!list_empty(&ctx->completed_transfers));
+		ctx->event_flags &= ~USBI_EVENT_TRANSFER_COMPLETED;
+		usbi_completed_queue_take(&ctx->completed_queue, &ctx->completed_transfers);
 		list_cut(&completed_transfers, &ctx->completed_transfers);
 		usbi_mutex_unlock(&ctx->event_data_lock);
 
@@ -2164,10 +3626,10 @@ static int handle_event_trigger(struct libusb_context *ctx)
 
 		usbi_mutex_lock(&ctx->event_data_lock);
 		if (!list_empty(&completed_transfers)) {
-			/* an error occurred, put the remaining transfers back on the list */
+			/* an error occurred, keep the remaining transfers for the
+			 * next time events are handled */
 			list_splice_front(&completed_transfers, &ctx->completed_transfers);
-		} else if (list_empty(&ctx->completed_transfers)) {
-			ctx->event_flags &= ~USBI_EVENT_TRANSFER_COMPLETED;
+			ctx->event_flags |= USBI_EVENT_TRANSFER_COMPLETED;
 		}
 	}
 
@@ -2189,7 +3651,7 @@ static int handle_timer_trigger(struct libusb_context *ctx)
 {
 	int r;
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	usbi_mutex_lock(&ctx->timeout_lock);
 
 	/* process the timeout that just happened */
 	handle_timeouts_locked(ctx);
@@ -2197,7 +3659,7 @@ static int handle_timer_trigger(struct libusb_context *ctx)
 	/* arm for next timeout */
 	r = arm_timer_for_next_timeout(ctx);
 
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	usbi_mutex_unlock(&ctx->timeout_lock);
 
 	return r;
 }
@@ -2282,7 +3744,8 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 		goto done;
 
 	r = usbi_backend.handle_events(ctx, reported_events.event_data,
-		reported_events.event_data_count, reported_events.num_ready);
+		reported_events.event_user_data, reported_events.event_data_count,
+		reported_events.num_ready);
 	if (r)
 		usbi_err(ctx, "backend handle_events failed with error %d", r);
 
@@ -2337,6 +3800,13 @@ static int get_next_timeout(libusb_context *ctx, struct timeval *tv,
  * pointed to is not 0. This allows for race free waiting for the completion
  * of a specific transfer.
  *
+ * While another thread handles events, this function sleeps until that
+ * thread releases the event handling lock after a transfer callback set the
+ * integer pointed to by completed. Completions of other threads' transfers do
+ * not wake it up. If the thread handling events stops
+ * doing so, one waiting thread takes over event handling within the same
+ * call, and those with a NULL completed return.
+ *
  * \param ctx the context to operate on, or NULL for the default context
  * \param tv the maximum time to block waiting for events, or an all zero
  * timeval struct for non-blocking mode
@@ -2351,6 +3821,7 @@ int API_EXPORTED libusb_handle_events_timeout_completed(libusb_context *ctx,
 {
 	int r;
 	struct timeval poll_timeout;
+	struct timespec wait_start;
 
 	if (!TIMEVAL_IS_VALID(tv))
 		return LIBUSB_ERROR_INVALID_PARAM;
@@ -2390,7 +3861,20 @@ retry:
 	}
 
 	usbi_dbg(ctx, "another thread is doing event handling");
-	r = libusb_wait_for_event(ctx, &poll_timeout);
+	usbi_get_monotonic_time(&wait_start);
+	r = wait_for_completion(ctx, completed, &poll_timeout);
+
+	if (r == USBI_WAITER_HANDOFF) {
+		/* the event handler went away, take over for what is left of
+		 * the timeout or let another waiter do so */
+		if (timeout_left(&poll_timeout, &wait_start, &poll_timeout)) {
+			libusb_unlock_event_waiters(ctx);
+			r = 0;
+			goto retry;
+		}
+		hand_off_event_handling(ctx);
+		r = 0;
+	}
 
 already_done:
 	libusb_unlock_event_waiters(ctx);
@@ -2573,39 +4057,25 @@ int API_EXPORTED libusb_pollfds_handle_timeouts(libusb_context *ctx)
 int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
 	struct timeval *tv)
 {
-	struct usbi_transfer *itransfer;
+	struct usbi_timeout_node *node;
 	struct timespec systime;
-	struct timespec next_timeout = { 0, 0 };
+	struct timespec next_timeout;
 
 	ctx = usbi_get_context(ctx);
 	if (usbi_using_timer(ctx))
 		return 0;
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	if (list_empty(&ctx->flying_transfers)) {
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
-		usbi_dbg(ctx, "no URBs, no timeout!");
-		return 0;
-	}
-
-	/* find next transfer which hasn't already been processed as timed out */
-	for_each_transfer(ctx, itransfer) {
-		if (itransfer->timeout_flags & (USBI_TRANSFER_TIMEOUT_HANDLED | USBI_TRANSFER_OS_HANDLES_TIMEOUT))
-			continue;
-
-		/* if we've reached transfers of infinite timeout, we're done looking */
-		if (!TIMESPEC_IS_SET(&itransfer->timeout))
-			break;
-
-		next_timeout = itransfer->timeout;
-		break;
-	}
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
-
-	if (!TIMESPEC_IS_SET(&next_timeout)) {
+	/* the earliest device handle timeout may be one that has completed in
+	 * the meantime, in which case the caller merely wakes up early */
+	usbi_mutex_lock(&ctx->timeout_lock);
+	node = usbi_timeout_heap_top(&ctx->timeout_heap);
+	if (!node) {
+		usbi_mutex_unlock(&ctx->timeout_lock);
 		usbi_dbg(ctx, "no URB with timeout or all handled by OS; no timeout!");
 		return 0;
 	}
+	next_timeout = node->expiry;
+	usbi_mutex_unlock(&ctx->timeout_lock);
 
 	usbi_get_monotonic_time(&systime);
 
@@ -2678,8 +4148,10 @@ static void usbi_event_source_notification(struct libusb_context *ctx)
 
 /* Add an event source to the list of event sources to be monitored.
  * poll_events should be specified as a bitmask of events passed to poll(), e.g.
- * POLLIN and/or POLLOUT. */
-int usbi_add_event_source(struct libusb_context *ctx, usbi_os_handle_t os_handle, short poll_events)
+ * POLLIN and/or POLLOUT. user_data is handed back to the backend's
+ * handle_events function alongside any events reported for the source. */
+int usbi_add_event_source(struct libusb_context *ctx, usbi_os_handle_t os_handle,
+	short poll_events, void *user_data)
 {
 	struct usbi_event_source *ievent_source = malloc(sizeof(*ievent_source));
 
@@ -2689,7 +4161,31 @@ int usbi_add_event_source(struct libusb_context *ctx, usbi_os_handle_t os_handle
 	usbi_dbg(ctx, "add " USBI_OS_HANDLE_FORMAT_STRING " events %d", os_handle, poll_events);
 	ievent_source->data.os_handle = os_handle;
 	ievent_source->data.poll_events = poll_events;
+	ievent_source->user_data = user_data;
+	ievent_source->worker = NULL;
 	usbi_mutex_lock(&ctx->event_data_lock);
+#ifdef HAVE_OS_EVENT_SET
+	/* event sources of devices go to an event thread, if there are any.
+	 * The thread handling events need not pick them up. */
+	if (ctx->event_workers && user_data) {
+		int r = add_worker_event_source(ctx, ievent_source);
+
+		usbi_mutex_unlock(&ctx->event_data_lock);
+		if (r)
+			free(ievent_source);
+		return r;
+	}
+
+	{
+		int r = usbi_event_set_add(&ctx->event_set, ievent_source);
+
+		if (r) {
+			usbi_mutex_unlock(&ctx->event_data_lock);
+			free(ievent_source);
+			return r;
+		}
+	}
+#endif
 	list_add_tail(&ievent_source->list, &ctx->event_sources);
 	usbi_event_source_notification(ctx);
 	usbi_mutex_unlock(&ctx->event_data_lock);
@@ -2717,14 +4213,29 @@ void usbi_remove_event_source(struct libusb_context *ctx, usbi_os_handle_t os_ha
 		}
 	}
 
+#ifdef HAVE_OS_EVENT_SET
+	if (!found) {
+		ievent_source = find_worker_event_source(ctx, os_handle);
+		if (ievent_source) {
+			remove_worker_event_source(ctx, ievent_source);
+			usbi_mutex_unlock(&ctx->event_data_lock);
+			return;
+		}
+	}
+#endif
+
 	if (!found) {
 		usbi_dbg(ctx, "couldn't find " USBI_OS_HANDLE_FORMAT_STRING " to remove", os_handle);
 		usbi_mutex_unlock(&ctx->event_data_lock);
 		return;
 	}
 
+#ifdef HAVE_OS_EVENT_SET
+	usbi_event_set_remove(&ctx->event_set, ievent_source);
+#endif
 	list_del(&ievent_source->list);
 	list_add_tail(&ievent_source->list, &ctx->removed_event_sources);
+	(void)usbi_atomic_inc(&ctx->event_sources_removed);
 	usbi_event_source_notification(ctx);
 	usbi_mutex_unlock(&ctx->event_data_lock);
 
@@ -2734,6 +4245,34 @@ void usbi_remove_event_source(struct libusb_context *ctx, usbi_os_handle_t os_ha
 #endif
 }
 
+/* Returns 1 if an event source with the given OS handle and user data is
+ * still registered, 0 otherwise. Backends use this during event handling to
+ * skip event sources removed by callbacks, e.g. when a device is closed. */
+int usbi_event_source_registered(struct libusb_context *ctx,
+	usbi_os_handle_t os_handle, void *user_data)
+{
+	struct usbi_event_source *ievent_source;
+	int found = 0;
+
+	usbi_mutex_lock(&ctx->event_data_lock);
+	for_each_event_source(ctx, ievent_source) {
+		if (ievent_source->data.os_handle == os_handle &&
+		    ievent_source->user_data == user_data) {
+			found = 1;
+			break;
+		}
+	}
+#ifdef HAVE_OS_EVENT_SET
+	if (!found) {
+		ievent_source = find_worker_event_source(ctx, os_handle);
+		found = ievent_source && ievent_source->user_data == user_data;
+	}
+#endif
+	usbi_mutex_unlock(&ctx->event_data_lock);
+
+	return found;
+}
+
 /** \ingroup libusb_poll
  * Retrieve a list of file descriptors that should be polled by your main loop
  * as libusb event sources.
@@ -2807,6 +4346,98 @@ void API_EXPORTED libusb_free_pollfds(const struct libusb_pollfd **pollfds)
 #endif
 }
 
+/** \ingroup libusb_poll
+ * Retrieve a single file descriptor that represents all of libusb's event
+ * sources for a context.
+ *
+ * The file descriptor becomes readable whenever libusb has events to handle,
+ * at which point you should call libusb_handle_ready_events(). It remains
+ * valid until the context is destroyed and must not be closed, read from or
+ * otherwise modified by the application.
+ *
+ * This is only available on platforms that can gather event sources in the
+ * kernel (currently Linux with epoll support). Elsewhere, use
+ * libusb_get_pollfds() instead.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns the file descriptor to poll for reading
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED on platforms where the functionality
+ * is not available
+ * \ref libusb_pollmain "Polling libusb file descriptors for event handling"
+ */
+int API_EXPORTED libusb_get_event_fd(libusb_context *ctx)
+{
+#ifdef HAVE_OS_EVENT_SET
+	ctx = usbi_get_context(ctx);
+	return ctx->event_set.epollfd;
+#else
+	UNUSED(ctx);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/** \ingroup libusb_poll
+ * Handle any events that are ready, without blocking.
+ *
+ * This is intended to be called when the file descriptor returned by
+ * libusb_get_event_fd() (or any of those returned by libusb_get_pollfds())
+ * indicates activity. It processes ready events and expired timeouts and
+ * then returns immediately.
+ *
+ * If another thread is currently handling events, or is waiting to close a
+ * device, this function does nothing and returns 0; the ready events are
+ * left for that thread to handle.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns 0 on success, or a LIBUSB_ERROR code on failure
+ * \ref libusb_pollmain "Polling libusb file descriptors for event handling"
+ */
+int API_EXPORTED libusb_handle_ready_events(libusb_context *ctx)
+{
+	struct timeval poll_timeout = { 0, 0 };
+	int r;
+
+	ctx = usbi_get_context(ctx);
+	if (libusb_try_lock_events(ctx))
+		return 0;
+
+	r = handle_events(ctx, &poll_timeout);
+	libusb_unlock_events(ctx);
+	return r;
+}
+
+/** \ingroup libusb_poll
+ * Retrieve the URB reaping statistics of a context.
+ *
+ * The counters are updated by every event handling pass that finds ready
+ * devices, and can be used to tune \ref LIBUSB_OPTION_REAP_BUDGET. They are
+ * only maintained on Linux and read as zero elsewhere.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param stats output location for the statistics
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if stats is NULL
+ */
+int API_EXPORTED libusb_get_reap_stats(libusb_context *ctx,
+	struct libusb_reap_stats *stats)
+{
+	if (!stats)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	ctx = usbi_get_context(ctx);
+	stats->wakeups = (uint64_t)usbi_atomic_load(&ctx->reap_wakeups);
+	stats->urbs = (uint64_t)usbi_atomic_load(&ctx->reap_urbs);
+	stats->max_urbs_per_wakeup = (uint64_t)usbi_atomic_load(&ctx->reap_max_urbs);
+	stats->budget_exhausted = (uint64_t)usbi_atomic_load(&ctx->reap_budget_exhausted);
+	return 0;
+}
+
 /* Backends may call this from handle_events to report disconnection of a
  * device. This function ensures transfers get cancelled appropriately.
  * Callers of this function must hold the events_lock.
@@ -2835,19 +4466,17 @@ void usbi_handle_disconnect(struct libusb_device_handle *dev_handle)
 
 	while (1) {
 		to_cancel = NULL;
-		usbi_mutex_lock(&ctx->flying_transfers_lock);
-		for_each_transfer(ctx, cur) {
-			if (USBI_TRANSFER_TO_LIBUSB_TRANSFER(cur)->dev_handle == dev_handle) {
-				usbi_mutex_lock(&cur->lock);
-				if (cur->state_flags & USBI_TRANSFER_IN_FLIGHT)
-					to_cancel = cur;
-				usbi_mutex_unlock(&cur->lock);
-
-				if (to_cancel)
-					break;
-			}
+		usbi_mutex_lock(&dev_handle->flying_transfers_lock);
+		for_each_transfer(dev_handle, cur) {
+			usbi_mutex_lock(&cur->lock);
+			if (cur->state_flags & USBI_TRANSFER_IN_FLIGHT)
+				to_cancel = cur;
+			usbi_mutex_unlock(&cur->lock);
+
+			if (to_cancel)
+				break;
 		}
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
+		usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
 
 		if (!to_cancel)
 			break;
@@ -146,7 +146,7 @@ typedef SSIZE_T ssize_t;
  * Internally, LIBUSB_API_VERSION is defined as follows:
  * (libusb major << 24) | (libusb minor << 16) | (16 bit incremental)
  */
-#define LIBUSB_API_VERSION 0x0100010A
+#define LIBUSB_API_VERSION 0x0100010B
 
 /* The following is kept for compatibility, but will be deprecated in the future */
 #define LIBUSBX_API_VERSION LIBUSB_API_VERSION
@@ -1120,6 +1120,15 @@ typedef struct libusb_device libusb_device;
  */
 typedef struct libusb_device_handle libusb_device_handle;
 
+/** \ingroup libusb_asyncio
+ * Structure representing a pool of transfer buffers. This is an opaque type
+ * for which you are only ever provided with a pointer, originating from
+ * libusb_alloc_buffer_pool().
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+typedef struct libusb_buffer_pool libusb_buffer_pool;
+
 /** \ingroup libusb_dev
  * Speed codes. Indicates the speed at which the device is operating.
  */
@@ -1291,7 +1300,24 @@ enum libusb_transfer_flags {
 	 *
 	 * Available since libusb-1.0.9.
 	 */
-	LIBUSB_TRANSFER_ADD_ZERO_PACKET = (1U << 3)
+	LIBUSB_TRANSFER_ADD_ZERO_PACKET = (1U << 3),
+
+	/** Automatically resubmit the transfer after its callback returns, if
+	 * the transfer completed with
+	 * \ref libusb_transfer_status::LIBUSB_TRANSFER_COMPLETED
+	 * "LIBUSB_TRANSFER_COMPLETED". The callback stops the resubmission by
+	 * clearing this flag, in which case
+	 * \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_TRANSFER
+	 * "LIBUSB_TRANSFER_FREE_TRANSFER" is honoured once the callback returns.
+	 *
+	 * If this flag is set, it is illegal to call libusb_free_transfer()
+	 * from your transfer callback for a completed transfer. If the
+	 * resubmission fails, the callback is invoked once more with an error
+	 * status and the transfer is not resubmitted again.
+	 *
+	 * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_TRANSFER_AUTO_RESUBMIT = (1U << 4)
 };
 
 /** \ingroup libusb_asyncio
@@ -1387,6 +1413,21 @@ struct libusb_transfer {
 	struct libusb_iso_packet_descriptor iso_packet_desc[ZERO_SIZED_ARRAY];
 };
 
+/** \ingroup libusb_asyncio
+ * Counters of the transfer pool, retrieved with
+ * libusb_get_transfer_pool_stats().
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+struct libusb_transfer_pool_stats {
+	/** Number of transfers allocated from the pool */
+	uint64_t hits;
+
+	/** Number of transfers that were allocated while the pool was enabled
+	 * but had no suitable free transfer */
+	uint64_t misses;
+};
+
 /** \ingroup libusb_misc
  * Capabilities supported by an instance of libusb on the current running
  * platform. Test if the loaded library supports a given capability by calling
@@ -1545,7 +1586,157 @@ enum libusb_option {
 	 */
 	LIBUSB_OPTION_LOG_CB = 4,
 
-	LIBUSB_OPTION_MAX = 5
+	/** Keep freed transfers in a pool for reuse by libusb_alloc_transfer()
+	 *
+	 * This option must be provided an argument of type int: the maximum
+	 * number of free transfers to keep per isochronous packet count class
+	 * and per pool shard. A value of 0, the default, disables the pool and
+	 * frees all transfers held in it.
+	 *
+	 * Transfers with up to 128 isochronous packet descriptors are pooled.
+	 * The pool is shared by all contexts, as libusb_alloc_transfer() does
+	 * not take a context, so setting this option on any context or with a
+	 * NULL context has the same effect. See
+	 * libusb_get_transfer_pool_stats() for its hit and miss counters.
+	 *
+	 *  Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_TRANSFER_POOL = 5,
+
+	/** Set the number of URBs reaped from each device per event handling pass
+	 *
+	 * This option must be provided an argument of type int: the maximum
+	 * number of completed URBs to reap from each ready device before
+	 * returning to wait for events again, or 0 to reap until the device has
+	 * no more completed URBs. The default is 26.
+	 *
+	 * Ready devices are reaped in turns of a few URBs each, so a busy device
+	 * does not delay the completions of the others until its budget is
+	 * used up. See libusb_get_reap_stats() for the number of URBs reaped
+	 * per pass.
+	 *
+	 * Only valid on Linux. Ignored on all other platforms.
+	 *
+	 *  Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_REAP_BUDGET = 6,
+
+	/** Perform small synchronous transfers with direct system calls
+	 *
+	 * Where the backend supports it, libusb_control_transfer(),
+	 * libusb_bulk_transfer() and libusb_interrupt_transfer() then perform
+	 * small transfers with a single blocking system call instead of the
+	 * asynchronous transfer machinery and event handling, which lowers
+	 * their latency. On Linux, data received by such an IN transfer before
+	 * it timed out or failed is discarded by the kernel, so
+	 * <tt>transferred</tt> is 0 after a timeout. Only set this option if
+	 * the application does not need the data of incomplete transfers.
+	 *
+	 * Only valid on Linux. Ignored on all other platforms.
+	 *
+	 *  Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_SYNC_DIRECT_IO = 7,
+
+	/** Set the number of transfers each device handle keeps for synchronous
+	 * I/O
+	 *
+	 * This option must be provided an argument of type int: the number of
+	 * transfers, with their control transfer bounce buffers, that each
+	 * device handle keeps for reuse by libusb_control_transfer(),
+	 * libusb_bulk_transfer() and libusb_interrupt_transfer(), or 0 to
+	 * allocate and free them on every call. The default is 4, which lets up
+	 * to 4 threads perform synchronous I/O on the same device handle
+	 * without heap allocation. Bounce buffers for more than 4096 bytes of
+	 * control data are not kept. See libusb_get_sync_stats() for the number
+	 * of allocations made.
+	 *
+	 *  Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_SYNC_CACHE_SIZE = 8,
+
+	/** Run transfer callbacks on a pool of threads
+	 *
+	 * This option must be provided an argument of type int: the number of
+	 * threads, up to 64, that run the callbacks of completed transfers, or
+	 * 0, the default, to run them on the thread handling events. With
+	 * callback threads, the thread handling events only reaps completed
+	 * transfers and queues them, so that a slow callback does not delay the
+	 * completions of other devices.
+	 *
+	 * The callbacks of all transfers on the same endpoint of a device
+	 * handle run on the same thread, in the order the transfers completed.
+	 * Callbacks of different endpoints may run concurrently. Functions
+	 * such as libusb_handle_events_completed() return once a callback has
+	 * set the completion flag, but libusb_handle_events() and
+	 * libusb_handle_events_timeout() may now return before the callbacks of
+	 * the transfers they reaped have run. libusb_exit() runs the pending
+	 * callbacks before it returns. libusb_close() runs the pending
+	 * callbacks of the device handle on the calling thread, after waiting
+	 * for those running on other callback threads, and the callbacks of
+	 * its transfers completing while it closes run on the thread handling
+	 * events.
+	 *
+	 * This option only takes effect when a context is created, so it must
+	 * be passed to libusb_init_context(), or set with a NULL context before
+	 * the default context is created.
+	 *
+	 *  Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_CALLBACK_THREADS = 9,
+
+	/** Handle the events of open devices on a pool of threads
+	 *
+	 * This option must be provided an argument of type int: the number of
+	 * threads, up to 64, that wait for and reap the completed transfers of
+	 * open devices, or 0, the default, to do so on the thread handling
+	 * events. Each device handle opened is assigned to the event thread
+	 * with the fewest devices, which then reaps its transfers and runs
+	 * their callbacks, concurrently with the event threads of other
+	 * devices.
+	 *
+	 * Transfer timeouts and hotplug events are still handled by the
+	 * application's calls to libusb_handle_events() and related
+	 * functions, which must continue. Those return once a callback on an
+	 * event thread has set their completion flag. Closing a device handle
+	 * briefly pauses all event threads. Device handles are not included in
+	 * libusb_get_pollfds().
+	 *
+	 * This option is only supported on platforms where libusb uses epoll,
+	 * and it only takes effect when a context is created, so it must be
+	 * passed to libusb_init_context(), or set with a NULL context before
+	 * the default context is created.
+	 *
+	 *  Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_EVENT_THREADS = 10,
+
+	/** Record log messages in a ring instead of writing them out
+	 *
+	 * This option must be provided an argument of type int: the number of
+	 * messages the ring holds, up to 65536 and rounded up to a power of
+	 * two, or 0, the default, to write each message out as it is logged.
+	 *
+	 * With a ring, a message that passes the log level is not formatted
+	 * where it is logged. Its format string, arguments, timestamp and
+	 * thread ID are copied into the ring without taking a lock, and the
+	 * message is only formatted and passed to the log handlers when the
+	 * application calls libusb_drain_log(), so that debug messages can be
+	 * enabled without holding up the threads that log them. Messages
+	 * logged while the ring is full are dropped and counted, and messages
+	 * with arguments that cannot be recorded are still written out as
+	 * they are logged. libusb_exit() drains the messages that are left.
+	 *
+	 * This option is not supported if libusb is built without logging or
+	 * with debug logging forced on, and it only takes effect when a
+	 * context is created, so it must be passed to libusb_init_context(),
+	 * or set with a NULL context before the default context is created.
+	 *
+	 *  Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_LOG_RING = 11,
+
+	LIBUSB_OPTION_MAX = 12
 };
 
 /** \ingroup libusb_lib
@@ -1582,6 +1773,7 @@ void LIBUSB_CALL libusb_exit(libusb_context *ctx);
 void LIBUSB_CALL libusb_set_debug(libusb_context *ctx, int level);
 /* may be deprecated in the future in favor of lubusb_init_context()+libusb_set_option() */
 void LIBUSB_CALL libusb_set_log_cb(libusb_context *ctx, libusb_log_cb cb, int mode);
+int LIBUSB_CALL libusb_drain_log(libusb_context *ctx, int max_messages);
 const struct libusb_version * LIBUSB_CALL libusb_get_version(void);
 int LIBUSB_CALL libusb_has_capability(uint32_t capability);
 const char * LIBUSB_CALL libusb_error_name(int errcode);
@@ -1691,6 +1883,13 @@ unsigned char * LIBUSB_CALL libusb_dev_mem_alloc(libusb_device_handle *dev_handl
 int LIBUSB_CALL libusb_dev_mem_free(libusb_device_handle *dev_handle,
 	unsigned char *buffer, size_t length);
 
+int LIBUSB_CALL libusb_alloc_buffer_pool(libusb_device_handle *dev_handle,
+	size_t buffer_size, int num_buffers, libusb_buffer_pool **pool);
+unsigned char * LIBUSB_CALL libusb_buffer_pool_get(libusb_buffer_pool *pool);
+void LIBUSB_CALL libusb_buffer_pool_put(libusb_buffer_pool *pool,
+	unsigned char *buffer);
+void LIBUSB_CALL libusb_free_buffer_pool(libusb_buffer_pool *pool);
+
 int LIBUSB_CALL libusb_kernel_driver_active(libusb_device_handle *dev_handle,
 	int interface_number);
 int LIBUSB_CALL libusb_detach_kernel_driver(libusb_device_handle *dev_handle,
@@ -1775,12 +1974,16 @@ static inline void libusb_fill_control_setup(unsigned char *buffer,
 
 struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(int iso_packets);
 int LIBUSB_CALL libusb_submit_transfer(struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_submit_transfers(struct libusb_transfer **transfers,
+	int num_transfers, int *results);
 int LIBUSB_CALL libusb_cancel_transfer(struct libusb_transfer *transfer);
 void LIBUSB_CALL libusb_free_transfer(struct libusb_transfer *transfer);
 void LIBUSB_CALL libusb_transfer_set_stream_id(
 	struct libusb_transfer *transfer, uint32_t stream_id);
 uint32_t LIBUSB_CALL libusb_transfer_get_stream_id(
 	struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_get_transfer_pool_stats(
+	struct libusb_transfer_pool_stats *stats);
 
 /** \ingroup libusb_asyncio
  * Helper function to populate the required \ref libusb_transfer fields
@@ -2049,6 +2252,146 @@ int LIBUSB_CALL libusb_interrupt_transfer(libusb_device_handle *dev_handle,
 	unsigned char endpoint, unsigned char *data, int length,
 	int *actual_length, unsigned int timeout);
 
+/** \ingroup libusb_syncio
+ * Synchronous I/O statistics of a context, see libusb_get_sync_stats().
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+struct libusb_sync_stats {
+	/** Number of synchronous transfers that went through the asynchronous
+	 * transfer path */
+	uint64_t transfers;
+
+	/** Number of those which reused a transfer kept by the device handle,
+	 * see \ref LIBUSB_OPTION_SYNC_CACHE_SIZE */
+	uint64_t cache_hits;
+
+	/** Number of heap allocations made for those transfers */
+	uint64_t allocations;
+};
+
+int LIBUSB_CALL libusb_get_sync_stats(libusb_context *ctx,
+	struct libusb_sync_stats *stats);
+
+/* streaming I/O */
+
+/** \ingroup libusb_stream
+ * Structure representing a stream. This is an opaque type for which you are
+ * only ever provided with a pointer, originating from libusb_stream_open().
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+typedef struct libusb_stream libusb_stream;
+
+/** \ingroup libusb_stream
+ * Stream flags
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+enum libusb_stream_flags {
+	/** When the ring of an IN stream is full, hold completed transfers
+	 * back until a buffer is released, instead of dropping their data */
+	LIBUSB_STREAM_STALL_WHEN_FULL = (1U << 0),
+
+	/** When the ring of an OUT stream is full, fail with
+	 * \ref LIBUSB_ERROR_BUSY instead of waiting for a free buffer */
+	LIBUSB_STREAM_NONBLOCK = (1U << 1),
+
+	/** Terminate each message written to an OUT stream with a zero length
+	 * packet if its length is a multiple of the maximum packet size, see
+	 * \ref LIBUSB_TRANSFER_ADD_ZERO_PACKET */
+	LIBUSB_STREAM_ZERO_PACKET = (1U << 2)
+};
+
+/** \ingroup libusb_stream
+ * A buffer of data taken from an IN stream with libusb_stream_read(), or a
+ * buffer to fill taken from an OUT stream with libusb_stream_acquire().
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+struct libusb_stream_buffer {
+	/** Data */
+	unsigned char *data;
+
+	/** Number of bytes of data. For an OUT stream, this is set to the
+	 * size of the buffer and must be set to the number of bytes to send
+	 * before libusb_stream_commit() */
+	int length;
+
+	/** Status of the packet, for an isochronous stream. Other streams
+	 * only hand out data of completed transfers. */
+	enum libusb_transfer_status status;
+
+	/** Number of transfers, or packets for an isochronous stream, whose
+	 * data was dropped right before this buffer because the ring was
+	 * full */
+	int dropped;
+
+	/** Position of the buffer in the stream, which counts up by one for
+	 * each buffer */
+	unsigned long position;
+};
+
+/** \ingroup libusb_stream
+ * Counters of a stream, retrieved with libusb_stream_get_stats().
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+struct libusb_stream_stats {
+	/** Number of transfers that completed */
+	uint64_t transfers;
+
+	/** Number of bytes those transfers carried */
+	uint64_t bytes;
+
+	/** Number of IN transfers, or packets for an isochronous stream, whose
+	 * data was dropped because the ring was full */
+	uint64_t overruns;
+
+	/** Number of IN transfers that were held back because the ring was full,
+	 * see \ref LIBUSB_STREAM_STALL_WHEN_FULL */
+	uint64_t stalls;
+
+	/** Number of transfers that failed */
+	uint64_t errors;
+
+	/** Number of packets received by an isochronous stream */
+	uint64_t packets;
+
+	/** Number of those packets that failed */
+	uint64_t packet_errors;
+
+	/** Number of packets an isochronous stream dropped because the ring
+	 * was full, over the last second */
+	uint32_t dropped_per_second;
+
+	/** Number of packets that failed over the last second */
+	uint32_t errors_per_second;
+};
+
+int LIBUSB_CALL libusb_stream_open(libusb_device_handle *dev_handle,
+	unsigned char endpoint, int transfer_size, int num_transfers,
+	int num_buffers, uint32_t flags, libusb_stream **stream);
+int LIBUSB_CALL libusb_stream_open_iso(libusb_device_handle *dev_handle,
+	unsigned char endpoint, int num_packets, int num_transfers,
+	int num_buffers, uint32_t flags, libusb_stream **stream);
+int LIBUSB_CALL libusb_stream_start(libusb_stream *stream);
+void LIBUSB_CALL libusb_stream_stop(libusb_stream *stream);
+int LIBUSB_CALL libusb_stream_read(libusb_stream *stream,
+	struct libusb_stream_buffer *buffer);
+void LIBUSB_CALL libusb_stream_release(libusb_stream *stream,
+	struct libusb_stream_buffer *buffer);
+int LIBUSB_CALL libusb_stream_acquire(libusb_stream *stream,
+	struct libusb_stream_buffer *buffer);
+int LIBUSB_CALL libusb_stream_commit(libusb_stream *stream,
+	struct libusb_stream_buffer *buffer);
+int LIBUSB_CALL libusb_stream_write(libusb_stream *stream,
+	const unsigned char *data, int length);
+int LIBUSB_CALL libusb_stream_flush(libusb_stream *stream);
+int LIBUSB_CALL libusb_stream_get_stats(libusb_stream *stream,
+	struct libusb_stream_stats *stats);
+void LIBUSB_CALL libusb_stream_close(libusb_stream *stream);
+
 /** \ingroup libusb_desc
  * Retrieve a descriptor from the default control pipe.
  * This is a convenience function which formulates the appropriate control
@@ -2156,9 +2499,33 @@ typedef void (LIBUSB_CALL *libusb_pollfd_added_cb)(int fd, short events,
  */
 typedef void (LIBUSB_CALL *libusb_pollfd_removed_cb)(int fd, void *user_data);
 
+/** \ingroup libusb_poll
+ * URB reaping statistics of a context, see libusb_get_reap_stats().
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+struct libusb_reap_stats {
+	/** Number of event handling passes over ready devices */
+	uint64_t wakeups;
+
+	/** Total number of URBs reaped */
+	uint64_t urbs;
+
+	/** Largest number of URBs reaped in a single pass */
+	uint64_t max_urbs_per_wakeup;
+
+	/** Number of passes in which at least one device used up its whole
+	 * \ref LIBUSB_OPTION_REAP_BUDGET */
+	uint64_t budget_exhausted;
+};
+
 const struct libusb_pollfd ** LIBUSB_CALL libusb_get_pollfds(
 	libusb_context *ctx);
 void LIBUSB_CALL libusb_free_pollfds(const struct libusb_pollfd **pollfds);
+int LIBUSB_CALL libusb_get_event_fd(libusb_context *ctx);
+int LIBUSB_CALL libusb_handle_ready_events(libusb_context *ctx);
+int LIBUSB_CALL libusb_get_reap_stats(libusb_context *ctx,
+	struct libusb_reap_stats *stats);
 void LIBUSB_CALL libusb_set_pollfd_notifiers(libusb_context *ctx,
 	libusb_pollfd_added_cb added_cb, libusb_pollfd_removed_cb removed_cb,
 	void *user_data);
@@ -92,6 +92,17 @@
  *   usbi_atomic_store() - Atomically write a new value value to a variable
  *   usbi_atomic_inc() - Atomically increment a variable's value and return the new value
  *   usbi_atomic_dec() - Atomically decrement a variable's value and return the new value
+ *   usbi_atomic_cas() - Atomically replace a variable's value if it equals an
+ *                       expected value, and return non-zero if it was replaced
+ *
+ * and the same for 64-bit values, on a usbi_atomic64_t, whatever the size of
+ * a long:
+ *   usbi_atomic64_load(), usbi_atomic64_store(), usbi_atomic64_cas()
+ *
+ * and the same for pointers, on a usbi_atomic_ptr_t:
+ *   usbi_atomic_ptr_load(), usbi_atomic_ptr_store(), usbi_atomic_ptr_cas()
+ *   usbi_atomic_ptr_exchange() - Atomically write a new pointer to a variable
+ *                                and return its previous value
  *
  * All of these operations are ordered with each other, thus the effects of
  * any one operation is guaranteed to be seen by any other operation.
@@ -102,6 +113,16 @@ typedef volatile LONG usbi_atomic_t;
 #define usbi_atomic_store(a, v)	(*(a)) = (v)
 #define usbi_atomic_inc(a)	InterlockedIncrement((a))
 #define usbi_atomic_dec(a)	InterlockedDecrement((a))
+#define usbi_atomic_cas(a, e, v)	(InterlockedCompareExchange((a), (v), (e)) == (e))
+typedef volatile LONGLONG usbi_atomic64_t;
+#define usbi_atomic64_load(a)	InterlockedCompareExchange64((a), 0, 0)
+#define usbi_atomic64_store(a, v)	(void)InterlockedExchange64((a), (v))
+#define usbi_atomic64_cas(a, e, v)	(InterlockedCompareExchange64((a), (v), (e)) == (e))
+typedef void * volatile usbi_atomic_ptr_t;
+#define usbi_atomic_ptr_load(a)	(*(a))
+#define usbi_atomic_ptr_store(a, v)	(*(a)) = (v)
+#define usbi_atomic_ptr_cas(a, e, v)	(InterlockedCompareExchangePointer((a), (v), (e)) == (e))
+#define usbi_atomic_ptr_exchange(a, v)	InterlockedExchangePointer((a), (v))
 #else
 #include <stdatomic.h>
 typedef atomic_long usbi_atomic_t;
@@ -109,6 +130,25 @@ typedef atomic_long usbi_atomic_t;
 #define usbi_atomic_store(a, v)	atomic_store((a), (v))
 #define usbi_atomic_inc(a)	(atomic_fetch_add((a), 1) + 1)
 #define usbi_atomic_dec(a)	(atomic_fetch_add((a), -1) - 1)
+static inline int usbi_atomic_cas(usbi_atomic_t *a, long expected, long value)
+{
+	return atomic_compare_exchange_strong(a, &expected, value);
+}
+typedef _Atomic(int64_t) usbi_atomic64_t;
+#define usbi_atomic64_load(a)	atomic_load((a))
+#define usbi_atomic64_store(a, v)	atomic_store((a), (v))
+static inline int usbi_atomic64_cas(usbi_atomic64_t *a, int64_t expected, int64_t value)
+{
+	return atomic_compare_exchange_strong(a, &expected, value);
+}
+typedef _Atomic(void *) usbi_atomic_ptr_t;
+#define usbi_atomic_ptr_load(a)	atomic_load((a))
+#define usbi_atomic_ptr_store(a, v)	atomic_store((a), (v))
+#define usbi_atomic_ptr_exchange(a, v)	atomic_exchange((a), (v))
+static inline int usbi_atomic_ptr_cas(usbi_atomic_ptr_t *a, void *expected, void *value)
+{
+	return atomic_compare_exchange_strong(a, &expected, value);
+}
 #endif
 
 /* Internal abstractions for event handling and thread synchronization */
@@ -146,6 +186,8 @@ extern "C" {
 #define USBI_MAX_LOG_LEN	1024
 /* Terminator for log lines */
 #define USBI_LOG_LINE_END	"\n"
+/* Maximum number of messages held by a context's log ring */
+#define USBI_MAX_LOG_RING	65536
 
 struct list_head {
 	struct list_head *prev, *next;
@@ -313,7 +355,25 @@ int usbi_vsnprintf(char *dst, size_t size, const char *format, va_list args);
 void usbi_log(struct libusb_context *ctx, enum libusb_log_level level,
 	const char *function, const char *format, ...) PRINTF_FORMAT(4, 5);
 
-#define _usbi_log(ctx, level, ...) usbi_log(ctx, level, __func__, __VA_ARGS__)
+/* Non-zero if a message of the given level may be logged. Without a context,
+ * usbi_log() resolves the context it logs for and decides. This is a macro
+ * so that the check is always inlined. */
+#ifdef ENABLE_DEBUG_LOGGING
+#define usbi_log_enabled(ctx, level)	1
+#else
+#define usbi_log_enabled(ctx, level)	\
+	(!(ctx) || usbi_atomic_load(&(ctx)->debug) >= (long)(level))
+#endif
+
+/* The level is checked before the arguments are evaluated, so that a message
+ * that would not be logged costs one branch, see usbi_log_enabled() */
+#define _usbi_log(ctx, level, ...)					\
+	do {								\
+		struct libusb_context *_usbi_log_ctx = (ctx);		\
+									\
+		if (usbi_log_enabled(_usbi_log_ctx, level))		\
+			usbi_log(_usbi_log_ctx, level, __func__, __VA_ARGS__); \
+	} while (0)
 
 #define usbi_err(ctx, ...)	_usbi_log(ctx, LIBUSB_LOG_LEVEL_ERROR, __VA_ARGS__)
 #define usbi_warn(ctx, ...)	_usbi_log(ctx, LIBUSB_LOG_LEVEL_WARNING, __VA_ARGS__)
@@ -341,11 +401,138 @@ void usbi_log(struct libusb_context *ctx, enum libusb_log_level level,
 #define IS_XFERIN(xfer)		(0 != ((xfer)->endpoint & LIBUSB_ENDPOINT_IN))
 #define IS_XFEROUT(xfer)	(!IS_XFERIN(xfer))
 
+/* An absolute expiry time that can be tracked in a struct usbi_timeout_heap.
+ * heap_index is the position in the heap plus one, or 0 if the node is not
+ * in any heap. */
+struct usbi_timeout_node {
+	struct timespec expiry;
+	unsigned int heap_index;
+};
+
+/* Binary min-heap of timeout nodes ordered by their expiry. The item at
+ * index 0 is always the node that expires the soonest. */
+struct usbi_timeout_heap {
+	struct usbi_timeout_node **items;
+	unsigned int count;
+	unsigned int size;
+};
+
+int usbi_timeout_heap_reserve(struct usbi_timeout_heap *heap, unsigned int size);
+int usbi_timeout_heap_insert(struct usbi_timeout_heap *heap,
+	struct usbi_timeout_node *node);
+void usbi_timeout_heap_remove(struct usbi_timeout_heap *heap,
+	struct usbi_timeout_node *node);
+
+static inline struct usbi_timeout_node *usbi_timeout_heap_top(struct usbi_timeout_heap *heap)
+{
+	return heap->count ? heap->items[0] : NULL;
+}
+
+/* An entry of a struct usbi_ring. sequence tells whose turn it is: it equals
+ * the entry's position while the entry is free for the writer at that
+ * position, and the position plus one once it holds data for the reader at
+ * that position. */
+struct usbi_ring_slot {
+	usbi_atomic_t sequence;
+	unsigned char *buffer;
+	int length;
+	int status;
+	int dropped;
+};
+
+/* Bounded ring of buffers which writers and readers claim entries of without
+ * locks. An entry is claimed with usbi_ring_acquire_*() and handed over with
+ * usbi_ring_commit_*(), so its buffer may be used in between. Positions only
+ * ever increase and are taken modulo the size to find the entry, which is
+ * why the size must be a power of two: positions then stay consistent when
+ * they wrap around. */
+struct usbi_ring {
+	struct usbi_ring_slot *slots;
+	unsigned long size;
+	usbi_atomic_t head;
+	usbi_atomic_t tail;
+};
+
+static inline void usbi_ring_init(struct usbi_ring *ring,
+	struct usbi_ring_slot *slots, unsigned long size)
+{
+	unsigned long i;
+
+	ring->slots = slots;
+	ring->size = size;
+	usbi_atomic_store(&ring->head, 0);
+	usbi_atomic_store(&ring->tail, 0);
+	for (i = 0; i < size; i++)
+		usbi_atomic_store(&slots[i].sequence, (long)i);
+}
+
+/* Claim the entry at *cursor whose sequence must be the position plus
+ * offset. Returns NULL if that entry is not ready yet. */
+static inline struct usbi_ring_slot *usbi_ring_acquire(struct usbi_ring *ring,
+	usbi_atomic_t *cursor, unsigned long offset, unsigned long *position)
+{
+	struct usbi_ring_slot *slot;
+	unsigned long pos;
+	long diff;
+
+	for (;;) {
+		pos = (unsigned long)usbi_atomic_load(cursor);
+		slot = &ring->slots[pos % ring->size];
+		diff = (long)((unsigned long)usbi_atomic_load(&slot->sequence) - (pos + offset));
+		if (diff < 0)
+			return NULL;
+		if (diff == 0 && usbi_atomic_cas(cursor, (long)pos, (long)(pos + 1)))
+			break;
+	}
+
+	*position = pos;
+	return slot;
+}
+
+/* Claim a free entry to fill, or return NULL if the ring is full */
+static inline struct usbi_ring_slot *usbi_ring_acquire_write(struct usbi_ring *ring,
+	unsigned long *position)
+{
+	return usbi_ring_acquire(ring, &ring->head, 0, position);
+}
+
+/* Hand a filled entry over to the readers */
+static inline void usbi_ring_commit_write(struct usbi_ring *ring,
+	unsigned long position)
+{
+	usbi_atomic_store(&ring->slots[position % ring->size].sequence,
+		(long)(position + 1));
+}
+
+/* Claim the oldest filled entry, or return NULL if the ring is empty */
+static inline struct usbi_ring_slot *usbi_ring_acquire_read(struct usbi_ring *ring,
+	unsigned long *position)
+{
+	return usbi_ring_acquire(ring, &ring->tail, 1, position);
+}
+
+/* Hand an entry that has been read back to the writers */
+static inline void usbi_ring_commit_read(struct usbi_ring *ring,
+	unsigned long position)
+{
+	usbi_atomic_store(&ring->slots[position % ring->size].sequence,
+		(long)(position + ring->size));
+}
+
 struct libusb_context {
 #if defined(ENABLE_LOGGING) && !defined(ENABLE_DEBUG_LOGGING)
-	enum libusb_log_level debug;
+	/* an enum libusb_log_level, read without a lock when logging */
+	usbi_atomic_t debug;
 	int debug_fixed;
 	libusb_log_cb log_handler;
+
+	/* messages recorded until libusb_drain_log() formats them, if the
+	 * context was created with a log ring. log_ring_size is only used
+	 * when the context is created, log_records is NULL without a ring */
+	int log_ring_size;
+	struct usbi_ring log_ring;
+	struct usbi_log_record *log_records;
+	usbi_atomic_t log_dropped;
 #endif
 
 	/* used for signalling occurrence of an internal event. */
@@ -357,6 +544,13 @@ struct libusb_context {
 	usbi_timer_t timer;
 #endif
 
+#ifdef HAVE_OS_EVENT_SET
+	/* kernel-side set of the event sources, if supported by OS.
+	 * event sources are registered and unregistered as they are added
+	 * and removed, so waiting does not need to pass them all in */
+	usbi_event_set_t event_set;
+#endif
+
 	struct list_head usb_devs;
 	usbi_mutex_t usb_devs_lock;
 
@@ -373,14 +567,15 @@ struct libusb_context {
 	/* A flag to indicate that the context is ready for hotplug notifications */
 	usbi_atomic_t hotplug_ready;
 
-	/* this is a list of in-flight transfer handles, sorted by timeout
-	 * expiration. URBs to timeout the soonest are placed at the beginning of
-	 * the list, URBs that will time out later are placed after, and urbs with
-	 * infinite timeout are always placed at the very end. */
-	struct list_head flying_transfers;
-	/* Note paths taking both this and usbi_transfer->lock must always
-	 * take this lock first */
-	usbi_mutex_t flying_transfers_lock;
+	/* in-flight transfers are tracked per device handle. this heap only
+	 * holds the timeout node of each device handle, keyed on a time that is
+	 * never later than the earliest pending timeout on that handle. it has
+	 * room reserved for one node per open device handle (timeout_shards). */
+	struct usbi_timeout_heap timeout_heap;
+	unsigned int timeout_shards;
+	/* Note paths taking both this and a device handle's
+	 * flying_transfers_lock must always take this lock first */
+	usbi_mutex_t timeout_lock;
 
 #if !defined(PLATFORM_WINDOWS)
 	/* user callbacks for pollfd changes */
@@ -395,8 +590,42 @@ struct libusb_context {
 	/* used to see if there is an active thread doing event handling */
 	int event_handler_active;
 
+	/* maximum number of URBs the backend reaps from each ready device per
+	 * event handling pass, or 0 for no limit */
+	int reap_budget;
+
+	/* URB reaping statistics, see usbi_account_reaped() */
+	usbi_atomic_t reap_wakeups;
+	usbi_atomic_t reap_urbs;
+	usbi_atomic_t reap_max_urbs;
+	usbi_atomic_t reap_budget_exhausted;
+
+	/* set if synchronous transfers may use the backend's direct system
+	 * calls, see LIBUSB_OPTION_SYNC_DIRECT_IO */
+	int sync_direct_io;
+
+	/* number of transfers each device handle keeps for synchronous I/O */
+	int sync_cache_size;
+
+	/* synchronous I/O statistics of the device handles closed so far, see
+	 * libusb_get_sync_stats(). Protected by open_devs_lock */
+	struct libusb_sync_stats closed_sync_stats;
+
+	/* threads that run transfer callbacks, see
+	 * LIBUSB_OPTION_CALLBACK_THREADS. callback_workers is NULL if
+	 * callbacks run on the thread handling events. */
+	int callback_threads;
+	struct usbi_callback_worker *callback_workers;
+
+	/* threads that handle the events of open devices, see
+	 * LIBUSB_OPTION_EVENT_THREADS. event_workers is NULL if the thread
+	 * handling events handles them. */
+	int event_threads;
+	struct usbi_event_worker *event_workers;
+
 	/* A thread-local storage key to track which thread is performing event
-	 * handling */
+	 * handling. Set to the context on the thread holding the event handling
+	 * lock, and to its struct usbi_event_worker on an event thread. */
 	usbi_tls_key_t event_handling_key;
 
 	/* used to wait for event completion in threads other than the one that is
@@ -404,6 +633,13 @@ struct libusb_context {
 	usbi_mutex_t event_waiters_lock;
 	usbi_cond_t event_waiters_cond;
 
+	/* Threads waiting in libusb_handle_events_timeout_completed() while
+	 * another thread handles events, each woken on its own, and the number
+	 * of threads blocked on event_waiters_cond in libusb_wait_for_event().
+	 * Protected by event_waiters_lock. */
+	struct list_head event_waiters;
+	unsigned int event_waiters_cond_users;
+
 	/* A lock to protect internal context event data. */
 	usbi_mutex_t event_data_lock;
 
@@ -422,15 +658,30 @@ struct libusb_context {
 	 * event sources were waited on. Protected by event_data_lock. */
 	struct list_head removed_event_sources;
 
+	/* Number of event sources removed over the lifetime of the context.
+	 * Only incremented with event_data_lock held, so that the threads
+	 * handling device events may read it unlocked to detect removals. */
+	usbi_atomic_t event_sources_removed;
+
 	/* A pointer and count to platform-specific data used for monitoring event
 	 * sources. Only accessed during event handling. */
 	void *event_data;
 	unsigned int event_data_cnt;
 
+	/* The user data of each event source, in the same order as event_data.
+	 * Only accessed during event handling. */
+	void **event_user_data;
+
 	/* A list of pending hotplug messages. Protected by event_data_lock. */
 	struct list_head hotplug_msgs;
 
-	/* A list of pending completed transfers. Protected by event_data_lock. */
+	/* Transfers completed by the backend, see usbi_completed_queue_push().
+	 * The USBI_EVENT_TRANSFER_COMPLETED flag is set while it is not empty. */
+	usbi_atomic_ptr_t completed_queue;
+
+	/* Completed transfers taken from completed_queue but not handled yet
+	 * because the backend failed. Only accessed by the thread handling
+	 * events. */
 	struct list_head completed_transfers;
 
 	struct list_head list;
@@ -477,6 +728,57 @@ enum usbi_event_flags {
 
 	/* A device is in the process of being closed */
 	USBI_EVENT_DEVICE_CLOSE = 1U << 5,
+
+	/* A callback thread has run transfer callbacks */
+	USBI_EVENT_CALLBACKS_RUN = 1U << 6,
+};
+
+/* A thread that runs the callbacks of completed transfers, see
+ * LIBUSB_OPTION_CALLBACK_THREADS */
+struct usbi_callback_worker {
+	struct libusb_context *ctx;
+	usbi_thread_t thread;
+	usbi_mutex_t lock;
+	usbi_cond_t cond;
+
+	/* Transfers whose callbacks are pending, linked through their
+	 * completed_list. Protected by lock. */
+	struct list_head transfers;
+
+	/* Thread ID of the thread, and device handle of the callback it is
+	 * running or NULL. Protected by lock. */
+	unsigned int tid;
+	struct libusb_device_handle *running;
+
+	/* Signalled whenever a callback has run */
+	usbi_cond_t idle;
+
+	/* Set to make the thread exit once transfers is empty. Protected by
+	 * lock. */
+	int stop;
+};
+
+/* Why an event waiter was woken */
+enum usbi_event_waiter_wakeup {
+	/* Its completion flag was set, or any transfer completed if it has
+	 * none */
+	USBI_WAITER_COMPLETED = 1,
+
+	/* The event handler went away and the waiter is to take over */
+	USBI_WAITER_HANDOFF = 2,
+};
+
+/* A thread waiting for another thread to handle its events, see
+ * ctx->event_waiters */
+struct usbi_event_waiter {
+	struct list_head list;
+	usbi_cond_t cond;
+
+	/* The completion flag the thread waits for, or NULL */
+	int *completed;
+
+	/* 0 while the thread sleeps, then an enum usbi_event_waiter_wakeup */
+	int wakeup;
 };
 
 /* Macros for managing event handling state */
@@ -521,6 +823,39 @@ struct libusb_device_handle {
 	struct list_head list;
 	struct libusb_device *dev;
 	int auto_detach_kernel_driver;
+
+	/* this is a list of in-flight transfers on this handle, in no particular
+	 * order, and a binary min-heap of those with a finite timeout which has
+	 * not yet been handled. Note paths taking both this and
+	 * usbi_transfer->lock must always take this lock first */
+	struct list_head flying_transfers;
+	struct usbi_timeout_heap flying_timeouts;
+	usbi_mutex_t flying_transfers_lock;
+
+	/* the earliest timeout that has been (or is about to be) published to
+	 * the context timeout heap through timeout_node. Protected by the
+	 * flying_transfers_lock. timeout_node itself is protected by the context
+	 * timeout_lock */
+	struct timespec timeout_published;
+	struct usbi_timeout_node timeout_node;
+
+	/* transfers kept for reuse by the synchronous I/O functions, see
+	 * sync.c */
+	usbi_mutex_t sync_cache_lock;
+	struct list_head sync_cache;
+	int sync_cache_count;
+
+	/* synchronous I/O statistics of this handle, which are kept per handle
+	 * so that threads using different handles do not share a cache line,
+	 * see libusb_get_sync_stats() */
+	usbi_atomic_t sync_transfers;
+	usbi_atomic_t sync_cache_hits;
+	usbi_atomic_t sync_allocations;
+
+	/* set by libusb_close() before it flushes the callbacks queued to
+	 * callback threads, so that callbacks are no longer queued, see
+	 * usbi_flush_callbacks() */
+	usbi_atomic_t closing;
 };
 
 /* Function called by backend during device initialization to convert
@@ -569,9 +904,14 @@ void usbi_get_real_time(struct timespec *tp);
 
 struct usbi_transfer {
 	int num_iso_packets;
+	int pool_class; /* Transfer pool size class plus one, or 0 if not pooled */
 	struct list_head list;
+	/* links the transfer into the context's completed_transfers, or into
+	 * the queue of a callback thread while its callback is pending */
 	struct list_head completed_list;
-	struct timespec timeout;
+	/* links the transfer into the context's completed_queue */
+	struct usbi_transfer *completed_next;
+	struct usbi_timeout_node timeout; /* Protected by the flying_transfers_lock */
 	int transferred;
 	uint32_t stream_id;
 	uint32_t state_flags;   /* Protected by usbi_transfer->lock */
@@ -604,6 +944,10 @@ enum usbi_transfer_state_flags {
 
 	/* Operation on the transfer failed because the device disappeared */
 	USBI_TRANSFER_DEVICE_DISAPPEARED = 1U << 2,
+
+	/* Transfer left on the flying list while its callback runs, to be
+	 * resubmitted automatically */
+	USBI_TRANSFER_RESUBMIT_PENDING = 1U << 3,
 };
 
 enum usbi_transfer_timeout_flags {
@@ -626,6 +970,42 @@ enum usbi_transfer_timeout_flags {
 	 ((unsigned char *)(transfer)			\
 	  - PTR_ALIGN(sizeof(struct usbi_transfer))))
 
+/* Queue of completed transfers which any thread adds to without locks, and
+ * which a single thread empties at once. It is a stack of transfers linked
+ * through completed_next, reversed when taken. Since transfers are never
+ * removed one at a time, a transfer pushed again after it was taken cannot
+ * confuse a concurrent push.
+ *
+ * Adds a transfer and returns non-zero if the queue was empty, so that only
+ * one of the threads adding transfers until the queue is next taken needs to
+ * signal it. */
+static inline int usbi_completed_queue_push(usbi_atomic_ptr_t *queue,
+	struct usbi_transfer *itransfer)
+{
+	struct usbi_transfer *head;
+
+	do {
+		head = (struct usbi_transfer *)usbi_atomic_ptr_load(queue);
+		itransfer->completed_next = head;
+	} while (!usbi_atomic_ptr_cas(queue, head, itransfer));
+
+	return head == NULL;
+}
+
+/* Takes all transfers from the queue and adds them to the tail of list,
+ * linked through their completed_list, in the order they were pushed */
+static inline void usbi_completed_queue_take(usbi_atomic_ptr_t *queue,
+	struct list_head *list)
+{
+	struct usbi_transfer *itransfer =
+		(struct usbi_transfer *)usbi_atomic_ptr_exchange(queue, NULL);
+	struct list_head *tail = list->prev;
+
+	/* the latest transfer comes first, each older one goes before it */
+	for (; itransfer; itransfer = itransfer->completed_next)
+		list_add(&itransfer->completed_list, tail);
+}
+
 #ifdef _MSC_VER
 #pragma pack(push, 1)
 #endif
@@ -780,8 +1160,24 @@ void usbi_hotplug_notification(struct libusb_context *ctx, struct libusb_device
 	libusb_hotplug_event event);
 void usbi_hotplug_process(struct libusb_context *ctx, struct list_head *hotplug_msgs);
 
+int usbi_transfer_pool_set_max(int max);
+
 int usbi_io_init(struct libusb_context *ctx);
 void usbi_io_exit(struct libusb_context *ctx);
+void usbi_stop_callback_threads(struct libusb_context *ctx);
+void usbi_flush_callbacks(struct libusb_device_handle *dev_handle);
+void usbi_stop_event_threads(struct libusb_context *ctx);
+struct usbi_event_worker *usbi_leave_event_worker(struct libusb_context *ctx);
+void usbi_return_to_event_worker(struct usbi_event_worker *worker);
+void usbi_pause_event_workers(struct libusb_context *ctx);
+void usbi_resume_event_workers(struct libusb_context *ctx);
+int usbi_io_handle_init(struct libusb_context *ctx,
+	struct libusb_device_handle *dev_handle);
+void usbi_io_handle_exit(struct libusb_context *ctx,
+	struct libusb_device_handle *dev_handle);
+void usbi_sync_cache_free(struct libusb_device_handle *dev_handle);
+void usbi_sync_stats_add(struct libusb_sync_stats *stats,
+	struct libusb_device_handle *dev_handle);
 
 struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
 	unsigned long session_id);
@@ -803,12 +1199,18 @@ struct usbi_event_source {
 		usbi_os_handle_t os_handle;
 		short poll_events;
 	} data;
+	void *user_data;
 	struct list_head list;
+
+	/* The event thread handling the event source, or NULL */
+	struct usbi_event_worker *worker;
 };
 
 int usbi_add_event_source(struct libusb_context *ctx, usbi_os_handle_t os_handle,
-	short poll_events);
+	short poll_events, void *user_data);
 void usbi_remove_event_source(struct libusb_context *ctx, usbi_os_handle_t os_handle);
+int usbi_event_source_registered(struct libusb_context *ctx,
+	usbi_os_handle_t os_handle, void *user_data);
 
 struct usbi_option {
   int is_set;
@@ -832,6 +1234,15 @@ int usbi_arm_timer(usbi_timer_t *timer, const struct timespec *timeout);
 int usbi_disarm_timer(usbi_timer_t *timer);
 #endif
 
+#ifdef HAVE_OS_EVENT_SET
+int usbi_create_event_set(usbi_event_set_t *event_set);
+void usbi_destroy_event_set(usbi_event_set_t *event_set);
+int usbi_event_set_add(usbi_event_set_t *event_set,
+	struct usbi_event_source *ievent_source);
+void usbi_event_set_remove(usbi_event_set_t *event_set,
+	struct usbi_event_source *ievent_source);
+#endif
+
 static inline int usbi_using_timer(struct libusb_context *ctx)
 {
 #ifdef HAVE_OS_TIMER
@@ -842,6 +1253,31 @@ static inline int usbi_using_timer(struct libusb_context *ctx)
 #endif
 }
 
+#define USBI_DEFAULT_REAP_BUDGET	26
+#define USBI_DEFAULT_SYNC_CACHE_SIZE	4
+#define USBI_MAX_CALLBACK_THREADS	64
+#define USBI_MAX_EVENT_THREADS		64
+
+/* Backends call this once per event handling pass to record how many URBs
+ * were reaped, and whether any device still had completed URBs left when its
+ * reap budget ran out. Event threads may call it concurrently. */
+static inline void usbi_account_reaped(struct libusb_context *ctx,
+	unsigned int urbs, int budget_exhausted)
+{
+	long value;
+
+	(void)usbi_atomic_inc(&ctx->reap_wakeups);
+	do {
+		value = usbi_atomic_load(&ctx->reap_urbs);
+	} while (!usbi_atomic_cas(&ctx->reap_urbs, value, value + (long)urbs));
+	do {
+		value = usbi_atomic_load(&ctx->reap_max_urbs);
+	} while ((long)urbs > value &&
+		 !usbi_atomic_cas(&ctx->reap_max_urbs, value, (long)urbs));
+	if (budget_exhausted)
+		(void)usbi_atomic_inc(&ctx->reap_budget_exhausted);
+}
+
 struct usbi_reported_events {
 	union {
 		struct {
@@ -853,6 +1289,7 @@ struct usbi_reported_events {
 		unsigned int event_bits;
 	};
 	void *event_data;
+	void **event_user_data;
 	unsigned int event_data_count;
 	unsigned int num_ready;
 };
@@ -861,6 +1298,48 @@ int usbi_alloc_event_data(struct libusb_context *ctx);
 int usbi_wait_for_events(struct libusb_context *ctx,
 	struct usbi_reported_events *reported_events, int timeout_ms);
 
+#ifdef HAVE_OS_EVENT_SET
+#define USBI_EVENT_WORKER_MAX_READY	64
+
+/* A thread that handles the events of some of the open devices, see
+ * LIBUSB_OPTION_EVENT_THREADS */
+struct usbi_event_worker {
+	struct libusb_context *ctx;
+	usbi_thread_t thread;
+
+	/* The event sources of the thread's devices and its own event, which
+	 * interrupts the thread when it is to be paused */
+	usbi_event_set_t event_set;
+	usbi_event_t event;
+	struct usbi_event_source event_source;
+
+	/* Held by the thread while it waits for and handles events, and taken
+	 * from it by threads that pause it, see usbi_pause_event_workers() */
+	usbi_mutex_t lock;
+	usbi_cond_t cond;
+
+	/* Number of threads pausing the thread */
+	usbi_atomic_t pause_requests;
+
+	/* Set to make the thread exit. Protected by lock. */
+	int stop;
+
+	/* The device event sources handled by the thread, and their number.
+	 * Protected by the context's event_data_lock. */
+	struct list_head event_sources;
+	unsigned int num_event_sources;
+
+	/* Set when a transfer callback ran during the current event handling
+	 * pass. Only accessed by the thread. */
+	int callbacks_run;
+
+	struct pollfd fds[USBI_EVENT_WORKER_MAX_READY];
+	void *user_data[USBI_EVENT_WORKER_MAX_READY];
+};
+
+int usbi_wait_for_worker_events(struct usbi_event_worker *worker);
+#endif
+
 /* accessor functions for structure private data */
 
 static inline void *usbi_get_context_priv(struct libusb_context *ctx)
@@ -1337,7 +1816,8 @@ struct usbi_os_backend {
 	 *
 	 * This function must not block.
 	 *
-	 * This function gets called with the flying_transfers_lock locked!
+	 * This function gets called with the device handle's
+	 * flying_transfers_lock locked!
 	 *
 	 * Return:
 	 * - 0 on success
@@ -1346,6 +1826,65 @@ struct usbi_os_backend {
 	 */
 	int (*submit_transfer)(struct usbi_transfer *itransfer);
 
+	/* Submit several transfers at once. Optional.
+	 *
+	 * Provide this function if your platform can submit a group of
+	 * transfers more cheaply than one at a time. Otherwise
+	 * libusb_submit_transfers() calls submit_transfer for each transfer.
+	 * All transfers belong to the same device handle.
+	 *
+	 * This function must not block.
+	 *
+	 * This function gets called with the lock of every transfer held.
+	 * It must store the result of each transfer, as described for
+	 * submit_transfer, in the results array.
+	 */
+	void (*submit_transfers)(struct usbi_transfer **itransfers, int count,
+		int *results);
+
+	/* Perform a bulk or interrupt transfer synchronously. Optional.
+	 *
+	 * Provide this function if your platform can perform a blocking bulk
+	 * or interrupt transfer directly, more cheaply than through
+	 * submit_transfer and event handling. It is called by
+	 * libusb_bulk_transfer() and libusb_interrupt_transfer() from the
+	 * calling thread, and may block for up to timeout milliseconds.
+	 *
+	 * Return:
+	 * - 0 on success, with the number of bytes transferred stored in
+	 *   transferred
+	 * - LIBUSB_ERROR_NOT_SUPPORTED if the transfer must go through
+	 *   submit_transfer instead. Nothing has been transferred in this case.
+	 * - LIBUSB_ERROR_TIMEOUT if the transfer timed out
+	 * - LIBUSB_ERROR_PIPE if the endpoint halted
+	 * - LIBUSB_ERROR_OVERFLOW if the device offered more data
+	 * - LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*sync_bulk_transfer)(struct libusb_device_handle *dev_handle,
+		unsigned char endpoint, unsigned char *data, int length,
+		int *transferred, unsigned int timeout);
+
+	/* Perform a control transfer synchronously. Optional.
+	 *
+	 * Like sync_bulk_transfer, for libusb_control_transfer(). The data
+	 * buffer is the caller's, without room for the setup packet, and the
+	 * setup fields are given in host-endian byte order.
+	 *
+	 * Return:
+	 * - the number of bytes transferred on success
+	 * - LIBUSB_ERROR_NOT_SUPPORTED if the transfer must go through
+	 *   submit_transfer instead. Nothing has been transferred in this case.
+	 * - LIBUSB_ERROR_TIMEOUT if the transfer timed out
+	 * - LIBUSB_ERROR_PIPE if the control request was not supported
+	 * - LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*sync_control_transfer)(struct libusb_device_handle *dev_handle,
+		uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+		uint16_t wIndex, unsigned char *data, uint16_t wLength,
+		unsigned int timeout);
+
 	/* Cancel a previously submitted transfer.
 	 *
 	 * This function must not block. The transfer cancellation must complete
@@ -1366,6 +1905,14 @@ struct usbi_os_backend {
 	 */
 	void (*clear_transfer_priv)(struct usbi_transfer *itransfer);
 
+	/* Release any resources the backend retained in the transfer's
+	 * private data across submissions. Optional.
+	 *
+	 * This function is called from libusb_free_transfer(). The transfer
+	 * is not in flight at this point.
+	 */
+	void (*free_transfer_priv)(struct usbi_transfer *itransfer);
+
 	/* Handle any pending events on event sources. Optional.
 	 *
 	 * Provide this function when event sources directly indicate device
@@ -1378,6 +1925,9 @@ struct usbi_os_backend {
 	 * The function is passed a pointer that represents platform-specific
 	 * data for monitoring event sources (size count). This data is to be
 	 * (re)allocated as necessary when event sources are modified.
+	 * event_user_data holds, for each element of that data, the user_data
+	 * pointer the event source was registered with in
+	 * usbi_add_event_source().
 	 * The num_ready parameter indicates the number of event sources that
 	 * have reported events. This should be enough information for you to
 	 * determine which actions need to be taken on the currently active
@@ -1400,7 +1950,8 @@ struct usbi_os_backend {
 	 * Return 0 on success, or a LIBUSB_ERROR code on failure.
 	 */
 	int (*handle_events)(struct libusb_context *ctx,
-		void *event_data, unsigned int count, unsigned int num_ready);
+		void *event_data, void **event_user_data, unsigned int count,
+		unsigned int num_ready);
 
 	/* Handle transfer completion. Optional.
 	 *
@@ -1469,14 +2020,14 @@ extern const struct usbi_os_backend usbi_backend;
 #define __for_each_transfer(list, t) \
 	for_each_helper(t, (list), struct usbi_transfer)
 
-#define for_each_transfer(ctx, t) \
-	__for_each_transfer(&(ctx)->flying_transfers, t)
+#define for_each_transfer(dev_handle, t) \
+	__for_each_transfer(&(dev_handle)->flying_transfers, t)
 
 #define __for_each_transfer_safe(list, t, n) \
 	for_each_safe_helper(t, n, (list), struct usbi_transfer)
 
-#define for_each_transfer_safe(ctx, t, n) \
-	__for_each_transfer_safe(&(ctx)->flying_transfers, t, n)
+#define for_each_transfer_safe(dev_handle, t, n) \
+	__for_each_transfer_safe(&(dev_handle)->flying_transfers, t, n)
 
 #define __for_each_completed_transfer_safe(list, t, n) \
 	list_for_each_entry_safe(t, n, (list), completed_list, struct usbi_transfer)
@@ -22,6 +22,10 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#ifdef HAVE_EPOLL
+#include <string.h>
+#include <sys/epoll.h>
+#endif
 #ifdef HAVE_EVENTFD
 #include <sys/eventfd.h>
 #endif
@@ -219,16 +223,236 @@ int usbi_disarm_timer(usbi_timer_t *timer)
 }
 #endif
 
+#ifdef HAVE_OS_EVENT_SET
+int usbi_create_event_set(usbi_event_set_t *event_set)
+{
+	event_set->epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (event_set->epollfd == -1) {
+		usbi_err(NULL, "failed to create epoll instance, errno=%d", errno);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	return 0;
+}
+
+void usbi_destroy_event_set(usbi_event_set_t *event_set)
+{
+	if (close(event_set->epollfd) == -1)
+		usbi_warn(NULL, "failed to close epoll instance, errno=%d", errno);
+}
+
+/* the POLL* and EPOLL* event bits have the same values on Linux, so
+ * poll_events and revents are passed through unchanged */
+int usbi_event_set_add(usbi_event_set_t *event_set,
+	struct usbi_event_source *ievent_source)
+{
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(event));
+	event.events = (uint32_t)ievent_source->data.poll_events;
+	event.data.ptr = ievent_source;
+	if (epoll_ctl(event_set->epollfd, EPOLL_CTL_ADD,
+		      ievent_source->data.os_handle, &event) == -1) {
+		usbi_err(NULL, "failed to add fd %d to epoll instance, errno=%d",
+			 ievent_source->data.os_handle, errno);
+		return errno == ENOMEM ? LIBUSB_ERROR_NO_MEM : LIBUSB_ERROR_OTHER;
+	}
+
+	return 0;
+}
+
+void usbi_event_set_remove(usbi_event_set_t *event_set,
+	struct usbi_event_source *ievent_source)
+{
+	if (epoll_ctl(event_set->epollfd, EPOLL_CTL_DEL,
+		      ievent_source->data.os_handle, NULL) == -1)
+		usbi_warn(NULL, "failed to remove fd %d from epoll instance, errno=%d",
+			  ievent_source->data.os_handle, errno);
+}
+
+/* The event data is a single allocation holding an array of struct pollfd
+ * followed by an array of struct epoll_event, each with one element per event
+ * source. epoll_wait() fills the latter, and the ready event sources are
+ * compacted into the former for the backend. */
+int usbi_alloc_event_data(struct libusb_context *ctx)
+{
+	struct usbi_event_source *ievent_source;
+	struct pollfd *fds;
+	void **user_data;
+
+	if (ctx->event_data) {
+		free(ctx->event_data);
+		ctx->event_data = NULL;
+	}
+	if (ctx->event_user_data) {
+		free(ctx->event_user_data);
+		ctx->event_user_data = NULL;
+	}
+
+	ctx->event_data_cnt = 0;
+	for_each_event_source(ctx, ievent_source)
+		ctx->event_data_cnt++;
+
+	fds = calloc(ctx->event_data_cnt, sizeof(*fds) + sizeof(struct epoll_event));
+	if (!fds)
+		return LIBUSB_ERROR_NO_MEM;
+
+	user_data = calloc(ctx->event_data_cnt, sizeof(*user_data));
+	if (!user_data) {
+		free(fds);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	ctx->event_data = fds;
+	ctx->event_user_data = user_data;
+	return 0;
+}
+
+int usbi_wait_for_events(struct libusb_context *ctx,
+	struct usbi_reported_events *reported_events, int timeout_ms)
+{
+	struct pollfd *fds = ctx->event_data;
+	struct epoll_event *events = (struct epoll_event *)(fds + ctx->event_data_cnt);
+	void **user_data = ctx->event_user_data;
+	int num_events, num_ready = 0, n;
+	unsigned int count = 0;
+
+	usbi_dbg(ctx, "epoll_wait() %u fds with timeout in %dms", ctx->event_data_cnt, timeout_ms);
+	num_events = epoll_wait(ctx->event_set.epollfd, events, (int)ctx->event_data_cnt, timeout_ms);
+	usbi_dbg(ctx, "epoll_wait() returned %d", num_events);
+	if (num_events == 0) {
+		if (usbi_using_timer(ctx))
+			goto done;
+		return LIBUSB_ERROR_TIMEOUT;
+	} else if (num_events == -1) {
+		if (errno == EINTR)
+			return LIBUSB_ERROR_INTERRUPTED;
+		usbi_err(ctx, "epoll_wait() failed, errno=%d", errno);
+		return LIBUSB_ERROR_IO;
+	}
+
+	reported_events->event_triggered = 0;
+#ifdef HAVE_OS_TIMER
+	reported_events->timer_triggered = 0;
+#endif
+
+	/* sort out the library's internal event sources and hand only the
+	 * remaining ready ones to the backend. until it is translated below,
+	 * user_data holds the event source itself. */
+	for (n = 0; n < num_events; n++) {
+		struct usbi_event_source *ievent_source = events[n].data.ptr;
+		int fd = ievent_source->data.os_handle;
+
+		if (fd == USBI_EVENT_OS_HANDLE(&ctx->event)) {
+			reported_events->event_triggered = 1;
+			continue;
+		}
+#ifdef HAVE_OS_TIMER
+		if (usbi_using_timer(ctx) && fd == USBI_TIMER_OS_HANDLE(&ctx->timer)) {
+			reported_events->timer_triggered = 1;
+			continue;
+		}
+#endif
+
+		fds[count].fd = fd;
+		fds[count].events = ievent_source->data.poll_events;
+		fds[count].revents = (short)events[n].events;
+		user_data[count] = ievent_source;
+		count++;
+	}
+
+	if (!count)
+		goto done;
+
+	num_ready = (int)count;
+
+	usbi_mutex_lock(&ctx->event_data_lock);
+	if (ctx->event_flags & USBI_EVENT_EVENT_SOURCES_MODIFIED) {
+		struct usbi_event_source *ievent_source;
+
+		for_each_removed_event_source(ctx, ievent_source) {
+			unsigned int i;
+
+			for (i = 0; i < count; i++) {
+				if (user_data[i] != ievent_source || !fds[i].revents)
+					continue;
+				/* event source was removed after epoll_wait() picked up
+				 * its events. remove triggered revent as it is no longer
+				 * relevant. */
+				usbi_dbg(ctx, "fd %d was removed, ignoring raised events", fds[i].fd);
+				fds[i].revents = 0;
+				num_ready--;
+				break;
+			}
+		}
+	}
+	usbi_mutex_unlock(&ctx->event_data_lock);
+
+	for (n = 0; n < (int)count; n++)
+		user_data[n] = ((struct usbi_event_source *)user_data[n])->user_data;
+
+	if (num_ready) {
+		reported_events->event_data = fds;
+		reported_events->event_user_data = user_data;
+		reported_events->event_data_count = count;
+	}
+
+done:
+	reported_events->num_ready = num_ready;
+	return LIBUSB_SUCCESS;
+}
+
+/* Waits for the event sources of an event thread and stores the ready device
+ * event sources in its fds and user_data arrays. Returns their number, or a
+ * LIBUSB_ERROR code. Event sources are only removed while the thread is
+ * paused or by the thread itself, so none can be removed meanwhile. */
+int usbi_wait_for_worker_events(struct usbi_event_worker *worker)
+{
+	struct epoll_event events[USBI_EVENT_WORKER_MAX_READY];
+	int num_events, count = 0, n;
+
+	num_events = epoll_wait(worker->event_set.epollfd, events,
+				USBI_EVENT_WORKER_MAX_READY, -1);
+	if (num_events == -1) {
+		if (errno == EINTR)
+			return LIBUSB_ERROR_INTERRUPTED;
+		usbi_err(worker->ctx, "epoll_wait() failed, errno=%d", errno);
+		return LIBUSB_ERROR_IO;
+	}
+
+	for (n = 0; n < num_events; n++) {
+		struct usbi_event_source *ievent_source = events[n].data.ptr;
+
+		if (ievent_source == &worker->event_source) {
+			usbi_clear_event(&worker->event);
+			continue;
+		}
+
+		worker->fds[count].fd = ievent_source->data.os_handle;
+		worker->fds[count].events = ievent_source->data.poll_events;
+		worker->fds[count].revents = (short)events[n].events;
+		worker->user_data[count] = ievent_source->user_data;
+		count++;
+	}
+
+	return count;
+}
+#else
 int usbi_alloc_event_data(struct libusb_context *ctx)
 {
 	struct usbi_event_source *ievent_source;
 	struct pollfd *fds;
+	void **user_data;
 	size_t i = 0;
 
 	if (ctx->event_data) {
 		free(ctx->event_data);
 		ctx->event_data = NULL;
 	}
+	if (ctx->event_user_data) {
+		free(ctx->event_user_data);
+		ctx->event_user_data = NULL;
+	}
 
 	ctx->event_data_cnt = 0;
 	for_each_event_source(ctx, ievent_source)
@@ -238,13 +462,21 @@ int usbi_alloc_event_data(struct libusb_context *ctx)
 	if (!fds)
 		return LIBUSB_ERROR_NO_MEM;
 
+	user_data = calloc(ctx->event_data_cnt, sizeof(*user_data));
+	if (!user_data) {
+		free(fds);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
 	for_each_event_source(ctx, ievent_source) {
 		fds[i].fd = ievent_source->data.os_handle;
 		fds[i].events = ievent_source->data.poll_events;
+		user_data[i] = ievent_source->user_data;
 		i++;
 	}
 
 	ctx->event_data = fds;
+	ctx->event_user_data = user_data;
 	return 0;
 }
 
@@ -340,6 +572,7 @@ int usbi_wait_for_events(struct libusb_context *ctx,
 	if (num_ready) {
 		assert(num_ready > 0);
 		reported_events->event_data = fds;
+		reported_events->event_user_data = ctx->event_user_data + internal_fds;
 		reported_events->event_data_count = (unsigned int)nfds;
 	}
 
@@ -347,3 +580,4 @@ done:
 	reported_events->num_ready = num_ready;
 	return LIBUSB_SUCCESS;
 }
+#endif
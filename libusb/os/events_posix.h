@@ -56,4 +56,11 @@ static inline int usbi_timer_valid(usbi_timer_t *timer)
 }
 #endif
 
+#ifdef HAVE_EPOLL
+#define HAVE_OS_EVENT_SET 1
+typedef struct usbi_event_set {
+	int epollfd;
+} usbi_event_set_t;
+#endif
+
 #endif
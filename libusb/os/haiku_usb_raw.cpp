@@ -218,8 +218,12 @@ const struct usbi_os_backend usbi_backend = {
 	/*.destroy_device =*/ NULL,
 
 	/*.submit_transfer =*/ haiku_submit_transfer,
+	/*.submit_transfers =*/ NULL,
+	/*.sync_bulk_transfer =*/ NULL,
+	/*.sync_control_transfer =*/ NULL,
 	/*.cancel_transfer =*/ haiku_cancel_transfer,
 	/*.clear_transfer_priv =*/ NULL,
+	/*.free_transfer_priv =*/ NULL,
 
 	/*.handle_events =*/ NULL,
 	/*.handle_transfer_completion =*/ haiku_handle_transfer_completion,
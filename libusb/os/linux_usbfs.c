@@ -152,10 +152,26 @@ enum reap_action {
 	ERROR,
 };
 
+/* what the URBs of a bulk or interrupt transfer are built from */
+struct bulk_urb_layout {
+	unsigned char *buffer;
+	int length;
+	int bulk_buffer_len;
+	int use_bulk_continuation;
+	unsigned char endpoint;
+	unsigned char type;
+	unsigned char zero_packet;
+};
+
+/* iso URBs are placed on cache line boundaries */
+#define ISO_URB_ALIGN	64
+
 struct linux_transfer_priv {
 	union {
 		struct usbfs_urb *urbs;
-		struct usbfs_urb **iso_urbs;
+		/* the iso URBs of the current submission, at iso_urb_stride
+		 * bytes from each other */
+		unsigned char *iso_urbs;
 	};
 
 	enum reap_action reap_action;
@@ -163,8 +179,18 @@ struct linux_transfer_priv {
 	int num_retired;
 	enum libusb_transfer_status reap_status;
 
-	/* next iso packet in user-supplied transfer to be populated */
-	int iso_packet_offset;
+	/* URB storage kept from the previous submission, reused when the
+	 * transfer is resubmitted with the same layout */
+	struct usbfs_urb *urb_cache;
+	int urb_cache_count;
+	/* set if the cached URBs are fully built for urb_cache_layout */
+	int urb_cache_built;
+	struct bulk_urb_layout urb_cache_layout;
+	/* storage for the iso URBs, kept across submissions and grown when
+	 * a submission needs more */
+	unsigned char *iso_urb_mem;
+	size_t iso_urb_mem_size;
+	size_t iso_urb_stride;
 };
 
 static int dev_has_config0(struct libusb_device *dev)
@@ -1339,7 +1365,7 @@ static int initialize_handle(struct libusb_device_handle *handle, int fd)
 		hpriv->caps = USBFS_CAP_BULK_CONTINUATION;
 	}
 
-	return usbi_add_event_source(HANDLE_CTX(handle), hpriv->fd, POLLOUT);
+	return usbi_add_event_source(HANDLE_CTX(handle), hpriv->fd, POLLOUT, handle);
 }
 
 static int op_wrap_sys_device(struct libusb_context *ctx,
@@ -1852,6 +1878,11 @@ static void op_destroy_device(struct libusb_device *dev)
 	free(priv->sysfs_dir);
 }
 
+static struct usbfs_urb *get_iso_urb(struct linux_transfer_priv *tpriv, int idx)
+{
+	return (struct usbfs_urb *)(tpriv->iso_urbs + (size_t)idx * tpriv->iso_urb_stride);
+}
+
 /* URBs are discarded in reverse order of submission to avoid races. */
 static int discard_urbs(struct usbi_transfer *itransfer, int first, int last_plus_one)
 {
@@ -1865,7 +1896,7 @@ static int discard_urbs(struct usbi_transfer *itransfer, int first, int last_plu
 
 	for (i = last_plus_one - 1; i >= first; i--) {
 		if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
-			urb = tpriv->iso_urbs[i];
+			urb = get_iso_urb(tpriv, i);
 		else
 			urb = &tpriv->urbs[i];
 
@@ -1887,22 +1918,101 @@ static int discard_urbs(struct usbi_transfer *itransfer, int first, int last_plu
 	return ret;
 }
 
-static void free_iso_urbs(struct linux_transfer_priv *tpriv)
+static int iso_urbs_for_packets(int num_packets)
+{
+	return (num_packets + (MAX_ISO_PACKETS_PER_URB - 1)) / MAX_ISO_PACKETS_PER_URB;
+}
+
+/* Returns a zeroed array of num_urbs URBs, taken from the cache when the
+ * previous submission used the same number of URBs. */
+static struct usbfs_urb *get_urbs(struct linux_transfer_priv *tpriv, int num_urbs)
+{
+	struct usbfs_urb *urbs = tpriv->urb_cache;
+
+	tpriv->urb_cache = NULL;
+	tpriv->urb_cache_built = 0;
+	if (urbs && tpriv->urb_cache_count == num_urbs) {
+		memset(urbs, 0, num_urbs * sizeof(*urbs));
+		return urbs;
+	}
+
+	free(urbs);
+	return calloc((size_t)num_urbs, sizeof(*urbs));
+}
+
+/* Returns the cached URBs unchanged if they were built for layout, so that
+ * they can be submitted again as they are, or NULL otherwise. */
+static struct usbfs_urb *get_built_urbs(struct linux_transfer_priv *tpriv,
+	const struct bulk_urb_layout *layout, int num_urbs)
 {
+	struct usbfs_urb *urbs = tpriv->urb_cache;
 	int i;
 
-	for (i = 0; i < tpriv->num_urbs; i++) {
-		struct usbfs_urb *urb = tpriv->iso_urbs[i];
+	if (!urbs || !tpriv->urb_cache_built || tpriv->urb_cache_count != num_urbs ||
+	    memcmp(&tpriv->urb_cache_layout, layout, sizeof(*layout)))
+		return NULL;
 
-		if (!urb)
-			break;
-		free(urb);
+	/* only clear what the kernel reported back */
+	for (i = 0; i < num_urbs; i++) {
+		urbs[i].status = 0;
+		urbs[i].actual_length = 0;
+		urbs[i].error_count = 0;
+	}
+
+	tpriv->urb_cache = NULL;
+	return urbs;
+}
+
+/* Retires the URBs of a finished bulk/interrupt/control submission into the
+ * cache. */
+static void put_urbs(struct linux_transfer_priv *tpriv)
+{
+	free(tpriv->urb_cache);
+	tpriv->urb_cache = tpriv->urbs;
+	tpriv->urb_cache_count = tpriv->num_urbs;
+	tpriv->urbs = NULL;
+}
+
+/* Returns zeroed storage for num_urbs iso URBs of stride bytes each, taken
+ * from the storage of the previous submission when it is large enough. */
+static unsigned char *get_iso_urbs(struct linux_transfer_priv *tpriv, int num_urbs,
+	size_t stride)
+{
+	size_t size = (size_t)num_urbs * stride;
+	unsigned char *urbs;
+
+	if (tpriv->iso_urb_mem_size < size) {
+		free(tpriv->iso_urb_mem);
+		tpriv->iso_urb_mem_size = 0;
+		tpriv->iso_urb_mem = malloc(size + ISO_URB_ALIGN - 1);
+		if (!tpriv->iso_urb_mem)
+			return NULL;
+		tpriv->iso_urb_mem_size = size;
 	}
 
-	free(tpriv->iso_urbs);
+	urbs = (unsigned char *)(((uintptr_t)tpriv->iso_urb_mem + ISO_URB_ALIGN - 1) &
+		~(uintptr_t)(ISO_URB_ALIGN - 1));
+	memset(urbs, 0, size);
+	tpriv->iso_urb_stride = stride;
+	return urbs;
+}
+
+/* Retires the iso URBs of a finished submission. Their storage is kept. */
+static void put_iso_urbs(struct linux_transfer_priv *tpriv)
+{
 	tpriv->iso_urbs = NULL;
 }
 
+static void free_urb_cache(struct linux_transfer_priv *tpriv)
+{
+	free(tpriv->urb_cache);
+	tpriv->urb_cache = NULL;
+	tpriv->urb_cache_built = 0;
+	free(tpriv->iso_urb_mem);
+	tpriv->iso_urb_mem = NULL;
+	tpriv->iso_urb_mem_size = 0;
+}
+
 static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer =
@@ -1911,6 +2021,7 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 	struct linux_device_handle_priv *hpriv =
 		usbi_get_device_handle_priv(transfer->dev_handle);
 	struct usbfs_urb *urbs;
+	struct bulk_urb_layout layout;
 	int is_out = IS_XFEROUT(transfer);
 	int bulk_buffer_len, use_bulk_continuation;
 	int num_urbs;
@@ -1969,9 +2080,69 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 		num_urbs++;
 	}
 	usbi_dbg(TRANSFER_CTX(transfer), "need %d urbs for new transfer with length %d", num_urbs, transfer->length);
-	urbs = calloc(num_urbs, sizeof(*urbs));
-	if (!urbs)
-		return LIBUSB_ERROR_NO_MEM;
+
+	memset(&layout, 0, sizeof(layout));
+	layout.buffer = transfer->buffer;
+	layout.length = transfer->length;
+	layout.bulk_buffer_len = bulk_buffer_len;
+	layout.use_bulk_continuation = use_bulk_continuation;
+	layout.endpoint = transfer->endpoint;
+	layout.type = transfer->type;
+	layout.zero_packet = !!(transfer->flags & LIBUSB_TRANSFER_ADD_ZERO_PACKET);
+
+	/* a transfer resubmitted unchanged reuses the URBs built last time */
+	urbs = get_built_urbs(tpriv, &layout, num_urbs);
+	if (!urbs) {
+		urbs = get_urbs(tpriv, num_urbs);
+		if (!urbs)
+			return LIBUSB_ERROR_NO_MEM;
+
+		for (i = 0; i < num_urbs; i++) {
+			struct usbfs_urb *urb = &urbs[i];
+
+			urb->usercontext = itransfer;
+			switch (transfer->type) {
+			case LIBUSB_TRANSFER_TYPE_BULK:
+				urb->type = USBFS_URB_TYPE_BULK;
+				urb->stream_id = 0;
+				break;
+			case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
+				urb->type = USBFS_URB_TYPE_BULK;
+				urb->stream_id = itransfer->stream_id;
+				break;
+			case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+				urb->type = USBFS_URB_TYPE_INTERRUPT;
+				break;
+			}
+			urb->endpoint = transfer->endpoint;
+			urb->buffer = transfer->buffer + (i * bulk_buffer_len);
+
+			/* don't set the short not ok flag for the last URB */
+			if (use_bulk_continuation && !is_out && (i < num_urbs - 1))
+				urb->flags = USBFS_URB_SHORT_NOT_OK;
+
+			if (i == num_urbs - 1 && last_urb_partial)
+				urb->buffer_length = transfer->length % bulk_buffer_len;
+			else if (transfer->length == 0)
+				urb->buffer_length = 0;
+			else
+				urb->buffer_length = bulk_buffer_len;
+
+			if (i > 0 && use_bulk_continuation)
+				urb->flags |= USBFS_URB_BULK_CONTINUATION;
+
+			/* we have already checked that the flag is supported */
+			if (is_out && i == num_urbs - 1 &&
+			    (transfer->flags & LIBUSB_TRANSFER_ADD_ZERO_PACKET))
+				urb->flags |= USBFS_URB_ZERO_PACKET;
+		}
+
+		/* the stream ID is not part of the layout */
+		if (transfer->type != LIBUSB_TRANSFER_TYPE_BULK_STREAM) {
+			tpriv->urb_cache_built = 1;
+			tpriv->urb_cache_layout = layout;
+		}
+	}
 	tpriv->urbs = urbs;
 	tpriv->num_urbs = num_urbs;
 	tpriv->num_retired = 0;
@@ -1981,42 +2152,6 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 	for (i = 0; i < num_urbs; i++) {
 		struct usbfs_urb *urb = &urbs[i];
 
-		urb->usercontext = itransfer;
-		switch (transfer->type) {
-		case LIBUSB_TRANSFER_TYPE_BULK:
-			urb->type = USBFS_URB_TYPE_BULK;
-			urb->stream_id = 0;
-			break;
-		case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
-			urb->type = USBFS_URB_TYPE_BULK;
-			urb->stream_id = itransfer->stream_id;
-			break;
-		case LIBUSB_TRANSFER_TYPE_INTERRUPT:
-			urb->type = USBFS_URB_TYPE_INTERRUPT;
-			break;
-		}
-		urb->endpoint = transfer->endpoint;
-		urb->buffer = transfer->buffer + (i * bulk_buffer_len);
-
-		/* don't set the short not ok flag for the last URB */
-		if (use_bulk_continuation && !is_out && (i < num_urbs - 1))
-			urb->flags = USBFS_URB_SHORT_NOT_OK;
-
-		if (i == num_urbs - 1 && last_urb_partial)
-			urb->buffer_length = transfer->length % bulk_buffer_len;
-		else if (transfer->length == 0)
-			urb->buffer_length = 0;
-		else
-			urb->buffer_length = bulk_buffer_len;
-
-		if (i > 0 && use_bulk_continuation)
-			urb->flags |= USBFS_URB_BULK_CONTINUATION;
-
-		/* we have already checked that the flag is supported */
-		if (is_out && i == num_urbs - 1 &&
-		    (transfer->flags & LIBUSB_TRANSFER_ADD_ZERO_PACKET))
-			urb->flags |= USBFS_URB_ZERO_PACKET;
-
 		r = ioctl(hpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
 		if (r == 0)
 			continue;
@@ -2034,8 +2169,7 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 		 * return failure immediately. */
 		if (i == 0) {
 			usbi_dbg(TRANSFER_CTX(transfer), "first URB failed, easy peasy");
-			free(urbs);
-			tpriv->urbs = NULL;
+			put_urbs(tpriv);
 			return r;
 		}
 
@@ -2082,7 +2216,8 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 	struct linux_transfer_priv *tpriv = usbi_get_transfer_priv(itransfer);
 	struct linux_device_handle_priv *hpriv =
 		usbi_get_device_handle_priv(transfer->dev_handle);
-	struct usbfs_urb **urbs;
+	unsigned char *urbs;
+	size_t stride;
 	int num_packets = transfer->num_iso_packets;
 	int num_packets_remaining;
 	int i, j;
@@ -2116,11 +2251,15 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 		return LIBUSB_ERROR_INVALID_PARAM;
 
 	/* usbfs limits the number of iso packets per URB */
-	num_urbs = (num_packets + (MAX_ISO_PACKETS_PER_URB - 1)) / MAX_ISO_PACKETS_PER_URB;
+	num_urbs = iso_urbs_for_packets(num_packets);
 
 	usbi_dbg(TRANSFER_CTX(transfer), "need %d urbs for new transfer with length %d", num_urbs, transfer->length);
 
-	urbs = calloc(num_urbs, sizeof(*urbs));
+	/* all URBs share one allocation, at a stride that fits the largest */
+	stride = sizeof(struct usbfs_urb) +
+		MIN(num_packets, MAX_ISO_PACKETS_PER_URB) * sizeof(struct usbfs_iso_packet_desc);
+	stride = (stride + ISO_URB_ALIGN - 1) & ~(size_t)(ISO_URB_ALIGN - 1);
+	urbs = get_iso_urbs(tpriv, num_urbs, stride);
 	if (!urbs)
 		return LIBUSB_ERROR_NO_MEM;
 
@@ -2128,25 +2267,14 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 	tpriv->num_urbs = num_urbs;
 	tpriv->num_retired = 0;
 	tpriv->reap_action = NORMAL;
-	tpriv->iso_packet_offset = 0;
 
-	/* allocate + initialize each URB with the correct number of packets */
+	/* initialize each URB with the correct number of packets */
 	num_packets_remaining = num_packets;
 	for (i = 0, j = 0; i < num_urbs; i++) {
 		int num_packets_in_urb = MIN(num_packets_remaining, MAX_ISO_PACKETS_PER_URB);
-		struct usbfs_urb *urb;
-		size_t alloc_size;
+		struct usbfs_urb *urb = get_iso_urb(tpriv, i);
 		int k;
 
-		alloc_size = sizeof(*urb)
-			+ (num_packets_in_urb * sizeof(struct usbfs_iso_packet_desc));
-		urb = calloc(1, alloc_size);
-		if (!urb) {
-			free_iso_urbs(tpriv);
-			return LIBUSB_ERROR_NO_MEM;
-		}
-		urbs[i] = urb;
-
 		/* populate packet lengths */
 		for (k = 0; k < num_packets_in_urb; j++, k++) {
 			packet_len = transfer->iso_packet_desc[j].length;
@@ -2168,7 +2296,7 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 
 	/* submit URBs */
 	for (i = 0; i < num_urbs; i++) {
-		int r = ioctl(hpriv->fd, IOCTL_USBFS_SUBMITURB, urbs[i]);
+		int r = ioctl(hpriv->fd, IOCTL_USBFS_SUBMITURB, get_iso_urb(tpriv, i));
 
 		if (r == 0)
 			continue;
@@ -2190,7 +2318,7 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 		 * return failure immediately. */
 		if (i == 0) {
 			usbi_dbg(TRANSFER_CTX(transfer), "first URB failed, easy peasy");
-			free_iso_urbs(tpriv);
+			put_iso_urbs(tpriv);
 			return r;
 		}
 
@@ -2235,7 +2363,7 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 	if (transfer->length - LIBUSB_CONTROL_SETUP_SIZE > MAX_CTRL_BUFFER_LENGTH)
 		return LIBUSB_ERROR_INVALID_PARAM;
 
-	urb = calloc(1, sizeof(*urb));
+	urb = get_urbs(tpriv, 1);
 	if (!urb)
 		return LIBUSB_ERROR_NO_MEM;
 	tpriv->urbs = urb;
@@ -2250,8 +2378,7 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 
 	r = ioctl(hpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
 	if (r < 0) {
-		free(urb);
-		tpriv->urbs = NULL;
+		put_urbs(tpriv);
 		if (errno == ENODEV)
 			return LIBUSB_ERROR_NO_DEVICE;
 
@@ -2282,6 +2409,85 @@ static int op_submit_transfer(struct usbi_transfer *itransfer)
 	}
 }
 
+/* translates the errno of a failed synchronous transfer ioctl */
+static int sync_transfer_error(struct libusb_device_handle *handle, const char *what)
+{
+	/* only logged */
+	UNUSED(what);
+
+	switch (errno) {
+	case ETIMEDOUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case EPIPE:
+		return LIBUSB_ERROR_PIPE;
+	case EOVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case ENODEV:
+	case ESHUTDOWN:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case ENOMEM:
+		return LIBUSB_ERROR_NO_MEM;
+	default:
+		usbi_dbg(HANDLE_CTX(handle), "%s ioctl failed, errno=%d", what, errno);
+		return LIBUSB_ERROR_IO;
+	}
+}
+
+static int op_sync_bulk_transfer(struct libusb_device_handle *handle,
+	unsigned char endpoint, unsigned char *data, int length,
+	int *transferred, unsigned int timeout)
+{
+	struct linux_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
+	struct usbfs_bulktransfer bulk;
+	int r;
+
+	/* the kernel allocates a bounce buffer of the whole length, leave
+	 * larger transfers to submit_bulk_transfer() which can split them */
+	if (length < 0 || length > MAX_BULK_BUFFER_LENGTH)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	bulk.ep = endpoint;
+	bulk.len = (unsigned int)length;
+	bulk.timeout = timeout;
+	bulk.data = data;
+
+	r = ioctl(hpriv->fd, IOCTL_USBFS_BULK, &bulk);
+	if (r >= 0) {
+		*transferred = r;
+		return 0;
+	}
+
+	*transferred = 0;
+	return sync_transfer_error(handle, "bulk");
+}
+
+static int op_sync_control_transfer(struct libusb_device_handle *handle,
+	uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+	unsigned char *data, uint16_t wLength, unsigned int timeout)
+{
+	struct linux_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
+	struct usbfs_ctrltransfer ctrl = {
+		.bmRequestType = bmRequestType,
+		.bRequest = bRequest,
+		.wValue = wValue,
+		.wIndex = wIndex,
+		.wLength = wLength,
+		.timeout = timeout,
+		.data = data
+	};
+	int r;
+
+	/* let submit_control_transfer() reject oversized requests */
+	if (wLength > MAX_CTRL_BUFFER_LENGTH)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	r = ioctl(hpriv->fd, IOCTL_USBFS_CONTROL, &ctrl);
+	if (r >= 0)
+		return r;
+
+	return sync_transfer_error(handle, "control");
+}
+
 static int op_cancel_transfer(struct usbi_transfer *itransfer)
 {
 	struct linux_transfer_priv *tpriv = usbi_get_transfer_priv(itransfer);
@@ -2326,14 +2532,18 @@ static void op_clear_transfer_priv(struct usbi_transfer *itransfer)
 		}
 		break;
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
-		if (tpriv->iso_urbs) {
-			free_iso_urbs(tpriv);
-			tpriv->iso_urbs = NULL;
-		}
+		tpriv->iso_urbs = NULL;
 		break;
 	default:
 		usbi_err(TRANSFER_CTX(transfer), "unknown transfer type %u", transfer->type);
 	}
+
+	free_urb_cache(tpriv);
+}
+
+static void op_free_transfer_priv(struct usbi_transfer *itransfer)
+{
+	free_urb_cache(usbi_get_transfer_priv(itransfer));
 }
 
 static int handle_bulk_completion(struct usbi_transfer *itransfer,
@@ -2465,84 +2675,87 @@ out_unlock:
 	return 0;
 
 completed:
-	free(tpriv->urbs);
-	tpriv->urbs = NULL;
+	put_urbs(tpriv);
 	usbi_mutex_unlock(&itransfer->lock);
 	return tpriv->reap_action == CANCELLED ?
 		usbi_handle_transfer_cancellation(itransfer) :
 		usbi_handle_transfer_completion(itransfer, tpriv->reap_status);
 }
 
+/* Translates the status of an iso packet that did not complete normally. */
+static enum libusb_transfer_status iso_packet_status(struct libusb_transfer *transfer,
+	int packet, int status)
+{
+	/* only logged */
+	UNUSED(packet);
+
+	switch (status) {
+	case -ENOENT: /* cancelled */
+	case -ECONNRESET:
+		return LIBUSB_TRANSFER_COMPLETED;
+	case -ENODEV:
+	case -ESHUTDOWN:
+		usbi_dbg(TRANSFER_CTX(transfer), "packet %d - device removed", packet);
+		return LIBUSB_TRANSFER_NO_DEVICE;
+	case -EPIPE:
+		usbi_dbg(TRANSFER_CTX(transfer), "packet %d - detected endpoint stall", packet);
+		return LIBUSB_TRANSFER_STALL;
+	case -EOVERFLOW:
+		usbi_dbg(TRANSFER_CTX(transfer), "packet %d - overflow error", packet);
+		return LIBUSB_TRANSFER_OVERFLOW;
+	case -ETIME:
+	case -EPROTO:
+	case -EILSEQ:
+	case -ECOMM:
+	case -ENOSR:
+	case -EXDEV:
+		usbi_dbg(TRANSFER_CTX(transfer), "packet %d - low-level USB error %d", packet, status);
+		return LIBUSB_TRANSFER_ERROR;
+	default:
+		usbi_warn(TRANSFER_CTX(transfer), "packet %d - unrecognised urb status %d",
+			  packet, status);
+		return LIBUSB_TRANSFER_ERROR;
+	}
+}
+
 static int handle_iso_completion(struct usbi_transfer *itransfer,
 	struct usbfs_urb *urb)
 {
 	struct libusb_transfer *transfer =
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	struct linux_transfer_priv *tpriv = usbi_get_transfer_priv(itransfer);
+	struct libusb_iso_packet_descriptor *lib_desc;
 	int num_urbs = tpriv->num_urbs;
-	int urb_idx = 0;
+	uintptr_t offset;
+	int urb_idx;
 	int i;
 	enum libusb_transfer_status status = LIBUSB_TRANSFER_COMPLETED;
 
 	usbi_mutex_lock(&itransfer->lock);
-	for (i = 0; i < num_urbs; i++) {
-		if (urb == tpriv->iso_urbs[i]) {
-			urb_idx = i + 1;
-			break;
-		}
-	}
-	if (urb_idx == 0) {
+	/* the URBs are laid out at a fixed stride, so the index follows from
+	 * the address */
+	offset = (uintptr_t)urb - (uintptr_t)tpriv->iso_urbs;
+	if (!tpriv->iso_urbs || offset % tpriv->iso_urb_stride ||
+	    offset / tpriv->iso_urb_stride >= (uintptr_t)num_urbs) {
 		usbi_err(TRANSFER_CTX(transfer), "could not locate urb!");
 		usbi_mutex_unlock(&itransfer->lock);
 		return LIBUSB_ERROR_NOT_FOUND;
 	}
+	urb_idx = (int)(offset / tpriv->iso_urb_stride);
 
 	usbi_dbg(TRANSFER_CTX(transfer), "handling completion status %d of iso urb %d/%d", urb->status,
-		 urb_idx, num_urbs);
-
-	/* copy isochronous results back in */
+		 urb_idx + 1, num_urbs);
 
+	/* copy isochronous results back in. URBs may be reaped in any order,
+	 * the packets of each one start at a fixed offset in the transfer */
+	lib_desc = &transfer->iso_packet_desc[urb_idx * MAX_ISO_PACKETS_PER_URB];
 	for (i = 0; i < urb->number_of_packets; i++) {
 		struct usbfs_iso_packet_desc *urb_desc = &urb->iso_frame_desc[i];
-		struct libusb_iso_packet_descriptor *lib_desc =
-			&transfer->iso_packet_desc[tpriv->iso_packet_offset++];
 
-		lib_desc->status = LIBUSB_TRANSFER_COMPLETED;
-		switch (urb_desc->status) {
-		case 0:
-			break;
-		case -ENOENT: /* cancelled */
-		case -ECONNRESET:
-			break;
-		case -ENODEV:
-		case -ESHUTDOWN:
-			usbi_dbg(TRANSFER_CTX(transfer), "packet %d - device removed", i);
-			lib_desc->status = LIBUSB_TRANSFER_NO_DEVICE;
-			break;
-		case -EPIPE:
-			usbi_dbg(TRANSFER_CTX(transfer), "packet %d - detected endpoint stall", i);
-			lib_desc->status = LIBUSB_TRANSFER_STALL;
-			break;
-		case -EOVERFLOW:
-			usbi_dbg(TRANSFER_CTX(transfer), "packet %d - overflow error", i);
-			lib_desc->status = LIBUSB_TRANSFER_OVERFLOW;
-			break;
-		case -ETIME:
-		case -EPROTO:
-		case -EILSEQ:
-		case -ECOMM:
-		case -ENOSR:
-		case -EXDEV:
-			usbi_dbg(TRANSFER_CTX(transfer), "packet %d - low-level USB error %d", i, urb_desc->status);
-			lib_desc->status = LIBUSB_TRANSFER_ERROR;
-			break;
-		default:
-			usbi_warn(TRANSFER_CTX(transfer), "packet %d - unrecognised urb status %d",
-				  i, urb_desc->status);
-			lib_desc->status = LIBUSB_TRANSFER_ERROR;
-			break;
-		}
-		lib_desc->actual_length = urb_desc->actual_length;
+		lib_desc[i].status = urb_desc->status ?
+			iso_packet_status(transfer, i, urb_desc->status) :
+			LIBUSB_TRANSFER_COMPLETED;
+		lib_desc[i].actual_length = urb_desc->actual_length;
 	}
 
 	tpriv->num_retired++;
@@ -2552,7 +2765,7 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 
 		if (tpriv->num_retired == num_urbs) {
 			usbi_dbg(TRANSFER_CTX(transfer), "CANCEL: last URB handled, reporting");
-			free_iso_urbs(tpriv);
+			put_iso_urbs(tpriv);
 			if (tpriv->reap_action == CANCELLED) {
 				usbi_mutex_unlock(&itransfer->lock);
 				return usbi_handle_transfer_cancellation(itransfer);
@@ -2583,7 +2796,7 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 	/* if we've reaped all urbs then we're done */
 	if (tpriv->num_retired == num_urbs) {
 		usbi_dbg(TRANSFER_CTX(transfer), "all URBs in transfer reaped --> complete!");
-		free_iso_urbs(tpriv);
+		put_iso_urbs(tpriv);
 		usbi_mutex_unlock(&itransfer->lock);
 		return usbi_handle_transfer_completion(itransfer, status);
 	}
@@ -2608,8 +2821,7 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 		if (urb->status && urb->status != -ENOENT)
 			usbi_warn(ITRANSFER_CTX(itransfer), "cancel: unrecognised urb status %d",
 				  urb->status);
-		free(tpriv->urbs);
-		tpriv->urbs = NULL;
+		put_urbs(tpriv);
 		usbi_mutex_unlock(&itransfer->lock);
 		return usbi_handle_transfer_cancellation(itransfer);
 	}
@@ -2648,8 +2860,7 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 		break;
 	}
 
-	free(tpriv->urbs);
-	tpriv->urbs = NULL;
+	put_urbs(tpriv);
 	usbi_mutex_unlock(&itransfer->lock);
 	return usbi_handle_transfer_completion(itransfer, status);
 }
@@ -2693,42 +2904,68 @@ static int reap_for_handle(struct libusb_device_handle *handle)
 	}
 }
 
+/* Number of URBs reaped from a ready device in one turn before moving on to
+ * the next one, so that a busy device does not starve the others */
+#define REAP_QUANTUM	8
+
+/* Returns non-zero if the handle of a ready event source was closed since
+ * removed was read. Every reaped URB may run a callback that does so. */
+static int event_source_closed(struct libusb_context *ctx, long removed,
+	struct pollfd *pollfd, struct libusb_device_handle *handle)
+{
+	return removed != usbi_atomic_load(&ctx->event_sources_removed) &&
+		!usbi_event_source_registered(ctx, pollfd->fd, handle);
+}
+
+/* Device handles are only closed with the event handling lock held, so the
+ * handles registered as event source user data stay valid here without
+ * taking open_devs_lock. The exception are handles closed from callbacks
+ * run by this very function, which is detected through the context's count
+ * of removed event sources before each URB is reaped. */
 static int op_handle_events(struct libusb_context *ctx,
-	void *event_data, unsigned int count, unsigned int num_ready)
+	void *event_data, void **event_user_data, unsigned int count,
+	unsigned int num_ready)
 {
 	struct pollfd *fds = event_data;
-	unsigned int n;
+	unsigned int budget = (unsigned int)ctx->reap_budget;
+	long removed = usbi_atomic_load(&ctx->event_sources_removed);
+	unsigned int reaped = 0, pending = 0;
+	unsigned int n, last, round;
+	int budget_exhausted = 0;
 	int r;
 
-	usbi_mutex_lock(&ctx->open_devs_lock);
 	for (n = 0; n < count && num_ready > 0; n++) {
 		struct pollfd *pollfd = &fds[n];
-		struct libusb_device_handle *handle;
-		struct linux_device_handle_priv *hpriv = NULL;
-		int reap_count;
+		struct libusb_device_handle *handle = event_user_data[n];
+		struct linux_device_handle_priv *hpriv;
 
 		if (!pollfd->revents)
 			continue;
 
 		num_ready--;
-		for_each_open_device(ctx, handle) {
-			hpriv = usbi_get_device_handle_priv(handle);
-			if (hpriv->fd == pollfd->fd)
-				break;
-		}
-
-		if (!hpriv || hpriv->fd != pollfd->fd) {
+		if (!handle) {
 			usbi_err(ctx, "cannot find handle for fd %d",
 				 pollfd->fd);
+			pollfd->revents = 0;
+			continue;
+		}
+
+		if (event_source_closed(ctx, removed, pollfd, handle)) {
+			pollfd->revents = 0;
 			continue;
 		}
 
+		hpriv = usbi_get_device_handle_priv(handle);
+
 		if (pollfd->revents & POLLERR) {
+			pollfd->revents = 0;
+
 			/* remove the fd from the pollfd set so that it doesn't continuously
 			 * trigger an event, and flag that it has been removed so op_close()
 			 * doesn't try to remove it a second time */
 			usbi_remove_event_source(HANDLE_CTX(handle), hpriv->fd);
 			hpriv->fd_removed = 1;
+			removed = usbi_atomic_load(&ctx->event_sources_removed);
 
 			/* device will still be marked as attached if hotplug monitor thread
 			 * hasn't processed remove event yet */
@@ -2739,29 +2976,61 @@ static int op_handle_events(struct libusb_context *ctx,
 			usbi_mutex_static_unlock(&linux_hotplug_lock);
 
 			if (hpriv->caps & USBFS_CAP_REAP_AFTER_DISCONNECT) {
-				do {
-					r = reap_for_handle(handle);
-				} while (r == 0);
+				while (reap_for_handle(handle) == 0)
+					reaped++;
 			}
 
 			usbi_handle_disconnect(handle);
 			continue;
 		}
 
-		reap_count = 0;
-		do {
-			r = reap_for_handle(handle);
-		} while (r == 0 && ++reap_count <= 25);
+		pending++;
+	}
+	last = n;
 
-		if (r == 1 || r == LIBUSB_ERROR_NO_DEVICE)
-			continue;
-		else if (r < 0)
-			goto out;
+	/* reap the remaining ready devices in turns of up to REAP_QUANTUM URBs
+	 * each, until they run out of completed URBs or their budget is used up */
+	for (round = 0; pending; round++) {
+		pending = 0;
+		for (n = 0; n < last; n++) {
+			struct pollfd *pollfd = &fds[n];
+			struct libusb_device_handle *handle = event_user_data[n];
+			unsigned int limit = REAP_QUANTUM, i;
+
+			if (!pollfd->revents)
+				continue;
+
+			if (budget && budget - round * REAP_QUANTUM < limit)
+				limit = budget - round * REAP_QUANTUM;
+
+			r = 0;
+			for (i = 0; i < limit && r == 0; i++) {
+				if (event_source_closed(ctx, removed, pollfd, handle)) {
+					r = 1;
+					break;
+				}
+				r = reap_for_handle(handle);
+				if (r == 0)
+					reaped++;
+			}
+
+			if (r == 0) {
+				if (!budget || budget > (round + 1) * REAP_QUANTUM) {
+					pending++;
+					continue;
+				}
+				budget_exhausted = 1;
+			}
+
+			pollfd->revents = 0;
+			if (r < 0 && r != LIBUSB_ERROR_NO_DEVICE)
+				goto out;
+		}
 	}
 
 	r = 0;
 out:
-	usbi_mutex_unlock(&ctx->open_devs_lock);
+	usbi_account_reaped(ctx, reaped, budget_exhausted);
 	return r;
 }
 
@@ -2801,8 +3070,11 @@ const struct usbi_os_backend usbi_backend = {
 	.destroy_device = op_destroy_device,
 
 	.submit_transfer = op_submit_transfer,
+	.sync_bulk_transfer = op_sync_bulk_transfer,
+	.sync_control_transfer = op_sync_control_transfer,
 	.cancel_transfer = op_cancel_transfer,
 	.clear_transfer_priv = op_clear_transfer_priv,
+	.free_transfer_priv = op_free_transfer_priv,
 
 	.handle_events = op_handle_events,
 
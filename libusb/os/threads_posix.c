@@ -79,6 +79,37 @@ int usbi_cond_timedwait(pthread_cond_t *cond,
 		return LIBUSB_ERROR_OTHER;
 }
 
+struct thread_start {
+	void (*func)(void *);
+	void *arg;
+};
+
+static void *thread_main(void *arg)
+{
+	struct thread_start start = *(struct thread_start *)arg;
+
+	free(arg);
+	start.func(start.arg);
+	return NULL;
+}
+
+int usbi_thread_create(usbi_thread_t *thread, void (*func)(void *), void *arg)
+{
+	struct thread_start *start = malloc(sizeof(*start));
+
+	if (!start)
+		return LIBUSB_ERROR_NO_MEM;
+
+	start->func = func;
+	start->arg = arg;
+	if (pthread_create(thread, NULL, thread_main, start) != 0) {
+		free(start);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	return 0;
+}
+
 unsigned int usbi_get_tid(void)
 {
 	static _Thread_local unsigned int tl_tid;
@@ -66,6 +66,10 @@ static inline void usbi_cond_wait(usbi_cond_t *cond, usbi_mutex_t *mutex)
 }
 int usbi_cond_timedwait(usbi_cond_t *cond,
 	usbi_mutex_t *mutex, const struct timeval *tv);
+static inline void usbi_cond_signal(usbi_cond_t *cond)
+{
+	PTHREAD_CHECK(pthread_cond_signal(cond));
+}
 static inline void usbi_cond_broadcast(usbi_cond_t *cond)
 {
 	PTHREAD_CHECK(pthread_cond_broadcast(cond));
@@ -93,6 +97,13 @@ static inline void usbi_tls_key_delete(usbi_tls_key_t key)
 	PTHREAD_CHECK(pthread_key_delete(key));
 }
 
+typedef pthread_t usbi_thread_t;
+int usbi_thread_create(usbi_thread_t *thread, void (*func)(void *), void *arg);
+static inline void usbi_thread_join(usbi_thread_t thread)
+{
+	PTHREAD_CHECK(pthread_join(thread, NULL));
+}
+
 unsigned int usbi_get_tid(void);
 
 #endif /* LIBUSB_THREADS_POSIX_H */
@@ -38,3 +38,35 @@ int usbi_cond_timedwait(usbi_cond_t *cond,
 	else
 		return LIBUSB_ERROR_OTHER;
 }
+
+struct thread_start {
+	void (*func)(void *);
+	void *arg;
+};
+
+static DWORD WINAPI thread_main(LPVOID arg)
+{
+	struct thread_start start = *(struct thread_start *)arg;
+
+	free(arg);
+	start.func(start.arg);
+	return 0;
+}
+
+int usbi_thread_create(usbi_thread_t *thread, void (*func)(void *), void *arg)
+{
+	struct thread_start *start = malloc(sizeof(*start));
+
+	if (!start)
+		return LIBUSB_ERROR_NO_MEM;
+
+	start->func = func;
+	start->arg = arg;
+	*thread = CreateThread(NULL, 0, thread_main, start, 0, NULL);
+	if (!*thread) {
+		free(start);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	return 0;
+}
@@ -77,6 +77,10 @@ static inline void usbi_cond_wait(usbi_cond_t *cond, usbi_mutex_t *mutex)
 }
 int usbi_cond_timedwait(usbi_cond_t *cond,
 	usbi_mutex_t *mutex, const struct timeval *tv);
+static inline void usbi_cond_signal(usbi_cond_t *cond)
+{
+	WakeConditionVariable(cond);
+}
 static inline void usbi_cond_broadcast(usbi_cond_t *cond)
 {
 	WakeAllConditionVariable(cond);
@@ -105,6 +109,14 @@ static inline void usbi_tls_key_delete(usbi_tls_key_t key)
 	WINAPI_CHECK(TlsFree(key));
 }
 
+typedef HANDLE usbi_thread_t;
+int usbi_thread_create(usbi_thread_t *thread, void (*func)(void *), void *arg);
+static inline void usbi_thread_join(usbi_thread_t thread)
+{
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+}
+
 static inline unsigned int usbi_get_tid(void)
 {
 	return (unsigned int)GetCurrentThreadId();
@@ -912,8 +912,12 @@ const struct usbi_os_backend usbi_backend = {
 	NULL,	/* attach_kernel_driver */
 	windows_destroy_device,
 	windows_submit_transfer,
+	NULL,	/* submit_transfers */
+	NULL,	/* sync_bulk_transfer */
+	NULL,	/* sync_control_transfer */
 	windows_cancel_transfer,
 	NULL,	/* clear_transfer_priv */
+	NULL,	/* free_transfer_priv */
 	NULL,	/* handle_events */
 	windows_handle_transfer_completion,
 	sizeof(struct windows_context_priv),
@@ -0,0 +1,1159 @@
+/* -*- Mode: C; indent-tabs-mode:t ; c-basic-offset:8 -*- */
+/*
+ * Streaming I/O functions for libusb
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "libusbi.h"
+
+#include <limits.h>
+#include <string.h>
+
+/**
+ * @defgroup libusb_stream Streaming device I/O
+ *
+ * This page documents libusb's streaming API, which keeps an endpoint busy
+ * with a queue of transfers and hands the data over to any number of
+ * consumer threads. It is built on the
+ * \ref libusb_asyncio "asynchronous I/O API": transfers are resubmitted from
+ * their callbacks, so the application must handle events as usual, see
+ * \ref libusb_mtasync.
+ *
+ * A stream is unrelated to the USB 3.0 bulk streams of
+ * \ref libusb_alloc_streams.
+ *
+ * \section stream_in Reading from an IN endpoint
+ *
+ * A stream keeps num_transfers transfers of transfer_size bytes in flight.
+ * Each completed transfer hands its buffer over to a ring of num_buffers
+ * entries in exchange for a free one, so that no data is copied, and is
+ * resubmitted straight away. Consumers take buffers from the ring with
+ * \ref libusb_stream_read and give them back with \ref libusb_stream_release,
+ * without taking any lock.
+ *
+ * If the consumers fall behind and the ring is full, the data of a completed
+ * transfer is dropped and counted as an overrun, and the next buffer read
+ * tells how many were dropped before it. With
+ * \ref LIBUSB_STREAM_STALL_WHEN_FULL, the transfer is held back instead until
+ * a buffer is released, which stops reading from the device.
+ *
+ * \code
+ * libusb_stream *stream;
+ * struct libusb_stream_buffer buffer;
+ *
+ * libusb_stream_open(dev_handle, 0x81, 16384, 8, 32, 0, &stream);
+ * libusb_stream_start(stream);
+ *
+ * // in any number of consumer threads, while another thread handles events
+ * while (libusb_stream_read(stream, &buffer) == 1) {
+ *     process(buffer.data, buffer.length);
+ *     libusb_stream_release(stream, &buffer);
+ * }
+ *
+ * libusb_stream_close(stream);
+ * \endcode
+ *
+ * \section stream_out Writing to an OUT endpoint
+ *
+ * Producers fill free buffers of the ring, either in place with
+ * \ref libusb_stream_acquire and \ref libusb_stream_commit, or by copying
+ * with \ref libusb_stream_write. Committed buffers are handed over to idle
+ * transfers in exchange for the buffers they sent, and up to num_transfers
+ * of them are kept in flight.
+ *
+ * When the ring is full, producers wait for transfers to complete, handling
+ * events like the \ref libusb_syncio "synchronous API" does. With
+ * \ref LIBUSB_STREAM_NONBLOCK they get \ref LIBUSB_ERROR_BUSY instead.
+ *
+ * With \ref LIBUSB_STREAM_ZERO_PACKET, every committed buffer, and the data
+ * of every libusb_stream_write() call, is a message which is terminated by a
+ * zero length packet if its length is a multiple of the maximum packet size
+ * of the endpoint, see \ref LIBUSB_TRANSFER_ADD_ZERO_PACKET. The
+ * transfer_size of such a stream should be a multiple of the maximum packet
+ * size, so that only the last transfer of a message ends with a short or
+ * zero length packet. Buffers committed with no data are not sent.
+ *
+ * \code
+ * libusb_stream_open(dev_handle, 0x01, 16384, 4, 16, 0, &stream);
+ * libusb_stream_start(stream);
+ *
+ * // in any number of producer threads
+ * libusb_stream_write(stream, data, length);
+ *
+ * libusb_stream_flush(stream);
+ * libusb_stream_close(stream);
+ * \endcode
+ *
+ * \section stream_iso Reading from an isochronous IN endpoint
+ *
+ * A stream opened with \ref libusb_stream_open_iso copies each packet that
+ * carried data, or failed, into a buffer of the ring, so that the transfer
+ * can be resubmitted right away. Consumers read one record per packet, with
+ * its status, and find out about gaps from the number of packets dropped
+ * before each record. \ref libusb_stream_get_stats counts the packets
+ * dropped and failed over the last second.
+ */
+
+/* upper bounds keeping the transfer and ring buffers within a buffer pool */
+#define STREAM_MAX_TRANSFERS	16384
+#define STREAM_MAX_BUFFERS	16384
+
+/* in the status of a ring entry of an OUT stream, marks the last buffer of
+ * a message */
+#define STREAM_END_OF_MESSAGE	1
+
+enum stream_transfer_state {
+	STREAM_TRANSFER_IDLE,
+	STREAM_TRANSFER_ACTIVE,
+	STREAM_TRANSFER_PARKED,
+};
+
+struct stream_transfer {
+	struct list_head list;
+	struct libusb_transfer *transfer;
+	struct libusb_stream *stream;
+	enum stream_transfer_state state;
+};
+
+struct libusb_stream {
+	struct libusb_device_handle *dev_handle;
+	uint32_t flags;
+	int out;
+	int transfer_size;
+	int num_transfers;
+	libusb_buffer_pool *pool;
+
+	/* for an iso stream, the pool of the ring buffers, each holding the
+	 * data of one packet */
+	libusb_buffer_pool *packet_pool;
+	int packet_size;
+
+	usbi_mutex_t lock;
+
+	/* the following are protected by lock */
+	int running;
+	int num_active;
+	struct list_head parked;	/* IN transfers holding data */
+	struct list_head idle;		/* OUT transfers waiting for data */
+	struct libusb_stream_stats stats;
+
+	/* data dropped since the last buffer was published */
+	int dropped;
+
+	/* start of the current one-second window of an iso stream, and the
+	 * packets dropped and failed in it */
+	struct timespec window_start;
+	uint32_t window_dropped;
+	uint32_t window_errors;
+
+	/* set once the stream is stopped and no transfer is in flight */
+	int drained;
+
+	/* set by libusb_stream_close(), which then waits for closed */
+	int closing;
+
+	/* set once a closing stream drained, by the callback which drained it
+	 * after unlocking the stream, or by libusb_stream_close() itself. Read
+	 * by libusb_stream_close() through libusb_handle_events_completed(),
+	 * which may free the stream right away. */
+	int closed;
+
+	/* number of transfers on the parked and idle lists, read by consumers
+	 * and producers without the lock */
+	usbi_atomic_t num_parked;
+	usbi_atomic_t num_idle;
+
+	/* LIBUSB_ERROR code which stopped the stream, or 0 */
+	usbi_atomic_t error;
+
+	struct stream_transfer *transfers;
+	struct usbi_ring ring;
+	struct usbi_ring_slot slots[ZERO_SIZED_ARRAY];
+};
+
+/* Note that the stream drained, if it did. Returns non-zero if it is
+ * closing, in which case the caller must set closed once it unlocked the
+ * stream, and not touch the stream afterwards. Called with the stream
+ * locked. */
+static int stream_check_drained(struct libusb_stream *stream)
+{
+	if (stream->running || stream->num_active)
+		return 0;
+
+	stream->drained = 1;
+	return stream->closing;
+}
+
+/* Returns the error a stream fails with after a transfer completed with the
+ * given status, or 0 if the status is not an error */
+static int stream_status_error(struct libusb_stream *stream,
+	enum libusb_transfer_status status)
+{
+	switch (status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+	case LIBUSB_TRANSFER_CANCELLED:
+		return 0;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case LIBUSB_TRANSFER_ERROR:
+		return LIBUSB_ERROR_IO;
+	default:
+		usbi_warn(HANDLE_CTX(stream->dev_handle),
+			"unrecognised status code %d", status);
+		return LIBUSB_ERROR_OTHER;
+	}
+}
+
+/* Cancel all transfers in flight. Called with the stream locked. */
+static void stream_cancel(struct libusb_stream *stream)
+{
+	int i;
+
+	for (i = 0; i < stream->num_transfers; i++) {
+		struct stream_transfer *st = &stream->transfers[i];
+
+		if (st->state == STREAM_TRANSFER_ACTIVE)
+			libusb_cancel_transfer(st->transfer);
+	}
+}
+
+/* Stop the stream because of an error. Called with the stream locked. */
+static void stream_fail(struct libusb_stream *stream, int error)
+{
+	usbi_dbg(HANDLE_CTX(stream->dev_handle), "stream %p failed, error %d",
+		(void *)stream, error);
+
+	if (!usbi_atomic_load(&stream->error))
+		usbi_atomic_store(&stream->error, error);
+	stream->running = 0;
+	stream_cancel(stream);
+}
+
+/* Called with the stream locked */
+static int stream_submit(struct libusb_stream *stream, struct stream_transfer *st)
+{
+	int r;
+
+	r = libusb_submit_transfer(st->transfer);
+	if (r < 0) {
+		stream_fail(stream, r);
+		return r;
+	}
+
+	st->state = STREAM_TRANSFER_ACTIVE;
+	stream->num_active++;
+	return 0;
+}
+
+/* Hand the buffer of a completed transfer over to the ring, in exchange for
+ * the free buffer of the ring entry. Returns 0 if the ring is full. Called
+ * with the stream locked. */
+static int stream_publish(struct libusb_stream *stream,
+	struct libusb_transfer *transfer)
+{
+	struct usbi_ring_slot *slot;
+	unsigned long position;
+	unsigned char *buffer;
+
+	slot = usbi_ring_acquire_write(&stream->ring, &position);
+	if (!slot)
+		return 0;
+
+	buffer = slot->buffer;
+	slot->buffer = transfer->buffer;
+	slot->length = transfer->actual_length;
+	slot->status = (int)transfer->status;
+	slot->dropped = stream->dropped;
+	transfer->buffer = buffer;
+	usbi_ring_commit_write(&stream->ring, position);
+	stream->dropped = 0;
+	return 1;
+}
+
+/* Publish the data of parked transfers, oldest first, for as long as the
+ * ring has room, and resubmit them. Called with the stream locked. */
+static void stream_unpark(struct libusb_stream *stream)
+{
+	while (!list_empty(&stream->parked)) {
+		struct stream_transfer *st =
+			list_first_entry(&stream->parked, struct stream_transfer, list);
+
+		if (!stream_publish(stream, st->transfer))
+			break;
+
+		list_del(&st->list);
+		(void)usbi_atomic_dec(&stream->num_parked);
+		st->state = STREAM_TRANSFER_IDLE;
+		if (stream->running)
+			stream_submit(stream, st);
+	}
+}
+
+static void LIBUSB_CALL stream_transfer_cb(struct libusb_transfer *transfer)
+{
+	struct stream_transfer *st = transfer->user_data;
+	struct libusb_stream *stream = st->stream;
+	int closed;
+
+	usbi_mutex_lock(&stream->lock);
+	st->state = STREAM_TRANSFER_IDLE;
+	stream->num_active--;
+
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		stream->stats.transfers++;
+		stream->stats.bytes += (uint64_t)transfer->actual_length;
+		if (!transfer->actual_length)
+			break;
+		if (list_empty(&stream->parked) && stream_publish(stream, transfer))
+			break;
+
+		if (stream->flags & LIBUSB_STREAM_STALL_WHEN_FULL) {
+			stream->stats.stalls++;
+			st->state = STREAM_TRANSFER_PARKED;
+			list_add_tail(&st->list, &stream->parked);
+			(void)usbi_atomic_inc(&stream->num_parked);
+
+			/* a consumer may have released a buffer before seeing
+			 * the parked transfer */
+			stream_unpark(stream);
+			goto out;
+		}
+
+		stream->stats.overruns++;
+		stream->dropped++;
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		goto out;
+	case LIBUSB_TRANSFER_ERROR:
+	case LIBUSB_TRANSFER_TIMED_OUT:
+	case LIBUSB_TRANSFER_STALL:
+	case LIBUSB_TRANSFER_NO_DEVICE:
+	case LIBUSB_TRANSFER_OVERFLOW:
+	default:
+		stream->stats.errors++;
+		stream_fail(stream, stream_status_error(stream, transfer->status));
+		goto out;
+	}
+
+	if (stream->running)
+		stream_submit(stream, st);
+
+out:
+	closed = stream_check_drained(stream);
+	usbi_mutex_unlock(&stream->lock);
+
+	/* libusb_stream_close() may free the stream as soon as this is set */
+	if (closed)
+		stream->closed = 1;
+}
+
+/* Hand committed buffers of an OUT stream over to idle transfers, in
+ * exchange for the buffers they sent, and submit them. Called with the
+ * stream locked. */
+static void stream_pump(struct libusb_stream *stream)
+{
+	while (stream->running && !list_empty(&stream->idle)) {
+		struct stream_transfer *st;
+		struct libusb_transfer *transfer;
+		struct usbi_ring_slot *slot;
+		unsigned long position;
+		unsigned char *buffer;
+		int end_of_message;
+
+		slot = usbi_ring_acquire_read(&stream->ring, &position);
+		if (!slot)
+			break;
+
+		if (!slot->length) {
+			usbi_ring_commit_read(&stream->ring, position);
+			continue;
+		}
+
+		st = list_first_entry(&stream->idle, struct stream_transfer, list);
+		transfer = st->transfer;
+		end_of_message = slot->status & STREAM_END_OF_MESSAGE;
+
+		buffer = transfer->buffer;
+		transfer->buffer = slot->buffer;
+		transfer->length = slot->length;
+		transfer->flags = (stream->flags & LIBUSB_STREAM_ZERO_PACKET) &&
+			end_of_message ? LIBUSB_TRANSFER_ADD_ZERO_PACKET : 0;
+		slot->buffer = buffer;
+		usbi_ring_commit_read(&stream->ring, position);
+
+		list_del(&st->list);
+		(void)usbi_atomic_dec(&stream->num_idle);
+		if (stream_submit(stream, st) < 0) {
+			list_add(&st->list, &stream->idle);
+			(void)usbi_atomic_inc(&stream->num_idle);
+			break;
+		}
+	}
+}
+
+static void LIBUSB_CALL stream_out_transfer_cb(struct libusb_transfer *transfer)
+{
+	struct stream_transfer *st = transfer->user_data;
+	struct libusb_stream *stream = st->stream;
+	int closed;
+
+	usbi_mutex_lock(&stream->lock);
+	st->state = STREAM_TRANSFER_IDLE;
+	stream->num_active--;
+	list_add_tail(&st->list, &stream->idle);
+	(void)usbi_atomic_inc(&stream->num_idle);
+
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		stream->stats.transfers++;
+		stream->stats.bytes += (uint64_t)transfer->actual_length;
+		stream_pump(stream);
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		break;
+	case LIBUSB_TRANSFER_ERROR:
+	case LIBUSB_TRANSFER_TIMED_OUT:
+	case LIBUSB_TRANSFER_STALL:
+	case LIBUSB_TRANSFER_NO_DEVICE:
+	case LIBUSB_TRANSFER_OVERFLOW:
+	default:
+		stream->stats.errors++;
+		stream_fail(stream, stream_status_error(stream, transfer->status));
+	}
+
+	closed = stream_check_drained(stream);
+	usbi_mutex_unlock(&stream->lock);
+
+	/* libusb_stream_close() may free the stream as soon as this is set */
+	if (closed)
+		stream->closed = 1;
+}
+
+/* Copy the packets of a completed iso transfer into the ring, one record
+ * per packet. Called with the stream locked. */
+static void stream_publish_packets(struct libusb_stream *stream,
+	struct libusb_transfer *transfer)
+{
+	unsigned char *data = transfer->buffer;
+	int i;
+
+	for (i = 0; i < transfer->num_iso_packets; i++) {
+		struct libusb_iso_packet_descriptor *desc = &transfer->iso_packet_desc[i];
+		int failed = desc->status != LIBUSB_TRANSFER_COMPLETED;
+		struct usbi_ring_slot *slot;
+		unsigned long position;
+
+		stream->stats.packets++;
+		stream->stats.bytes += desc->actual_length;
+		stream->stats.packet_errors += (uint64_t)failed;
+		stream->window_errors += (uint32_t)failed;
+
+		/* packets without data carry nothing worth a record */
+		if (!failed && !desc->actual_length) {
+			data += stream->packet_size;
+			continue;
+		}
+
+		slot = usbi_ring_acquire_write(&stream->ring, &position);
+		if (!slot) {
+			stream->stats.overruns++;
+			stream->window_dropped++;
+			stream->dropped++;
+			data += stream->packet_size;
+			continue;
+		}
+
+		slot->length = failed ? 0 : (int)desc->actual_length;
+		slot->status = (int)desc->status;
+		slot->dropped = stream->dropped;
+		if (slot->length)
+			memcpy(slot->buffer, data, (size_t)slot->length);
+		usbi_ring_commit_write(&stream->ring, position);
+		stream->dropped = 0;
+		data += stream->packet_size;
+	}
+}
+
+static void LIBUSB_CALL stream_iso_transfer_cb(struct libusb_transfer *transfer)
+{
+	struct stream_transfer *st = transfer->user_data;
+	struct libusb_stream *stream = st->stream;
+	struct timespec now, elapsed;
+	int closed;
+
+	usbi_mutex_lock(&stream->lock);
+	st->state = STREAM_TRANSFER_IDLE;
+	stream->num_active--;
+
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		stream->stats.transfers++;
+		stream_publish_packets(stream, transfer);
+		if (stream->running)
+			stream_submit(stream, st);
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		break;
+	case LIBUSB_TRANSFER_ERROR:
+	case LIBUSB_TRANSFER_TIMED_OUT:
+	case LIBUSB_TRANSFER_STALL:
+	case LIBUSB_TRANSFER_NO_DEVICE:
+	case LIBUSB_TRANSFER_OVERFLOW:
+	default:
+		stream->stats.errors++;
+		stream_fail(stream, stream_status_error(stream, transfer->status));
+	}
+
+	usbi_get_monotonic_time(&now);
+	TIMESPEC_SUB(&now, &stream->window_start, &elapsed);
+	if (elapsed.tv_sec >= 1) {
+		stream->stats.dropped_per_second = stream->window_dropped;
+		stream->stats.errors_per_second = stream->window_errors;
+		stream->window_dropped = 0;
+		stream->window_errors = 0;
+		stream->window_start = now;
+	}
+
+	closed = stream_check_drained(stream);
+	usbi_mutex_unlock(&stream->lock);
+
+	/* libusb_stream_close() may free the stream as soon as this is set */
+	if (closed)
+		stream->closed = 1;
+}
+
+static void free_stream(struct libusb_stream *stream)
+{
+	int i;
+
+	for (i = 0; i < stream->num_transfers; i++)
+		libusb_free_transfer(stream->transfers[i].transfer);
+	libusb_free_buffer_pool(stream->pool);
+	libusb_free_buffer_pool(stream->packet_pool);
+	usbi_mutex_destroy(&stream->lock);
+	free(stream->transfers);
+	free(stream);
+}
+
+/* Allocate a stream of bulk transfers of size bytes, or if num_packets is
+ * non-zero, of iso transfers of num_packets packets of size bytes */
+static int alloc_stream(libusb_device_handle *dev_handle, unsigned char endpoint,
+	int size, int num_packets, int num_transfers, int num_buffers,
+	uint32_t flags, libusb_stream **stream)
+{
+	struct libusb_stream *_stream;
+	unsigned long ring_size, i;
+	int transfer_size = num_packets ? size * num_packets : size;
+	int r;
+
+	if (num_transfers <= 0 || num_transfers > STREAM_MAX_TRANSFERS ||
+	    num_buffers <= 0 || num_buffers > STREAM_MAX_BUFFERS)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	for (ring_size = 1; ring_size < (unsigned long)num_buffers; ring_size <<= 1)
+		;
+
+	_stream = calloc(1, sizeof(*_stream) + ring_size * sizeof(_stream->slots[0]));
+	if (!_stream)
+		return LIBUSB_ERROR_NO_MEM;
+
+	_stream->transfers = calloc((size_t)num_transfers, sizeof(*_stream->transfers));
+	if (!_stream->transfers) {
+		free(_stream);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	_stream->dev_handle = dev_handle;
+	_stream->flags = flags;
+	_stream->out = IS_EPOUT(endpoint);
+	_stream->transfer_size = transfer_size;
+	_stream->drained = 1;
+	list_init(&_stream->parked);
+	list_init(&_stream->idle);
+	usbi_mutex_init(&_stream->lock);
+
+	if (num_packets) {
+		/* packets are copied out of the transfers, so the ring buffers
+		 * need no device memory */
+		_stream->packet_size = size;
+		r = libusb_alloc_buffer_pool(dev_handle, (size_t)transfer_size,
+			num_transfers, &_stream->pool);
+		if (r == LIBUSB_SUCCESS)
+			r = libusb_alloc_buffer_pool(NULL, (size_t)size,
+				(int)ring_size, &_stream->packet_pool);
+	} else {
+		r = libusb_alloc_buffer_pool(dev_handle, (size_t)transfer_size,
+			num_transfers + (int)ring_size, &_stream->pool);
+	}
+	if (r < 0) {
+		free_stream(_stream);
+		return r;
+	}
+
+	usbi_ring_init(&_stream->ring, _stream->slots, ring_size);
+	for (i = 0; i < ring_size; i++)
+		_stream->slots[i].buffer = libusb_buffer_pool_get(num_packets ?
+			_stream->packet_pool : _stream->pool);
+
+	for (; _stream->num_transfers < num_transfers; _stream->num_transfers++) {
+		struct stream_transfer *st = &_stream->transfers[_stream->num_transfers];
+		unsigned char *buffer;
+
+		st->transfer = libusb_alloc_transfer(num_packets);
+		if (!st->transfer) {
+			free_stream(_stream);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+
+		st->stream = _stream;
+		buffer = libusb_buffer_pool_get(_stream->pool);
+		if (num_packets) {
+			libusb_fill_iso_transfer(st->transfer, dev_handle, endpoint,
+				buffer, transfer_size, num_packets,
+				stream_iso_transfer_cb, st, 0);
+			libusb_set_iso_packet_lengths(st->transfer, (unsigned int)size);
+		} else {
+			libusb_fill_bulk_transfer(st->transfer, dev_handle, endpoint,
+				buffer, transfer_size,
+				_stream->out ? stream_out_transfer_cb : stream_transfer_cb,
+				st, 0);
+		}
+
+		if (_stream->out) {
+			list_add_tail(&st->list, &_stream->idle);
+			(void)usbi_atomic_inc(&_stream->num_idle);
+		}
+	}
+
+	*stream = _stream;
+	return LIBUSB_SUCCESS;
+}
+
+/** \ingroup libusb_stream
+ * Open a stream reading from a bulk IN endpoint or writing to a bulk OUT
+ * endpoint. The stream does not transfer any data until
+ * \ref libusb_stream_start is called.
+ *
+ * The buffers come from a buffer pool of the device handle, see
+ * \ref libusb_alloc_buffer_pool, so the stream must be closed before the
+ * device handle is.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param dev_handle a device handle
+ * \param endpoint address of a bulk endpoint
+ * \param transfer_size size of each transfer and buffer, which should be a
+ * multiple of the maximum packet size of the endpoint
+ * \param num_transfers number of transfers to keep in flight
+ * \param num_buffers number of buffers in the ring between the transfers and
+ * the application, rounded up to a power of two
+ * \param flags bitwise OR of \ref libusb_stream_flags
+ * \param stream output location for the new stream
+ * \returns \ref LIBUSB_SUCCESS on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if a size or count is out of range
+ * \returns \ref LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns \ref LIBUSB_ERROR_NO_MEM on memory allocation failure
+ */
+int API_EXPORTED libusb_stream_open(libusb_device_handle *dev_handle,
+	unsigned char endpoint, int transfer_size, int num_transfers,
+	int num_buffers, uint32_t flags, libusb_stream **stream)
+{
+	if (!dev_handle || transfer_size <= 0 || !stream)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	return alloc_stream(dev_handle, endpoint, transfer_size, 0,
+		num_transfers, num_buffers, flags, stream);
+}
+
+/** \ingroup libusb_stream
+ * Open a stream reading from an isochronous IN endpoint. The stream does not
+ * transfer any data until \ref libusb_stream_start is called.
+ *
+ * Each transfer holds num_packets packets of the size returned by
+ * \ref libusb_get_max_iso_packet_size for the endpoint, in its current
+ * alternate setting, which must be selected before opening the stream. The
+ * data of the packets is copied into the ring, one buffer per packet that
+ * carried data or failed, and the transfer is resubmitted from its callback.
+ * \ref libusb_stream_read hands out these records of a packet's data, length
+ * and status, and reports the packets dropped before each one because the
+ * ring was full.
+ *
+ * The number of queued packets, num_packets * num_transfers, should cover
+ * the time it may take for events to be handled, so that no frame goes by
+ * without a transfer waiting for it.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param dev_handle a device handle
+ * \param endpoint address of an isochronous IN endpoint
+ * \param num_packets number of packets of each transfer
+ * \param num_transfers number of transfers to keep in flight
+ * \param num_buffers number of packet records in the ring between the
+ * transfers and the consumers, rounded up to a power of two
+ * \param flags bitwise OR of \ref libusb_stream_flags, which are ignored for
+ * now
+ * \param stream output location for the new stream
+ * \returns \ref LIBUSB_SUCCESS on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if a count is out of range
+ * \returns \ref LIBUSB_ERROR_NOT_SUPPORTED if the endpoint is not an IN
+ * endpoint
+ * \returns \ref LIBUSB_ERROR_NOT_FOUND if the endpoint does not exist
+ * \returns \ref LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns \ref LIBUSB_ERROR_NO_MEM on memory allocation failure
+ */
+int API_EXPORTED libusb_stream_open_iso(libusb_device_handle *dev_handle,
+	unsigned char endpoint, int num_packets, int num_transfers,
+	int num_buffers, uint32_t flags, libusb_stream **stream)
+{
+	int packet_size;
+
+	if (!dev_handle || num_packets <= 0 || !stream)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	if (!IS_EPIN(endpoint))
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	packet_size = libusb_get_max_iso_packet_size(libusb_get_device(dev_handle),
+		endpoint);
+	if (packet_size < 0)
+		return packet_size;
+	if (!packet_size || num_packets > INT_MAX / packet_size)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	return alloc_stream(dev_handle, endpoint, packet_size, num_packets,
+		num_transfers, num_buffers, flags, stream);
+}
+
+/** \ingroup libusb_stream
+ * Start transferring data. Buffers still in the ring from an earlier run
+ * remain readable, or for an OUT stream, are sent.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param stream the stream to start
+ * \returns \ref LIBUSB_SUCCESS on success
+ * \returns \ref LIBUSB_ERROR_BUSY if the stream is running, or has not
+ * finished stopping
+ * \returns another LIBUSB_ERROR code if a transfer could not be submitted,
+ * in which case the stream is stopped again
+ */
+int API_EXPORTED libusb_stream_start(libusb_stream *stream)
+{
+	int i, r = 0;
+
+	usbi_mutex_lock(&stream->lock);
+	if (stream->running || !stream->drained) {
+		r = LIBUSB_ERROR_BUSY;
+		goto out;
+	}
+
+	usbi_atomic_store(&stream->error, 0);
+	stream->running = 1;
+	stream->drained = 0;
+	usbi_get_monotonic_time(&stream->window_start);
+
+	if (stream->out) {
+		stream_pump(stream);
+		if (!stream->running && !stream->num_active)
+			stream->drained = 1;
+		r = (int)usbi_atomic_load(&stream->error);
+		goto out;
+	}
+
+	for (i = 0; i < stream->num_transfers; i++) {
+		struct stream_transfer *st = &stream->transfers[i];
+
+		if (st->state != STREAM_TRANSFER_IDLE)
+			continue;
+
+		r = stream_submit(stream, st);
+		if (r < 0)
+			break;
+	}
+
+	if (stream->running)
+		stream_unpark(stream);
+	else if (!stream->num_active)
+		stream->drained = 1;
+
+out:
+	usbi_mutex_unlock(&stream->lock);
+	return r;
+}
+
+/** \ingroup libusb_stream
+ * Stop transferring data. The transfers in flight are cancelled, and finish
+ * stopping while events are handled.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param stream the stream to stop
+ */
+void API_EXPORTED libusb_stream_stop(libusb_stream *stream)
+{
+	usbi_mutex_lock(&stream->lock);
+	stream->running = 0;
+	stream_cancel(stream);
+	if (!stream->num_active)
+		stream->drained = 1;
+	usbi_mutex_unlock(&stream->lock);
+}
+
+/** \ingroup libusb_stream
+ * Take the oldest buffer of data from an IN stream. This function does not
+ * block or take any lock, and may be called from any number of threads.
+ * The buffer must be given back with \ref libusb_stream_release.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param stream the stream to read from
+ * \param buffer output location for the buffer
+ * \returns 1 if a buffer was taken
+ * \returns 0 if no data is available
+ * \returns \ref LIBUSB_ERROR_NOT_SUPPORTED for an OUT stream
+ * \returns another LIBUSB_ERROR code if no data is available and the stream
+ * stopped because of an error
+ */
+int API_EXPORTED libusb_stream_read(libusb_stream *stream,
+	struct libusb_stream_buffer *buffer)
+{
+	struct usbi_ring_slot *slot;
+	unsigned long position;
+
+	if (stream->out)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	slot = usbi_ring_acquire_read(&stream->ring, &position);
+	if (!slot)
+		return (int)usbi_atomic_load(&stream->error);
+
+	buffer->data = slot->buffer;
+	buffer->length = slot->length;
+	buffer->status = (enum libusb_transfer_status)slot->status;
+	buffer->dropped = slot->dropped;
+	buffer->position = position;
+	return 1;
+}
+
+/** \ingroup libusb_stream
+ * Give back a buffer taken with \ref libusb_stream_read, so that it can be
+ * filled again. Buffers may be given back in any order.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param stream the stream the buffer was read from
+ * \param buffer the buffer to give back
+ */
+void API_EXPORTED libusb_stream_release(libusb_stream *stream,
+	struct libusb_stream_buffer *buffer)
+{
+	usbi_ring_commit_read(&stream->ring, buffer->position);
+
+	/* pairs with the parking in stream_transfer_cb() */
+	if (usbi_atomic_load(&stream->num_parked)) {
+		usbi_mutex_lock(&stream->lock);
+		stream_unpark(stream);
+		usbi_mutex_unlock(&stream->lock);
+	}
+}
+
+/* Wait for a free buffer in the ring of an OUT stream */
+static struct usbi_ring_slot *stream_wait_write(struct libusb_stream *stream,
+	unsigned long *position, int *error)
+{
+	struct libusb_context *ctx = HANDLE_CTX(stream->dev_handle);
+	struct usbi_ring_slot *slot;
+	int running, r;
+
+	while (!(slot = usbi_ring_acquire_write(&stream->ring, position))) {
+		r = (int)usbi_atomic_load(&stream->error);
+		if (!r && (stream->flags & LIBUSB_STREAM_NONBLOCK))
+			r = LIBUSB_ERROR_BUSY;
+		if (!r) {
+			usbi_mutex_lock(&stream->lock);
+			running = stream->running;
+			usbi_mutex_unlock(&stream->lock);
+			if (!running)
+				r = LIBUSB_ERROR_BUSY;
+		}
+		if (!r) {
+			r = libusb_handle_events_completed(ctx, NULL);
+			if (r == LIBUSB_ERROR_INTERRUPTED)
+				r = 0;
+		}
+		if (r < 0) {
+			*error = r;
+			return NULL;
+		}
+	}
+
+	return slot;
+}
+
+/* Hand a filled buffer of an OUT stream over to the transfers */
+static void stream_commit(struct libusb_stream *stream, unsigned long position,
+	int length, int status)
+{
+	struct usbi_ring_slot *slot = &stream->ring.slots[position % stream->ring.size];
+
+	slot->length = length;
+	slot->status = status;
+	usbi_ring_commit_write(&stream->ring, position);
+
+	/* pairs with the return of a transfer to the idle list in
+	 * stream_out_transfer_cb() */
+	if (usbi_atomic_load(&stream->num_idle)) {
+		usbi_mutex_lock(&stream->lock);
+		stream_pump(stream);
+		usbi_mutex_unlock(&stream->lock);
+	}
+}
+
+/** \ingroup libusb_stream
+ * Take a free buffer of an OUT stream, to be filled in place and handed over
+ * with \ref libusb_stream_commit. This function may be called from any
+ * number of threads. If the ring is full, it handles events until a buffer
+ * is free, unless the stream was opened with \ref LIBUSB_STREAM_NONBLOCK.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param stream the stream to write to
+ * \param buffer output location for the buffer, whose length is set to the
+ * transfer size of the stream
+ * \returns \ref LIBUSB_SUCCESS on success
+ * \returns \ref LIBUSB_ERROR_BUSY if the ring is full and the stream is
+ * non-blocking or not running
+ * \returns \ref LIBUSB_ERROR_NOT_SUPPORTED for an IN stream
+ * \returns another LIBUSB_ERROR code if the stream stopped because of an
+ * error, or event handling failed
+ */
+int API_EXPORTED libusb_stream_acquire(libusb_stream *stream,
+	struct libusb_stream_buffer *buffer)
+{
+	struct usbi_ring_slot *slot;
+	unsigned long position;
+	int r;
+
+	if (!stream->out)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	slot = stream_wait_write(stream, &position, &r);
+	if (!slot)
+		return r;
+
+	buffer->data = slot->buffer;
+	buffer->length = stream->transfer_size;
+	buffer->status = LIBUSB_TRANSFER_COMPLETED;
+	buffer->dropped = 0;
+	buffer->position = position;
+	return LIBUSB_SUCCESS;
+}
+
+/** \ingroup libusb_stream
+ * Hand a buffer taken with \ref libusb_stream_acquire over to the
+ * transfers, to be sent as a single transfer. Buffers are sent in the order
+ * they were taken in, so a buffer that is not committed holds back the ones
+ * taken after it.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param stream the stream the buffer was taken from
+ * \param buffer the buffer, with its length set to the number of bytes to
+ * send
+ * \returns \ref LIBUSB_SUCCESS on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if the length is negative or
+ * larger than the transfer size, in which case nothing is sent
+ */
+int API_EXPORTED libusb_stream_commit(libusb_stream *stream,
+	struct libusb_stream_buffer *buffer)
+{
+	if (buffer->length < 0 || buffer->length > stream->transfer_size) {
+		stream_commit(stream, buffer->position, 0, 0);
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	stream_commit(stream, buffer->position, buffer->length,
+		STREAM_END_OF_MESSAGE);
+	return LIBUSB_SUCCESS;
+}
+
+/** \ingroup libusb_stream
+ * Copy data into the ring of an OUT stream, as transfers of up to the
+ * transfer size of the stream. This function may be called from any number
+ * of threads, but the data of concurrent calls may be interleaved. If the
+ * ring is full, it handles events until a buffer is free, unless the stream
+ * was opened with \ref LIBUSB_STREAM_NONBLOCK.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param stream the stream to write to
+ * \param data the data to send
+ * \param length the number of bytes to send
+ * \returns the number of bytes queued, which is less than length if the
+ * ring filled up on a non-blocking stream, or if the stream stopped
+ * \returns \ref LIBUSB_ERROR_BUSY if no byte could be queued because the
+ * ring is full and the stream is non-blocking or not running
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if length is negative
+ * \returns \ref LIBUSB_ERROR_NOT_SUPPORTED for an IN stream
+ * \returns another LIBUSB_ERROR code if no byte could be queued because the
+ * stream stopped because of an error, or event handling failed
+ */
+int API_EXPORTED libusb_stream_write(libusb_stream *stream,
+	const unsigned char *data, int length)
+{
+	int done = 0;
+
+	if (!stream->out)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	if (length < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	do {
+		struct usbi_ring_slot *slot;
+		unsigned long position;
+		int chunk, r;
+
+		slot = stream_wait_write(stream, &position, &r);
+		if (!slot)
+			return done ? done : r;
+
+		chunk = MIN(length - done, stream->transfer_size);
+		if (chunk)
+			memcpy(slot->buffer, data + done, (size_t)chunk);
+		done += chunk;
+		stream_commit(stream, position, chunk,
+			done == length ? STREAM_END_OF_MESSAGE : 0);
+	} while (done < length);
+
+	return done;
+}
+
+/** \ingroup libusb_stream
+ * Wait until all data committed to an OUT stream has been sent, handling
+ * events meanwhile. Buffers that have been taken but not committed hold the
+ * wait up.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param stream the stream to flush
+ * \returns \ref LIBUSB_SUCCESS once all data has been sent
+ * \returns \ref LIBUSB_ERROR_BUSY if the stream is not running and still
+ * holds data
+ * \returns \ref LIBUSB_ERROR_NOT_SUPPORTED for an IN stream
+ * \returns another LIBUSB_ERROR code if the stream stopped because of an
+ * error, or event handling failed
+ */
+int API_EXPORTED libusb_stream_flush(libusb_stream *stream)
+{
+	struct libusb_context *ctx = HANDLE_CTX(stream->dev_handle);
+	int running, active, r;
+
+	if (!stream->out)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	for (;;) {
+		r = (int)usbi_atomic_load(&stream->error);
+		if (r)
+			return r;
+
+		usbi_mutex_lock(&stream->lock);
+		running = stream->running;
+		active = stream->num_active;
+		usbi_mutex_unlock(&stream->lock);
+
+		if (!active && usbi_atomic_load(&stream->ring.head) ==
+				usbi_atomic_load(&stream->ring.tail))
+			return LIBUSB_SUCCESS;
+		if (!running)
+			return LIBUSB_ERROR_BUSY;
+
+		r = libusb_handle_events_completed(ctx, NULL);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+			return r;
+	}
+}
+
+/** \ingroup libusb_stream
+ * Get the counters of a stream.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param stream the stream to operate on
+ * \param stats output location for the counters
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if stats is NULL
+ */
+int API_EXPORTED libusb_stream_get_stats(libusb_stream *stream,
+	struct libusb_stream_stats *stats)
+{
+	if (!stats)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_mutex_lock(&stream->lock);
+	*stats = stream->stats;
+	usbi_mutex_unlock(&stream->lock);
+	return 0;
+}
+
+/** \ingroup libusb_stream
+ * Stop a stream, wait for its transfers to finish and free it, along with
+ * all of its buffers. This function handles events while waiting, so it must
+ * not be called from a transfer callback.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param stream the stream to close, may be NULL
+ */
+void API_EXPORTED libusb_stream_close(libusb_stream *stream)
+{
+	struct libusb_context *ctx;
+	int r;
+
+	if (!stream)
+		return;
+
+	ctx = HANDLE_CTX(stream->dev_handle);
+
+	usbi_mutex_lock(&stream->lock);
+	stream->running = 0;
+	stream->closing = 1;
+	stream_cancel(stream);
+	stream->closed = stream_check_drained(stream);
+	usbi_mutex_unlock(&stream->lock);
+
+	/* the buffers of the transfers in flight must outlive them */
+	while (!stream->closed) {
+		r = libusb_handle_events_completed(ctx, &stream->closed);
+		if (r < 0) {
+			if (r == LIBUSB_ERROR_INTERRUPTED)
+				continue;
+			usbi_err(ctx, "libusb_handle_events failed: %s, cancelling transfers and retrying",
+				 libusb_error_name(r));
+			usbi_mutex_lock(&stream->lock);
+			stream_cancel(stream);
+			usbi_mutex_unlock(&stream->lock);
+		}
+	}
+
+	free_stream(stream);
+}
@@ -32,6 +32,126 @@
  * may wish to consider using the \ref libusb_asyncio "asynchronous I/O API" instead.
  */
 
+/* size of the bounce buffer kept with a cached transfer, for control
+ * transfers with up to 4096 bytes of data */
+#define SYNC_BUFFER_SIZE	(LIBUSB_CONTROL_SETUP_SIZE + 4096)
+
+/* a transfer kept by a device handle for synchronous I/O */
+struct sync_transfer {
+	struct list_head list;
+	struct libusb_transfer *transfer;
+
+	/* SYNC_BUFFER_SIZE bytes, allocated by the first control transfer */
+	unsigned char *buffer;
+};
+
+static void free_sync_transfer(struct sync_transfer *st)
+{
+	libusb_free_transfer(st->transfer);
+	free(st->buffer);
+	free(st);
+}
+
+/* takes a transfer kept by the device handle, or allocates a new one */
+static struct sync_transfer *get_sync_transfer(struct libusb_device_handle *dev_handle)
+{
+	struct sync_transfer *st = NULL;
+
+	(void)usbi_atomic_inc(&dev_handle->sync_transfers);
+
+	usbi_mutex_lock(&dev_handle->sync_cache_lock);
+	if (!list_empty(&dev_handle->sync_cache)) {
+		st = list_first_entry(&dev_handle->sync_cache, struct sync_transfer, list);
+		list_del(&st->list);
+		dev_handle->sync_cache_count--;
+	}
+	usbi_mutex_unlock(&dev_handle->sync_cache_lock);
+
+	if (st) {
+		(void)usbi_atomic_inc(&dev_handle->sync_cache_hits);
+		return st;
+	}
+
+	(void)usbi_atomic_inc(&dev_handle->sync_allocations);
+	st = calloc(1, sizeof(*st));
+	if (!st)
+		return NULL;
+
+	(void)usbi_atomic_inc(&dev_handle->sync_allocations);
+	st->transfer = libusb_alloc_transfer(0);
+	if (!st->transfer) {
+		free(st);
+		return NULL;
+	}
+
+	return st;
+}
+
+/* gives a transfer back to its device handle, or frees it if the handle
+ * already keeps enough of them */
+static void put_sync_transfer(struct sync_transfer *st)
+{
+	/* NULL if the device handle was closed during the transfer */
+	struct libusb_device_handle *dev_handle = st->transfer->dev_handle;
+
+	if (dev_handle) {
+		usbi_mutex_lock(&dev_handle->sync_cache_lock);
+		if (dev_handle->sync_cache_count < HANDLE_CTX(dev_handle)->sync_cache_size) {
+			list_add(&st->list, &dev_handle->sync_cache);
+			dev_handle->sync_cache_count++;
+			st = NULL;
+		}
+		usbi_mutex_unlock(&dev_handle->sync_cache_lock);
+	}
+
+	if (st)
+		free_sync_transfer(st);
+}
+
+/* returns a bounce buffer of at least size bytes, which is the one kept with
+ * the transfer if it is large enough */
+static unsigned char *get_sync_buffer(struct libusb_device_handle *dev_handle,
+	struct sync_transfer *st, size_t size)
+{
+	if (size > SYNC_BUFFER_SIZE || !HANDLE_CTX(dev_handle)->sync_cache_size) {
+		(void)usbi_atomic_inc(&dev_handle->sync_allocations);
+		return malloc(size);
+	}
+
+	if (!st->buffer) {
+		(void)usbi_atomic_inc(&dev_handle->sync_allocations);
+		st->buffer = malloc(SYNC_BUFFER_SIZE);
+	}
+
+	return st->buffer;
+}
+
+static void put_sync_buffer(struct sync_transfer *st, unsigned char *buffer)
+{
+	if (buffer != st->buffer)
+		free(buffer);
+}
+
+/* Frees the transfers kept by a device handle which is being closed */
+void usbi_sync_cache_free(struct libusb_device_handle *dev_handle)
+{
+	struct sync_transfer *st, *tmp;
+
+	list_for_each_entry_safe(st, tmp, &dev_handle->sync_cache, list, struct sync_transfer)
+		free_sync_transfer(st);
+	list_init(&dev_handle->sync_cache);
+	dev_handle->sync_cache_count = 0;
+}
+
+/* Adds the synchronous I/O statistics of a device handle to stats */
+void usbi_sync_stats_add(struct libusb_sync_stats *stats,
+	struct libusb_device_handle *dev_handle)
+{
+	stats->transfers += (uint64_t)usbi_atomic_load(&dev_handle->sync_transfers);
+	stats->cache_hits += (uint64_t)usbi_atomic_load(&dev_handle->sync_cache_hits);
+	stats->allocations += (uint64_t)usbi_atomic_load(&dev_handle->sync_allocations);
+}
+
 static void LIBUSB_CALL sync_transfer_cb(struct libusb_transfer *transfer)
 {
 	usbi_dbg(TRANSFER_CTX(transfer), "actual_length=%d", transfer->actual_length);
@@ -103,21 +223,34 @@ int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 	uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
 	unsigned char *data, uint16_t wLength, unsigned int timeout)
 {
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	struct sync_transfer *st;
 	struct libusb_transfer *transfer;
 	unsigned char *buffer;
 	int completed = 0;
 	int r;
 
-	if (usbi_handling_events(HANDLE_CTX(dev_handle)))
+	if (usbi_handling_events(ctx))
 		return LIBUSB_ERROR_BUSY;
 
-	transfer = libusb_alloc_transfer(0);
-	if (!transfer)
+	/* let the backend perform the transfer with a blocking system call
+	 * straight from and to the caller's buffer. this does not depend on
+	 * event handling, whichever thread may be doing it */
+	if (usbi_backend.sync_control_transfer && ctx->sync_direct_io) {
+		r = usbi_backend.sync_control_transfer(dev_handle, bmRequestType,
+			bRequest, wValue, wIndex, data, wLength, timeout);
+		if (r != LIBUSB_ERROR_NOT_SUPPORTED)
+			return r;
+	}
+
+	st = get_sync_transfer(dev_handle);
+	if (!st)
 		return LIBUSB_ERROR_NO_MEM;
+	transfer = st->transfer;
 
-	buffer = malloc(LIBUSB_CONTROL_SETUP_SIZE + wLength);
+	buffer = get_sync_buffer(dev_handle, st, LIBUSB_CONTROL_SETUP_SIZE + wLength);
 	if (!buffer) {
-		libusb_free_transfer(transfer);
+		put_sync_transfer(st);
 		return LIBUSB_ERROR_NO_MEM;
 	}
 
@@ -128,10 +261,11 @@ int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 
 	libusb_fill_control_transfer(transfer, dev_handle, buffer,
 		sync_transfer_cb, &completed, timeout);
-	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+	transfer->flags = 0;
 	r = libusb_submit_transfer(transfer);
 	if (r < 0) {
-		libusb_free_transfer(transfer);
+		put_sync_buffer(st, buffer);
+		put_sync_transfer(st);
 		return r;
 	}
 
@@ -162,12 +296,12 @@ int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 		r = LIBUSB_ERROR_IO;
 		break;
 	default:
-		usbi_warn(HANDLE_CTX(dev_handle),
-			"unrecognised status code %d", transfer->status);
+		usbi_warn(ctx, "unrecognised status code %d", transfer->status);
 		r = LIBUSB_ERROR_OTHER;
 	}
 
-	libusb_free_transfer(transfer);
+	put_sync_buffer(st, buffer);
+	put_sync_transfer(st);
 	return r;
 }
 
@@ -175,24 +309,42 @@ static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
 	unsigned char endpoint, unsigned char *buffer, int length,
 	int *transferred, unsigned int timeout, unsigned char type)
 {
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	struct sync_transfer *st;
 	struct libusb_transfer *transfer;
 	int completed = 0;
 	int r;
 
-	if (usbi_handling_events(HANDLE_CTX(dev_handle)))
+	if (usbi_handling_events(ctx))
 		return LIBUSB_ERROR_BUSY;
 
-	transfer = libusb_alloc_transfer(0);
-	if (!transfer)
+	/* let the backend perform the transfer with a blocking system call,
+	 * bypassing transfer allocation and event handling */
+	if (usbi_backend.sync_bulk_transfer && ctx->sync_direct_io) {
+		int direct_transferred = 0;
+
+		r = usbi_backend.sync_bulk_transfer(dev_handle, endpoint, buffer,
+			length, &direct_transferred, timeout);
+		if (r != LIBUSB_ERROR_NOT_SUPPORTED) {
+			if (transferred)
+				*transferred = direct_transferred;
+			return r;
+		}
+	}
+
+	st = get_sync_transfer(dev_handle);
+	if (!st)
 		return LIBUSB_ERROR_NO_MEM;
+	transfer = st->transfer;
 
 	libusb_fill_bulk_transfer(transfer, dev_handle, endpoint, buffer, length,
 		sync_transfer_cb, &completed, timeout);
 	transfer->type = type;
+	transfer->flags = 0;
 
 	r = libusb_submit_transfer(transfer);
 	if (r < 0) {
-		libusb_free_transfer(transfer);
+		put_sync_transfer(st);
 		return r;
 	}
 
@@ -222,12 +374,11 @@ static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
 		r = LIBUSB_ERROR_IO;
 		break;
 	default:
-		usbi_warn(HANDLE_CTX(dev_handle),
-			"unrecognised status code %d", transfer->status);
+		usbi_warn(ctx, "unrecognised status code %d", transfer->status);
 		r = LIBUSB_ERROR_OTHER;
 	}
 
-	libusb_free_transfer(transfer);
+	put_sync_transfer(st);
 	return r;
 }
 
@@ -249,6 +400,10 @@ static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
  * the first few chunks have completed. libusb is careful not to lose any data
  * that may have been transferred; do not assume that timeout conditions
  * indicate a complete lack of I/O. See \ref asynctimeout for more details.
+ * Transfers performed with a single blocking system call, which the
+ * application may opt into with
+ * \ref libusb_option::LIBUSB_OPTION_SYNC_DIRECT_IO
+ * "LIBUSB_OPTION_SYNC_DIRECT_IO", report no data after a timeout though.
  *
  * \param dev_handle a handle for the device to communicate with
  * \param endpoint the address of a valid endpoint to communicate with
@@ -302,6 +457,10 @@ int API_EXPORTED libusb_bulk_transfer(libusb_device_handle *dev_handle,
  * the first few chunks have completed. libusb is careful not to lose any data
  * that may have been transferred; do not assume that timeout conditions
  * indicate a complete lack of I/O. See \ref asynctimeout for more details.
+ * Transfers performed with a single blocking system call, which the
+ * application may opt into with
+ * \ref libusb_option::LIBUSB_OPTION_SYNC_DIRECT_IO
+ * "LIBUSB_OPTION_SYNC_DIRECT_IO", report no data after a timeout though.
  *
  * The default endpoint bInterval value is used as the polling interval.
  *
@@ -337,3 +496,34 @@ int API_EXPORTED libusb_interrupt_transfer(libusb_device_handle *dev_handle,
 	return do_sync_bulk_transfer(dev_handle, endpoint, data, length,
 		transferred, timeout, LIBUSB_TRANSFER_TYPE_INTERRUPT);
 }
+
+/** \ingroup libusb_syncio
+ * Get the synchronous I/O statistics of a context, summed over its device
+ * handles, including those already closed. Only synchronous
+ * transfers which go through the asynchronous transfer path are counted,
+ * see \ref libusb_option::LIBUSB_OPTION_SYNC_DIRECT_IO
+ * "LIBUSB_OPTION_SYNC_DIRECT_IO".
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param stats output location for the statistics
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if stats is NULL
+ */
+int API_EXPORTED libusb_get_sync_stats(libusb_context *ctx,
+	struct libusb_sync_stats *stats)
+{
+	struct libusb_device_handle *dev_handle;
+
+	if (!stats)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	ctx = usbi_get_context(ctx);
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	*stats = ctx->closed_sync_stats;
+	for_each_open_device(ctx, dev_handle)
+		usbi_sync_stats_add(stats, dev_handle);
+	usbi_mutex_unlock(&ctx->open_devs_lock);
+	return 0;
+}
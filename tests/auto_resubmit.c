@@ -0,0 +1,231 @@
+/*
+ * libusb LIBUSB_TRANSFER_AUTO_RESUBMIT tests, against a mock usbfs
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <time.h>
+
+#include "libusb.h"
+#include "libusb_testlib.h"
+#include "mock_usbfs.h"
+
+#define NUM_COMPLETIONS	5
+
+/* What the callback does on each completion before the last one, on which
+ * it clears LIBUSB_TRANSFER_AUTO_RESUBMIT unless told otherwise */
+enum callback_action {
+	ACTION_NONE,
+	/* resubmit the transfer itself */
+	ACTION_SUBMIT,
+	/* on the last completion, fill the device so the resubmission fails */
+	ACTION_FAIL,
+	/* on the last completion, close the device handle */
+	ACTION_CLOSE,
+};
+
+static libusb_context *ctx;
+static libusb_device_handle *handle;
+static struct libusb_transfer *blocker;
+static unsigned char buffer[64], blocker_buffer[64];
+static enum callback_action action;
+static int completed, failed, blocked, submit_errors;
+static enum libusb_transfer_status failed_status;
+
+static void LIBUSB_CALL blocker_cb(struct libusb_transfer *transfer)
+{
+	(void)transfer;
+	blocked = 1;
+}
+
+static void LIBUSB_CALL resubmit_cb(struct libusb_transfer *transfer)
+{
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		failed_status = transfer->status;
+		failed++;
+		return;
+	}
+
+	if (++completed < NUM_COMPLETIONS) {
+		if (action == ACTION_SUBMIT && libusb_submit_transfer(transfer))
+			submit_errors++;
+		return;
+	}
+
+	switch (action) {
+	case ACTION_FAIL:
+		/* the blocker takes the only URB the device accepts */
+		mock_usbfs_max_urbs = 1;
+		if (libusb_submit_transfer(blocker))
+			submit_errors++;
+		break;
+	case ACTION_CLOSE:
+		libusb_close(handle);
+		handle = NULL;
+		break;
+	case ACTION_NONE:
+	case ACTION_SUBMIT:
+		transfer->flags &= ~LIBUSB_TRANSFER_AUTO_RESUBMIT;
+		break;
+	}
+}
+
+static int finished(int expect_failed)
+{
+	return completed >= NUM_COMPLETIONS && failed >= expect_failed &&
+		(action != ACTION_FAIL || blocked);
+}
+
+/* Submits a transfer with LIBUSB_TRANSFER_AUTO_RESUBMIT and the given timeout
+ * and extra flags, and handles events until the callback stopped it */
+static libusb_testlib_result run_resubmits(enum callback_action test_action,
+	unsigned int timeout, uint8_t flags, int expect_failed)
+{
+	struct libusb_init_option options[] = {
+		{ .option = LIBUSB_OPTION_NO_DEVICE_DISCOVERY },
+	};
+	struct libusb_transfer *transfer;
+	struct timeval tv = { 0, 50000 };
+	struct timespec start, now;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	unsigned int expect_reaped;
+	int r;
+
+	r = mock_usbfs_open(options, 1, &ctx, &handle);
+	if (r != LIBUSB_SUCCESS)
+		return r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+
+	action = test_action;
+	completed = 0;
+	failed = 0;
+	blocked = 0;
+	submit_errors = 0;
+	transfer = libusb_alloc_transfer(0);
+	blocker = libusb_alloc_transfer(0);
+	if (!transfer || !blocker) {
+		libusb_free_transfer(transfer);
+		libusb_free_transfer(blocker);
+		mock_usbfs_close(ctx, handle);
+		return TEST_STATUS_ERROR;
+	}
+
+	libusb_fill_bulk_transfer(blocker, handle, 0x81, blocker_buffer,
+		(int)sizeof(blocker_buffer), blocker_cb, NULL, 1000);
+	libusb_fill_bulk_transfer(transfer, handle, 0x81, buffer, (int)sizeof(buffer),
+		resubmit_cb, NULL, timeout);
+	transfer->flags = LIBUSB_TRANSFER_AUTO_RESUBMIT | flags;
+	r = libusb_submit_transfer(transfer);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("submit failed: %s", libusb_error_name(r));
+		goto out;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		if (libusb_handle_events_timeout(ctx, &tv) != LIBUSB_SUCCESS)
+			goto out;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while (!finished(expect_failed) && now.tv_sec - start.tv_sec < 2);
+
+	/* nothing is resubmitted once the callback stopped it */
+	if (libusb_handle_events_timeout(ctx, &tv) != LIBUSB_SUCCESS)
+		goto out;
+
+	expect_reaped = NUM_COMPLETIONS + (action == ACTION_FAIL ? 1 : 0);
+	if (completed != NUM_COMPLETIONS || failed != expect_failed || submit_errors ||
+	    mock_usbfs_reaped != expect_reaped) {
+		libusb_testlib_logf("timeout %u: %d completed, %d failed, %d submit errors, "
+			"%u URBs reaped", timeout, completed, failed, submit_errors,
+			mock_usbfs_reaped);
+		goto out;
+	}
+
+	if (failed && (failed_status != LIBUSB_TRANSFER_ERROR || transfer->actual_length)) {
+		libusb_testlib_logf("failed resubmission reported status %d, %d bytes",
+			failed_status, transfer->actual_length);
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	if (result != TEST_STATUS_SUCCESS && !finished(expect_failed) && handle) {
+		libusb_cancel_transfer(transfer);
+		libusb_handle_events_timeout(ctx, &tv);
+	}
+	if (!(flags & LIBUSB_TRANSFER_FREE_TRANSFER))
+		libusb_free_transfer(transfer);
+	libusb_free_transfer(blocker);
+	mock_usbfs_close(ctx, handle);
+	mock_usbfs_max_urbs = 0;
+	return result;
+}
+
+/* Runs the test on a transfer without a timeout, which is resubmitted while
+ * it stays on the flying list, and on one with a timeout */
+static libusb_testlib_result run_both(enum callback_action test_action,
+	uint8_t flags, int expect_failed)
+{
+	libusb_testlib_result result;
+
+	result = run_resubmits(test_action, 0, flags, expect_failed);
+	if (result != TEST_STATUS_SUCCESS)
+		return result;
+
+	return run_resubmits(test_action, 1000, flags, expect_failed);
+}
+
+static libusb_testlib_result test_resubmit(void)
+{
+	return run_both(ACTION_NONE, 0, 0);
+}
+
+/* Clearing the flag frees a transfer with LIBUSB_TRANSFER_FREE_TRANSFER,
+ * which LeakSanitizer would otherwise report */
+static libusb_testlib_result test_clear_flag(void)
+{
+	return run_both(ACTION_NONE, LIBUSB_TRANSFER_FREE_TRANSFER, 0);
+}
+
+static libusb_testlib_result test_callback_submits(void)
+{
+	return run_both(ACTION_SUBMIT, 0, 0);
+}
+
+static libusb_testlib_result test_resubmit_failure(void)
+{
+	return run_both(ACTION_FAIL, 0, 1);
+}
+
+static libusb_testlib_result test_close_pending(void)
+{
+	return run_both(ACTION_CLOSE, 0, 0);
+}
+
+static const libusb_testlib_test tests[] = {
+	{ "resubmit", &test_resubmit },
+	{ "clear_flag", &test_clear_flag },
+	{ "callback_submits", &test_callback_submits },
+	{ "resubmit_failure", &test_resubmit_failure },
+	{ "close_pending", &test_close_pending },
+	LIBUSB_NULL_TEST
+};
+
+int main(int argc, char *argv[])
+{
+	return libusb_testlib_run_tests(argc, argv, tests);
+}
@@ -0,0 +1,186 @@
+/*
+ * libusb buffer pool tests
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libusb.h"
+#include "libusb_testlib.h"
+
+#define BUFFER_SIZE	1000
+#define NUM_BUFFERS	32
+
+/* Pools without a device handle use host memory only, which is what these
+ * tests exercise. Device memory is tested against a mock usbfs, in
+ * buffer_pool_io.c. */
+static libusb_testlib_result test_get_put(void)
+{
+	libusb_buffer_pool *pool;
+	unsigned char *buffers[NUM_BUFFERS];
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	int i, j;
+
+	if (libusb_alloc_buffer_pool(NULL, BUFFER_SIZE, NUM_BUFFERS, &pool) != LIBUSB_SUCCESS)
+		return TEST_STATUS_ERROR;
+
+	for (i = 0; i < NUM_BUFFERS; i++) {
+		buffers[i] = libusb_buffer_pool_get(pool);
+		if (!buffers[i]) {
+			libusb_testlib_logf("pool ran out after %d buffers", i);
+			goto out;
+		}
+		if ((uintptr_t)buffers[i] % 64) {
+			libusb_testlib_logf("buffer %d is not aligned", i);
+			goto out;
+		}
+		for (j = 0; j < i; j++) {
+			if (buffers[i] < buffers[j] + BUFFER_SIZE &&
+			    buffers[j] < buffers[i] + BUFFER_SIZE) {
+				libusb_testlib_logf("buffers %d and %d overlap", j, i);
+				goto out;
+			}
+		}
+		memset(buffers[i], i, BUFFER_SIZE);
+	}
+
+	if (libusb_buffer_pool_get(pool)) {
+		libusb_testlib_logf("exhausted pool returned a buffer");
+		goto out;
+	}
+
+	/* a buffer given back must be the next one taken */
+	libusb_buffer_pool_put(pool, buffers[5]);
+	if (libusb_buffer_pool_get(pool) != buffers[5])
+		goto out;
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	libusb_free_buffer_pool(pool);
+	return result;
+}
+
+static libusb_testlib_result test_invalid_param(void)
+{
+	libusb_buffer_pool *pool;
+
+	if (libusb_alloc_buffer_pool(NULL, 0, NUM_BUFFERS, &pool) != LIBUSB_ERROR_INVALID_PARAM ||
+	    libusb_alloc_buffer_pool(NULL, BUFFER_SIZE, 0, &pool) != LIBUSB_ERROR_INVALID_PARAM ||
+	    libusb_alloc_buffer_pool(NULL, BUFFER_SIZE, 65536, &pool) != LIBUSB_ERROR_INVALID_PARAM ||
+	    libusb_alloc_buffer_pool(NULL, BUFFER_SIZE, NUM_BUFFERS, NULL) != LIBUSB_ERROR_INVALID_PARAM)
+		return TEST_STATUS_FAILURE;
+
+	/* larger buffers than fit in one region */
+	if (libusb_alloc_buffer_pool(NULL, 3 * 1024 * 1024, 3, &pool) != LIBUSB_SUCCESS)
+		return TEST_STATUS_FAILURE;
+	libusb_free_buffer_pool(pool);
+
+	return TEST_STATUS_SUCCESS;
+}
+
+#if defined(PLATFORM_POSIX)
+#include <pthread.h>
+
+#define NTHREADS	4
+#define THREAD_ITERS	100000
+
+struct get_put_info {
+	libusb_buffer_pool *pool;
+	unsigned char id;
+	int err;
+};
+
+static void *get_put_loop(void *arg)
+{
+	struct get_put_info *info = arg;
+	int i;
+
+	for (i = 0; i < THREAD_ITERS; i++) {
+		unsigned char *buffer = libusb_buffer_pool_get(info->pool);
+
+		if (!buffer) {
+			info->err = 1;
+			break;
+		}
+
+		/* another thread owning the same buffer would overwrite this */
+		memset(buffer, info->id, BUFFER_SIZE);
+		if (buffer[0] != info->id || buffer[BUFFER_SIZE - 1] != info->id) {
+			info->err = 1;
+			break;
+		}
+
+		libusb_buffer_pool_put(info->pool, buffer);
+	}
+
+	return NULL;
+}
+
+static libusb_testlib_result test_threads(void)
+{
+	struct get_put_info info[NTHREADS];
+	pthread_t threads[NTHREADS];
+	libusb_buffer_pool *pool;
+	int errs = 0;
+	int t;
+
+	/* one buffer per thread, so that a thread which finds the pool empty
+	 * has been handed a buffer twice */
+	if (libusb_alloc_buffer_pool(NULL, BUFFER_SIZE, NTHREADS, &pool) != LIBUSB_SUCCESS)
+		return TEST_STATUS_ERROR;
+
+	for (t = 0; t < NTHREADS; t++) {
+		info[t].pool = pool;
+		info[t].id = (unsigned char)(t + 1);
+		info[t].err = 0;
+		if (pthread_create(&threads[t], NULL, get_put_loop, &info[t]) != 0) {
+			libusb_free_buffer_pool(pool);
+			return TEST_STATUS_ERROR;
+		}
+	}
+
+	for (t = 0; t < NTHREADS; t++) {
+		pthread_join(threads[t], NULL);
+		errs += info[t].err;
+	}
+
+	libusb_free_buffer_pool(pool);
+	return errs ? TEST_STATUS_FAILURE : TEST_STATUS_SUCCESS;
+}
+#else
+static libusb_testlib_result test_threads(void)
+{
+	return TEST_STATUS_SKIP;
+}
+#endif
+
+static const libusb_testlib_test tests[] = {
+	{ "get_put", &test_get_put },
+	{ "invalid_param", &test_invalid_param },
+	{ "threads", &test_threads },
+	LIBUSB_NULL_TEST
+};
+
+int main(int argc, char *argv[])
+{
+	return libusb_testlib_run_tests(argc, argv, tests);
+}
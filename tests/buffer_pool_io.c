@@ -0,0 +1,259 @@
+/*
+ * libusb buffer pool tests, against a mock usbfs
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "libusb.h"
+#include "libusb_testlib.h"
+#include "mock_usbfs.h"
+
+#define BUFFER_SIZE	1000
+#define NUM_BUFFERS	32
+#define BENCH_ITERS	100000
+
+/* buffers of this size get a region each */
+#define REGION_BUFFER_SIZE	(3 * 1024 * 1024)
+#define NUM_REGIONS		3
+
+static libusb_context *ctx;
+static libusb_device_handle *handle;
+
+/* keeps the compiler from optimizing the benchmarked allocations away */
+static unsigned char *volatile sink;
+
+static int open_mock(void)
+{
+	struct libusb_init_option options[] = {
+		{ .option = LIBUSB_OPTION_NO_DEVICE_DISCOVERY },
+	};
+
+	return mock_usbfs_open(options, 1, &ctx, &handle);
+}
+
+static void close_mock(void)
+{
+	mock_usbfs_close(ctx, handle);
+	mock_usbfs_mmap_errno = 0;
+	mock_usbfs_max_mappings = 0;
+}
+
+/* Takes every buffer of the pool, checks that they are aligned and can be
+ * written, transfers the first one, and gives them all back */
+static libusb_testlib_result use_pool(libusb_buffer_pool *pool, size_t size,
+	int num_buffers)
+{
+	unsigned char *buffers[NUM_BUFFERS];
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	int i, transferred, r;
+
+	for (i = 0; i < num_buffers; i++) {
+		buffers[i] = libusb_buffer_pool_get(pool);
+		if (!buffers[i]) {
+			libusb_testlib_logf("pool ran out after %d buffers", i);
+			goto out;
+		}
+		if ((uintptr_t)buffers[i] % 64) {
+			libusb_testlib_logf("buffer %d is not aligned", i);
+			i++;
+			goto out;
+		}
+		memset(buffers[i], i, size);
+	}
+
+	if (libusb_buffer_pool_get(pool)) {
+		libusb_testlib_logf("exhausted pool returned a buffer");
+		goto out;
+	}
+
+	r = libusb_bulk_transfer(handle, 0x81, buffers[0], BUFFER_SIZE,
+		&transferred, 1000);
+	if (r != LIBUSB_SUCCESS || transferred != BUFFER_SIZE) {
+		libusb_testlib_logf("transfer: %s, %d bytes", libusb_error_name(r),
+			transferred);
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	while (i--)
+		libusb_buffer_pool_put(pool, buffers[i]);
+	return result;
+}
+
+/* A pool on a device handle is carved from regions of device memory, which
+ * are given back when the pool is freed */
+static libusb_testlib_result test_device_memory(void)
+{
+	libusb_buffer_pool *pool;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	int r;
+
+	r = open_mock();
+	if (r != LIBUSB_SUCCESS)
+		return r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+
+	r = libusb_alloc_buffer_pool(handle, REGION_BUFFER_SIZE, NUM_REGIONS, &pool);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("allocating the pool: %s", libusb_error_name(r));
+		goto out;
+	}
+
+	if (mock_usbfs_mappings != NUM_REGIONS) {
+		libusb_testlib_logf("%d regions mapped", mock_usbfs_mappings);
+		libusb_free_buffer_pool(pool);
+		goto out;
+	}
+
+	result = use_pool(pool, REGION_BUFFER_SIZE, NUM_REGIONS);
+	libusb_free_buffer_pool(pool);
+	if (mock_usbfs_mappings) {
+		libusb_testlib_logf("%d regions left mapped", mock_usbfs_mappings);
+		result = TEST_STATUS_FAILURE;
+	}
+
+out:
+	close_mock();
+	return result;
+}
+
+/* Where the device memory cannot be mapped, or runs out, the pool falls back
+ * to host memory, and only unmaps the regions that were mapped */
+static libusb_testlib_result test_host_fallback(void)
+{
+	libusb_buffer_pool *pool;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	int r;
+
+	r = open_mock();
+	if (r != LIBUSB_SUCCESS)
+		return r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+
+	mock_usbfs_mmap_errno = ENOMEM;
+	r = libusb_alloc_buffer_pool(handle, BUFFER_SIZE, NUM_BUFFERS, &pool);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("allocating the host pool: %s", libusb_error_name(r));
+		goto out;
+	}
+	if (mock_usbfs_mappings ||
+	    use_pool(pool, BUFFER_SIZE, NUM_BUFFERS) != TEST_STATUS_SUCCESS) {
+		libusb_free_buffer_pool(pool);
+		goto out;
+	}
+	libusb_free_buffer_pool(pool);
+
+	/* the first region is device memory, the others host memory */
+	mock_usbfs_mmap_errno = 0;
+	mock_usbfs_max_mappings = 1;
+	r = libusb_alloc_buffer_pool(handle, REGION_BUFFER_SIZE, NUM_REGIONS, &pool);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("allocating the mixed pool: %s", libusb_error_name(r));
+		goto out;
+	}
+	if (mock_usbfs_mappings != 1) {
+		libusb_testlib_logf("%d regions mapped", mock_usbfs_mappings);
+		libusb_free_buffer_pool(pool);
+		goto out;
+	}
+
+	result = use_pool(pool, REGION_BUFFER_SIZE, NUM_REGIONS);
+	libusb_free_buffer_pool(pool);
+	if (mock_usbfs_mappings) {
+		libusb_testlib_logf("%d regions left mapped", mock_usbfs_mappings);
+		result = TEST_STATUS_FAILURE;
+	}
+
+out:
+	close_mock();
+	return result;
+}
+
+static double elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+	return (double)(end->tv_sec - start->tv_sec) * 1e9 +
+		(double)(end->tv_nsec - start->tv_nsec);
+}
+
+/* Compares taking and giving back a buffer of the pool with allocating
+ * device memory for each transfer with libusb_dev_mem_alloc() and
+ * libusb_dev_mem_free(). The mock maps anonymous memory, which is cheaper
+ * than mapping usbfs memory, so this understates the difference. */
+static libusb_testlib_result test_pool_benchmark(void)
+{
+	libusb_buffer_pool *pool;
+	struct timespec start, end;
+	double dev_mem_ns, pool_ns;
+	int i, r;
+
+	r = open_mock();
+	if (r != LIBUSB_SUCCESS)
+		return r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < BENCH_ITERS; i++) {
+		sink = libusb_dev_mem_alloc(handle, BUFFER_SIZE);
+		if (!sink)
+			break;
+		libusb_dev_mem_free(handle, sink, BUFFER_SIZE);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (i < BENCH_ITERS) {
+		close_mock();
+		return TEST_STATUS_ERROR;
+	}
+	dev_mem_ns = elapsed_ns(&start, &end) / BENCH_ITERS;
+
+	r = libusb_alloc_buffer_pool(handle, BUFFER_SIZE, NUM_BUFFERS, &pool);
+	if (r != LIBUSB_SUCCESS) {
+		close_mock();
+		return TEST_STATUS_ERROR;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < BENCH_ITERS; i++) {
+		sink = libusb_buffer_pool_get(pool);
+		libusb_buffer_pool_put(pool, sink);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	pool_ns = elapsed_ns(&start, &end) / BENCH_ITERS;
+
+	libusb_free_buffer_pool(pool);
+	close_mock();
+
+	libusb_testlib_logf("get/put: dev_mem_alloc/free %.1fns, pool %.1fns",
+		dev_mem_ns, pool_ns);
+
+	return TEST_STATUS_SUCCESS;
+}
+
+static const libusb_testlib_test tests[] = {
+	{ "device_memory", &test_device_memory },
+	{ "host_fallback", &test_host_fallback },
+	{ "pool_benchmark", &test_pool_benchmark },
+	LIBUSB_NULL_TEST
+};
+
+int main(int argc, char *argv[])
+{
+	return libusb_testlib_run_tests(argc, argv, tests);
+}
@@ -0,0 +1,395 @@
+/*
+ * libusb callback thread tests, against a mock usbfs
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libusb.h"
+#include "libusb_testlib.h"
+#include "mock_usbfs.h"
+
+#define NUM_ENDPOINTS	4
+#define NUM_IN_FLIGHT	8
+#define NUM_CALLBACKS	4000
+#define NUM_EXIT	20
+#define NUM_CLOSE	20
+#define NUM_SLOW	50
+#define NUM_FAST	200
+#define SLOW_CALLBACK_NS	1000000L
+
+static libusb_context *ctx;
+static libusb_device_handle *handle;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int callbacks;
+static int in_flight;
+static int done;
+static int closed_handles;
+
+static int open_mock(int callback_threads)
+{
+	struct libusb_init_option options[] = {
+		{ .option = LIBUSB_OPTION_NO_DEVICE_DISCOVERY },
+		{ .option = LIBUSB_OPTION_CALLBACK_THREADS, .value = { .ival = callback_threads } },
+	};
+
+	mock_usbfs_reap_lifo = 0;
+	callbacks = 0;
+	in_flight = 0;
+	done = 0;
+	closed_handles = 0;
+	return mock_usbfs_open(options, 2, &ctx, &handle);
+}
+
+static double elapsed_ms(const struct timespec *start, const struct timespec *end)
+{
+	return (double)(end->tv_sec - start->tv_sec) * 1e3 +
+		(double)(end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static int submit_bulk(unsigned char endpoint, libusb_transfer_cb_fn callback,
+	void *user_data, int seq)
+{
+	struct libusb_transfer *transfer;
+	unsigned char *buffer;
+	int r;
+
+	transfer = libusb_alloc_transfer(0);
+	buffer = malloc(64);
+	if (!transfer || !buffer) {
+		libusb_free_transfer(transfer);
+		free(buffer);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	memcpy(buffer, &seq, sizeof(seq));
+	libusb_fill_bulk_transfer(transfer, handle, endpoint, buffer, 64,
+		callback, user_data, 0);
+	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER;
+
+	pthread_mutex_lock(&lock);
+	in_flight++;
+	pthread_mutex_unlock(&lock);
+
+	r = libusb_submit_transfer(transfer);
+	if (r != LIBUSB_SUCCESS) {
+		pthread_mutex_lock(&lock);
+		in_flight--;
+		pthread_mutex_unlock(&lock);
+		libusb_free_transfer(transfer);
+	}
+	return r;
+}
+
+/* Counts a callback and, once no transfer is left in flight, sets done */
+static void count_callback(void)
+{
+	pthread_mutex_lock(&lock);
+	callbacks++;
+	if (--in_flight == 0)
+		done = 1;
+	pthread_mutex_unlock(&lock);
+}
+
+struct endpoint_state {
+	unsigned char endpoint;
+	int next_submit;
+	int next_callback;
+	pthread_t thread;
+	int has_thread;
+	int error;
+};
+
+static void order_cb(struct libusb_transfer *transfer)
+{
+	struct endpoint_state *ep = transfer->user_data;
+	int seq, resubmit;
+
+	memcpy(&seq, transfer->buffer, sizeof(seq));
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED || seq != ep->next_callback)
+		ep->error = 1;
+	ep->next_callback++;
+
+	if (!ep->has_thread) {
+		ep->thread = pthread_self();
+		ep->has_thread = 1;
+	} else if (!pthread_equal(ep->thread, pthread_self())) {
+		ep->error = 1;
+	}
+
+	pthread_mutex_lock(&lock);
+	resubmit = callbacks + in_flight < NUM_CALLBACKS;
+	pthread_mutex_unlock(&lock);
+
+	/* the transfer is freed once this callback returns */
+	if (resubmit && submit_bulk(ep->endpoint, order_cb, ep, ep->next_submit++) != LIBUSB_SUCCESS)
+		ep->error = 1;
+	count_callback();
+}
+
+/* Callbacks of each endpoint must run in completion order, on one thread */
+static libusb_testlib_result test_callback_order(void)
+{
+	struct endpoint_state eps[NUM_ENDPOINTS];
+	libusb_testlib_result result = TEST_STATUS_SUCCESS;
+	int i, j, r = LIBUSB_SUCCESS;
+
+	if (open_mock(3) != LIBUSB_SUCCESS)
+		return TEST_STATUS_ERROR;
+
+	memset(eps, 0, sizeof(eps));
+	for (i = 0; i < NUM_ENDPOINTS; i++)
+		eps[i].endpoint = (unsigned char)(LIBUSB_ENDPOINT_IN | (i + 1));
+	for (j = 0; j < NUM_IN_FLIGHT && r == LIBUSB_SUCCESS; j++)
+		for (i = 0; i < NUM_ENDPOINTS && r == LIBUSB_SUCCESS; i++)
+			r = submit_bulk(eps[i].endpoint, order_cb, &eps[i], eps[i].next_submit++);
+
+	while (!done && r == LIBUSB_SUCCESS)
+		r = libusb_handle_events_completed(ctx, &done);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("handling events failed: %s", libusb_error_name(r));
+		result = TEST_STATUS_FAILURE;
+	}
+
+	for (i = 0; i < NUM_ENDPOINTS; i++) {
+		if (eps[i].error) {
+			libusb_testlib_logf("endpoint 0x%02x: callback out of order or on another thread",
+				eps[i].endpoint);
+			result = TEST_STATUS_FAILURE;
+		}
+	}
+	if (result == TEST_STATUS_SUCCESS && callbacks != NUM_CALLBACKS) {
+		libusb_testlib_logf("%d callbacks, expected %d", callbacks, NUM_CALLBACKS);
+		result = TEST_STATUS_FAILURE;
+	}
+
+	mock_usbfs_close(ctx, handle);
+	return result;
+}
+
+/* Synchronous transfers wait for their callback on a callback thread */
+static libusb_testlib_result test_sync_transfer(void)
+{
+	unsigned char data[64];
+	int i, r = LIBUSB_SUCCESS, transferred = (int)sizeof(data);
+
+	if (open_mock(2) != LIBUSB_SUCCESS)
+		return TEST_STATUS_ERROR;
+
+	for (i = 0; i < 100 && r == LIBUSB_SUCCESS && transferred == (int)sizeof(data); i++)
+		r = libusb_bulk_transfer(handle, 0x82, data, (int)sizeof(data), &transferred, 1000);
+
+	mock_usbfs_close(ctx, handle);
+	if (r != LIBUSB_SUCCESS || transferred != (int)sizeof(data)) {
+		libusb_testlib_logf("bulk transfer returned %s, %d bytes",
+			libusb_error_name(r), transferred);
+		return TEST_STATUS_FAILURE;
+	}
+
+	return TEST_STATUS_SUCCESS;
+}
+
+static void slow_cb(struct libusb_transfer *transfer)
+{
+	struct timespec delay = { 0, SLOW_CALLBACK_NS };
+
+	(void)transfer;
+	nanosleep(&delay, NULL);
+	count_callback();
+}
+
+/* libusb_exit() must run the callbacks still queued to callback threads */
+static libusb_testlib_result test_exit_runs_callbacks(void)
+{
+	int i, r = LIBUSB_SUCCESS;
+
+	if (open_mock(2) != LIBUSB_SUCCESS)
+		return TEST_STATUS_ERROR;
+
+	for (i = 0; i < NUM_EXIT && r == LIBUSB_SUCCESS; i++)
+		r = submit_bulk(0x81, slow_cb, NULL, i);
+	while (r == LIBUSB_SUCCESS && mock_usbfs_reaped < NUM_EXIT)
+		r = libusb_handle_events_timeout_completed(ctx, &(struct timeval){ 0, 0 }, NULL);
+
+	mock_usbfs_close(ctx, handle);
+	if (r != LIBUSB_SUCCESS || callbacks != NUM_EXIT) {
+		libusb_testlib_logf("%d callbacks, expected %d", callbacks, NUM_EXIT);
+		return TEST_STATUS_FAILURE;
+	}
+
+	return TEST_STATUS_SUCCESS;
+}
+
+/* Reads the device handle of the transfer, which must still be open, and
+ * then takes its time */
+static void handle_cb(struct libusb_transfer *transfer)
+{
+	if (!transfer->dev_handle || !libusb_get_device(transfer->dev_handle)) {
+		pthread_mutex_lock(&lock);
+		closed_handles++;
+		pthread_mutex_unlock(&lock);
+	}
+	slow_cb(transfer);
+}
+
+/* libusb_close() must run the callbacks of the device handle still queued
+ * to callback threads, and wait for those running, before it frees it */
+static libusb_testlib_result test_close_runs_callbacks(void)
+{
+	int i, r = LIBUSB_SUCCESS;
+
+	if (open_mock(2) != LIBUSB_SUCCESS)
+		return TEST_STATUS_ERROR;
+
+	for (i = 0; i < NUM_CLOSE && r == LIBUSB_SUCCESS; i++)
+		r = submit_bulk(i % 2 ? 0x81 : 0x82, handle_cb, NULL, i);
+	while (r == LIBUSB_SUCCESS && mock_usbfs_reaped < NUM_CLOSE)
+		r = libusb_handle_events_timeout_completed(ctx, &(struct timeval){ 0, 0 }, NULL);
+
+	libusb_close(handle);
+	pthread_mutex_lock(&lock);
+	i = callbacks;
+	pthread_mutex_unlock(&lock);
+
+	mock_usbfs_close(ctx, NULL);
+	if (r != LIBUSB_SUCCESS || i != NUM_CLOSE || closed_handles) {
+		libusb_testlib_logf("%d callbacks before the handle was closed, expected %d, "
+			"%d saw it closed", i, NUM_CLOSE, closed_handles);
+		return TEST_STATUS_FAILURE;
+	}
+
+	return TEST_STATUS_SUCCESS;
+}
+
+/* The first callback, once the other transfers completed, closes the device
+ * handle while their callbacks are queued to its own thread */
+static void close_cb(struct libusb_transfer *transfer)
+{
+	int seq;
+
+	memcpy(&seq, transfer->buffer, sizeof(seq));
+	if (seq == 0) {
+		struct timespec delay = { 0, 20 * SLOW_CALLBACK_NS };
+
+		nanosleep(&delay, NULL);
+		libusb_close(transfer->dev_handle);
+	} else if (!transfer->dev_handle || !libusb_get_device(transfer->dev_handle)) {
+		pthread_mutex_lock(&lock);
+		closed_handles++;
+		pthread_mutex_unlock(&lock);
+	}
+	count_callback();
+}
+
+static libusb_testlib_result test_close_from_callback(void)
+{
+	int i, r = LIBUSB_SUCCESS;
+
+	if (open_mock(2) != LIBUSB_SUCCESS)
+		return TEST_STATUS_ERROR;
+
+	for (i = 0; i < NUM_CLOSE && r == LIBUSB_SUCCESS; i++)
+		r = submit_bulk(0x81, close_cb, NULL, i);
+	while (!done && r == LIBUSB_SUCCESS)
+		r = libusb_handle_events_completed(ctx, &done);
+
+	mock_usbfs_close(ctx, NULL);
+	if (r != LIBUSB_SUCCESS || callbacks != NUM_CLOSE || closed_handles) {
+		libusb_testlib_logf("%d callbacks, expected %d, %d saw the handle closed",
+			callbacks, NUM_CLOSE, closed_handles);
+		return TEST_STATUS_FAILURE;
+	}
+
+	return TEST_STATUS_SUCCESS;
+}
+
+static struct timespec fast_done;
+
+static void fast_cb(struct libusb_transfer *transfer)
+{
+	(void)transfer;
+	pthread_mutex_lock(&lock);
+	clock_gettime(CLOCK_MONOTONIC, &fast_done);
+	pthread_mutex_unlock(&lock);
+	count_callback();
+}
+
+/* Times reaping a mix of slow and fast completions on two endpoints */
+static int run_latency(int callback_threads, double *reap_ms, double *fast_ms, double *total_ms)
+{
+	struct timespec start, end;
+	int i, r = LIBUSB_SUCCESS;
+
+	if (open_mock(callback_threads) != LIBUSB_SUCCESS)
+		return LIBUSB_ERROR_OTHER;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < NUM_FAST && r == LIBUSB_SUCCESS; i++) {
+		if (i % (NUM_FAST / NUM_SLOW) == 0)
+			r = submit_bulk(0x82, slow_cb, NULL, i);
+		if (r == LIBUSB_SUCCESS)
+			r = submit_bulk(0x83, fast_cb, NULL, i);
+	}
+	while (!done && r == LIBUSB_SUCCESS)
+		r = libusb_handle_events_completed(ctx, &done);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	*reap_ms = elapsed_ms(&start, &mock_usbfs_last_reap);
+	*fast_ms = elapsed_ms(&start, &fast_done);
+	*total_ms = elapsed_ms(&start, &end);
+	mock_usbfs_close(ctx, handle);
+	return r;
+}
+
+/* Reports how long it takes until all URBs are reaped and all fast
+ * callbacks have run, with callbacks run inline and on two threads.
+ * Inline, both wait for every slow callback ahead of them. */
+static libusb_testlib_result test_reap_latency(void)
+{
+	double reap_ms, fast_ms, total_ms;
+	int threads;
+
+	for (threads = 0; threads <= 2; threads += 2) {
+		if (run_latency(threads, &reap_ms, &fast_ms, &total_ms) != LIBUSB_SUCCESS)
+			return TEST_STATUS_FAILURE;
+		libusb_testlib_logf("%d callback threads: all URBs reaped after %.1fms, "
+			"fast callbacks done after %.1fms, slow after %.1fms",
+			threads, reap_ms, fast_ms, total_ms);
+	}
+
+	return TEST_STATUS_SUCCESS;
+}
+
+static const libusb_testlib_test tests[] = {
+	{ "callback_order", &test_callback_order },
+	{ "sync_transfer", &test_sync_transfer },
+	{ "exit_runs_callbacks", &test_exit_runs_callbacks },
+	{ "close_runs_callbacks", &test_close_runs_callbacks },
+	{ "close_from_callback", &test_close_from_callback },
+	{ "reap_latency", &test_reap_latency },
+	LIBUSB_NULL_TEST
+};
+
+int main(int argc, char *argv[])
+{
+	return libusb_testlib_run_tests(argc, argv, tests);
+}
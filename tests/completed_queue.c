@@ -0,0 +1,265 @@
+/*
+ * libusb completed transfer queue tests
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libusbi.h"
+#include "libusb_testlib.h"
+
+#if defined(PLATFORM_POSIX)
+
+#include <pthread.h>
+typedef pthread_t thread_t;
+typedef void * thread_return_t;
+#define THREAD_RETURN_VALUE NULL
+#define THREAD_CALL_TYPE
+
+static inline int thread_create(thread_t *thread,
+	thread_return_t (*thread_entry)(void *arg), void *arg)
+{
+	return pthread_create(thread, NULL, thread_entry, arg) == 0 ? 0 : -1;
+}
+
+static inline void thread_join(thread_t thread)
+{
+	(void)pthread_join(thread, NULL);
+}
+
+#elif defined(PLATFORM_WINDOWS)
+
+typedef HANDLE thread_t;
+#define THREAD_RETURN_VALUE 0
+#define THREAD_CALL_TYPE __stdcall
+
+#if defined(__CYGWIN__)
+typedef DWORD thread_return_t;
+#else
+#include <process.h>
+typedef unsigned thread_return_t;
+#endif
+
+static inline int thread_create(thread_t *thread,
+	thread_return_t (__stdcall *thread_entry)(void *arg), void *arg)
+{
+#if defined(__CYGWIN__)
+	*thread = CreateThread(NULL, 0, thread_entry, arg, 0, NULL);
+#else
+	*thread = (HANDLE)_beginthreadex(NULL, 0, thread_entry, arg, 0, NULL);
+#endif
+	return *thread != NULL ? 0 : -1;
+}
+
+static inline void thread_join(thread_t thread)
+{
+	(void)WaitForSingleObject(thread, INFINITE);
+	(void)CloseHandle(thread);
+}
+#endif /* PLATFORM_WINDOWS */
+
+#define NUM_PRODUCERS	4
+#define NUM_PUSHES	50000
+
+/* Transfers are pushed, taken and pushed again in order */
+static libusb_testlib_result test_order(void)
+{
+	struct usbi_transfer itransfers[3];
+	struct usbi_transfer *itransfer, *tmp;
+	usbi_atomic_ptr_t queue;
+	struct list_head list;
+	int i;
+
+	memset(itransfers, 0, sizeof(itransfers));
+	usbi_atomic_ptr_store(&queue, NULL);
+	list_init(&list);
+
+	if (!usbi_completed_queue_push(&queue, &itransfers[0]) ||
+	    usbi_completed_queue_push(&queue, &itransfers[1])) {
+		libusb_testlib_logf("only the first push should find the queue empty");
+		return TEST_STATUS_FAILURE;
+	}
+
+	/* taken transfers go after those already on the list */
+	usbi_completed_queue_take(&queue, &list);
+	usbi_completed_queue_push(&queue, &itransfers[2]);
+	usbi_completed_queue_take(&queue, &list);
+	if (usbi_atomic_ptr_load(&queue)) {
+		libusb_testlib_logf("queue not empty after it was taken");
+		return TEST_STATUS_FAILURE;
+	}
+
+	i = 0;
+	__for_each_completed_transfer_safe(&list, itransfer, tmp) {
+		if (itransfer != &itransfers[i]) {
+			libusb_testlib_logf("transfer %d taken out of order", i);
+			return TEST_STATUS_FAILURE;
+		}
+		list_del(&itransfer->completed_list);
+		i++;
+	}
+	if (i != 3) {
+		libusb_testlib_logf("%d transfers taken, expected 3", i);
+		return TEST_STATUS_FAILURE;
+	}
+
+	if (!usbi_completed_queue_push(&queue, &itransfers[0])) {
+		libusb_testlib_logf("push after take should find the queue empty");
+		return TEST_STATUS_FAILURE;
+	}
+
+	return TEST_STATUS_SUCCESS;
+}
+
+/* The queue is compared with a list protected by a mutex, which is what the
+ * context used before. Either way, only a push that finds it empty counts
+ * as a signal. */
+static struct usbi_transfer *itransfers;
+static usbi_atomic_ptr_t queue;
+static usbi_mutex_t lock;
+static struct list_head locked_list;
+static int use_lock;
+static usbi_atomic_t signals;
+
+static thread_return_t THREAD_CALL_TYPE producer(void *arg)
+{
+	struct usbi_transfer *first = arg;
+	int i, was_empty;
+
+	for (i = 0; i < NUM_PUSHES; i++) {
+		if (use_lock) {
+			usbi_mutex_lock(&lock);
+			was_empty = list_empty(&locked_list);
+			list_add_tail(&first[i].completed_list, &locked_list);
+			usbi_mutex_unlock(&lock);
+		} else {
+			was_empty = usbi_completed_queue_push(&queue, &first[i]);
+		}
+		if (was_empty)
+			(void)usbi_atomic_inc(&signals);
+	}
+
+	return THREAD_RETURN_VALUE;
+}
+
+static double elapsed_ms(const struct timespec *start, const struct timespec *end)
+{
+	return (double)(end->tv_sec - start->tv_sec) * 1e3 +
+		(double)(end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* Takes transfers from several producers until all arrived, checking that
+ * those of each producer arrive in order */
+static int run_producers(int with_lock, double *ms)
+{
+	thread_t threads[NUM_PRODUCERS];
+	int next[NUM_PRODUCERS] = { 0 };
+	struct timespec start, end;
+	struct list_head list;
+	int received = 0, errors = 0, p;
+
+	use_lock = with_lock;
+	usbi_atomic_ptr_store(&queue, NULL);
+	usbi_atomic_store(&signals, 0);
+	list_init(&locked_list);
+	list_init(&list);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (p = 0; p < NUM_PRODUCERS; p++) {
+		if (thread_create(&threads[p], producer, &itransfers[p * NUM_PUSHES]) != 0) {
+			libusb_testlib_logf("failed to start producer %d", p);
+			return -1;
+		}
+	}
+
+	while (received < NUM_PRODUCERS * NUM_PUSHES) {
+		struct usbi_transfer *itransfer, *tmp;
+
+		if (use_lock) {
+			usbi_mutex_lock(&lock);
+			list_cut(&list, &locked_list);
+			usbi_mutex_unlock(&lock);
+		} else {
+			usbi_completed_queue_take(&queue, &list);
+		}
+
+		__for_each_completed_transfer_safe(&list, itransfer, tmp) {
+			int index = (int)(itransfer - itransfers);
+
+			p = index / NUM_PUSHES;
+			if (index % NUM_PUSHES != next[p])
+				errors++;
+			next[p] = index % NUM_PUSHES + 1;
+			list_del(&itransfer->completed_list);
+			received++;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	for (p = 0; p < NUM_PRODUCERS; p++)
+		thread_join(threads[p]);
+
+	*ms = elapsed_ms(&start, &end);
+	return errors;
+}
+
+/* Transfers of several producers all arrive, each producer's in order, and
+ * reports how many pushes found the queue empty */
+static libusb_testlib_result test_producers(void)
+{
+	libusb_testlib_result result = TEST_STATUS_SUCCESS;
+	int with_lock;
+	double ms;
+
+	itransfers = calloc(NUM_PRODUCERS * NUM_PUSHES, sizeof(*itransfers));
+	if (!itransfers)
+		return TEST_STATUS_ERROR;
+	usbi_mutex_init(&lock);
+
+	for (with_lock = 1; with_lock >= 0; with_lock--) {
+		int errors = run_producers(with_lock, &ms);
+
+		if (errors) {
+			libusb_testlib_logf("%s: %d transfers out of order",
+				with_lock ? "locked list" : "queue", errors);
+			result = TEST_STATUS_FAILURE;
+			break;
+		}
+		libusb_testlib_logf("%s: %d pushes from %d threads in %.1fms, %ld found it empty",
+			with_lock ? "locked list" : "queue", NUM_PRODUCERS * NUM_PUSHES,
+			NUM_PRODUCERS, ms, (long)usbi_atomic_load(&signals));
+	}
+
+	usbi_mutex_destroy(&lock);
+	free(itransfers);
+	return result;
+}
+
+static const libusb_testlib_test tests[] = {
+	{ "order", &test_order },
+	{ "producers", &test_producers },
+	LIBUSB_NULL_TEST
+};
+
+int main(int argc, char *argv[])
+{
+	return libusb_testlib_run_tests(argc, argv, tests);
+}
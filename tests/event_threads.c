@@ -0,0 +1,213 @@
+/*
+ * libusb event thread tests, against a mock usbfs
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libusb.h"
+#include "libusb_testlib.h"
+#include "mock_usbfs.h"
+
+#define NUM_ENDPOINTS	4
+#define NUM_IN_FLIGHT	8
+#define NUM_CALLBACKS	4000
+
+static libusb_context *ctx;
+static libusb_device_handle *handle;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t main_thread;
+static int callbacks;
+static int submitted;
+static int in_flight;
+static int on_main_thread;
+static int done;
+
+static int open_mock(int event_threads)
+{
+	struct libusb_init_option options[] = {
+		{ .option = LIBUSB_OPTION_NO_DEVICE_DISCOVERY },
+		{ .option = LIBUSB_OPTION_EVENT_THREADS, .value = { .ival = event_threads } },
+	};
+
+	main_thread = pthread_self();
+	mock_usbfs_reap_lifo = 0;
+	callbacks = 0;
+	submitted = 0;
+	in_flight = 0;
+	on_main_thread = 0;
+	done = 0;
+	return mock_usbfs_open(options, 2, &ctx, &handle);
+}
+
+static int submit_bulk(unsigned char endpoint, libusb_transfer_cb_fn callback)
+{
+	struct libusb_transfer *transfer;
+	unsigned char *buffer;
+	int r;
+
+	transfer = libusb_alloc_transfer(0);
+	buffer = malloc(64);
+	if (!transfer || !buffer) {
+		libusb_free_transfer(transfer);
+		free(buffer);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	libusb_fill_bulk_transfer(transfer, handle, endpoint, buffer, 64,
+		callback, NULL, 0);
+	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER;
+
+	pthread_mutex_lock(&lock);
+	in_flight++;
+	pthread_mutex_unlock(&lock);
+
+	r = libusb_submit_transfer(transfer);
+	if (r != LIBUSB_SUCCESS) {
+		pthread_mutex_lock(&lock);
+		in_flight--;
+		pthread_mutex_unlock(&lock);
+		libusb_free_transfer(transfer);
+	}
+	return r;
+}
+
+static void resubmit_cb(struct libusb_transfer *transfer)
+{
+	int resubmit;
+
+	pthread_mutex_lock(&lock);
+	if (pthread_equal(pthread_self(), main_thread))
+		on_main_thread++;
+	/* callbacks of different endpoints may run concurrently, so the
+	 * transfer to resubmit is counted before it is submitted */
+	resubmit = transfer->status == LIBUSB_TRANSFER_COMPLETED &&
+		submitted < NUM_CALLBACKS;
+	if (resubmit)
+		submitted++;
+	pthread_mutex_unlock(&lock);
+
+	/* the transfer is freed once this callback returns */
+	if (resubmit)
+		submit_bulk(transfer->endpoint, resubmit_cb);
+
+	pthread_mutex_lock(&lock);
+	callbacks++;
+	if (--in_flight == 0)
+		done = 1;
+	pthread_mutex_unlock(&lock);
+}
+
+/* Transfers are reaped and their callbacks run on an event thread, and the
+ * application's event handling returns once they set its completion flag */
+static libusb_testlib_result test_callbacks(void)
+{
+	libusb_testlib_result result = TEST_STATUS_SUCCESS;
+	int i, r = LIBUSB_SUCCESS;
+
+	if (open_mock(2) != LIBUSB_SUCCESS)
+		return TEST_STATUS_ERROR;
+
+	submitted = NUM_ENDPOINTS * NUM_IN_FLIGHT;
+	for (i = 0; i < NUM_ENDPOINTS * NUM_IN_FLIGHT && r == LIBUSB_SUCCESS; i++)
+		r = submit_bulk((unsigned char)(LIBUSB_ENDPOINT_IN | (i % NUM_ENDPOINTS + 1)),
+			resubmit_cb);
+
+	while (r == LIBUSB_SUCCESS && !done)
+		r = libusb_handle_events_completed(ctx, &done);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("handling events failed: %s", libusb_error_name(r));
+		result = TEST_STATUS_FAILURE;
+	}
+
+	mock_usbfs_close(ctx, handle);
+	if (callbacks != NUM_CALLBACKS || on_main_thread) {
+		libusb_testlib_logf("%d callbacks, expected %d, %d on the main thread",
+			callbacks, NUM_CALLBACKS, on_main_thread);
+		result = TEST_STATUS_FAILURE;
+	}
+
+	return result;
+}
+
+/* Synchronous transfers wait for their callback on an event thread */
+static libusb_testlib_result test_sync_transfer(void)
+{
+	unsigned char data[64];
+	int i, r = LIBUSB_SUCCESS, transferred = (int)sizeof(data);
+
+	if (open_mock(1) != LIBUSB_SUCCESS)
+		return TEST_STATUS_ERROR;
+
+	for (i = 0; i < 100 && r == LIBUSB_SUCCESS && transferred == (int)sizeof(data); i++)
+		r = libusb_bulk_transfer(handle, 0x82, data, (int)sizeof(data), &transferred, 1000);
+
+	mock_usbfs_close(ctx, handle);
+	if (r != LIBUSB_SUCCESS || transferred != (int)sizeof(data)) {
+		libusb_testlib_logf("bulk transfer returned %s, %d bytes",
+			libusb_error_name(r), transferred);
+		return TEST_STATUS_FAILURE;
+	}
+
+	return TEST_STATUS_SUCCESS;
+}
+
+static void close_cb(struct libusb_transfer *transfer)
+{
+	(void)transfer;
+	libusb_close(handle);
+	handle = NULL;
+	done = 1;
+}
+
+/* An event thread may close a device from a transfer callback, while the
+ * application handles events */
+static libusb_testlib_result test_close_from_callback(void)
+{
+	int r;
+
+	if (open_mock(2) != LIBUSB_SUCCESS)
+		return TEST_STATUS_ERROR;
+
+	r = submit_bulk(0x81, close_cb);
+	while (r == LIBUSB_SUCCESS && !done)
+		r = libusb_handle_events_completed(ctx, &done);
+
+	mock_usbfs_close(ctx, handle);
+	if (r != LIBUSB_SUCCESS || handle) {
+		libusb_testlib_logf("handling events returned %s", libusb_error_name(r));
+		return TEST_STATUS_FAILURE;
+	}
+
+	return TEST_STATUS_SUCCESS;
+}
+
+static const libusb_testlib_test tests[] = {
+	{ "callbacks", &test_callbacks },
+	{ "sync_transfer", &test_sync_transfer },
+	{ "close_from_callback", &test_close_from_callback },
+	LIBUSB_NULL_TEST
+};
+
+int main(int argc, char *argv[])
+{
+	return libusb_testlib_run_tests(argc, argv, tests);
+}
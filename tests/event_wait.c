@@ -0,0 +1,432 @@
+/*
+ * libusb event wait tests
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libusb.h"
+#include "libusb_testlib.h"
+
+#ifdef HAVE_EPOLL
+#include <poll.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "mock_usbfs.h"
+
+/* Each mock device is a pipe whose read end stands in for a usbfs fd, and
+ * which is made ready by writing to the other end. */
+#define NUM_DEVICES	256
+#define BENCH_ITERS	20000
+
+struct mock_devices {
+	int pipes[NUM_DEVICES][2];
+	struct pollfd fds[NUM_DEVICES];
+	int epollfd;
+};
+
+static void close_mock_devices(struct mock_devices *devs)
+{
+	int i;
+
+	for (i = 0; i < NUM_DEVICES; i++) {
+		if (devs->pipes[i][0] >= 0)
+			close(devs->pipes[i][0]);
+		if (devs->pipes[i][1] >= 0)
+			close(devs->pipes[i][1]);
+	}
+	if (devs->epollfd >= 0)
+		close(devs->epollfd);
+}
+
+static int open_mock_devices(struct mock_devices *devs)
+{
+	int i;
+
+	memset(devs, 0xff, sizeof(devs->pipes));
+	devs->epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (devs->epollfd == -1)
+		return -1;
+
+	for (i = 0; i < NUM_DEVICES; i++) {
+		struct epoll_event event;
+
+		if (pipe(devs->pipes[i]) == -1)
+			goto err;
+
+		devs->fds[i].fd = devs->pipes[i][0];
+		devs->fds[i].events = POLLIN;
+		devs->fds[i].revents = 0;
+
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.ptr = &devs->fds[i];
+		if (epoll_ctl(devs->epollfd, EPOLL_CTL_ADD, devs->pipes[i][0], &event) == -1)
+			goto err;
+	}
+
+	return 0;
+
+err:
+	close_mock_devices(devs);
+	return -1;
+}
+
+static int make_ready(struct mock_devices *devs, int i)
+{
+	char c = 0;
+
+	return write(devs->pipes[i][1], &c, 1) == 1 ? 0 : -1;
+}
+
+static int consume(struct pollfd *pollfd)
+{
+	char c;
+
+	return read(pollfd->fd, &c, 1) == 1 ? 0 : -1;
+}
+
+/* Waits for the single ready device with poll() and returns its index */
+static int wait_poll(struct mock_devices *devs)
+{
+	int i;
+
+	if (poll(devs->fds, NUM_DEVICES, -1) != 1)
+		return -1;
+
+	for (i = 0; i < NUM_DEVICES; i++) {
+		if (devs->fds[i].revents)
+			return consume(&devs->fds[i]) ? -1 : i;
+	}
+
+	return -1;
+}
+
+/* Waits for the single ready device with epoll_wait() and returns its index */
+static int wait_epoll(struct mock_devices *devs)
+{
+	struct epoll_event events[NUM_DEVICES];
+	struct pollfd *pollfd;
+
+	if (epoll_wait(devs->epollfd, events, NUM_DEVICES, -1) != 1)
+		return -1;
+
+	pollfd = events[0].data.ptr;
+	return consume(pollfd) ? -1 : (int)(pollfd - devs->fds);
+}
+
+static libusb_testlib_result test_epoll_ready_only(void)
+{
+	struct mock_devices devs;
+	struct epoll_event events[NUM_DEVICES];
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	int n;
+
+	if (open_mock_devices(&devs))
+		return TEST_STATUS_ERROR;
+
+	if (make_ready(&devs, 7) || make_ready(&devs, 200)) {
+		result = TEST_STATUS_ERROR;
+		goto out;
+	}
+
+	n = epoll_wait(devs.epollfd, events, NUM_DEVICES, 0);
+	if (n != 2) {
+		libusb_testlib_logf("expected 2 ready devices, got %d", n);
+		goto out;
+	}
+
+	for (n = 0; n < 2; n++) {
+		struct pollfd *pollfd = events[n].data.ptr;
+
+		if (pollfd != &devs.fds[7] && pollfd != &devs.fds[200])
+			goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	close_mock_devices(&devs);
+	return result;
+}
+
+static double bench_wakeups(struct mock_devices *devs,
+	int (*wait_fn)(struct mock_devices *))
+{
+	struct timespec start, end;
+	int i;
+
+	srand(1);
+	timespec_get(&start, TIME_UTC);
+	for (i = 0; i < BENCH_ITERS; i++) {
+		int dev = rand() % NUM_DEVICES;
+
+		if (make_ready(devs, dev) || wait_fn(devs) != dev)
+			return -1.0;
+	}
+	timespec_get(&end, TIME_UTC);
+
+	return ((double)(end.tv_sec - start.tv_sec) * 1e9 +
+		(double)(end.tv_nsec - start.tv_nsec)) / BENCH_ITERS;
+}
+
+/* Compares the cost of a wakeup on one of NUM_DEVICES open devices when
+ * waiting with poll() over all of them and with epoll_wait(). */
+static libusb_testlib_result test_wait_benchmark(void)
+{
+	struct mock_devices devs;
+	double poll_ns, epoll_ns;
+
+	if (open_mock_devices(&devs))
+		return TEST_STATUS_ERROR;
+
+	poll_ns = bench_wakeups(&devs, wait_poll);
+	epoll_ns = bench_wakeups(&devs, wait_epoll);
+	close_mock_devices(&devs);
+
+	if (poll_ns < 0 || epoll_ns < 0)
+		return TEST_STATUS_FAILURE;
+
+	libusb_testlib_logf("%d devices: poll %.0fns, epoll %.0fns per wakeup",
+		NUM_DEVICES, poll_ns, epoll_ns);
+
+	return TEST_STATUS_SUCCESS;
+}
+
+static void LIBUSB_CALL transfer_cb(struct libusb_transfer *transfer)
+{
+	*(int *)transfer->user_data = 1;
+}
+
+static int event_fd_readable(int fd, int timeout_ms)
+{
+	struct pollfd pollfd = { .fd = fd, .events = POLLIN, .revents = 0 };
+
+	return poll(&pollfd, 1, timeout_ms) == 1 && (pollfd.revents & POLLIN);
+}
+
+static long elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long)(now.tv_sec - start->tv_sec) * 1000 +
+		(now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* Handles events whenever the event fd becomes readable, until the transfer
+ * has completed */
+static int run_until_completed(libusb_context *ctx, int fd, const int *completed)
+{
+	int i;
+
+	for (i = 0; i < 10 && !*completed; i++) {
+		if (!event_fd_readable(fd, 1000)) {
+			libusb_testlib_logf("event fd not readable");
+			return -1;
+		}
+		if (libusb_handle_ready_events(ctx) != LIBUSB_SUCCESS)
+			return -1;
+	}
+
+	return *completed ? 0 : -1;
+}
+
+/* Submits a bulk transfer to the mock device, with the event fd drained and
+ * not readable */
+static int open_event_fd(libusb_context **ctx, libusb_device_handle **handle,
+	int *fd, struct libusb_transfer **transfer, unsigned char *buffer, int length,
+	unsigned int timeout, int *completed)
+{
+	struct libusb_init_option options[] = {
+		{ .option = LIBUSB_OPTION_NO_DEVICE_DISCOVERY },
+	};
+	int r;
+
+	r = mock_usbfs_open(options, 1, ctx, handle);
+	if (r != LIBUSB_SUCCESS)
+		return r;
+
+	*fd = libusb_get_event_fd(*ctx);
+	*transfer = libusb_alloc_transfer(0);
+	if (*fd < 0 || !*transfer) {
+		libusb_testlib_logf("event fd %d, transfer %p", *fd, (void *)*transfer);
+		r = LIBUSB_ERROR_OTHER;
+		goto err;
+	}
+
+	r = libusb_handle_ready_events(*ctx);
+	if (r == LIBUSB_SUCCESS && event_fd_readable(*fd, 0)) {
+		libusb_testlib_logf("event fd readable with no events pending");
+		r = LIBUSB_ERROR_OTHER;
+	}
+	if (r != LIBUSB_SUCCESS)
+		goto err;
+
+	*completed = 0;
+	libusb_fill_bulk_transfer(*transfer, *handle, 0x81, buffer, length,
+		transfer_cb, completed, timeout);
+	r = libusb_submit_transfer(*transfer);
+	if (r == LIBUSB_SUCCESS)
+		return r;
+
+err:
+	libusb_free_transfer(*transfer);
+	mock_usbfs_close(*ctx, *handle);
+	return r;
+}
+
+/* The event fd becomes readable when a transfer completes, and handling the
+ * ready events completes it */
+static libusb_testlib_result test_event_fd_completion(void)
+{
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	struct libusb_transfer *transfer;
+	unsigned char buffer[64];
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	int fd, completed, r;
+
+	r = open_event_fd(&ctx, &handle, &fd, &transfer, buffer, (int)sizeof(buffer),
+		1000, &completed);
+	if (r == LIBUSB_ERROR_NOT_SUPPORTED)
+		return TEST_STATUS_SKIP;
+	else if (r != LIBUSB_SUCCESS)
+		return TEST_STATUS_ERROR;
+
+	if (run_until_completed(ctx, fd, &completed) ||
+	    transfer->status != LIBUSB_TRANSFER_COMPLETED ||
+	    transfer->actual_length != (int)sizeof(buffer)) {
+		libusb_testlib_logf("transfer %scompleted, status %d, %d bytes",
+			completed ? "" : "not ", transfer->status, transfer->actual_length);
+		goto out;
+	}
+
+	if (event_fd_readable(fd, 0)) {
+		libusb_testlib_logf("event fd still readable after handling events");
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	libusb_free_transfer(transfer);
+	mock_usbfs_close(ctx, handle);
+	return result;
+}
+
+/* The event fd becomes readable when a transfer times out, and handling the
+ * ready events does not block while the transfer is still pending */
+static libusb_testlib_result test_event_fd_timeout(void)
+{
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	struct libusb_transfer *transfer;
+	struct timespec start;
+	unsigned char buffer[64];
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	long waited;
+	int fd, completed, r;
+
+	mock_usbfs_hold_urbs = 1;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	r = open_event_fd(&ctx, &handle, &fd, &transfer, buffer, (int)sizeof(buffer),
+		100, &completed);
+	if (r != LIBUSB_SUCCESS) {
+		mock_usbfs_hold_urbs = 0;
+		return r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+	}
+
+	if (!libusb_pollfds_handle_timeouts(ctx)) {
+		libusb_cancel_transfer(transfer);
+		result = TEST_STATUS_SKIP;
+		goto out;
+	}
+
+	r = libusb_handle_ready_events(ctx);
+	waited = elapsed_ms(&start);
+	if (r != LIBUSB_SUCCESS || completed || waited >= 100 || event_fd_readable(fd, 0)) {
+		libusb_testlib_logf("handling events returned %s after %ldms",
+			libusb_error_name(r), waited);
+		goto out;
+	}
+
+	if (run_until_completed(ctx, fd, &completed) ||
+	    transfer->status != LIBUSB_TRANSFER_TIMED_OUT) {
+		libusb_testlib_logf("transfer %scompleted, status %d",
+			completed ? "" : "not ", transfer->status);
+		goto out;
+	}
+
+	waited = elapsed_ms(&start);
+	if (waited < 100) {
+		libusb_testlib_logf("transfer timed out after %ldms", waited);
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	if (!completed) {
+		libusb_cancel_transfer(transfer);
+		while (!completed && libusb_handle_events_completed(ctx, &completed) == 0)
+			;
+	}
+	libusb_free_transfer(transfer);
+	mock_usbfs_close(ctx, handle);
+	mock_usbfs_hold_urbs = 0;
+	return result;
+}
+#else
+static libusb_testlib_result test_epoll_ready_only(void)
+{
+	return TEST_STATUS_SKIP;
+}
+
+static libusb_testlib_result test_wait_benchmark(void)
+{
+	return TEST_STATUS_SKIP;
+}
+
+static libusb_testlib_result test_event_fd_completion(void)
+{
+	return TEST_STATUS_SKIP;
+}
+
+static libusb_testlib_result test_event_fd_timeout(void)
+{
+	return TEST_STATUS_SKIP;
+}
+#endif
+
+static const libusb_testlib_test tests[] = {
+	{ "epoll_ready_only", &test_epoll_ready_only },
+	{ "wait_benchmark", &test_wait_benchmark },
+	{ "event_fd_completion", &test_event_fd_completion },
+	{ "event_fd_timeout", &test_event_fd_timeout },
+	LIBUSB_NULL_TEST
+};
+
+int main(int argc, char *argv[])
+{
+	return libusb_testlib_run_tests(argc, argv, tests);
+}
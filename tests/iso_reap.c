@@ -0,0 +1,263 @@
+/*
+ * libusb isochronous reap tests, against a mock usbfs
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libusbi.h"
+#include "os/linux_usbfs.h"
+#include "libusb_testlib.h"
+#include "mock_usbfs.h"
+
+#define NUM_PACKETS	(256 * MAX_ISO_PACKETS_PER_URB)
+#define BENCH_ROUNDS	100
+
+static libusb_context *ctx;
+static libusb_device_handle *handle;
+
+static void transfer_cb(struct libusb_transfer *transfer)
+{
+	*(int *)transfer->user_data = 1;
+}
+
+static int open_mock(void)
+{
+	struct libusb_init_option option = { .option = LIBUSB_OPTION_NO_DEVICE_DISCOVERY };
+
+	/* URBs are reaped last first, which is the worst case for finding a
+	 * URB in its transfer by searching */
+	mock_usbfs_reap_lifo = 1;
+	return mock_usbfs_open(&option, 1, &ctx, &handle);
+}
+
+static void close_mock(void)
+{
+	mock_usbfs_close(ctx, handle);
+}
+
+/* Submits transfer and handles events until it completes */
+static int run_transfer(struct libusb_transfer *transfer)
+{
+	int completed = 0;
+	int r;
+
+	transfer->user_data = &completed;
+	r = libusb_submit_transfer(transfer);
+	while (r == LIBUSB_SUCCESS && !completed)
+		r = libusb_handle_events_completed(ctx, &completed);
+
+	return r;
+}
+
+static struct libusb_transfer *alloc_iso_transfer(void)
+{
+	struct libusb_transfer *transfer;
+	unsigned char *buffer;
+	int i, length = 0;
+
+	transfer = libusb_alloc_transfer(NUM_PACKETS);
+	if (!transfer)
+		return NULL;
+
+	for (i = 0; i < NUM_PACKETS; i++)
+		length += i % 7 + 1;
+	buffer = malloc((size_t)length);
+	if (!buffer) {
+		libusb_free_transfer(transfer);
+		return NULL;
+	}
+
+	libusb_fill_iso_transfer(transfer, handle, MOCK_USBFS_EP_ISO_IN, buffer, length,
+		NUM_PACKETS, transfer_cb, NULL, 0);
+	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+	for (i = 0; i < NUM_PACKETS; i++)
+		transfer->iso_packet_desc[i].length = (unsigned int)(i % 7 + 1);
+
+	return transfer;
+}
+
+/* Each packet's results must land in its own descriptor, whatever order the
+ * URBs are reaped in and however many packets each submission has */
+static libusb_testlib_result test_reap_order(void)
+{
+	static const int num_packets[] = { NUM_PACKETS, 200, 1, NUM_PACKETS };
+	struct libusb_transfer *transfer;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	size_t n;
+	int i;
+
+	if (open_mock() != LIBUSB_SUCCESS)
+		return TEST_STATUS_ERROR;
+
+	transfer = alloc_iso_transfer();
+	if (!transfer) {
+		close_mock();
+		return TEST_STATUS_ERROR;
+	}
+
+	mock_usbfs_error_status = 0;
+	mock_usbfs_unaligned_urbs = 0;
+	for (n = 0; n < ARRAYSIZE(num_packets); n++) {
+		transfer->num_iso_packets = num_packets[n];
+		if (run_transfer(transfer) != LIBUSB_SUCCESS ||
+		    transfer->status != LIBUSB_TRANSFER_COMPLETED)
+			goto out;
+
+		for (i = 0; i < num_packets[n]; i++) {
+			struct libusb_iso_packet_descriptor *desc = &transfer->iso_packet_desc[i];
+
+			if (desc->status != LIBUSB_TRANSFER_COMPLETED ||
+			    desc->actual_length != (unsigned int)(i % 7 + 1)) {
+				libusb_testlib_logf("%d packets: packet %d has status %d, length %u",
+					num_packets[n], i, desc->status, desc->actual_length);
+				goto out;
+			}
+			desc->actual_length = 0;
+		}
+	}
+
+	if (mock_usbfs_unaligned_urbs) {
+		libusb_testlib_logf("%d URBs were not cache line aligned",
+			mock_usbfs_unaligned_urbs);
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	libusb_free_transfer(transfer);
+	close_mock();
+	return result;
+}
+
+static libusb_testlib_result test_packet_status(void)
+{
+	static const struct {
+		int urb_status;
+		enum libusb_transfer_status status;
+	} statuses[] = {
+		{ -ENOENT, LIBUSB_TRANSFER_COMPLETED },
+		{ -ECONNRESET, LIBUSB_TRANSFER_COMPLETED },
+		{ -ESHUTDOWN, LIBUSB_TRANSFER_NO_DEVICE },
+		{ -EPIPE, LIBUSB_TRANSFER_STALL },
+		{ -EOVERFLOW, LIBUSB_TRANSFER_OVERFLOW },
+		{ -EPROTO, LIBUSB_TRANSFER_ERROR },
+		{ -EXDEV, LIBUSB_TRANSFER_ERROR },
+		{ -EBUSY, LIBUSB_TRANSFER_ERROR },
+	};
+	struct libusb_transfer *transfer;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	size_t n;
+	int i;
+
+	if (open_mock() != LIBUSB_SUCCESS)
+		return TEST_STATUS_ERROR;
+
+	transfer = alloc_iso_transfer();
+	if (!transfer) {
+		close_mock();
+		return TEST_STATUS_ERROR;
+	}
+
+	libusb_set_log_cb(ctx, NULL, LIBUSB_LOG_CB_CONTEXT);
+	libusb_set_option(ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_NONE);
+
+	mock_usbfs_error_stride = 5;
+	for (n = 0; n < ARRAYSIZE(statuses); n++) {
+		mock_usbfs_error_status = statuses[n].urb_status;
+		if (run_transfer(transfer) != LIBUSB_SUCCESS)
+			goto out;
+
+		for (i = 0; i < NUM_PACKETS; i++) {
+			enum libusb_transfer_status expected = LIBUSB_TRANSFER_COMPLETED;
+
+			if ((i % MAX_ISO_PACKETS_PER_URB) % mock_usbfs_error_stride == 0)
+				expected = statuses[n].status;
+			if (transfer->iso_packet_desc[i].status != expected) {
+				libusb_testlib_logf("urb status %d: packet %d has status %d",
+					statuses[n].urb_status, i,
+					transfer->iso_packet_desc[i].status);
+				goto out;
+			}
+		}
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	mock_usbfs_error_status = 0;
+	mock_usbfs_error_stride = 1;
+	libusb_free_transfer(transfer);
+	close_mock();
+	return result;
+}
+
+/* Feeds large iso transfers through the reap path and reports the time
+ * taken per URB and per packet. */
+static libusb_testlib_result test_reap_benchmark(void)
+{
+	struct libusb_transfer *transfer;
+	struct timespec start, end;
+	double ns;
+	int i, r = LIBUSB_SUCCESS;
+
+	if (open_mock() != LIBUSB_SUCCESS)
+		return TEST_STATUS_ERROR;
+
+	transfer = alloc_iso_transfer();
+	if (!transfer) {
+		close_mock();
+		return TEST_STATUS_ERROR;
+	}
+
+	mock_usbfs_error_status = 0;
+	timespec_get(&start, TIME_UTC);
+	for (i = 0; i < BENCH_ROUNDS && r == LIBUSB_SUCCESS; i++)
+		r = run_transfer(transfer);
+	timespec_get(&end, TIME_UTC);
+
+	libusb_free_transfer(transfer);
+	close_mock();
+	if (r != LIBUSB_SUCCESS)
+		return TEST_STATUS_FAILURE;
+
+	ns = ((double)(end.tv_sec - start.tv_sec) * 1e9 +
+		(double)(end.tv_nsec - start.tv_nsec)) / BENCH_ROUNDS;
+	libusb_testlib_logf("%d packets in %d URBs: %.0fns per URB, %.1fns per packet",
+		NUM_PACKETS, NUM_PACKETS / MAX_ISO_PACKETS_PER_URB,
+		ns / (NUM_PACKETS / MAX_ISO_PACKETS_PER_URB), ns / NUM_PACKETS);
+
+	return TEST_STATUS_SUCCESS;
+}
+
+static const libusb_testlib_test tests[] = {
+	{ "reap_order", &test_reap_order },
+	{ "packet_status", &test_packet_status },
+	{ "reap_benchmark", &test_reap_benchmark },
+	LIBUSB_NULL_TEST
+};
+
+int main(int argc, char *argv[])
+{
+	return libusb_testlib_run_tests(argc, argv, tests);
+}
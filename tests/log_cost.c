@@ -0,0 +1,180 @@
+/*
+ * libusb logging cost benchmark, against a mock usbfs
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "libusb.h"
+#include "libusb_testlib.h"
+#include "mock_usbfs.h"
+
+#define NUM_IN_FLIGHT	16
+#define NUM_TRANSFERS	200000
+#define LOG_RING_SIZE	16384
+
+static libusb_context *ctx;
+static libusb_device_handle *handle;
+static int remaining;
+static int in_flight;
+static int done;
+static unsigned long messages;
+static double drain_ns;
+
+static void LIBUSB_CALL discard_log(libusb_context *log_ctx,
+	enum libusb_log_level level, const char *str)
+{
+	(void)log_ctx;
+	(void)level;
+	(void)str;
+	messages++;
+}
+
+static void LIBUSB_CALL resubmit_cb(struct libusb_transfer *transfer)
+{
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED && remaining > 0) {
+		remaining--;
+		if (libusb_submit_transfer(transfer) == LIBUSB_SUCCESS)
+			return;
+	}
+
+	libusb_free_transfer(transfer);
+	if (--in_flight == 0)
+		done = 1;
+}
+
+static double elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+	return (double)(end->tv_sec - start->tv_sec) * 1e9 +
+		(double)(end->tv_nsec - start->tv_nsec);
+}
+
+/* Submits and reaps NUM_TRANSFERS bulk transfers, NUM_IN_FLIGHT at a time,
+ * and returns the time per transfer in nanoseconds, or a negative value.
+ * With a log ring, the messages are drained after each round of events,
+ * and the time spent draining is left out and put in drain_ns instead. */
+static double run_transfers(int log_level, int log_ring)
+{
+	struct libusb_init_option options[] = {
+		{ .option = LIBUSB_OPTION_NO_DEVICE_DISCOVERY },
+		{ .option = LIBUSB_OPTION_LOG_LEVEL, .value = { .ival = log_level } },
+		{ .option = LIBUSB_OPTION_LOG_RING, .value = { .ival = log_ring } },
+	};
+	static unsigned char buffers[NUM_IN_FLIGHT][64];
+	struct timespec start, end, drain_start, drain_end;
+	int i, r = LIBUSB_SUCCESS;
+
+	if (mock_usbfs_open(options, 3, &ctx, &handle) != LIBUSB_SUCCESS)
+		return -1;
+	if (log_ring)
+		(void)libusb_drain_log(ctx, 0);
+
+	remaining = NUM_TRANSFERS - NUM_IN_FLIGHT;
+	in_flight = 0;
+	done = 0;
+	messages = 0;
+	drain_ns = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < NUM_IN_FLIGHT && r == LIBUSB_SUCCESS; i++) {
+		struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+
+		if (!transfer) {
+			r = LIBUSB_ERROR_NO_MEM;
+			break;
+		}
+		libusb_fill_bulk_transfer(transfer, handle, 0x81, buffers[i],
+			(int)sizeof(buffers[i]), resubmit_cb, NULL, 0);
+		r = libusb_submit_transfer(transfer);
+		if (r == LIBUSB_SUCCESS)
+			in_flight++;
+		else
+			libusb_free_transfer(transfer);
+	}
+	while (r == LIBUSB_SUCCESS && !done) {
+		r = libusb_handle_events_completed(ctx, &done);
+		if (log_ring) {
+			clock_gettime(CLOCK_MONOTONIC, &drain_start);
+			(void)libusb_drain_log(ctx, 0);
+			clock_gettime(CLOCK_MONOTONIC, &drain_end);
+			drain_ns += elapsed_ns(&drain_start, &drain_end);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	mock_usbfs_close(ctx, handle);
+	if (r != LIBUSB_SUCCESS)
+		return -1;
+
+	drain_ns /= NUM_TRANSFERS;
+	return (elapsed_ns(&start, &end) - drain_ns * NUM_TRANSFERS) / NUM_TRANSFERS;
+}
+
+/* Reports the time per transfer reaped with logging enabled at build time
+ * but set to LIBUSB_LOG_LEVEL_NONE, where disabled log messages should cost
+ * next to nothing, with all debug messages formatted and discarded, and with
+ * debug messages recorded in a log ring and formatted when it is drained */
+static libusb_testlib_result test_reap_cost(void)
+{
+	double none_ns, debug_ns, ring_ns;
+	unsigned long debug_messages;
+
+	libusb_set_log_cb(NULL, discard_log, LIBUSB_LOG_CB_GLOBAL);
+
+	none_ns = run_transfers(LIBUSB_LOG_LEVEL_NONE, 0);
+	if (none_ns < 0 || messages) {
+		libusb_testlib_logf("level NONE failed, %lu messages", messages);
+		libusb_set_log_cb(NULL, NULL, LIBUSB_LOG_CB_GLOBAL);
+		return TEST_STATUS_FAILURE;
+	}
+
+	debug_ns = run_transfers(LIBUSB_LOG_LEVEL_DEBUG, 0);
+	debug_messages = messages;
+	if (debug_ns < 0) {
+		libusb_testlib_logf("level DEBUG failed");
+		libusb_set_log_cb(NULL, NULL, LIBUSB_LOG_CB_GLOBAL);
+		return TEST_STATUS_FAILURE;
+	}
+
+	/* the ring must not drop messages for the drained ones to be counted */
+	ring_ns = run_transfers(LIBUSB_LOG_LEVEL_DEBUG, LOG_RING_SIZE);
+	libusb_set_log_cb(NULL, NULL, LIBUSB_LOG_CB_GLOBAL);
+	if (ring_ns < 0 || messages < debug_messages) {
+		libusb_testlib_logf("level DEBUG with a log ring failed, %lu messages, "
+			"expected %lu", messages, debug_messages);
+		return TEST_STATUS_FAILURE;
+	}
+
+	libusb_testlib_logf("%d transfers: %.0fns each at level NONE, "
+		"%.0fns at level DEBUG (%.1f messages each)", NUM_TRANSFERS,
+		none_ns, debug_ns, (double)debug_messages / NUM_TRANSFERS);
+	libusb_testlib_logf("with a log ring: %.0fns each, plus %.0fns when drained",
+		ring_ns, drain_ns);
+	return TEST_STATUS_SUCCESS;
+}
+
+static const libusb_testlib_test tests[] = {
+	{ "reap_cost", &test_reap_cost },
+	LIBUSB_NULL_TEST
+};
+
+int main(int argc, char *argv[])
+{
+	return libusb_testlib_run_tests(argc, argv, tests);
+}
@@ -0,0 +1,160 @@
+/*
+ * libusb log ring tests, against a mock usbfs
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "libusb.h"
+#include "libusb_testlib.h"
+#include "mock_usbfs.h"
+
+static libusb_context *ctx;
+static libusb_device_handle *handle;
+static int messages;
+static int untimed;
+static int version_found;
+static char first[256];
+
+static void LIBUSB_CALL count_log(libusb_context *log_ctx,
+	enum libusb_log_level level, const char *str)
+{
+	(void)log_ctx;
+	(void)level;
+
+	/* skip the legend written before the first timestamped message */
+	if (!strstr(str, "libusb: "))
+		return;
+
+	/* recorded messages always carry the time they were logged at */
+	if (str[0] != '[')
+		untimed++;
+	if (strstr(str, "libusb v1.0."))
+		version_found = 1;
+	if (!messages++)
+		snprintf(first, sizeof(first), "%s", str);
+}
+
+static int open_mock(int ring_size)
+{
+	struct libusb_init_option options[] = {
+		{ .option = LIBUSB_OPTION_NO_DEVICE_DISCOVERY },
+		{ .option = LIBUSB_OPTION_LOG_LEVEL, .value = { .ival = LIBUSB_LOG_LEVEL_DEBUG } },
+		{ .option = LIBUSB_OPTION_LOG_RING, .value = { .ival = ring_size } },
+	};
+
+	messages = 0;
+	untimed = 0;
+	version_found = 0;
+	first[0] = '\0';
+	libusb_set_log_cb(NULL, count_log, LIBUSB_LOG_CB_GLOBAL);
+	return mock_usbfs_open(options, 3, &ctx, &handle);
+}
+
+static void close_mock(void)
+{
+	mock_usbfs_close(ctx, handle);
+	libusb_set_log_cb(NULL, NULL, LIBUSB_LOG_CB_GLOBAL);
+}
+
+/* Messages are only written out when they are drained, in the order they
+ * were logged, and libusb_exit() drains those that are left */
+static libusb_testlib_result test_deferred(void)
+{
+	unsigned char data[64];
+	int i, r, transferred, drained, total;
+
+	r = open_mock(4096);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_set_log_cb(NULL, NULL, LIBUSB_LOG_CB_GLOBAL);
+		return r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+	}
+
+	for (i = 0; i < 10; i++) {
+		r = libusb_bulk_transfer(handle, 0x81, data, (int)sizeof(data), &transferred, 1000);
+		if (r != LIBUSB_SUCCESS)
+			break;
+	}
+	if (r != LIBUSB_SUCCESS || messages) {
+		libusb_testlib_logf("bulk transfers returned %s, %d messages written out",
+			libusb_error_name(r), messages);
+		close_mock();
+		return TEST_STATUS_FAILURE;
+	}
+
+	if (libusb_drain_log(ctx, -1) != LIBUSB_ERROR_INVALID_PARAM ||
+	    libusb_drain_log(ctx, 1) != 1 || messages != 1) {
+		libusb_testlib_logf("draining one message wrote out %d", messages);
+		close_mock();
+		return TEST_STATUS_FAILURE;
+	}
+
+	drained = libusb_drain_log(ctx, 0);
+	total = messages;
+	if (drained <= 0 || total != drained + 1 || libusb_drain_log(ctx, 0) != 0) {
+		libusb_testlib_logf("drained %d messages, %d written out", drained, total);
+		close_mock();
+		return TEST_STATUS_FAILURE;
+	}
+
+	close_mock();
+	if (messages == total || untimed || !version_found) {
+		libusb_testlib_logf("%d messages written out on exit, %d without a timestamp, "
+			"version %sfound", messages - total, untimed, version_found ? "" : "not ");
+		return TEST_STATUS_FAILURE;
+	}
+
+	libusb_testlib_logf("%d messages drained, %d more on exit", total, messages - total);
+	return TEST_STATUS_SUCCESS;
+}
+
+/* Messages logged while the ring is full are dropped, and counted in a
+ * warning written out before the others */
+static libusb_testlib_result test_dropped(void)
+{
+	int r, drained;
+
+	r = open_mock(4);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_set_log_cb(NULL, NULL, LIBUSB_LOG_CB_GLOBAL);
+		return r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+	}
+
+	drained = libusb_drain_log(ctx, 0);
+	if (drained != 4 || messages != 5 || !strstr(first, "messages dropped") ||
+	    !version_found) {
+		libusb_testlib_logf("drained %d messages, first: %s", drained, first);
+		close_mock();
+		return TEST_STATUS_FAILURE;
+	}
+
+	close_mock();
+	return TEST_STATUS_SUCCESS;
+}
+
+static const libusb_testlib_test tests[] = {
+	{ "deferred", &test_deferred },
+	{ "dropped", &test_dropped },
+	LIBUSB_NULL_TEST
+};
+
+int main(int argc, char *argv[])
+{
+	return libusb_testlib_run_tests(argc, argv, tests);
+}
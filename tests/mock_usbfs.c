@@ -0,0 +1,447 @@
+/*
+ * libusb test helpers: a mock usbfs device for Linux
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "libusbi.h"
+#include "os/linux_usbfs.h"
+#include "mock_usbfs.h"
+
+#define MAX_FLYING	1024
+#define MAX_HANDLES	8
+#define MAX_MAPPINGS	64
+
+/* A device with one isochronous IN endpoint, as read from a usbfs fd */
+static const unsigned char descriptors[] = {
+	/* device */
+	0x12, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x40,
+	0x34, 0x12, 0x78, 0x56, 0x00, 0x01, 0x00, 0x00,
+	0x00, 0x01,
+	/* configuration */
+	0x09, 0x02, 0x19, 0x00, 0x01, 0x01, 0x00, 0x80, 0x32,
+	/* interface */
+	0x09, 0x04, 0x00, 0x00, 0x01, 0xff, 0x00, 0x00, 0x00,
+	/* endpoint */
+	0x07, 0x05, MOCK_USBFS_EP_ISO_IN, 0x01, 0x00, 0x04, 0x01,
+};
+
+int mock_usbfs_reap_lifo;
+int mock_usbfs_hold_urbs;
+int mock_usbfs_max_urbs;
+int mock_usbfs_sync_errno;
+unsigned int mock_usbfs_sync_calls;
+int mock_usbfs_error_status;
+int mock_usbfs_error_stride = 1;
+unsigned int mock_usbfs_zero_packets;
+int mock_usbfs_unaligned_urbs;
+unsigned int mock_usbfs_reaped;
+struct timespec mock_usbfs_last_reap;
+int mock_usbfs_mmap_errno;
+int mock_usbfs_max_mappings;
+int mock_usbfs_mappings;
+
+/* mock_fd is the write end of a pipe, which is kept full while no URB is in
+ * flight, so that the event loop only wakes up (POLLOUT) to reap URBs. URBs
+ * may be submitted from several threads. */
+static int mock_fd = -1;
+static int handle_fds[MAX_HANDLES] = { -1, -1, -1, -1, -1, -1, -1, -1 };
+static libusb_device_handle *handles[MAX_HANDLES];
+static int pipe_rd = -1;
+static unsigned char pipe_page[4096];
+static size_t mock_offset;
+static pthread_mutex_t mock_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct usbfs_urb *flying[MAX_FLYING];
+static unsigned int flying_head, num_flying;
+static struct usbfs_urb *held[MAX_FLYING];
+static unsigned int num_held;
+static void *mappings[MAX_MAPPINGS];
+
+/* Returns non-zero if fd is served by the mock */
+static int is_mock_fd(int fd)
+{
+	int i;
+
+	if (fd < 0)
+		return 0;
+	if (fd == mock_fd)
+		return 1;
+	for (i = 0; i < MAX_HANDLES; i++) {
+		if (fd == handle_fds[i])
+			return 1;
+	}
+	return 0;
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+	if (!is_mock_fd(fd))
+		return (ssize_t)syscall(SYS_read, fd, buf, count);
+
+	if (count > sizeof(descriptors) - mock_offset)
+		count = sizeof(descriptors) - mock_offset;
+	memcpy(buf, descriptors + mock_offset, count);
+	mock_offset += count;
+	return (ssize_t)count;
+}
+
+off_t lseek(int fd, off_t offset, int whence)
+{
+	if (!is_mock_fd(fd))
+		return (off_t)syscall(SYS_lseek, fd, offset, whence);
+
+	if (whence != SEEK_SET || offset < 0 || (size_t)offset > sizeof(descriptors)) {
+		errno = EINVAL;
+		return -1;
+	}
+	mock_offset = (size_t)offset;
+	return offset;
+}
+
+static void *sys_mmap(void *addr, size_t length, int prot, int flags, int fd,
+	off_t offset)
+{
+#ifdef SYS_mmap2
+	return (void *)syscall(SYS_mmap2, addr, length, prot, flags, fd, offset / 4096);
+#else
+	return (void *)syscall(SYS_mmap, addr, length, prot, flags, fd, offset);
+#endif
+}
+
+/* Mapping the mock device hands out anonymous memory, where usbfs would hand
+ * out memory suitable for DMA */
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+	void *mem = MAP_FAILED;
+	int i;
+
+	if (!is_mock_fd(fd))
+		return sys_mmap(addr, length, prot, flags, fd, offset);
+
+	pthread_mutex_lock(&mock_lock);
+	if (mock_usbfs_mmap_errno) {
+		errno = mock_usbfs_mmap_errno;
+		goto out;
+	}
+	if (mock_usbfs_max_mappings && mock_usbfs_mappings >= mock_usbfs_max_mappings) {
+		errno = ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < MAX_MAPPINGS; i++) {
+		if (!mappings[i])
+			break;
+	}
+	if (i == MAX_MAPPINGS) {
+		errno = ENOMEM;
+		goto out;
+	}
+
+	mem = sys_mmap(addr, length, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem != MAP_FAILED) {
+		mappings[i] = mem;
+		mock_usbfs_mappings++;
+	}
+out:
+	pthread_mutex_unlock(&mock_lock);
+	return mem;
+}
+
+int munmap(void *addr, size_t length)
+{
+	int i;
+
+	pthread_mutex_lock(&mock_lock);
+	for (i = 0; i < MAX_MAPPINGS; i++) {
+		if (mappings[i] && mappings[i] == addr) {
+			mappings[i] = NULL;
+			mock_usbfs_mappings--;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&mock_lock);
+
+	return (int)syscall(SYS_munmap, addr, length);
+}
+
+static void complete_urb(struct usbfs_urb *urb)
+{
+	int i;
+
+	if (urb->type == USBFS_URB_TYPE_CONTROL) {
+		/* the setup packet is not counted */
+		if (!urb->status)
+			urb->actual_length = urb->buffer_length - LIBUSB_CONTROL_SETUP_SIZE;
+		return;
+	} else if (urb->type != USBFS_URB_TYPE_ISO) {
+		if (!urb->status)
+			urb->actual_length = urb->buffer_length;
+		return;
+	}
+
+	urb->actual_length = 0;
+	for (i = 0; i < urb->number_of_packets; i++) {
+		struct usbfs_iso_packet_desc *desc = &urb->iso_frame_desc[i];
+
+		desc->status = mock_usbfs_error_status && i % mock_usbfs_error_stride == 0 ?
+			mock_usbfs_error_status : 0;
+		desc->actual_length = desc->length;
+		urb->actual_length += (int)desc->length;
+	}
+}
+
+/* Makes mock_fd writable while there are URBs to reap */
+static void update_ready(void)
+{
+	if (num_flying)
+		(void)syscall(SYS_read, pipe_rd, pipe_page, sizeof(pipe_page));
+	else
+		(void)syscall(SYS_write, mock_fd, pipe_page, sizeof(pipe_page));
+}
+
+static int queue_urb(struct usbfs_urb *urb)
+{
+	if (num_flying == MAX_FLYING) {
+		errno = ENOMEM;
+		return -1;
+	}
+	flying[(flying_head + num_flying++) % MAX_FLYING] = urb;
+	if (num_flying == 1)
+		update_ready();
+	return 0;
+}
+
+static int mock_ioctl(unsigned long request, void *arg)
+{
+	struct usbfs_connectinfo *ci;
+	struct usbfs_bulktransfer *bulk;
+	struct usbfs_ctrltransfer *ctrl;
+	struct usbfs_urb *urb;
+	unsigned int i;
+
+	switch (request) {
+	case IOCTL_USBFS_GET_CAPABILITIES:
+		*(uint32_t *)arg = 0;
+		return 0;
+	case IOCTL_USBFS_GET_SPEED:
+		return USBFS_SPEED_HIGH;
+	case IOCTL_USBFS_CONNECTINFO:
+		ci = arg;
+		ci->devnum = 1;
+		ci->slow = 0;
+		return 0;
+	case IOCTL_USBFS_BULK:
+		bulk = arg;
+		mock_usbfs_sync_calls++;
+		if (mock_usbfs_sync_errno) {
+			errno = mock_usbfs_sync_errno;
+			return -1;
+		}
+		return (int)bulk->len;
+	case IOCTL_USBFS_CONTROL:
+		ctrl = arg;
+		mock_usbfs_sync_calls++;
+		if (mock_usbfs_sync_errno) {
+			errno = mock_usbfs_sync_errno;
+			return -1;
+		}
+		if (ctrl->bmRequestType == LIBUSB_ENDPOINT_IN &&
+		    ctrl->bRequest == LIBUSB_REQUEST_GET_CONFIGURATION && ctrl->wLength) {
+			*(unsigned char *)ctrl->data = 1;
+			return 1;
+		}
+		/* other IN requests read back their bRequest */
+		if (ctrl->bmRequestType & LIBUSB_ENDPOINT_IN)
+			memset(ctrl->data, ctrl->bRequest, ctrl->wLength);
+		return ctrl->wLength;
+	case IOCTL_USBFS_SUBMITURB:
+		if ((uintptr_t)arg % 64)
+			mock_usbfs_unaligned_urbs++;
+		if (mock_usbfs_max_urbs &&
+		    num_flying + num_held >= (unsigned int)mock_usbfs_max_urbs) {
+			errno = ENOMEM;
+			return -1;
+		}
+		urb = arg;
+		urb->status = 0;
+		if (urb->flags & USBFS_URB_ZERO_PACKET)
+			mock_usbfs_zero_packets++;
+		if (!mock_usbfs_hold_urbs)
+			return queue_urb(urb);
+		if (num_held == MAX_FLYING) {
+			errno = ENOMEM;
+			return -1;
+		}
+		held[num_held++] = urb;
+		return 0;
+	case IOCTL_USBFS_DISCARDURB:
+		for (i = 0; i < num_held; i++) {
+			urb = held[i];
+			if (urb == arg) {
+				held[i] = held[--num_held];
+				urb->status = -ENOENT;
+				return queue_urb(urb);
+			}
+		}
+		for (i = 0; i < num_flying; i++) {
+			urb = flying[(flying_head + i) % MAX_FLYING];
+			if (urb == arg) {
+				urb->status = -ENOENT;
+				return 0;
+			}
+		}
+		errno = EINVAL;
+		return -1;
+	case IOCTL_USBFS_REAPURBNDELAY:
+		if (!num_flying) {
+			errno = EAGAIN;
+			return -1;
+		}
+		if (mock_usbfs_reap_lifo) {
+			urb = flying[(flying_head + --num_flying) % MAX_FLYING];
+		} else {
+			urb = flying[flying_head];
+			flying_head = (flying_head + 1) % MAX_FLYING;
+			num_flying--;
+		}
+		if (!num_flying)
+			update_ready();
+		complete_urb(urb);
+		mock_usbfs_reaped++;
+		clock_gettime(CLOCK_MONOTONIC, &mock_usbfs_last_reap);
+		*(void **)arg = urb;
+		return 0;
+	default:
+		errno = ENOTTY;
+		return -1;
+	}
+}
+
+#if defined(__GLIBC__)
+int ioctl(int fd, unsigned long request, ...)
+#else
+int ioctl(int fd, int request, ...)
+#endif
+{
+	va_list ap;
+	void *arg;
+	int r;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if (!is_mock_fd(fd))
+		return (int)syscall(SYS_ioctl, fd, request, arg);
+
+	pthread_mutex_lock(&mock_lock);
+	r = mock_ioctl((unsigned long)request, arg);
+	pthread_mutex_unlock(&mock_lock);
+	return r;
+}
+
+int mock_usbfs_open(const struct libusb_init_option *options, int num_options,
+	libusb_context **ctx, libusb_device_handle **handle)
+{
+	int fds[2];
+	int r;
+
+	if (pipe2(fds, O_CLOEXEC | O_NONBLOCK) < 0)
+		return LIBUSB_ERROR_IO;
+	pipe_rd = fds[0];
+	mock_fd = fds[1];
+	while (syscall(SYS_write, mock_fd, pipe_page, sizeof(pipe_page)) > 0)
+		;
+	flying_head = 0;
+	num_flying = 0;
+	num_held = 0;
+	mock_usbfs_sync_calls = 0;
+	mock_usbfs_zero_packets = 0;
+	mock_usbfs_reaped = 0;
+
+	r = libusb_init_context(ctx, options, num_options);
+	if (r == LIBUSB_SUCCESS) {
+		r = libusb_wrap_sys_device(*ctx, (intptr_t)mock_fd, handle);
+		if (r != LIBUSB_SUCCESS)
+			libusb_exit(*ctx);
+	}
+	if (r != LIBUSB_SUCCESS) {
+		close(mock_fd);
+		close(pipe_rd);
+		mock_fd = -1;
+	}
+
+	return r;
+}
+
+int mock_usbfs_open_handle(libusb_context *ctx, libusb_device_handle **handle)
+{
+	int i, r;
+
+	for (i = 0; i < MAX_HANDLES; i++) {
+		if (handle_fds[i] < 0)
+			break;
+	}
+	if (i == MAX_HANDLES)
+		return LIBUSB_ERROR_NO_MEM;
+
+	handle_fds[i] = fcntl(mock_fd, F_DUPFD_CLOEXEC, 0);
+	if (handle_fds[i] < 0)
+		return LIBUSB_ERROR_IO;
+
+	r = libusb_wrap_sys_device(ctx, (intptr_t)handle_fds[i], handle);
+	if (r == LIBUSB_SUCCESS) {
+		handles[i] = *handle;
+	} else {
+		close(handle_fds[i]);
+		handle_fds[i] = -1;
+	}
+
+	return r;
+}
+
+void mock_usbfs_close_handle(libusb_device_handle *handle)
+{
+	int i;
+
+	libusb_close(handle);
+	for (i = 0; i < MAX_HANDLES; i++) {
+		if (handle_fds[i] >= 0 && handles[i] == handle) {
+			close(handle_fds[i]);
+			handle_fds[i] = -1;
+			handles[i] = NULL;
+		}
+	}
+}
+
+void mock_usbfs_close(libusb_context *ctx, libusb_device_handle *handle)
+{
+	libusb_close(handle);
+	libusb_exit(ctx);
+	close(mock_fd);
+	close(pipe_rd);
+	mock_fd = -1;
+}
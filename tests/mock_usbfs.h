@@ -0,0 +1,96 @@
+/*
+ * libusb test helpers: a mock usbfs device for Linux
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef LIBUSB_MOCK_USBFS_H
+#define LIBUSB_MOCK_USBFS_H
+
+#include <time.h>
+
+#include "libusb.h"
+
+/** Isochronous IN endpoint of the mock device */
+#define MOCK_USBFS_EP_ISO_IN	0x81
+
+/**
+ * Creates a context with the given options and a device handle on the mock
+ * device. read(), lseek(), ioctl() and mmap() calls on the mock device's
+ * file descriptor are served by the mock. Unless mock_usbfs_hold_urbs is set,
+ * every URB submitted completes right away, with all its data transferred,
+ * and is reaped in the order set by mock_usbfs_reap_lifo. Only one mock
+ * device may be open at a time.
+ */
+int mock_usbfs_open(const struct libusb_init_option *options, int num_options,
+	libusb_context **ctx, libusb_device_handle **handle);
+
+/** Opens another handle on the mock device, with a file descriptor of its
+ * own, which must be closed with mock_usbfs_close_handle() before the mock
+ * device is closed. URBs submitted through any handle may be reaped through
+ * any of them. */
+int mock_usbfs_open_handle(libusb_context *ctx, libusb_device_handle **handle);
+void mock_usbfs_close_handle(libusb_device_handle *handle);
+
+/** Closes the device handle, unless it is NULL, and exits the context. */
+void mock_usbfs_close(libusb_context *ctx, libusb_device_handle *handle);
+
+/** If set, URBs are reaped last first, otherwise in submission order */
+extern int mock_usbfs_reap_lifo;
+
+/** If set, URBs submitted stay in flight until they are discarded */
+extern int mock_usbfs_hold_urbs;
+
+/** If not 0, the number of URBs the mock device keeps in flight at most.
+ * Submitting more fails with ENOMEM. */
+extern int mock_usbfs_max_urbs;
+
+/** If not 0, the status the iso packets at a multiple of
+ * mock_usbfs_error_stride in each URB complete with */
+extern int mock_usbfs_error_status;
+extern int mock_usbfs_error_stride;
+
+/** If not 0, the errno synchronous transfer ioctls fail with. Otherwise
+ * they transfer all their data. GET_CONFIGURATION returns configuration 1,
+ * other IN control requests fill their data with their bRequest. */
+extern int mock_usbfs_sync_errno;
+
+/** Number of synchronous transfer ioctls since the mock device was opened */
+extern unsigned int mock_usbfs_sync_calls;
+
+/** Number of URBs submitted with USBFS_URB_ZERO_PACKET since the mock
+ * device was opened */
+extern unsigned int mock_usbfs_zero_packets;
+
+/** Number of URBs submitted that do not start on a cache line */
+extern int mock_usbfs_unaligned_urbs;
+
+/** Number of URBs reaped since the mock device was opened, and the
+ * CLOCK_MONOTONIC time of the last reap */
+extern unsigned int mock_usbfs_reaped;
+extern struct timespec mock_usbfs_last_reap;
+
+/** If not 0, the errno mmap() of the mock device fails with. Otherwise it
+ * maps anonymous memory. */
+extern int mock_usbfs_mmap_errno;
+
+/** If not 0, the number of mappings of the mock device kept at most.
+ * Mapping more fails with ENOMEM. */
+extern int mock_usbfs_max_mappings;
+
+/** Number of mappings of the mock device not unmapped yet */
+extern int mock_usbfs_mappings;
+
+#endif /* LIBUSB_MOCK_USBFS_H */
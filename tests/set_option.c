@@ -228,10 +228,156 @@ static libusb_testlib_result test_set_log_cb(void)
 #endif
 }
 
+static libusb_testlib_result test_set_reap_budget(void)
+{
+  libusb_context *test_ctx = NULL;
+  struct libusb_reap_stats stats;
+
+  LIBUSB_EXPECT(==, libusb_set_option(NULL, LIBUSB_OPTION_REAP_BUDGET, -1),
+                LIBUSB_ERROR_INVALID_PARAM);
+
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_init_context(&test_ctx, /*options=*/NULL,
+                                                  /*num_options=*/0));
+  LIBUSB_EXPECT(==, test_ctx->reap_budget, USBI_DEFAULT_REAP_BUDGET);
+
+  /* 0 means reaping until no completed URBs are left */
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_set_option(test_ctx, LIBUSB_OPTION_REAP_BUDGET, 0));
+  LIBUSB_EXPECT(==, test_ctx->reap_budget, 0);
+
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_get_reap_stats(test_ctx, &stats));
+  LIBUSB_EXPECT(==, stats.urbs, 0);
+
+  LIBUSB_TEST_CLEAN_EXIT(TEST_STATUS_SUCCESS);
+}
+
+static libusb_testlib_result test_set_sync_direct_io(void)
+{
+  libusb_context *test_ctx = NULL;
+
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_init_context(&test_ctx, /*options=*/NULL,
+                                                  /*num_options=*/0));
+  LIBUSB_EXPECT(==, test_ctx->sync_direct_io, 0);
+
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_set_option(test_ctx, LIBUSB_OPTION_SYNC_DIRECT_IO));
+  LIBUSB_EXPECT(==, test_ctx->sync_direct_io, 1);
+
+  LIBUSB_TEST_CLEAN_EXIT(TEST_STATUS_SUCCESS);
+}
+
+static libusb_testlib_result test_set_sync_cache_size(void)
+{
+  libusb_context *test_ctx = NULL;
+  struct libusb_sync_stats stats;
+
+  LIBUSB_EXPECT(==, libusb_set_option(NULL, LIBUSB_OPTION_SYNC_CACHE_SIZE, -1),
+                LIBUSB_ERROR_INVALID_PARAM);
+
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_init_context(&test_ctx, /*options=*/NULL,
+                                                  /*num_options=*/0));
+  LIBUSB_EXPECT(==, test_ctx->sync_cache_size, USBI_DEFAULT_SYNC_CACHE_SIZE);
+
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_set_option(test_ctx, LIBUSB_OPTION_SYNC_CACHE_SIZE, 0));
+  LIBUSB_EXPECT(==, test_ctx->sync_cache_size, 0);
+
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_get_sync_stats(test_ctx, &stats));
+  LIBUSB_EXPECT(==, stats.allocations, 0);
+
+  LIBUSB_TEST_CLEAN_EXIT(TEST_STATUS_SUCCESS);
+}
+
+static libusb_testlib_result test_set_callback_threads(void)
+{
+  libusb_context *test_ctx = NULL;
+  struct libusb_init_option options[] = {
+    {
+      .option = LIBUSB_OPTION_CALLBACK_THREADS,
+      .value = {.ival = 2},
+    },
+  };
+
+  LIBUSB_EXPECT(==, libusb_set_option(NULL, LIBUSB_OPTION_CALLBACK_THREADS, -1),
+                LIBUSB_ERROR_INVALID_PARAM);
+  LIBUSB_EXPECT(==, libusb_set_option(NULL, LIBUSB_OPTION_CALLBACK_THREADS,
+                                      USBI_MAX_CALLBACK_THREADS + 1),
+                LIBUSB_ERROR_INVALID_PARAM);
+
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_init_context(&test_ctx, options,
+                                                  /*num_options=*/1));
+  LIBUSB_EXPECT(==, test_ctx->callback_threads, 2);
+  LIBUSB_EXPECT(!=, test_ctx->callback_workers, NULL);
+
+  LIBUSB_TEST_CLEAN_EXIT(TEST_STATUS_SUCCESS);
+}
+
+static libusb_testlib_result test_set_event_threads(void)
+{
+  libusb_context *test_ctx = NULL;
+  struct libusb_init_option options[] = {
+    {
+      .option = LIBUSB_OPTION_EVENT_THREADS,
+      .value = {.ival = 2},
+    },
+  };
+
+  LIBUSB_EXPECT(==, libusb_set_option(NULL, LIBUSB_OPTION_EVENT_THREADS, -1),
+                LIBUSB_ERROR_INVALID_PARAM);
+  LIBUSB_EXPECT(==, libusb_set_option(NULL, LIBUSB_OPTION_EVENT_THREADS,
+                                      USBI_MAX_EVENT_THREADS + 1),
+                LIBUSB_ERROR_INVALID_PARAM);
+
+#ifdef HAVE_OS_EVENT_SET
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_init_context(&test_ctx, options,
+                                                  /*num_options=*/1));
+  LIBUSB_EXPECT(==, test_ctx->event_threads, 2);
+  LIBUSB_EXPECT(!=, test_ctx->event_workers, NULL);
+#else
+  LIBUSB_EXPECT(==, libusb_init_context(&test_ctx, options, /*num_options=*/1),
+                LIBUSB_ERROR_NOT_SUPPORTED);
+#endif
+
+  LIBUSB_TEST_CLEAN_EXIT(TEST_STATUS_SUCCESS);
+}
+
+static libusb_testlib_result test_set_log_ring(void)
+{
+  libusb_context *test_ctx = NULL;
+  struct libusb_init_option options[] = {
+    {
+      .option = LIBUSB_OPTION_LOG_RING,
+      .value = {.ival = 5},
+    },
+  };
+
+  LIBUSB_EXPECT(==, libusb_set_option(NULL, LIBUSB_OPTION_LOG_RING, -1),
+                LIBUSB_ERROR_INVALID_PARAM);
+  LIBUSB_EXPECT(==, libusb_set_option(NULL, LIBUSB_OPTION_LOG_RING,
+                                      USBI_MAX_LOG_RING + 1),
+                LIBUSB_ERROR_INVALID_PARAM);
+
+#if defined(ENABLE_LOGGING) && !defined(ENABLE_DEBUG_LOGGING)
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_init_context(&test_ctx, options,
+                                                  /*num_options=*/1));
+  LIBUSB_EXPECT(==, test_ctx->log_ring_size, 5);
+  LIBUSB_EXPECT(==, test_ctx->log_ring.size, 8);
+  LIBUSB_EXPECT(!=, test_ctx->log_records, NULL);
+#else
+  LIBUSB_EXPECT(==, libusb_init_context(&test_ctx, options, /*num_options=*/1),
+                LIBUSB_ERROR_NOT_SUPPORTED);
+#endif
+
+  LIBUSB_TEST_CLEAN_EXIT(TEST_STATUS_SUCCESS);
+}
+
 static const libusb_testlib_test tests[] = {
   { "test_set_log_level_basic", &test_set_log_level_basic },
   { "test_set_log_level_env", &test_set_log_level_env },
   { "test_no_discovery", &test_no_discovery },
+  { "test_set_reap_budget", &test_set_reap_budget },
+  { "test_set_sync_direct_io", &test_set_sync_direct_io },
+  { "test_set_sync_cache_size", &test_set_sync_cache_size },
+  { "test_set_callback_threads", &test_set_callback_threads },
+  { "test_set_event_threads", &test_set_event_threads },
+  { "test_set_log_ring", &test_set_log_ring },
   /* since default options can't be unset, run this one last */
   { "test_set_log_level_default", &test_set_log_level_default },
   { "test_set_log_cb", &test_set_log_cb },
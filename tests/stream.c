@@ -0,0 +1,225 @@
+/*
+ * libusb stream tests
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libusbi.h"
+#include "libusb_testlib.h"
+
+#define RING_SIZE	8
+
+static libusb_testlib_result test_ring_order(void)
+{
+	struct usbi_ring_slot slots[RING_SIZE];
+	struct usbi_ring ring;
+	struct usbi_ring_slot *slot;
+	unsigned long positions[RING_SIZE], position;
+	int i;
+
+	usbi_ring_init(&ring, slots, RING_SIZE);
+
+	if (usbi_ring_acquire_read(&ring, &position))
+		return TEST_STATUS_FAILURE;
+
+	/* positions keep counting up across several laps of the ring */
+	for (i = 0; i < 3 * RING_SIZE; i++) {
+		slot = usbi_ring_acquire_write(&ring, &position);
+		if (!slot || position != (unsigned long)i)
+			return TEST_STATUS_FAILURE;
+		slot->length = i;
+		usbi_ring_commit_write(&ring, position);
+
+		slot = usbi_ring_acquire_read(&ring, &position);
+		if (!slot || slot->length != i)
+			return TEST_STATUS_FAILURE;
+		usbi_ring_commit_read(&ring, position);
+	}
+
+	for (i = 0; i < RING_SIZE; i++) {
+		slot = usbi_ring_acquire_write(&ring, &position);
+		if (!slot)
+			return TEST_STATUS_FAILURE;
+		slot->length = i;
+		usbi_ring_commit_write(&ring, position);
+	}
+
+	if (usbi_ring_acquire_write(&ring, &position)) {
+		libusb_testlib_logf("full ring accepted an entry");
+		return TEST_STATUS_FAILURE;
+	}
+
+	for (i = 0; i < RING_SIZE; i++) {
+		slot = usbi_ring_acquire_read(&ring, &positions[i]);
+		if (!slot || slot->length != i)
+			return TEST_STATUS_FAILURE;
+	}
+
+	/* an entry released out of order only frees up once the ones before
+	 * it have been released too */
+	usbi_ring_commit_read(&ring, positions[1]);
+	if (usbi_ring_acquire_write(&ring, &position))
+		return TEST_STATUS_FAILURE;
+	usbi_ring_commit_read(&ring, positions[0]);
+	for (i = 0; i < 2; i++) {
+		if (!usbi_ring_acquire_write(&ring, &position))
+			return TEST_STATUS_FAILURE;
+		usbi_ring_commit_write(&ring, position);
+	}
+
+	return TEST_STATUS_SUCCESS;
+}
+
+static libusb_testlib_result test_open_invalid_param(void)
+{
+	libusb_stream *stream;
+
+	if (libusb_stream_open(NULL, 0x81, 512, 4, 8, 0, &stream) != LIBUSB_ERROR_INVALID_PARAM ||
+	    libusb_stream_open_iso(NULL, 0x81, 8, 4, 64, 0, &stream) != LIBUSB_ERROR_INVALID_PARAM)
+		return TEST_STATUS_FAILURE;
+
+	return TEST_STATUS_SUCCESS;
+}
+
+#if defined(PLATFORM_POSIX)
+#include <pthread.h>
+#include <sched.h>
+
+#define NUM_CONSUMERS	4
+#define NUM_ITEMS	200000
+
+struct consumer_info {
+	struct usbi_ring *ring;
+	usbi_atomic_t *done;
+	unsigned char *seen;
+	int err;
+};
+
+static void *consume_loop(void *arg)
+{
+	struct consumer_info *info = arg;
+
+	for (;;) {
+		struct usbi_ring_slot *slot;
+		unsigned long position;
+
+		slot = usbi_ring_acquire_read(info->ring, &position);
+		if (!slot) {
+			if (usbi_atomic_load(info->done))
+				break;
+			sched_yield();
+			continue;
+		}
+
+		if (slot->length < 0 || slot->length >= NUM_ITEMS ||
+		    info->seen[slot->length]++) {
+			info->err = 1;
+			break;
+		}
+		usbi_ring_commit_read(info->ring, position);
+	}
+
+	return NULL;
+}
+
+/* One producer and several consumers, as in a stream: every item must be
+ * read exactly once */
+static libusb_testlib_result test_ring_threads(void)
+{
+	struct usbi_ring_slot slots[RING_SIZE];
+	struct consumer_info info[NUM_CONSUMERS];
+	pthread_t threads[NUM_CONSUMERS];
+	struct usbi_ring ring;
+	usbi_atomic_t done;
+	unsigned char *seen;
+	libusb_testlib_result result = TEST_STATUS_SUCCESS;
+	int i, t;
+
+	seen = calloc(NUM_ITEMS, 1);
+	if (!seen)
+		return TEST_STATUS_ERROR;
+
+	usbi_ring_init(&ring, slots, RING_SIZE);
+	usbi_atomic_store(&done, 0);
+
+	for (t = 0; t < NUM_CONSUMERS; t++) {
+		info[t].ring = &ring;
+		info[t].done = &done;
+		info[t].seen = seen;
+		info[t].err = 0;
+		if (pthread_create(&threads[t], NULL, consume_loop, &info[t]) != 0) {
+			free(seen);
+			return TEST_STATUS_ERROR;
+		}
+	}
+
+	for (i = 0; i < NUM_ITEMS; ) {
+		struct usbi_ring_slot *slot;
+		unsigned long position;
+
+		slot = usbi_ring_acquire_write(&ring, &position);
+		if (!slot) {
+			sched_yield();
+			continue;
+		}
+		slot->length = i++;
+		usbi_ring_commit_write(&ring, position);
+	}
+
+	/* wait for the ring to drain */
+	while (usbi_atomic_load(&ring.tail) != NUM_ITEMS)
+		sched_yield();
+	usbi_atomic_store(&done, 1);
+
+	for (t = 0; t < NUM_CONSUMERS; t++) {
+		pthread_join(threads[t], NULL);
+		if (info[t].err)
+			result = TEST_STATUS_FAILURE;
+	}
+
+	for (i = 0; i < NUM_ITEMS && result == TEST_STATUS_SUCCESS; i++) {
+		if (seen[i] != 1) {
+			libusb_testlib_logf("item %d was read %d times", i, seen[i]);
+			result = TEST_STATUS_FAILURE;
+		}
+	}
+
+	free(seen);
+	return result;
+}
+#else
+static libusb_testlib_result test_ring_threads(void)
+{
+	return TEST_STATUS_SKIP;
+}
+#endif
+
+static const libusb_testlib_test tests[] = {
+	{ "ring_order", &test_ring_order },
+	{ "ring_threads", &test_ring_threads },
+	{ "open_invalid_param", &test_open_invalid_param },
+	LIBUSB_NULL_TEST
+};
+
+int main(int argc, char *argv[])
+{
+	return libusb_testlib_run_tests(argc, argv, tests);
+}
@@ -0,0 +1,897 @@
+/*
+ * libusb stream tests, against a mock usbfs
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <time.h>
+
+#include "libusb.h"
+#include "libusb_testlib.h"
+#include "mock_usbfs.h"
+
+#define TRANSFER_SIZE	64
+#define NUM_TRANSFERS	2
+#define NUM_BUFFERS	4
+#define NUM_CLOSES	100
+
+/* wMaxPacketSize of MOCK_USBFS_EP_ISO_IN */
+#define ISO_PACKET_SIZE	1024
+#define ISO_PACKETS	4
+#define ISO_RECORDS	64
+
+static libusb_context *ctx;
+static libusb_device_handle *handle;
+static unsigned char data[3 * TRANSFER_SIZE];
+
+/* The mock completes URBs as soon as they are submitted, so a running stream
+ * always has some to reap. The reap budget makes event handling return. */
+static int open_mock(int event_threads)
+{
+	struct libusb_init_option options[] = {
+		{ .option = LIBUSB_OPTION_NO_DEVICE_DISCOVERY },
+		{ .option = LIBUSB_OPTION_REAP_BUDGET, .value = { .ival = NUM_BUFFERS } },
+		{ .option = LIBUSB_OPTION_EVENT_THREADS, .value = { .ival = event_threads } },
+	};
+
+	return mock_usbfs_open(options, event_threads ? 3 : 2, &ctx, &handle);
+}
+
+static void close_mock(void)
+{
+	mock_usbfs_close(ctx, handle);
+	mock_usbfs_hold_urbs = 0;
+	mock_usbfs_error_status = 0;
+	mock_usbfs_error_stride = 1;
+}
+
+static long elapsed_ms(const struct timespec *start, const struct timespec *end)
+{
+	return (long)(end->tv_sec - start->tv_sec) * 1000 +
+		(end->tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static int handle_events(void)
+{
+	struct timeval tv = { 0, 50000 };
+
+	return libusb_handle_events_timeout(ctx, &tv);
+}
+
+/* Handles events until the stream completed at least the given number of
+ * transfers, or for up to two seconds */
+static int wait_transfers(libusb_stream *stream, uint64_t transfers,
+	struct libusb_stream_stats *stats)
+{
+	struct timespec start, now;
+	int r;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (;;) {
+		libusb_stream_get_stats(stream, stats);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (stats->transfers >= transfers || now.tv_sec - start.tv_sec >= 2)
+			return LIBUSB_SUCCESS;
+
+		r = handle_events();
+		if (r < 0)
+			return r;
+	}
+}
+
+/* Reads the given number of buffers, which must carry a full transfer each
+ * and follow the given position, reporting no data dropped before them
+ * except for the first one, and releases them */
+static libusb_testlib_result read_buffers(libusb_stream *stream, int count,
+	unsigned long position, int dropped)
+{
+	struct libusb_stream_buffer buffers[NUM_BUFFERS];
+	int i, r;
+
+	for (i = 0; i < count; i++) {
+		r = libusb_stream_read(stream, &buffers[i]);
+		if (r != 1) {
+			libusb_testlib_logf("reading buffer %d: %d", i, r);
+			return TEST_STATUS_FAILURE;
+		}
+
+		if (buffers[i].length != TRANSFER_SIZE ||
+		    buffers[i].position != position + (unsigned long)i ||
+		    buffers[i].dropped != (i ? 0 : dropped)) {
+			libusb_testlib_logf("buffer %d: %d bytes at %lu, %d dropped", i,
+				buffers[i].length, buffers[i].position, buffers[i].dropped);
+			return TEST_STATUS_FAILURE;
+		}
+	}
+
+	for (i = 0; i < count; i++)
+		libusb_stream_release(stream, &buffers[i]);
+	return TEST_STATUS_SUCCESS;
+}
+
+/* Transfers completing while the ring is full are dropped, counted, and
+ * reported along with the next buffer */
+static libusb_testlib_result test_overruns(void)
+{
+	struct libusb_stream_stats stats, stopped;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	libusb_stream *stream = NULL;
+	struct libusb_stream_buffer buffer;
+	int r;
+
+	r = open_mock(0);
+	if (r != LIBUSB_SUCCESS)
+		return r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+
+	r = libusb_stream_open(handle, 0x81, TRANSFER_SIZE, NUM_TRANSFERS,
+		NUM_BUFFERS, 0, &stream);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_stream_start(stream);
+	if (r == LIBUSB_SUCCESS)
+		r = wait_transfers(stream, 4 * NUM_BUFFERS, &stats);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("running the stream: %s", libusb_error_name(r));
+		goto out;
+	}
+
+	/* the transfers in flight are cancelled, and not counted */
+	libusb_stream_stop(stream);
+	if (handle_events() < 0 || handle_events() < 0)
+		goto out;
+
+	libusb_stream_get_stats(stream, &stopped);
+	if (stopped.transfers < 4 * NUM_BUFFERS ||
+	    stopped.overruns != stopped.transfers - NUM_BUFFERS ||
+	    stopped.bytes != stopped.transfers * TRANSFER_SIZE ||
+	    stopped.stalls || stopped.errors) {
+		libusb_testlib_logf("%llu transfers of %llu bytes, %llu overruns, "
+			"%llu stalls, %llu errors",
+			(unsigned long long)stopped.transfers,
+			(unsigned long long)stopped.bytes,
+			(unsigned long long)stopped.overruns,
+			(unsigned long long)stopped.stalls,
+			(unsigned long long)stopped.errors);
+		goto out;
+	}
+
+	/* the ring kept the first buffers */
+	if (read_buffers(stream, NUM_BUFFERS, 0, 0) != TEST_STATUS_SUCCESS)
+		goto out;
+	r = libusb_stream_read(stream, &buffer);
+	if (r != 0) {
+		libusb_testlib_logf("empty ring read: %d", r);
+		goto out;
+	}
+
+	r = libusb_stream_start(stream);
+	if (r == LIBUSB_SUCCESS)
+		r = wait_transfers(stream, stopped.transfers + 1, &stats);
+	if (r != LIBUSB_SUCCESS || stats.transfers <= stopped.transfers) {
+		libusb_testlib_logf("restarting the stream: %s", libusb_error_name(r));
+		goto out;
+	}
+
+	result = read_buffers(stream, 1, NUM_BUFFERS, (int)stopped.overruns);
+
+out:
+	libusb_stream_close(stream);
+	close_mock();
+	return result;
+}
+
+/* With LIBUSB_STREAM_STALL_WHEN_FULL, transfers completing while the ring is
+ * full are parked until a buffer is released, and no data is dropped */
+static libusb_testlib_result test_stall_when_full(void)
+{
+	struct libusb_stream_stats stats;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	libusb_stream *stream = NULL;
+	uint64_t transfers = NUM_BUFFERS + NUM_TRANSFERS;
+	int r;
+
+	r = open_mock(0);
+	if (r != LIBUSB_SUCCESS)
+		return r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+
+	r = libusb_stream_open(handle, 0x81, TRANSFER_SIZE, NUM_TRANSFERS,
+		NUM_BUFFERS, LIBUSB_STREAM_STALL_WHEN_FULL, &stream);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_stream_start(stream);
+	if (r == LIBUSB_SUCCESS)
+		r = wait_transfers(stream, transfers, &stats);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("running the stream: %s", libusb_error_name(r));
+		goto out;
+	}
+
+	/* once every transfer is parked, nothing is submitted */
+	if (handle_events() < 0)
+		goto out;
+	libusb_stream_get_stats(stream, &stats);
+	if (stats.transfers != transfers || stats.stalls != NUM_TRANSFERS ||
+	    stats.overruns || mock_usbfs_reaped != transfers) {
+		libusb_testlib_logf("%llu transfers, %llu stalls, %llu overruns, "
+			"%u URBs reaped", (unsigned long long)stats.transfers,
+			(unsigned long long)stats.stalls,
+			(unsigned long long)stats.overruns, mock_usbfs_reaped);
+		goto out;
+	}
+
+	/* releasing a buffer publishes the oldest parked transfer and
+	 * resubmits it, and it parks again */
+	if (read_buffers(stream, 1, 0, 0) != TEST_STATUS_SUCCESS)
+		goto out;
+	r = wait_transfers(stream, transfers + 1, &stats);
+	if (r != LIBUSB_SUCCESS || stats.transfers != transfers + 1 ||
+	    stats.stalls != NUM_TRANSFERS + 1 || stats.overruns) {
+		libusb_testlib_logf("after a release: %llu transfers, %llu stalls, "
+			"%llu overruns", (unsigned long long)stats.transfers,
+			(unsigned long long)stats.stalls,
+			(unsigned long long)stats.overruns);
+		goto out;
+	}
+
+	result = read_buffers(stream, NUM_BUFFERS, 1, 0);
+
+out:
+	libusb_stream_close(stream);
+	close_mock();
+	return result;
+}
+
+/* A stream only restarts once its cancelled transfers came back, and closing
+ * it waits for those in flight */
+static libusb_testlib_result test_stop_close(void)
+{
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	libusb_stream *stream = NULL;
+	int r;
+
+	r = open_mock(0);
+	if (r != LIBUSB_SUCCESS)
+		return r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+
+	/* neither a NULL stream nor one never started needs any event */
+	libusb_stream_close(NULL);
+	r = libusb_stream_open(handle, 0x81, TRANSFER_SIZE, NUM_TRANSFERS,
+		NUM_BUFFERS, 0, &stream);
+	if (r != LIBUSB_SUCCESS)
+		goto out;
+	libusb_stream_close(stream);
+	stream = NULL;
+
+	mock_usbfs_hold_urbs = 1;
+	r = libusb_stream_open(handle, 0x81, TRANSFER_SIZE, NUM_TRANSFERS,
+		NUM_BUFFERS, 0, &stream);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_stream_start(stream);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("starting the stream: %s", libusb_error_name(r));
+		goto out;
+	}
+
+	r = libusb_stream_start(stream);
+	if (r != LIBUSB_ERROR_BUSY) {
+		libusb_testlib_logf("starting a running stream: %s", libusb_error_name(r));
+		goto out;
+	}
+
+	libusb_stream_stop(stream);
+	r = libusb_stream_start(stream);
+	if (r != LIBUSB_ERROR_BUSY) {
+		libusb_testlib_logf("starting a stopping stream: %s", libusb_error_name(r));
+		goto out;
+	}
+
+	if (handle_events() < 0)
+		goto out;
+	r = libusb_stream_start(stream);
+	if (r != LIBUSB_SUCCESS || mock_usbfs_reaped != NUM_TRANSFERS) {
+		libusb_testlib_logf("restarting the stream: %s, %u URBs reaped",
+			libusb_error_name(r), mock_usbfs_reaped);
+		goto out;
+	}
+
+	libusb_stream_close(stream);
+	stream = NULL;
+	if (mock_usbfs_reaped != 2 * NUM_TRANSFERS) {
+		libusb_testlib_logf("closed with %u URBs in flight",
+			2 * NUM_TRANSFERS - mock_usbfs_reaped);
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	libusb_stream_close(stream);
+	close_mock();
+	return result;
+}
+
+/* Closes running streams while event threads complete their transfers, so
+ * that AddressSanitizer can catch a stream freed under their callbacks */
+static libusb_testlib_result test_close_threads(void)
+{
+	libusb_stream *stream;
+	int i, r;
+
+	r = open_mock(2);
+	if (r != LIBUSB_SUCCESS)
+		return r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+
+	for (i = 0; i < NUM_CLOSES; i++) {
+		r = libusb_stream_open(handle, 0x81, TRANSFER_SIZE, NUM_TRANSFERS,
+			NUM_BUFFERS, i % 2 ? LIBUSB_STREAM_STALL_WHEN_FULL : 0, &stream);
+		if (r != LIBUSB_SUCCESS)
+			break;
+
+		r = libusb_stream_start(stream);
+		libusb_stream_close(stream);
+		if (r != LIBUSB_SUCCESS)
+			break;
+	}
+
+	close_mock();
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("stream %d: %s", i, libusb_error_name(r));
+		return TEST_STATUS_FAILURE;
+	}
+
+	return TEST_STATUS_SUCCESS;
+}
+
+/* Writes a message of three transfers, one of a single transfer and a
+ * buffer committed on its own to an OUT stream, each of which ends with a
+ * zero length packet if the stream asks for them */
+static libusb_testlib_result write_messages(uint32_t flags,
+	unsigned int expect_zero_packets)
+{
+	struct libusb_stream_stats stats;
+	struct libusb_stream_buffer buffer;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	libusb_stream *stream = NULL;
+	int r;
+
+	r = open_mock(0);
+	if (r != LIBUSB_SUCCESS)
+		return r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+
+	r = libusb_stream_open(handle, 0x02, TRANSFER_SIZE, NUM_TRANSFERS,
+		NUM_BUFFERS, flags, &stream);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_stream_start(stream);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("starting the stream: %s", libusb_error_name(r));
+		goto out;
+	}
+
+	if (libusb_stream_write(stream, data, 3 * TRANSFER_SIZE) != 3 * TRANSFER_SIZE ||
+	    libusb_stream_write(stream, data, 10) != 10)
+		goto out;
+
+	r = libusb_stream_acquire(stream, &buffer);
+	if (r == LIBUSB_SUCCESS) {
+		buffer.length = TRANSFER_SIZE / 2;
+		r = libusb_stream_commit(stream, &buffer);
+	}
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_stream_flush(stream);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("committing a buffer: %s", libusb_error_name(r));
+		goto out;
+	}
+
+	libusb_stream_get_stats(stream, &stats);
+	if (stats.transfers != 5 || stats.bytes != 3 * TRANSFER_SIZE + 10 + TRANSFER_SIZE / 2 ||
+	    mock_usbfs_reaped != 5 || mock_usbfs_zero_packets != expect_zero_packets) {
+		libusb_testlib_logf("%llu transfers of %llu bytes, %u URBs reaped, "
+			"%u zero length packets", (unsigned long long)stats.transfers,
+			(unsigned long long)stats.bytes, mock_usbfs_reaped,
+			mock_usbfs_zero_packets);
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	libusb_stream_close(stream);
+	close_mock();
+	return result;
+}
+
+static libusb_testlib_result test_zero_packet(void)
+{
+	return write_messages(LIBUSB_STREAM_ZERO_PACKET, 3);
+}
+
+static libusb_testlib_result test_no_zero_packet(void)
+{
+	return write_messages(0, 0);
+}
+
+/* Empty writes and commits send nothing, and do not hold back the data
+ * after them, nor does a buffer committed with an invalid length */
+static libusb_testlib_result test_zero_length(void)
+{
+	struct libusb_stream_stats stats;
+	struct libusb_stream_buffer buffer;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	libusb_stream *stream = NULL;
+	int r;
+
+	r = open_mock(0);
+	if (r != LIBUSB_SUCCESS)
+		return r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+
+	r = libusb_stream_open(handle, 0x02, TRANSFER_SIZE, NUM_TRANSFERS,
+		NUM_BUFFERS, LIBUSB_STREAM_ZERO_PACKET, &stream);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_stream_start(stream);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("starting the stream: %s", libusb_error_name(r));
+		goto out;
+	}
+
+	r = libusb_stream_write(stream, data, 0);
+	if (r != 0) {
+		libusb_testlib_logf("empty write: %d", r);
+		goto out;
+	}
+
+	r = libusb_stream_acquire(stream, &buffer);
+	if (r == LIBUSB_SUCCESS) {
+		buffer.length = 0;
+		r = libusb_stream_commit(stream, &buffer);
+	}
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("empty commit: %s", libusb_error_name(r));
+		goto out;
+	}
+
+	r = libusb_stream_acquire(stream, &buffer);
+	if (r == LIBUSB_SUCCESS) {
+		buffer.length = TRANSFER_SIZE + 1;
+		r = libusb_stream_commit(stream, &buffer);
+	}
+	if (r != LIBUSB_ERROR_INVALID_PARAM) {
+		libusb_testlib_logf("oversized commit: %s", libusb_error_name(r));
+		goto out;
+	}
+
+	if (libusb_stream_write(stream, data, 16) != 16 ||
+	    libusb_stream_write(stream, data, 0) != 0)
+		goto out;
+
+	r = libusb_stream_flush(stream);
+	libusb_stream_get_stats(stream, &stats);
+	if (r != LIBUSB_SUCCESS || stats.transfers != 1 || stats.bytes != 16 ||
+	    mock_usbfs_reaped != 1 || mock_usbfs_zero_packets != 1) {
+		libusb_testlib_logf("flush: %s, %llu transfers of %llu bytes, "
+			"%u URBs reaped, %u zero length packets", libusb_error_name(r),
+			(unsigned long long)stats.transfers,
+			(unsigned long long)stats.bytes, mock_usbfs_reaped,
+			mock_usbfs_zero_packets);
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	libusb_stream_close(stream);
+	close_mock();
+	return result;
+}
+
+/* A non-blocking stream fails writes to a full ring. Once stopped, it keeps
+ * the data of the ring, which flushing does not wait for. */
+static libusb_testlib_result test_nonblock(void)
+{
+	struct libusb_stream_stats stats;
+	struct libusb_stream_buffer buffer;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	libusb_stream *stream = NULL;
+	int i, r;
+
+	r = open_mock(0);
+	if (r != LIBUSB_SUCCESS)
+		return r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+
+	mock_usbfs_hold_urbs = 1;
+	r = libusb_stream_open(handle, 0x02, TRANSFER_SIZE, NUM_TRANSFERS,
+		NUM_BUFFERS, LIBUSB_STREAM_NONBLOCK, &stream);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_stream_start(stream);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("starting the stream: %s", libusb_error_name(r));
+		goto out;
+	}
+
+	/* the transfers take the first buffers, and the ring the others */
+	for (i = 0; i < NUM_TRANSFERS + NUM_BUFFERS; i++) {
+		r = libusb_stream_write(stream, data, TRANSFER_SIZE);
+		if (r != TRANSFER_SIZE) {
+			libusb_testlib_logf("write %d: %d", i, r);
+			goto out;
+		}
+	}
+
+	r = libusb_stream_write(stream, data, 1);
+	if (r == LIBUSB_ERROR_BUSY)
+		r = libusb_stream_acquire(stream, &buffer);
+	if (r != LIBUSB_ERROR_BUSY) {
+		libusb_testlib_logf("full ring: %d", r);
+		goto out;
+	}
+
+	libusb_stream_stop(stream);
+	if (handle_events() < 0)
+		goto out;
+	r = libusb_stream_flush(stream);
+	if (r != LIBUSB_ERROR_BUSY) {
+		libusb_testlib_logf("flushing a stopped stream: %s", libusb_error_name(r));
+		goto out;
+	}
+
+	/* the cancelled transfers lost their data, the ring did not */
+	mock_usbfs_hold_urbs = 0;
+	r = libusb_stream_start(stream);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_stream_flush(stream);
+	libusb_stream_get_stats(stream, &stats);
+	if (r != LIBUSB_SUCCESS || stats.transfers != NUM_BUFFERS || stats.errors ||
+	    mock_usbfs_reaped != NUM_TRANSFERS + NUM_BUFFERS) {
+		libusb_testlib_logf("restarting: %s, %llu transfers, %llu errors, "
+			"%u URBs reaped", libusb_error_name(r),
+			(unsigned long long)stats.transfers,
+			(unsigned long long)stats.errors, mock_usbfs_reaped);
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	libusb_stream_close(stream);
+	close_mock();
+	return result;
+}
+
+/* Data written before a stream starts is sent once it does. Until then,
+ * flushing fails, and so does writing to a full ring. */
+static libusb_testlib_result test_flush_stopped(void)
+{
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	libusb_stream *stream = NULL;
+	int r;
+
+	r = open_mock(0);
+	if (r != LIBUSB_SUCCESS)
+		return r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+
+	r = libusb_stream_open(handle, 0x02, TRANSFER_SIZE, NUM_TRANSFERS,
+		NUM_BUFFERS, 0, &stream);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("opening the stream: %s", libusb_error_name(r));
+		goto out;
+	}
+
+	r = libusb_stream_flush(stream);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("flushing an empty stream: %s", libusb_error_name(r));
+		goto out;
+	}
+
+	if (libusb_stream_write(stream, data, 10) != 10)
+		goto out;
+	r = libusb_stream_flush(stream);
+	if (r != LIBUSB_ERROR_BUSY) {
+		libusb_testlib_logf("flushing a stream never started: %s",
+			libusb_error_name(r));
+		goto out;
+	}
+
+	/* a write stops at a full ring */
+	r = libusb_stream_write(stream, data, NUM_BUFFERS * TRANSFER_SIZE);
+	if (r != (NUM_BUFFERS - 1) * TRANSFER_SIZE) {
+		libusb_testlib_logf("write to a filling ring: %d", r);
+		goto out;
+	}
+	r = libusb_stream_write(stream, data, 1);
+	if (r != LIBUSB_ERROR_BUSY) {
+		libusb_testlib_logf("write to a full ring: %d", r);
+		goto out;
+	}
+
+	r = libusb_stream_start(stream);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_stream_flush(stream);
+	if (r != LIBUSB_SUCCESS || mock_usbfs_reaped != NUM_BUFFERS) {
+		libusb_testlib_logf("flushing: %s, %u URBs reaped", libusb_error_name(r),
+			mock_usbfs_reaped);
+		goto out;
+	}
+
+	libusb_stream_stop(stream);
+	r = libusb_stream_flush(stream);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("flushing a stopped empty stream: %s",
+			libusb_error_name(r));
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	libusb_stream_close(stream);
+	close_mock();
+	return result;
+}
+
+/* Reads the given number of packet records of an iso stream whose mock
+ * fails every other packet, starting with the first of a transfer, and
+ * releases them */
+static libusb_testlib_result read_records(libusb_stream *stream, int count,
+	int dropped)
+{
+	struct libusb_stream_buffer buffer;
+	int i, r;
+
+	for (i = 0; i < count; i++) {
+		int failed = (i % ISO_PACKETS) % 2 == 0;
+
+		r = libusb_stream_read(stream, &buffer);
+		if (r != 1) {
+			libusb_testlib_logf("reading record %d: %d", i, r);
+			return TEST_STATUS_FAILURE;
+		}
+
+		if (buffer.length != (failed ? 0 : ISO_PACKET_SIZE) ||
+		    buffer.status != (failed ? LIBUSB_TRANSFER_ERROR : LIBUSB_TRANSFER_COMPLETED) ||
+		    buffer.dropped != (i ? 0 : dropped)) {
+			libusb_testlib_logf("record %d: %d bytes, status %d, %d dropped", i,
+				buffer.length, buffer.status, buffer.dropped);
+			libusb_stream_release(stream, &buffer);
+			return TEST_STATUS_FAILURE;
+		}
+
+		libusb_stream_release(stream, &buffer);
+	}
+
+	return TEST_STATUS_SUCCESS;
+}
+
+/* Opens an iso stream with the given number of records on the mock device,
+ * which fails every other packet, and starts it */
+static int start_iso(int num_buffers, libusb_stream **stream)
+{
+	int r;
+
+	mock_usbfs_error_status = -EXDEV;
+	mock_usbfs_error_stride = 2;
+	r = libusb_stream_open_iso(handle, MOCK_USBFS_EP_ISO_IN, ISO_PACKETS,
+		NUM_TRANSFERS, num_buffers, 0, stream);
+	if (r != LIBUSB_SUCCESS) {
+		*stream = NULL;
+		return r;
+	}
+
+	return libusb_stream_start(*stream);
+}
+
+/* An iso stream hands out one record per packet, holding either its data
+ * or its failure */
+static libusb_testlib_result test_iso_records(void)
+{
+	struct libusb_stream_stats stats;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	libusb_stream *stream = NULL;
+	struct libusb_stream_buffer buffer;
+	int r;
+
+	r = open_mock(0);
+	if (r != LIBUSB_SUCCESS)
+		return r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+
+	r = start_iso(ISO_RECORDS, &stream);
+	if (r == LIBUSB_SUCCESS)
+		r = wait_transfers(stream, 2 * NUM_TRANSFERS, &stats);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("running the stream: %s", libusb_error_name(r));
+		goto out;
+	}
+
+	libusb_stream_stop(stream);
+	if (handle_events() < 0 || handle_events() < 0)
+		goto out;
+
+	libusb_stream_get_stats(stream, &stats);
+	if (stats.transfers < 2 * NUM_TRANSFERS ||
+	    stats.packets != stats.transfers * ISO_PACKETS ||
+	    stats.packets > ISO_RECORDS ||
+	    stats.packet_errors != stats.packets / 2 ||
+	    stats.overruns || stats.errors) {
+		libusb_testlib_logf("%llu transfers, %llu packets, %llu failed, "
+			"%llu overruns, %llu errors", (unsigned long long)stats.transfers,
+			(unsigned long long)stats.packets,
+			(unsigned long long)stats.packet_errors,
+			(unsigned long long)stats.overruns,
+			(unsigned long long)stats.errors);
+		goto out;
+	}
+
+	if (read_records(stream, (int)stats.packets, 0) != TEST_STATUS_SUCCESS)
+		goto out;
+	r = libusb_stream_read(stream, &buffer);
+	if (r != 0) {
+		libusb_testlib_logf("read past the last record: %d", r);
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	libusb_stream_close(stream);
+	close_mock();
+	return result;
+}
+
+/* Packets arriving while the ring is full are dropped, failed or not,
+ * counted, and reported along with the next record */
+static libusb_testlib_result test_iso_dropped(void)
+{
+	struct libusb_stream_stats stats, stopped;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	libusb_stream *stream = NULL;
+	int r;
+
+	r = open_mock(0);
+	if (r != LIBUSB_SUCCESS)
+		return r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+
+	r = start_iso(ISO_PACKETS, &stream);
+	if (r == LIBUSB_SUCCESS)
+		r = wait_transfers(stream, 2 * NUM_TRANSFERS, &stats);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("running the stream: %s", libusb_error_name(r));
+		goto out;
+	}
+
+	libusb_stream_stop(stream);
+	if (handle_events() < 0 || handle_events() < 0)
+		goto out;
+
+	libusb_stream_get_stats(stream, &stopped);
+	if (stopped.packets != stopped.transfers * ISO_PACKETS ||
+	    stopped.overruns != stopped.packets - ISO_PACKETS ||
+	    stopped.packet_errors != stopped.packets / 2) {
+		libusb_testlib_logf("%llu packets, %llu failed, %llu overruns",
+			(unsigned long long)stopped.packets,
+			(unsigned long long)stopped.packet_errors,
+			(unsigned long long)stopped.overruns);
+		goto out;
+	}
+
+	/* the ring kept the packets of the first transfer */
+	if (read_records(stream, ISO_PACKETS, 0) != TEST_STATUS_SUCCESS)
+		goto out;
+
+	r = libusb_stream_start(stream);
+	if (r == LIBUSB_SUCCESS)
+		r = wait_transfers(stream, stopped.transfers + 1, &stats);
+	if (r != LIBUSB_SUCCESS || stats.transfers <= stopped.transfers) {
+		libusb_testlib_logf("restarting the stream: %s", libusb_error_name(r));
+		goto out;
+	}
+
+	result = read_records(stream, 1, (int)stopped.overruns);
+
+out:
+	libusb_stream_close(stream);
+	close_mock();
+	return result;
+}
+
+/* The packets dropped and failed per second are only updated by the first
+ * completion a second after the window started, with the counts of the
+ * whole window */
+static libusb_testlib_result test_iso_window(void)
+{
+	struct libusb_stream_stats stats, window;
+	struct timespec before, started, now;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	libusb_stream *stream = NULL;
+	int r;
+
+	r = open_mock(0);
+	if (r != LIBUSB_SUCCESS)
+		return r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+
+	clock_gettime(CLOCK_MONOTONIC, &before);
+	r = start_iso(ISO_PACKETS, &stream);
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	if (r == LIBUSB_SUCCESS)
+		r = wait_transfers(stream, 2 * NUM_TRANSFERS, &stats);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("running the stream: %s", libusb_error_name(r));
+		goto out;
+	}
+
+	/* the transfers in flight complete once more, and are then held */
+	mock_usbfs_hold_urbs = 1;
+	if (handle_events() < 0)
+		goto out;
+	libusb_stream_get_stats(stream, &stats);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!stats.overruns || !stats.packet_errors ||
+	    (elapsed_ms(&before, &now) < 1000 &&
+	     (stats.dropped_per_second || stats.errors_per_second))) {
+		libusb_testlib_logf("within a second: %llu overruns, %llu failed, "
+			"%u dropped and %u failed per second",
+			(unsigned long long)stats.overruns,
+			(unsigned long long)stats.packet_errors,
+			stats.dropped_per_second, stats.errors_per_second);
+		goto out;
+	}
+
+	do {
+		if (handle_events() < 0)
+			goto out;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while (elapsed_ms(&started, &now) < 1100);
+
+	/* the cancelled transfers carry no packet, but close the window */
+	libusb_stream_stop(stream);
+	if (handle_events() < 0)
+		goto out;
+	libusb_stream_get_stats(stream, &window);
+	if (window.packets != stats.packets ||
+	    window.dropped_per_second != stats.overruns ||
+	    window.errors_per_second != stats.packet_errors) {
+		libusb_testlib_logf("after a second: %llu packets, %u dropped and "
+			"%u failed per second", (unsigned long long)window.packets,
+			window.dropped_per_second, window.errors_per_second);
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	libusb_stream_close(stream);
+	close_mock();
+	return result;
+}
+
+static const libusb_testlib_test tests[] = {
+	{ "overruns", &test_overruns },
+	{ "stall_when_full", &test_stall_when_full },
+	{ "stop_close", &test_stop_close },
+	{ "close_threads", &test_close_threads },
+	{ "zero_packet", &test_zero_packet },
+	{ "no_zero_packet", &test_no_zero_packet },
+	{ "zero_length", &test_zero_length },
+	{ "nonblock", &test_nonblock },
+	{ "flush_stopped", &test_flush_stopped },
+	{ "iso_records", &test_iso_records },
+	{ "iso_dropped", &test_iso_dropped },
+	{ "iso_window", &test_iso_window },
+	LIBUSB_NULL_TEST
+};
+
+int main(int argc, char *argv[])
+{
+	return libusb_testlib_run_tests(argc, argv, tests);
+}
@@ -21,6 +21,7 @@
 
 #include <libusb.h>
 #include <stdio.h>
+#include <time.h>
 
 #if defined(PLATFORM_POSIX)
 
@@ -155,6 +156,193 @@ static int test_multi_init(int enumerate)
 	return errs;
 }
 
+/* Test that measures transfer submission and reaping throughput for an
+ * increasing number of threads, each thread using its own handle on the
+ * same device. The device is a mock usbfs device, which completes every URB
+ * as soon as it is submitted, so that the cost measured is libusb's. */
+
+#if defined(__linux__)
+#include "mock_usbfs.h"
+
+#define SUBMIT_ITERS	32768
+#define QUEUE_DEPTH	16
+#define TRANSFER_SIZE	64
+
+struct submit_info {
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	struct libusb_transfer *transfers[QUEUE_DEPTH];
+	unsigned char buffers[QUEUE_DEPTH][TRANSFER_SIZE];
+	int completed;
+	int done;
+	double submit_ns;
+	int err;
+} sinfo[NTHREADS];
+
+static double elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+	return (double)(end->tv_sec - start->tv_sec) * 1e9 +
+		(double)(end->tv_nsec - start->tv_nsec);
+}
+
+static void LIBUSB_CALL submit_cb(struct libusb_transfer *transfer)
+{
+	struct submit_info *si = transfer->user_data;
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+		si->err = LIBUSB_ERROR_IO;
+	if (++si->completed == QUEUE_DEPTH)
+		si->done = 1;
+}
+
+/* Submits QUEUE_DEPTH transfers at a time, and handles events until they
+ * have all completed */
+static thread_return_t THREAD_CALL_TYPE submit_loop(void * arg)
+{
+	struct submit_info *si = (struct submit_info *) arg;
+	struct timespec start, end;
+
+	for (int i = 0; i < SUBMIT_ITERS && !si->err; i += QUEUE_DEPTH) {
+		int submitted;
+
+		si->completed = 0;
+		si->done = 0;
+
+		for (submitted = 0; submitted < QUEUE_DEPTH; ++submitted) {
+			int r;
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			r = libusb_submit_transfer(si->transfers[submitted]);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			si->submit_ns += elapsed_ns(&start, &end);
+			if (r < 0) {
+				si->err = r;
+				break;
+			}
+		}
+
+		if (submitted < QUEUE_DEPTH) {
+			/* wait for the transfers already submitted */
+			while (si->completed < submitted)
+				libusb_handle_events_completed(si->ctx, NULL);
+			break;
+		}
+
+		while (!si->done) {
+			int r = libusb_handle_events_completed(si->ctx, &si->done);
+
+			if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+				si->err = r;
+				break;
+			}
+		}
+	}
+	return (thread_return_t) THREAD_RETURN_VALUE;
+}
+
+static int run_submit_threads(libusb_context *ctx, int nthreads)
+{
+	thread_t threadId[NTHREADS];
+	struct timespec start, end;
+	double secs, submit_ns = 0;
+	int errs = 0;
+	int t;
+
+	for (t = 0; t < nthreads; t++) {
+		sinfo[t].ctx = ctx;
+		sinfo[t].submit_ns = 0;
+		sinfo[t].err = 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (t = 0; t < nthreads; t++)
+		thread_create(&threadId[t], &submit_loop, (void *) &sinfo[t]);
+	for (t = 0; t < nthreads; t++)
+		thread_join(threadId[t]);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	for (t = 0; t < nthreads; t++) {
+		if (sinfo[t].err) {
+			errs++;
+			fprintf(stderr, "Thread %d failed: %s\n", t,
+				libusb_error_name(sinfo[t].err));
+		}
+		submit_ns += sinfo[t].submit_ns;
+	}
+
+	secs = elapsed_ns(&start, &end) / 1e9;
+	printf("%d threads: %d transfers in %.3fs, %.0f submitted and reaped/s, "
+	       "%.0fns per submit\n", nthreads, nthreads * SUBMIT_ITERS, secs,
+	       secs > 0 ? nthreads * SUBMIT_ITERS / secs : 0.0,
+	       submit_ns / (nthreads * SUBMIT_ITERS));
+
+	return errs;
+}
+
+static int test_submit_scaling(void)
+{
+	struct libusb_init_option options[] = {
+		{ .option = LIBUSB_OPTION_NO_DEVICE_DISCOVERY },
+	};
+	libusb_context *ctx = NULL;
+	libusb_device_handle *handle;
+	int num_handles = 0;
+	int errs = 0;
+	int r;
+
+	r = mock_usbfs_open(options, 1, &ctx, &handle);
+	if (r != LIBUSB_SUCCESS) {
+		fprintf(stderr, "Failed to open the mock device: %s\n", libusb_error_name(r));
+		return 1;
+	}
+
+	for (int t = 0; t < NTHREADS && !errs; t++) {
+		sinfo[t].handle = handle;
+		if (t > 0) {
+			r = mock_usbfs_open_handle(ctx, &sinfo[t].handle);
+			if (r != LIBUSB_SUCCESS) {
+				fprintf(stderr, "Failed to open handle %d: %s\n", t,
+					libusb_error_name(r));
+				errs++;
+				break;
+			}
+		}
+		num_handles++;
+
+		for (int j = 0; j < QUEUE_DEPTH; ++j) {
+			struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+
+			sinfo[t].transfers[j] = transfer;
+			if (!transfer) {
+				errs++;
+				break;
+			}
+			libusb_fill_bulk_transfer(transfer, sinfo[t].handle, 0x81,
+				sinfo[t].buffers[j], TRANSFER_SIZE, submit_cb, &sinfo[t], 1000);
+		}
+	}
+
+	for (int nthreads = 1; nthreads <= NTHREADS && !errs; nthreads *= 2)
+		errs += run_submit_threads(ctx, nthreads);
+
+	while (num_handles-- > 0) {
+		for (int j = 0; j < QUEUE_DEPTH; ++j)
+			libusb_free_transfer(sinfo[num_handles].transfers[j]);
+		if (num_handles > 0)
+			mock_usbfs_close_handle(sinfo[num_handles].handle);
+	}
+	mock_usbfs_close(ctx, handle);
+
+	return errs;
+}
+#else
+static int test_submit_scaling(void)
+{
+	printf("No mock device on this platform, skipping\n");
+	return 0;
+}
+#endif
+
 int main(void)
 {
 	int errs = 0;
@@ -163,6 +351,8 @@ int main(void)
 	errs += test_multi_init(0);
 	printf("Running multithreaded init/exit test with enumeration...\n");
 	errs += test_multi_init(1);
+	printf("Running multithreaded submit scaling test...\n");
+	errs += test_submit_scaling();
 	printf("All done, %d errors\n", errs);
 
 	return errs != 0;
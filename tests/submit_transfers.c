@@ -0,0 +1,368 @@
+/*
+ * libusb_submit_transfers() tests, against a mock usbfs
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <time.h>
+
+#include "libusb.h"
+#include "libusb_testlib.h"
+#include "mock_usbfs.h"
+
+#define NUM_TRANSFERS	4
+#define BUFFER_SIZE	64
+
+static libusb_context *ctx;
+static libusb_device_handle *handle;
+static struct libusb_transfer *transfers[NUM_TRANSFERS];
+static unsigned char buffers[NUM_TRANSFERS][BUFFER_SIZE];
+static int callbacks[NUM_TRANSFERS];
+static int completion_order[NUM_TRANSFERS];
+static long completion_ms[NUM_TRANSFERS];
+static int num_completed;
+static struct timespec start;
+
+static long elapsed_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long)(now.tv_sec - start.tv_sec) * 1000 +
+		(now.tv_nsec - start.tv_nsec) / 1000000;
+}
+
+static void LIBUSB_CALL transfer_cb(struct libusb_transfer *transfer)
+{
+	int i = (int)(intptr_t)transfer->user_data;
+
+	callbacks[i]++;
+	completion_ms[i] = elapsed_ms();
+	if (num_completed < NUM_TRANSFERS)
+		completion_order[num_completed] = i;
+	num_completed++;
+}
+
+static void fill_transfer(int i, libusb_device_handle *dev_handle,
+	unsigned int timeout)
+{
+	libusb_fill_bulk_transfer(transfers[i], dev_handle, 0x81, buffers[i],
+		BUFFER_SIZE, transfer_cb, (void *)(intptr_t)i, timeout);
+}
+
+static void teardown(void);
+
+/* Opens the mock device and allocates the transfers, or returns an error
+ * with nothing left open */
+static int setup(void)
+{
+	struct libusb_init_option options[] = {
+		{ .option = LIBUSB_OPTION_NO_DEVICE_DISCOVERY },
+	};
+	int i, r;
+
+	r = mock_usbfs_open(options, 1, &ctx, &handle);
+	if (r != LIBUSB_SUCCESS)
+		return r;
+
+	memset(callbacks, 0, sizeof(callbacks));
+	num_completed = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < NUM_TRANSFERS; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		if (!transfers[i]) {
+			teardown();
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		fill_transfer(i, handle, 1000);
+	}
+
+	return LIBUSB_SUCCESS;
+}
+
+static void teardown(void)
+{
+	int i;
+
+	for (i = 0; i < NUM_TRANSFERS; i++) {
+		libusb_free_transfer(transfers[i]);
+		transfers[i] = NULL;
+	}
+	mock_usbfs_close(ctx, handle);
+	mock_usbfs_hold_urbs = 0;
+	mock_usbfs_max_urbs = 0;
+}
+
+static libusb_testlib_result setup_result(int r)
+{
+	return r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+}
+
+/* Handles events until count callbacks have run, for at most two seconds */
+static int wait_completed(int count)
+{
+	struct timeval tv = { 0, 100000 };
+
+	while (num_completed < count && elapsed_ms() < 2000) {
+		if (libusb_handle_events_timeout(ctx, &tv) != LIBUSB_SUCCESS)
+			return -1;
+	}
+
+	return num_completed == count ? 0 : -1;
+}
+
+/* A transfer listed twice, or already in flight, is busy and submitted
+ * only once */
+static libusb_testlib_result test_duplicates(void)
+{
+	struct libusb_transfer *list[3];
+	int results[3];
+	int r;
+
+	r = setup();
+	if (r != LIBUSB_SUCCESS)
+		return setup_result(r);
+
+	list[0] = transfers[0];
+	list[1] = transfers[0];
+	list[2] = transfers[1];
+	r = libusb_submit_transfers(list, 3, results);
+	if (r != 2 || results[0] != LIBUSB_SUCCESS ||
+	    results[1] != LIBUSB_ERROR_BUSY || results[2] != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("submitted %d, results %d %d %d", r,
+			results[0], results[1], results[2]);
+		goto fail;
+	}
+
+	r = libusb_submit_transfers(list, 1, results);
+	if (r != 0 || results[0] != LIBUSB_ERROR_BUSY) {
+		libusb_testlib_logf("in flight transfer submitted %d, result %s", r,
+			libusb_error_name(results[0]));
+		goto fail;
+	}
+
+	if (wait_completed(2) || callbacks[0] != 1 || callbacks[1] != 1 ||
+	    transfers[0]->status != LIBUSB_TRANSFER_COMPLETED) {
+		libusb_testlib_logf("%d callbacks, %d and %d", num_completed,
+			callbacks[0], callbacks[1]);
+		goto fail;
+	}
+
+	teardown();
+	return TEST_STATUS_SUCCESS;
+
+fail:
+	wait_completed(2);
+	teardown();
+	return TEST_STATUS_FAILURE;
+}
+
+/* Transfers of several device handles are submitted in one call, and a
+ * transfer without a device handle rejects the whole array */
+static libusb_testlib_result test_mixed_handles(void)
+{
+	libusb_device_handle *other;
+	struct timeval zero = { 0, 0 };
+	int results[NUM_TRANSFERS];
+	int i, r;
+
+	r = setup();
+	if (r != LIBUSB_SUCCESS)
+		return setup_result(r);
+
+	r = mock_usbfs_open_handle(ctx, &other);
+	if (r != LIBUSB_SUCCESS) {
+		teardown();
+		return TEST_STATUS_ERROR;
+	}
+
+	fill_transfer(1, other, 1000);
+	fill_transfer(3, other, 1000);
+	transfers[2]->dev_handle = NULL;
+	r = libusb_submit_transfers(transfers, NUM_TRANSFERS, results);
+	if (r != LIBUSB_ERROR_INVALID_PARAM || num_completed ||
+	    libusb_handle_events_timeout(ctx, &zero) ||
+	    num_completed) {
+		libusb_testlib_logf("transfer without a device handle: %s",
+			libusb_error_name(r));
+		goto fail;
+	}
+
+	transfers[2]->dev_handle = handle;
+	r = libusb_submit_transfers(transfers, NUM_TRANSFERS, results);
+	if (r != NUM_TRANSFERS) {
+		libusb_testlib_logf("submitted %d", r);
+		goto fail;
+	}
+
+	if (wait_completed(NUM_TRANSFERS))
+		goto fail;
+
+	for (i = 0; i < NUM_TRANSFERS; i++) {
+		if (results[i] != LIBUSB_SUCCESS || callbacks[i] != 1 ||
+		    transfers[i]->status != LIBUSB_TRANSFER_COMPLETED ||
+		    transfers[i]->actual_length != BUFFER_SIZE) {
+			libusb_testlib_logf("transfer %d: result %d, %d callbacks, status %d",
+				i, results[i], callbacks[i], transfers[i]->status);
+			goto fail;
+		}
+	}
+
+	mock_usbfs_close_handle(other);
+	teardown();
+	return TEST_STATUS_SUCCESS;
+
+fail:
+	wait_completed(r > 0 ? r : 0);
+	mock_usbfs_close_handle(other);
+	teardown();
+	return TEST_STATUS_FAILURE;
+}
+
+/* Transfers the backend fails to submit get their own result, are not in
+ * flight and can be submitted again later */
+static libusb_testlib_result test_partial_failure(void)
+{
+	int results[NUM_TRANSFERS];
+	int i, r;
+
+	r = setup();
+	if (r != LIBUSB_SUCCESS)
+		return setup_result(r);
+
+	mock_usbfs_max_urbs = 2;
+	r = libusb_submit_transfers(transfers, NUM_TRANSFERS, results);
+	if (r != 2 || results[0] != LIBUSB_SUCCESS || results[1] != LIBUSB_SUCCESS ||
+	    results[2] != LIBUSB_ERROR_NO_MEM || results[3] != LIBUSB_ERROR_NO_MEM) {
+		libusb_testlib_logf("submitted %d, results %d %d %d %d", r,
+			results[0], results[1], results[2], results[3]);
+		goto fail;
+	}
+
+	r = libusb_cancel_transfer(transfers[2]);
+	if (r != LIBUSB_ERROR_NOT_FOUND) {
+		libusb_testlib_logf("cancelling a failed transfer returned %s",
+			libusb_error_name(r));
+		goto fail;
+	}
+
+	if (wait_completed(2) || callbacks[2] || callbacks[3]) {
+		libusb_testlib_logf("%d callbacks", num_completed);
+		goto fail;
+	}
+
+	r = libusb_submit_transfers(transfers + 2, 2, NULL);
+	if (r != 2 || wait_completed(NUM_TRANSFERS)) {
+		libusb_testlib_logf("submitted %d again, %d callbacks", r, num_completed);
+		goto fail;
+	}
+
+	for (i = 0; i < NUM_TRANSFERS; i++) {
+		if (callbacks[i] != 1 || transfers[i]->status != LIBUSB_TRANSFER_COMPLETED)
+			goto fail;
+	}
+
+	teardown();
+	return TEST_STATUS_SUCCESS;
+
+fail:
+	for (i = 0; i < NUM_TRANSFERS; i++)
+		libusb_cancel_transfer(transfers[i]);
+	wait_completed(num_completed);
+	teardown();
+	return TEST_STATUS_FAILURE;
+}
+
+/* The earliest timeout of each device handle is published, so transfers
+ * time out in order of their timeouts whatever their place in the array */
+static libusb_testlib_result test_timeouts(void)
+{
+	libusb_device_handle *other;
+	int i, r;
+
+	r = setup();
+	if (r != LIBUSB_SUCCESS)
+		return setup_result(r);
+
+	r = mock_usbfs_open_handle(ctx, &other);
+	if (r != LIBUSB_SUCCESS) {
+		teardown();
+		return TEST_STATUS_ERROR;
+	}
+
+	mock_usbfs_hold_urbs = 1;
+	fill_transfer(0, handle, 1000);
+	fill_transfer(1, other, 500);
+	fill_transfer(2, handle, 100);
+	fill_transfer(3, other, 0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	r = libusb_submit_transfers(transfers, NUM_TRANSFERS, NULL);
+	if (r != NUM_TRANSFERS) {
+		libusb_testlib_logf("submitted %d", r);
+		goto fail;
+	}
+
+	if (wait_completed(3) || callbacks[3] ||
+	    completion_order[0] != 2 || completion_order[1] != 1 ||
+	    completion_order[2] != 0) {
+		libusb_testlib_logf("%d callbacks, order %d %d %d", num_completed,
+			completion_order[0], completion_order[1], completion_order[2]);
+		goto fail;
+	}
+
+	for (i = 0; i < 3; i++) {
+		unsigned int timeout = transfers[i]->timeout;
+
+		if (transfers[i]->status != LIBUSB_TRANSFER_TIMED_OUT ||
+		    completion_ms[i] < (long)timeout || completion_ms[i] > (long)timeout + 300) {
+			libusb_testlib_logf("transfer %d: status %d after %ldms, timeout %ums",
+				i, transfers[i]->status, completion_ms[i], timeout);
+			goto fail;
+		}
+	}
+
+	libusb_cancel_transfer(transfers[3]);
+	if (wait_completed(NUM_TRANSFERS) ||
+	    transfers[3]->status != LIBUSB_TRANSFER_CANCELLED)
+		goto fail;
+
+	mock_usbfs_close_handle(other);
+	teardown();
+	return TEST_STATUS_SUCCESS;
+
+fail:
+	for (i = 0; i < NUM_TRANSFERS; i++)
+		libusb_cancel_transfer(transfers[i]);
+	wait_completed(r > 0 ? r : 0);
+	mock_usbfs_close_handle(other);
+	teardown();
+	return TEST_STATUS_FAILURE;
+}
+
+static const libusb_testlib_test tests[] = {
+	{ "duplicates", &test_duplicates },
+	{ "mixed_handles", &test_mixed_handles },
+	{ "partial_failure", &test_partial_failure },
+	{ "timeouts", &test_timeouts },
+	LIBUSB_NULL_TEST
+};
+
+int main(int argc, char *argv[])
+{
+	return libusb_testlib_run_tests(argc, argv, tests);
+}
@@ -0,0 +1,231 @@
+/*
+ * libusb synchronous transfer cache tests, against a mock usbfs
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "libusb.h"
+#include "libusb_testlib.h"
+#include "mock_usbfs.h"
+
+#define NUM_TRANSFERS	100
+#define NUM_THREADS	4
+#define NUM_HANDLES	2
+#define DATA_LENGTH	64
+
+#define REQUEST_TYPE_IN		(LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR)
+#define REQUEST			0x5a
+
+static libusb_context *ctx;
+static libusb_device_handle *handle;
+
+static int open_mock(int cache_size)
+{
+	struct libusb_init_option options[] = {
+		{ .option = LIBUSB_OPTION_NO_DEVICE_DISCOVERY },
+		{ .option = LIBUSB_OPTION_SYNC_CACHE_SIZE, .value = { .ival = cache_size } },
+	};
+
+	return mock_usbfs_open(options, cache_size >= 0 ? 2 : 1, &ctx, &handle);
+}
+
+/* Performs count synchronous transfers on the handle, alternating between
+ * control and bulk transfers */
+static int do_transfers(libusb_device_handle *dev_handle, int count)
+{
+	unsigned char data[DATA_LENGTH];
+	int i, r, transferred;
+
+	for (i = 0; i < count; i++) {
+		if (i % 2) {
+			r = libusb_bulk_transfer(dev_handle, 0x81, data, DATA_LENGTH,
+				&transferred, 1000);
+		} else {
+			r = libusb_control_transfer(dev_handle, REQUEST_TYPE_IN, REQUEST,
+				0, 0, data, DATA_LENGTH, 1000);
+			if (r == DATA_LENGTH)
+				r = LIBUSB_SUCCESS;
+		}
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf("transfer %d: %s", i, libusb_error_name(r));
+			return r;
+		}
+	}
+
+	return LIBUSB_SUCCESS;
+}
+
+static void log_stats(const char *what, const struct libusb_sync_stats *stats)
+{
+	libusb_testlib_logf("%s: %llu transfers, %llu cache hits, %llu allocations",
+		what, (unsigned long long)stats->transfers,
+		(unsigned long long)stats->cache_hits,
+		(unsigned long long)stats->allocations);
+}
+
+/* Once a handle keeps a transfer, synchronous transfers reuse it and no
+ * longer allocate */
+static libusb_testlib_result test_cache_hits(void)
+{
+	struct libusb_sync_stats first, stats;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	int r;
+
+	r = open_mock(-1);
+	if (r != LIBUSB_SUCCESS)
+		return r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+
+	/* a control transfer first, so that the kept transfer has its buffer */
+	if (do_transfers(handle, 1) != LIBUSB_SUCCESS)
+		goto out;
+	libusb_get_sync_stats(ctx, &first);
+	if (first.transfers != 1 || first.cache_hits || !first.allocations) {
+		log_stats("first transfer", &first);
+		goto out;
+	}
+
+	if (do_transfers(handle, NUM_TRANSFERS) != LIBUSB_SUCCESS)
+		goto out;
+	libusb_get_sync_stats(ctx, &stats);
+	if (stats.transfers != first.transfers + NUM_TRANSFERS ||
+	    stats.cache_hits != NUM_TRANSFERS ||
+	    stats.allocations != first.allocations) {
+		log_stats("first transfer", &first);
+		log_stats("all transfers", &stats);
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	mock_usbfs_close(ctx, handle);
+	return result;
+}
+
+/* With a cache size of 0, every synchronous transfer allocates at least its
+ * transfer and the structure keeping it */
+static libusb_testlib_result test_cache_disabled(void)
+{
+	struct libusb_sync_stats stats;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	int r;
+
+	r = open_mock(0);
+	if (r != LIBUSB_SUCCESS)
+		return r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+
+	if (do_transfers(handle, NUM_TRANSFERS) != LIBUSB_SUCCESS)
+		goto out;
+	libusb_get_sync_stats(ctx, &stats);
+	if (stats.transfers != NUM_TRANSFERS || stats.cache_hits ||
+	    stats.allocations < 2 * NUM_TRANSFERS) {
+		log_stats("all transfers", &stats);
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	mock_usbfs_close(ctx, handle);
+	return result;
+}
+
+static void *transfer_thread(void *arg)
+{
+	return (void *)(intptr_t)do_transfers(arg, NUM_TRANSFERS);
+}
+
+/* Several threads use each handle at once, so that the handles keep several
+ * transfers, which are freed when the handles are closed (checked by running
+ * this under AddressSanitizer). The statistics of closed handles are kept. */
+static libusb_testlib_result test_close(void)
+{
+	libusb_device_handle *handles[NUM_HANDLES];
+	pthread_t threads[NUM_HANDLES * NUM_THREADS];
+	struct libusb_sync_stats open_stats, closed_stats;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	int num_handles, num_threads, r;
+	void *ret;
+
+	r = open_mock(-1);
+	if (r != LIBUSB_SUCCESS)
+		return r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+
+	handles[0] = handle;
+	for (num_handles = 1; num_handles < NUM_HANDLES; num_handles++) {
+		r = mock_usbfs_open_handle(ctx, &handles[num_handles]);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf("opening handle %d: %s", num_handles,
+				libusb_error_name(r));
+			goto out;
+		}
+	}
+
+	for (num_threads = 0; num_threads < NUM_HANDLES * NUM_THREADS; num_threads++) {
+		if (pthread_create(&threads[num_threads], NULL, transfer_thread,
+				handles[num_threads % NUM_HANDLES]))
+			break;
+	}
+
+	r = num_threads < NUM_HANDLES * NUM_THREADS ? LIBUSB_ERROR_OTHER : LIBUSB_SUCCESS;
+	while (num_threads--) {
+		pthread_join(threads[num_threads], &ret);
+		if ((intptr_t)ret != LIBUSB_SUCCESS)
+			r = (int)(intptr_t)ret;
+	}
+	if (r != LIBUSB_SUCCESS)
+		goto out;
+
+	libusb_get_sync_stats(ctx, &open_stats);
+	if (open_stats.transfers != NUM_HANDLES * NUM_THREADS * NUM_TRANSFERS) {
+		log_stats("open handles", &open_stats);
+		goto out;
+	}
+
+	while (num_handles > 1)
+		mock_usbfs_close_handle(handles[--num_handles]);
+	libusb_get_sync_stats(ctx, &closed_stats);
+	if (memcmp(&open_stats, &closed_stats, sizeof(open_stats))) {
+		log_stats("open handles", &open_stats);
+		log_stats("closed handles", &closed_stats);
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	while (num_handles > 1)
+		mock_usbfs_close_handle(handles[--num_handles]);
+	mock_usbfs_close(ctx, handle);
+	return result;
+}
+
+static const libusb_testlib_test tests[] = {
+	{ "cache_hits", &test_cache_hits },
+	{ "cache_disabled", &test_cache_disabled },
+	{ "close", &test_close },
+	LIBUSB_NULL_TEST
+};
+
+int main(int argc, char *argv[])
+{
+	return libusb_testlib_run_tests(argc, argv, tests);
+}
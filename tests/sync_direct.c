@@ -0,0 +1,302 @@
+/*
+ * libusb direct synchronous transfer tests, against a mock usbfs
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include "libusb.h"
+#include "libusb_testlib.h"
+#include "mock_usbfs.h"
+
+/* larger than the kernel's bounce buffers, see MAX_BULK_BUFFER_LENGTH and
+ * MAX_CTRL_BUFFER_LENGTH */
+#define LARGE_LENGTH	(16384 + 1)
+#define LARGE_CONTROL_LENGTH	(4096 + 1)
+
+#define REQUEST_TYPE_IN		(LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR)
+#define REQUEST_TYPE_OUT	(LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR)
+#define REQUEST			0x5a
+
+static libusb_context *ctx;
+static libusb_device_handle *handle;
+static unsigned char data[LARGE_LENGTH];
+
+static int open_mock(int direct)
+{
+	struct libusb_init_option options[] = {
+		{ .option = LIBUSB_OPTION_NO_DEVICE_DISCOVERY },
+		{ .option = LIBUSB_OPTION_SYNC_DIRECT_IO },
+	};
+
+	return mock_usbfs_open(options, direct ? 2 : 1, &ctx, &handle);
+}
+
+static void close_mock(void)
+{
+	mock_usbfs_close(ctx, handle);
+	mock_usbfs_sync_errno = 0;
+}
+
+/* Performs a bulk transfer of the given length and checks its result, the
+ * number of bytes reported and whether it went through a direct ioctl or
+ * through URBs */
+static libusb_testlib_result check_bulk(unsigned char endpoint, int length,
+	int expect_r, int expect_transferred, int expect_direct)
+{
+	unsigned int urbs = mock_usbfs_reaped, calls = mock_usbfs_sync_calls;
+	int transferred = -1;
+	int r;
+
+	r = libusb_bulk_transfer(handle, endpoint, data, length, &transferred, 1000);
+	if (r != expect_r || transferred != expect_transferred) {
+		libusb_testlib_logf("%d bytes to 0x%02x: %s, %d transferred", length,
+			endpoint, libusb_error_name(r), transferred);
+		return TEST_STATUS_FAILURE;
+	}
+
+	if ((mock_usbfs_sync_calls != calls) != expect_direct ||
+	    (mock_usbfs_reaped != urbs) == expect_direct) {
+		libusb_testlib_logf("%d bytes to 0x%02x: %u ioctls, %u URBs", length,
+			endpoint, mock_usbfs_sync_calls - calls, mock_usbfs_reaped - urbs);
+		return TEST_STATUS_FAILURE;
+	}
+
+	return TEST_STATUS_SUCCESS;
+}
+
+/* Performs a control transfer of the given length and checks its result,
+ * and whether it went through a direct ioctl or through URBs */
+static libusb_testlib_result check_control(uint8_t request_type, uint16_t length,
+	int expect_r, int expect_direct)
+{
+	unsigned int urbs = mock_usbfs_reaped, calls = mock_usbfs_sync_calls;
+	int r;
+
+	memset(data, 0, length);
+	r = libusb_control_transfer(handle, request_type, REQUEST, 0x1234, 0,
+		data, length, 1000);
+	if (r != expect_r) {
+		libusb_testlib_logf("%u byte request 0x%02x: %s", length, request_type,
+			libusb_error_name(r));
+		return TEST_STATUS_FAILURE;
+	}
+
+	if ((mock_usbfs_sync_calls != calls) != expect_direct ||
+	    (mock_usbfs_reaped != urbs) == expect_direct) {
+		libusb_testlib_logf("%u byte request 0x%02x: %u ioctls, %u URBs", length,
+			request_type, mock_usbfs_sync_calls - calls, mock_usbfs_reaped - urbs);
+		return TEST_STATUS_FAILURE;
+	}
+
+	/* the mock only fills the data of direct requests */
+	if (expect_direct && r > 0 && (request_type & LIBUSB_ENDPOINT_IN) &&
+	    (data[0] != REQUEST || data[r - 1] != REQUEST)) {
+		libusb_testlib_logf("%u byte request 0x%02x read 0x%02x", length,
+			request_type, data[0]);
+		return TEST_STATUS_FAILURE;
+	}
+
+	return TEST_STATUS_SUCCESS;
+}
+
+/* Without LIBUSB_OPTION_SYNC_DIRECT_IO, transfers go through URBs */
+static libusb_testlib_result test_bulk_default(void)
+{
+	libusb_testlib_result result;
+	int r;
+
+	r = open_mock(0);
+	if (r != LIBUSB_SUCCESS)
+		return r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+
+	result = check_bulk(0x81, 64, LIBUSB_SUCCESS, 64, 0);
+	if (result == TEST_STATUS_SUCCESS)
+		result = check_bulk(0x02, 64, LIBUSB_SUCCESS, 64, 0);
+	close_mock();
+	return result;
+}
+
+static libusb_testlib_result test_bulk_direct(void)
+{
+	libusb_testlib_result result;
+	int r;
+
+	r = open_mock(1);
+	if (r != LIBUSB_SUCCESS)
+		return r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+
+	result = check_bulk(0x81, 64, LIBUSB_SUCCESS, 64, 1);
+	if (result == TEST_STATUS_SUCCESS)
+		result = check_bulk(0x02, 64, LIBUSB_SUCCESS, 64, 1);
+	if (result == TEST_STATUS_SUCCESS)
+		result = check_bulk(0x81, 0, LIBUSB_SUCCESS, 0, 1);
+	close_mock();
+	return result;
+}
+
+/* A direct transfer that timed out reports no data */
+static libusb_testlib_result test_bulk_timeout(void)
+{
+	libusb_testlib_result result;
+	int r;
+
+	r = open_mock(1);
+	if (r != LIBUSB_SUCCESS)
+		return r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+
+	mock_usbfs_sync_errno = ETIMEDOUT;
+	result = check_bulk(0x81, 64, LIBUSB_ERROR_TIMEOUT, 0, 1);
+	close_mock();
+	return result;
+}
+
+static libusb_testlib_result test_bulk_stall(void)
+{
+	libusb_testlib_result result;
+	int r;
+
+	r = open_mock(1);
+	if (r != LIBUSB_SUCCESS)
+		return r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+
+	mock_usbfs_sync_errno = EPIPE;
+	result = check_bulk(0x81, 64, LIBUSB_ERROR_PIPE, 0, 1);
+	if (result == TEST_STATUS_SUCCESS) {
+		mock_usbfs_sync_errno = ENODEV;
+		result = check_bulk(0x02, 64, LIBUSB_ERROR_NO_DEVICE, 0, 1);
+	}
+	close_mock();
+	return result;
+}
+
+/* Transfers larger than the kernel's bounce buffer are split into URBs */
+static libusb_testlib_result test_bulk_fallback(void)
+{
+	libusb_testlib_result result;
+	int r;
+
+	r = open_mock(1);
+	if (r != LIBUSB_SUCCESS)
+		return r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+
+	result = check_bulk(0x81, LARGE_LENGTH, LIBUSB_SUCCESS, LARGE_LENGTH, 0);
+	close_mock();
+	return result;
+}
+
+static libusb_testlib_result test_control_default(void)
+{
+	libusb_testlib_result result;
+	int r;
+
+	r = open_mock(0);
+	if (r != LIBUSB_SUCCESS)
+		return r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+
+	result = check_control(REQUEST_TYPE_IN, 16, 16, 0);
+	if (result == TEST_STATUS_SUCCESS)
+		result = check_control(REQUEST_TYPE_OUT, 16, 16, 0);
+	close_mock();
+	return result;
+}
+
+static libusb_testlib_result test_control_direct(void)
+{
+	libusb_testlib_result result;
+	int r;
+
+	r = open_mock(1);
+	if (r != LIBUSB_SUCCESS)
+		return r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+
+	result = check_control(REQUEST_TYPE_IN, 16, 16, 1);
+	if (result == TEST_STATUS_SUCCESS)
+		result = check_control(REQUEST_TYPE_OUT, 16, 16, 1);
+	if (result == TEST_STATUS_SUCCESS)
+		result = check_control(REQUEST_TYPE_OUT, 0, 0, 1);
+	close_mock();
+	return result;
+}
+
+static libusb_testlib_result test_control_errors(void)
+{
+	libusb_testlib_result result;
+	int r;
+
+	r = open_mock(1);
+	if (r != LIBUSB_SUCCESS)
+		return r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+
+	mock_usbfs_sync_errno = ETIMEDOUT;
+	result = check_control(REQUEST_TYPE_IN, 16, LIBUSB_ERROR_TIMEOUT, 1);
+	if (result == TEST_STATUS_SUCCESS) {
+		/* an unsupported request */
+		mock_usbfs_sync_errno = EPIPE;
+		result = check_control(REQUEST_TYPE_IN, 16, LIBUSB_ERROR_PIPE, 1);
+	}
+	if (result == TEST_STATUS_SUCCESS) {
+		mock_usbfs_sync_errno = EOVERFLOW;
+		result = check_control(REQUEST_TYPE_IN, 16, LIBUSB_ERROR_OVERFLOW, 1);
+	}
+	close_mock();
+	return result;
+}
+
+/* Requests larger than the kernel's bounce buffer are left to the URB path,
+ * which rejects them */
+static libusb_testlib_result test_control_fallback(void)
+{
+	libusb_testlib_result result;
+	unsigned int calls;
+	int r;
+
+	r = open_mock(1);
+	if (r != LIBUSB_SUCCESS)
+		return r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+
+	calls = mock_usbfs_sync_calls;
+	r = libusb_control_transfer(handle, REQUEST_TYPE_IN, REQUEST, 0, 0,
+		data, LARGE_CONTROL_LENGTH, 1000);
+	result = r == LIBUSB_ERROR_INVALID_PARAM && mock_usbfs_sync_calls == calls ?
+		TEST_STATUS_SUCCESS : TEST_STATUS_FAILURE;
+	if (result != TEST_STATUS_SUCCESS)
+		libusb_testlib_logf("large request: %s, %u ioctls", libusb_error_name(r),
+			mock_usbfs_sync_calls - calls);
+	close_mock();
+	return result;
+}
+
+static const libusb_testlib_test tests[] = {
+	{ "bulk_default", &test_bulk_default },
+	{ "bulk_direct", &test_bulk_direct },
+	{ "bulk_timeout", &test_bulk_timeout },
+	{ "bulk_stall", &test_bulk_stall },
+	{ "bulk_fallback", &test_bulk_fallback },
+	{ "control_default", &test_control_default },
+	{ "control_direct", &test_control_direct },
+	{ "control_errors", &test_control_errors },
+	{ "control_fallback", &test_control_fallback },
+	LIBUSB_NULL_TEST
+};
+
+int main(int argc, char *argv[])
+{
+	return libusb_testlib_run_tests(argc, argv, tests);
+}
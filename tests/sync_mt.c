@@ -0,0 +1,171 @@
+/*
+ * libusb multi-thread synchronous transfer benchmark, against a mock usbfs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "libusb.h"
+#include "mock_usbfs.h"
+
+/* Threads each performing synchronous bulk transfers, while a separate
+ * thread handles events for all of them. Every thread waits for its own
+ * transfer, so only its completion should wake it up. */
+
+#define NTHREADS 64
+#define ITERS 200
+
+static libusb_context *ctx;
+static libusb_device_handle *handle;
+static volatile int stop;
+
+struct thread_info {
+	int number;
+	int err;
+	int iteration;
+	long sleeps;
+	long preemptions;
+	double latency_us[ITERS];
+} tinfo[NTHREADS];
+
+static double elapsed_us(const struct timespec *start, const struct timespec *end)
+{
+	return (double)(end->tv_sec - start->tv_sec) * 1e6 +
+		(double)(end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+static void *transfer_loop(void *arg)
+{
+	struct thread_info *ti = (struct thread_info *) arg;
+	unsigned char data[64];
+	struct timespec start, end;
+	struct rusage usage;
+
+	for (int i = 0; i < ITERS; ++i) {
+		int transferred, r;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		r = libusb_bulk_transfer(handle, 0x81 + (ti->number % 4), data,
+			(int)sizeof(data), &transferred, 5000);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if (r != LIBUSB_SUCCESS) {
+			ti->err = r;
+			ti->iteration = i;
+			break;
+		}
+		ti->latency_us[i] = elapsed_us(&start, &end);
+	}
+
+	/* a thread woken up for another thread's transfer goes back to sleep,
+	 * which counts as one more voluntary context switch */
+	getrusage(RUSAGE_THREAD, &usage);
+	ti->sleeps = usage.ru_nvcsw;
+	ti->preemptions = usage.ru_nivcsw;
+	return NULL;
+}
+
+static void *event_loop(void *arg)
+{
+	struct timeval tv = { 0, 100000 };
+
+	(void)arg;
+	while (!stop)
+		libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+	return NULL;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+int main(void)
+{
+	struct libusb_init_option options[] = {
+		{ .option = LIBUSB_OPTION_NO_DEVICE_DISCOVERY },
+	};
+	pthread_t threadId[NTHREADS], event_thread;
+	struct timespec start, end;
+	double *latencies;
+	long sleeps = 0, preemptions = 0;
+	int errs = 0;
+	int n = 0;
+	int t;
+
+	if (mock_usbfs_open(options, 1, &ctx, &handle) != LIBUSB_SUCCESS) {
+		fprintf(stderr, "Failed to open the mock device\n");
+		return 1;
+	}
+
+	if (pthread_create(&event_thread, NULL, event_loop, NULL) != 0) {
+		fprintf(stderr, "Failed to start the event thread\n");
+		return 1;
+	}
+
+	printf("Starting %d threads, %d transfers each\n", NTHREADS, ITERS);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (t = 0; t < NTHREADS; t++) {
+		tinfo[t].number = t;
+		if (pthread_create(&threadId[t], NULL, transfer_loop, &tinfo[t]) != 0) {
+			fprintf(stderr, "Failed to start thread %d\n", t);
+			return 1;
+		}
+	}
+
+	for (t = 0; t < NTHREADS; t++)
+		pthread_join(threadId[t], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	stop = 1;
+	pthread_join(event_thread, NULL);
+	mock_usbfs_close(ctx, handle);
+
+	latencies = malloc(sizeof(*latencies) * NTHREADS * ITERS);
+	if (!latencies)
+		return 1;
+	for (t = 0; t < NTHREADS; t++) {
+		if (tinfo[t].err) {
+			errs++;
+			fprintf(stderr, "Thread %d failed (iteration %d): %s\n",
+				tinfo[t].number, tinfo[t].iteration,
+				libusb_error_name(tinfo[t].err));
+			continue;
+		}
+		for (int i = 0; i < ITERS; i++)
+			latencies[n++] = tinfo[t].latency_us[i];
+		sleeps += tinfo[t].sleeps;
+		preemptions += tinfo[t].preemptions;
+	}
+
+	if (n) {
+		qsort(latencies, (size_t)n, sizeof(*latencies), compare_double);
+		printf("%d transfers in %.1fms\n", n, elapsed_us(&start, &end) / 1e3);
+		printf("context switches per transfer: %.3f sleeping, %.3f preempted\n",
+			(double)sleeps / n, (double)preemptions / n);
+		printf("latency p50 %.1fus, p99 %.1fus, max %.1fus\n",
+			latencies[n / 2], latencies[n * 99 / 100], latencies[n - 1]);
+	}
+	free(latencies);
+
+	return errs;
+}
@@ -0,0 +1,218 @@
+/*
+ * libusb timeout heap tests
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libusbi.h"
+#include "libusb_testlib.h"
+
+#define NUM_TRANSFERS	4096
+#define MIN_BENCH_TRANSFERS	64
+#define MAX_BENCH_TRANSFERS	65536
+#define MAX_LIST_TRANSFERS	16384
+
+static struct usbi_transfer *alloc_transfers(unsigned int count)
+{
+	struct usbi_transfer *itransfers;
+	unsigned int i;
+
+	itransfers = calloc(count, sizeof(*itransfers));
+	if (!itransfers)
+		return NULL;
+
+	/* pseudo-random but reproducible timeouts, with duplicates */
+	srand(1);
+	for (i = 0; i < count; i++) {
+		itransfers[i].timeout.expiry.tv_sec = 1 + rand() % 64;
+		itransfers[i].timeout.expiry.tv_nsec = (rand() % 1000) * 1000000L;
+	}
+
+	return itransfers;
+}
+
+static int heap_is_valid(struct usbi_timeout_heap *heap)
+{
+	unsigned int i;
+
+	for (i = 0; i < heap->count; i++) {
+		if (heap->items[i]->heap_index != i + 1)
+			return 0;
+		if (i > 0 && TIMESPEC_CMP(&heap->items[i]->expiry,
+				&heap->items[(i - 1) / 2]->expiry, <))
+			return 0;
+	}
+
+	return 1;
+}
+
+static libusb_testlib_result test_heap_order(void)
+{
+	struct usbi_timeout_heap heap = { NULL, 0, 0 };
+	struct usbi_transfer *itransfers;
+	struct usbi_timeout_node *prev, *cur;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	unsigned int i;
+
+	itransfers = alloc_transfers(NUM_TRANSFERS);
+	if (!itransfers)
+		return TEST_STATUS_ERROR;
+
+	for (i = 0; i < NUM_TRANSFERS; i++) {
+		if (usbi_timeout_heap_insert(&heap, &itransfers[i].timeout)) {
+			result = TEST_STATUS_ERROR;
+			goto out;
+		}
+	}
+
+	if (heap.count != NUM_TRANSFERS || !heap_is_valid(&heap))
+		goto out;
+
+	/* remove every third transfer from the middle of the heap */
+	for (i = 0; i < NUM_TRANSFERS; i += 3)
+		usbi_timeout_heap_remove(&heap, &itransfers[i].timeout);
+
+	if (!heap_is_valid(&heap))
+		goto out;
+
+	/* removing a transfer twice must be harmless */
+	usbi_timeout_heap_remove(&heap, &itransfers[0].timeout);
+
+	/* the remaining transfers must come out in timeout order */
+	prev = NULL;
+	while ((cur = usbi_timeout_heap_top(&heap))) {
+		if (prev && TIMESPEC_CMP(&cur->expiry, &prev->expiry, <)) {
+			libusb_testlib_logf("timeout heap out of order");
+			goto out;
+		}
+		usbi_timeout_heap_remove(&heap, cur);
+		if (cur->heap_index)
+			goto out;
+		prev = cur;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	free(heap.items);
+	free(itransfers);
+	return result;
+}
+
+static double elapsed_us(const struct timespec *start)
+{
+	struct timespec now;
+
+	usbi_get_monotonic_time(&now);
+	return (double)(now.tv_sec - start->tv_sec) * 1e6 +
+		(double)(now.tv_nsec - start->tv_nsec) / 1e3;
+}
+
+/* Returns the time taken to keep count in-flight transfers ordered by timeout
+ * using the former sorted list insertion, or -1 if it would take too long */
+static double list_insert_us(struct usbi_transfer *itransfers, unsigned int count)
+{
+	struct list_head flying;
+	struct usbi_transfer *cur;
+	struct timespec start;
+	unsigned int i;
+	double us;
+
+	/* the list is quadratic in the number of transfers */
+	if (count > MAX_LIST_TRANSFERS)
+		return -1;
+
+	list_init(&flying);
+	usbi_get_monotonic_time(&start);
+	for (i = 0; i < count; i++) {
+		struct usbi_transfer *itransfer = &itransfers[i];
+
+		__for_each_transfer(&flying, cur) {
+			if (TIMESPEC_CMP(&cur->timeout.expiry, &itransfer->timeout.expiry, >))
+				break;
+		}
+		list_add_tail(&itransfer->list, &cur->list);
+	}
+	us = elapsed_us(&start);
+
+	while (!list_empty(&flying))
+		list_del(flying.next);
+	return us;
+}
+
+/* Reports the cost per insert and per remove of the timeout heap, and per
+ * insert of the former sorted list, for a range of in-flight transfer
+ * counts. Removing from the list is constant time and is not measured. */
+static libusb_testlib_result test_heap_benchmark(void)
+{
+	struct usbi_timeout_heap heap = { NULL, 0, 0 };
+	struct usbi_transfer *itransfers;
+	struct usbi_timeout_node *node;
+	struct timespec start;
+	double list_us, insert_us, remove_us;
+	unsigned int count, i;
+
+	itransfers = alloc_transfers(MAX_BENCH_TRANSFERS);
+	if (!itransfers)
+		return TEST_STATUS_ERROR;
+
+	for (count = MIN_BENCH_TRANSFERS; count <= MAX_BENCH_TRANSFERS; count *= 4) {
+		list_us = list_insert_us(itransfers, count);
+
+		usbi_get_monotonic_time(&start);
+		for (i = 0; i < count; i++) {
+			if (usbi_timeout_heap_insert(&heap, &itransfers[i].timeout)) {
+				free(heap.items);
+				free(itransfers);
+				return TEST_STATUS_ERROR;
+			}
+		}
+		insert_us = elapsed_us(&start);
+
+		usbi_get_monotonic_time(&start);
+		while ((node = usbi_timeout_heap_top(&heap)))
+			usbi_timeout_heap_remove(&heap, node);
+		remove_us = elapsed_us(&start);
+
+		if (list_us < 0)
+			libusb_testlib_logf("%5u transfers: heap insert %.1fns, remove %.1fns",
+				count, insert_us * 1e3 / count, remove_us * 1e3 / count);
+		else
+			libusb_testlib_logf("%5u transfers: heap insert %.1fns, remove %.1fns, "
+				"sorted list insert %.1fns", count, insert_us * 1e3 / count,
+				remove_us * 1e3 / count, list_us * 1e3 / count);
+	}
+
+	free(heap.items);
+	free(itransfers);
+	return TEST_STATUS_SUCCESS;
+}
+
+static const libusb_testlib_test tests[] = {
+	{ "heap_order", &test_heap_order },
+	{ "heap_benchmark", &test_heap_benchmark },
+	LIBUSB_NULL_TEST
+};
+
+int main(int argc, char *argv[])
+{
+	return libusb_testlib_run_tests(argc, argv, tests);
+}
@@ -0,0 +1,125 @@
+/*
+ * libusb transfer pool tests
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "libusb.h"
+#include "libusb_testlib.h"
+
+#define BENCH_ITERS	1000000
+#define POOL_SIZE	64
+
+static libusb_testlib_result test_pool_reuse(void)
+{
+	struct libusb_transfer_pool_stats stats;
+	struct libusb_transfer *transfer, *reused;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	int i;
+
+	if (libusb_set_option(NULL, LIBUSB_OPTION_TRANSFER_POOL, POOL_SIZE) != LIBUSB_SUCCESS)
+		return TEST_STATUS_ERROR;
+
+	transfer = libusb_alloc_transfer(4);
+	if (!transfer)
+		goto out;
+	transfer->length = 1234;
+	transfer->num_iso_packets = 4;
+	for (i = 0; i < 4; i++)
+		transfer->iso_packet_desc[i].length = 512;
+	libusb_free_transfer(transfer);
+
+	/* a transfer of the same size class must come back from the pool
+	 * cleared */
+	reused = libusb_alloc_transfer(8);
+	if (!reused)
+		goto out;
+	if (reused != transfer) {
+		libusb_testlib_logf("transfer was not reused");
+		libusb_free_transfer(reused);
+		goto out;
+	}
+	if (reused->length || reused->num_iso_packets ||
+	    reused->iso_packet_desc[0].length || reused->iso_packet_desc[7].length) {
+		libusb_testlib_logf("reused transfer was not cleared");
+		libusb_free_transfer(reused);
+		goto out;
+	}
+	libusb_free_transfer(reused);
+
+	if (libusb_get_transfer_pool_stats(&stats) != LIBUSB_SUCCESS || !stats.hits)
+		goto out;
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	libusb_set_option(NULL, LIBUSB_OPTION_TRANSFER_POOL, 0);
+	return result;
+}
+
+static double bench_alloc_free(int iso_packets)
+{
+	struct timespec start, end;
+	int i;
+
+	timespec_get(&start, TIME_UTC);
+	for (i = 0; i < BENCH_ITERS; i++)
+		libusb_free_transfer(libusb_alloc_transfer(iso_packets));
+	timespec_get(&end, TIME_UTC);
+
+	return ((double)(end.tv_sec - start.tv_sec) * 1e9 +
+		(double)(end.tv_nsec - start.tv_nsec)) / BENCH_ITERS;
+}
+
+/* Compares libusb_alloc_transfer() / libusb_free_transfer() pairs with and
+ * without the transfer pool. */
+static libusb_testlib_result test_pool_benchmark(void)
+{
+	struct libusb_transfer_pool_stats before, after;
+	double malloc_ns, pool_ns;
+
+	malloc_ns = bench_alloc_free(0);
+
+	if (libusb_set_option(NULL, LIBUSB_OPTION_TRANSFER_POOL, POOL_SIZE) != LIBUSB_SUCCESS)
+		return TEST_STATUS_ERROR;
+	libusb_get_transfer_pool_stats(&before);
+	pool_ns = bench_alloc_free(0);
+	libusb_get_transfer_pool_stats(&after);
+	libusb_set_option(NULL, LIBUSB_OPTION_TRANSFER_POOL, 0);
+
+	libusb_testlib_logf("alloc/free: malloc %.1fns, pool %.1fns (%llu hits, %llu misses)",
+		malloc_ns, pool_ns,
+		(unsigned long long)(after.hits - before.hits),
+		(unsigned long long)(after.misses - before.misses));
+
+	return TEST_STATUS_SUCCESS;
+}
+
+static const libusb_testlib_test tests[] = {
+	{ "pool_reuse", &test_pool_reuse },
+	{ "pool_benchmark", &test_pool_benchmark },
+	LIBUSB_NULL_TEST
+};
+
+int main(int argc, char *argv[])
+{
+	return libusb_testlib_run_tests(argc, argv, tests);
+}